@@ -25,18 +25,37 @@
 #include <limits.h>
 #include <assert.h>
 #include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 
 #include <bsd/string.h> /* strlcpy */
 #include <bsd/stdlib.h> /* getprogname */
+#include <bsd/sys/queue.h>
+#include <bsd/sys/time.h> /* timespecsub */
 
 #include <event2/dns.h>
+#include <event2/http.h>
 
 #include <net/if.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/can/bcm.h>
+#include <linux/can/error.h>
+#include <linux/can/netlink.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "log.h"
 #include "amqtt.h"
@@ -49,9 +68,142 @@
 #define BATGW_MQTT_LWT		"LWT"
 #define BATGW_MQTT_STATUS	"STATUS"
 #define BATGW_MQTT_CMND		"cmnd"
+#define BATGW_MQTT_SENSOR	"SENSOR"
+#define BATGW_MQTT_BINARY	"BINARY"
+#define BATGW_MQTT_BINARY_IDS	"BINARY/IDS"
 
 struct batgw_mqtt;
 
+/*
+ * how far behind its deadline a task can run before it counts as late
+ */
+#define BATGW_TASK_LATE_USEC	1000
+/*
+ * tasks registered without a phase are spread out by this much
+ */
+#define BATGW_TASK_STAGGER_USEC	1000
+
+struct batgw_task {
+	TAILQ_ENTRY(batgw_task)	 t_entry;
+	struct batgw		*t_bg;
+	const char		*t_name;
+	struct event		*t_ev;
+
+	struct timeval		 t_period;
+	struct timeval		 t_phase;
+	struct timeval		 t_next;	/* absolute deadline */
+
+	void			(*t_fn)(struct batgw *, void *);
+	void			*t_arg;
+
+	uint64_t		 t_runs;
+	uint64_t		 t_late;
+	uint64_t		 t_overruns;
+	struct batgw_hist	*t_hist;	/* lateness */
+};
+
+TAILQ_HEAD(batgw_tasks, batgw_task);
+
+/*
+ * log-linear histograms. values below 2^HIST_SUB_BITS get a bucket
+ * each, after that every power of two is split into 2^HIST_SUB_BITS
+ * buckets, so the error is bounded at 1/2^HIST_SUB_BITS.
+ */
+#define BATGW_HIST_SUB_BITS	3
+#define BATGW_HIST_SUB		(1U << BATGW_HIST_SUB_BITS)
+#define BATGW_HIST_BUCKETS	\
+	((32 - BATGW_HIST_SUB_BITS + 1) * BATGW_HIST_SUB)
+
+struct batgw_hist {
+	TAILQ_ENTRY(batgw_hist)	 h_entry;
+	const char		*h_name;
+
+	uint64_t		 h_count;
+	uint64_t		 h_sum;
+	uint32_t		 h_max;
+	uint32_t		 h_buckets[BATGW_HIST_BUCKETS];
+};
+
+TAILQ_HEAD(batgw_hists, batgw_hist);
+
+struct batgw_can;
+TAILQ_HEAD(batgw_cans, batgw_can);
+struct batgw_canif;
+TAILQ_HEAD(batgw_canifs, batgw_canif);
+
+struct batgw_kv_scope {
+	TAILQ_ENTRY(batgw_kv_scope)
+				 ks_entry;
+	const char		*ks_scope;
+	const char		*ks_array;	/* publish as one array */
+	struct batgw_kv		*ks_kvs;
+	size_t			 ks_nkvs;
+	struct batgw_kv_block	*ks_block;	/* instead of kvs */
+
+	char			*ks_topic;	/* telemetry json */
+	size_t			 ks_topic_len;
+};
+
+TAILQ_HEAD(batgw_kv_scopes, batgw_kv_scope);
+
+/*
+ * a block of kvs that only differ by their index, eg, cells. what
+ * they share is stored once, the values and times are kept in
+ * parallel arrays, and bitmaps say which are set and which need
+ * publishing so scans can skip 64 entries at a time.
+ */
+
+#define BATGW_KV_BLOCK_BITS	64
+
+struct batgw_kv_block {
+	const char		*kb_scope;
+	const char		*kb_name;	/* kb_name0, kb_name1, ... */
+	enum batgw_kv_type	 kb_type;
+	unsigned int		 kb_precision;
+	unsigned int		 kb_deadband;	/* in kb_precision units */
+	unsigned int		 kb_n;
+	unsigned int		 kb_nwords;
+	char			*kb_topic;	/* up to the index */
+	size_t			 kb_topic_len;
+
+	int			*kb_v;
+	int			*kb_published;
+	unsigned int		*kb_updated;
+	uint64_t		*kb_valid;
+	uint64_t		*kb_dirty;
+
+	struct batgw_kv_block	*kb_dirty_next;
+	unsigned int		 kb_queued;
+};
+
+/*
+ * the safety verdict and current limits are only worked out again
+ * when one of their inputs changes, or when one of them gets too old.
+ */
+
+struct batgw_limits {
+	unsigned int		 l_dirty;	/* fields, or LIMITS_ALL */
+#define BATGW_LIMITS_ALL		(1U << BATGW_B_F_NONE)
+	struct timeval		 l_expire;	/* an input goes stale */
+	struct event		*l_ev;
+
+	unsigned int		 l_safety;
+	unsigned int		 l_charge_da;	/* as if it were safe */
+	unsigned int		 l_discharge_da;
+
+	uint64_t		 l_evals;
+	uint64_t		 l_pushes;
+};
+
+#define BATGW_LIMITS_FIELDS	(					\
+	(1U << BATGW_B_F_VOLTAGE_DV) |					\
+	(1U << BATGW_B_F_MIN_TEMP_DC) |					\
+	(1U << BATGW_B_F_MAX_TEMP_DC) |					\
+	(1U << BATGW_B_F_MIN_CELL_VOLTAGE_MV) |				\
+	(1U << BATGW_B_F_MAX_CELL_VOLTAGE_MV) |				\
+	(1U << BATGW_B_F_CHARGE_W) |					\
+	(1U << BATGW_B_F_DISCHARGE_W))
+
 struct batgw_b_state {
 	unsigned int		 bs_running;
 
@@ -68,14 +220,11 @@ struct batgw_b_state {
 	unsigned int		 bs_min_cell_voltage_mv;
 	unsigned int		 bs_max_cell_voltage_mv;
 
-	unsigned int		 bs_valid;
-#define BATGW_B_VALID_SOC		(1 << 0)
-#define BATGW_B_VALID_VOLTAGE		(1 << 1)
-#define BATGW_B_VALID_CURRENT		(1 << 2)
-#define BATGW_B_VALID_MIN_TEMP		(1 << 4)
-#define BATGW_B_VALID_MAX_TEMP		(1 << 5)
-#define BATGW_B_VALID_AVG_TEMP		(1 << 6)
-
+	/* a field is valid while it is younger than its max age */
+	struct timeval		 bs_updated[BATGW_B_F_COUNT];
+	struct timeval		 bs_max_age[BATGW_B_F_COUNT];
+	struct batgw_hist	*bs_age[BATGW_B_F_COUNT];	/* at use */
+	unsigned int		 bs_provisional;	/* from a snapshot */
 
 	unsigned int		 bs_soc_cpct;
 	unsigned int		 bs_voltage_dv;
@@ -86,37 +235,117 @@ struct batgw_b_state {
 	int			 bs_avg_temp_dc;
 };
 
+/*
+ * charge and energy counted from the current and voltage readings.
+ * positive current charges the pack.
+ */
+
+enum batgw_energy_counter {
+	BATGW_E_CHARGED_MAS,
+	BATGW_E_DISCHARGED_MAS,
+	BATGW_E_CHARGED_MJ,
+	BATGW_E_DISCHARGED_MJ,
+
+	BATGW_E_COUNT
+};
+
+enum batgw_energy_kv {
+	BATGW_E_KV_CHARGED_AH,
+	BATGW_E_KV_DISCHARGED_AH,
+	BATGW_E_KV_CHARGED_KWH,
+	BATGW_E_KV_DISCHARGED_KWH,
+	BATGW_E_KV_SOC,
+
+	BATGW_E_KV_COUNT
+};
+
+struct batgw_energy {
+	struct timeval		 be_t;		/* of the last sample */
+	int			 be_da;
+	int			 be_cw;		/* INT_MIN without voltage */
+
+	int64_t			 be_acc[BATGW_E_COUNT];	/* under a unit */
+	uint64_t		 be_total[BATGW_E_COUNT];
+
+	/* where the bms last put the soc */
+	unsigned int		 be_soc_cpct;
+	int64_t			 be_soc_mas;	/* net charge then */
+	unsigned int		 be_soc_valid;
+
+	struct batgw_kv		 be_kvs[BATGW_E_KV_COUNT];
+};
+
+struct batgw_b {
+	struct batgw		*b_bg;
+	char			 b_scope[16];
+	const struct batgw_battery
+				*b_driver;
+	struct batgw_config_battery
+				*b_conf;
+	void			*b_sc;
+	struct batgw_b_state	 b_state;
+	struct batgw_energy	 b_energy;
+	const char		*b_unsafe_reason;
+	unsigned int		 b_safe;
+};
+
 struct batgw_i_state {
 	unsigned int		 is_running;
 	unsigned int		 is_contactor;
 };
 
 struct batgw {
-	const struct batgw_config *
-				 bg_conf;
+	struct batgw_config	*bg_conf;
+	const char		*bg_conffile;
+	char			**bg_argv;	/* to restart */
 	unsigned int		 bg_verbose;
 
 	struct event_config	*bg_evcfg;
 	struct event_base	*bg_evbase;
 
 	struct batgw_mqtt	*bg_mqtt;
+	struct batgw_http	*bg_http;
 
 	unsigned int		 bg_charge_off;
 	unsigned int		 bg_discharge_off;
 	unsigned int		 bg_max_charge_w;
 	unsigned int		 bg_max_discharge_w;
 
-	const struct batgw_battery
-				*bg_battery;
-	void			*bg_battery_sc;
-	struct batgw_b_state	 bg_battery_state;
+	struct batgw_b		 bg_batteries[BATGW_BATTERIES];
+	unsigned int		 bg_nbatteries;
 
 	const struct batgw_inverter *
 				 bg_inverter;
 	void			*bg_inverter_sc;
 	struct batgw_i_state	 bg_inverter_state;
 
-	const char		*bg_unsafe_reason;
+	struct batgw_limits	 bg_limits;
+
+	struct batgw_tasks	 bg_tasks;
+	unsigned int		 bg_ntasks;
+	struct batgw_hists	 bg_hists;
+	struct batgw_cans	 bg_cans;
+	struct batgw_canifs	 bg_canifs;
+	struct batgw_task	*bg_canif_task;
+	int			 bg_nl;		/* rtnetlink */
+	int			 bg_db;		/* BATGW_DB_DIR is ours */
+	struct event		*bg_rec_sig;
+	struct event		*bg_term_sig;
+	struct event		*bg_int_sig;
+	struct event		*bg_hup_sig;
+	struct event		*bg_reload_ev;
+	int			 bg_reload_force;
+	struct batgw_replay	*bg_replay;
+	struct batgw_snap_hdr	*bg_snap;	/* mapped */
+	size_t			 bg_snap_len;
+	struct batgw_task	*bg_snap_task;
+	struct timeval		 bg_now;	/* cached per wakeup */
+	struct timeval		 bg_can_rx;	/* current frame */
+
+	struct batgw_kv_scopes	 bg_kv_scopes;
+	struct batgw_kv		*bg_kv_dirty;
+	struct batgw_kv_block	*bg_kv_block_dirty;
+	unsigned int		 bg_kv_deadband[KV_T_MAXTYPE];	/* milli */
 };
 
 extern const struct batgw_inverter inverter_byd_can;
@@ -148,15 +377,52 @@ batgw_battery_lookup(const char *name)
 	return (NULL);
 }
 
-static void	can_recv(int, short, void *);
-static void	can_poll(int, short, void *);
-
 static void	teleperiod(int, short, void *);
 static const struct timeval teleperiod_tv = { 60, 0 };
 
 static void	batgw_mqtt_init(struct batgw *);
 static void	batgw_mqtt_status(struct batgw *);
 static int	batgw_cmnd_onoff(const char *);
+static int	batgw_b_max_ages(struct batgw_b *);
+static void	batgw_limits_commit(struct batgw *);
+static void	batgw_limits_expire(int, short, void *);
+static int	batgw_kv_deadbands(struct batgw *,
+		    const struct batgw_config_mqtt *);
+static int	batgw_mqtt_config(struct batgw *, struct batgw_config_mqtt *);
+static void	batgw_realtime(const struct batgw_config *);
+static void	batgw_mqtt_reload(struct batgw *, struct batgw_config_mqtt *);
+static void	batgw_b_limits_config(struct batgw_config_battery *);
+static void	batgw_reload_signal(int, short, void *);
+static void	batgw_reload_ev(int, short, void *);
+static int	batgw_strcmp(const char *, const char *);
+static unsigned int
+		batgw_kv_deadband(const struct batgw *,
+		    enum batgw_kv_type, unsigned int, const char *);
+static void	batgw_kv_block_deadband(const struct batgw *,
+		    struct batgw_kv_block *);
+static int	batgw_kv_block_flush(struct batgw *, struct batgw_kv_block *,
+		    unsigned int, unsigned int, int, int);
+static void	batgw_kv_block_refresh(struct batgw *, struct batgw_kv_block *,
+		    unsigned int, unsigned int);
+static void	batgw_energy_attach(struct batgw *, struct batgw_b *);
+static void	batgw_energy_sample(struct batgw_b *);
+static void	batgw_db_init(struct batgw *);
+static void	batgw_rec_dump(struct batgw *);
+static void	batgw_rec_signal(int, short, void *);
+static int	batgw_rec_export(const char *);
+static void	batgw_replay_load(struct batgw *, const char *, int);
+static void	batgw_replay_start(struct batgw *);
+static void	batgw_replay_drain(int, short, void *);
+static struct batgw_canif *
+		batgw_canif_get(struct batgw *, struct batgw_can *);
+static void	batgw_canif_error(struct batgw *, struct batgw_can *,
+		    const struct canfd_frame *);
+static void	batgw_bench_report(struct batgw *);
+static void	batgw_http_init(struct batgw *);
+static void	batgw_snap_init(struct batgw *);
+static void	batgw_snap_save(struct batgw *);
+static void	batgw_snap_sync(struct batgw *);
+static void	batgw_shutdown(int, short, void *);
 
 static struct batgw _bg;
 
@@ -170,6 +436,9 @@ usage(void)
 
 	fprintf(stderr, "usage: %s [-dnv] [-c on|off] [-D macro=value] "
 	    "[-f file]\n", progname);
+	fprintf(stderr, "       %*s [-B recording] [-r recording]\n",
+	    (int)strlen(progname), "");
+	fprintf(stderr, "       %s -R recording\n", progname);
 
 	exit(1);
 }
@@ -187,14 +456,28 @@ main(int argc, char *argv[])
 
 	struct batgw_config *conf;
 	struct batgw_config_mqtt *mqttconf;
+	struct batgw_b *b;
+	unsigned int i;
+
+	TAILQ_INIT(&bg->bg_tasks);
+	TAILQ_INIT(&bg->bg_hists);
+	TAILQ_INIT(&bg->bg_cans);
+	TAILQ_INIT(&bg->bg_canifs);
+	TAILQ_INIT(&bg->bg_kv_scopes);
+	bg->bg_nl = -1;
 
 	v_safe = arc4random();
 	do {
 		v_unsafe = arc4random();
 	} while (v_unsafe == v_safe);
+	bg->bg_limits.l_safety = v_unsafe;
+	bg->bg_limits.l_dirty = BATGW_LIMITS_ALL;
 
-	while ((ch = getopt(argc, argv, "c:dD:f:nv")) != -1) {
+	while ((ch = getopt(argc, argv, "B:c:dD:f:nr:R:v")) != -1) {
 		switch (ch) {
+		case 'B':
+			batgw_replay_load(bg, optarg, 1);
+			break;
 		case 'c':
 			v = batgw_cmnd_onoff(optarg);
 			if (v == -1) {
@@ -218,6 +501,11 @@ main(int argc, char *argv[])
 		case 'n':
 			confcheck = 1;
 			break;
+		case 'r':
+			batgw_replay_load(bg, optarg, 0);
+			break;
+		case 'R':
+			return (batgw_rec_export(optarg));
 		case 'v':
 			bg->bg_verbose++;
 			break;
@@ -230,17 +518,35 @@ main(int argc, char *argv[])
 	conf = parse_config(conffile);
 	if (conf == NULL)
 		exit(1);
+	bg->bg_conffile = conffile;
+	bg->bg_argv = argv;
+
+	for (i = 0; i < conf->nbatteries; i++) {
+		struct batgw_config_battery *bconf = &conf->batteries[i];
+
+		b = &bg->bg_batteries[i];
+		b->b_bg = bg;
+		b->b_conf = bconf;
+		b->b_driver = batgw_battery_lookup(bconf->protocol);
+		if (b->b_driver == NULL) {
+			errx(1, "battery protocol \"%s\": unknown",
+			    bconf->protocol);
+		}
+
+		/* a lone pack keeps the names it always had */
+		if (conf->nbatteries == 1) {
+			strlcpy(b->b_scope, "battery", sizeof(b->b_scope));
+		} else {
+			snprintf(b->b_scope, sizeof(b->b_scope),
+			    "battery%u", i);
+		}
 
-	bg->bg_battery = batgw_battery_lookup(conf->battery.protocol);
-	if (bg->bg_battery == NULL) {
-		errx(1, "battery protocol \"%s\": unknown",
-		    conf->battery.protocol);
+		if (b->b_driver->b_check(bconf) != 0)
+			return (1);
 	}
+	bg->bg_nbatteries = conf->nbatteries;
 	bg->bg_inverter = &inverter_byd_can; /* XXX */
 
-	if (bg->bg_battery->b_check(&conf->battery) != 0)
-		return (1);
-
 	if (bg->bg_inverter->i_check(&conf->inverter) != 0)
 		return (1);
 
@@ -250,37 +556,21 @@ main(int argc, char *argv[])
 	}
 
 	mqttconf = conf->mqtt;
-	if (mqttconf != NULL) {
-		if (mqttconf->port == NULL)
-			mqttconf->port = BATGW_MQTT_PORT;
-		if (mqttconf->topic == NULL)
-			mqttconf->topic = BATGW_MQTT_TOPIC;
-		if (mqttconf->clientid == NULL) {
-			int rv = asprintf(&mqttconf->clientid, "%s-%d-%08x%08x",
-			    getprogname(), getpid(),
-			    arc4random(), arc4random());
-			if (rv == -1)
-				errx(1, "unable to create mqtt client id");
-		}
+	if (mqttconf != NULL && batgw_mqtt_config(bg, mqttconf) != 0)
+		return (1);
 
-		if (mqttconf->keepalive == BATGW_MQTT_KEEPALIVE_UNSET)
-			mqttconf->keepalive = BATGW_MQTT_KEEPALIVE_DEFAULT;
-		if (mqttconf->teleperiod == 0)
-			mqttconf->teleperiod = BATGW_MQTT_TELEPERIOD;
-		if (mqttconf->reconnect_tmo == 0)
-			mqttconf->reconnect_tmo = 30;
-	}
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
 
-	if (conf->battery.max_charge_w == 0) {
-		conf->battery.max_charge_w = BATGW_CHARGE_MAX_DEFAULT;
-		conf->battery.charge_w = BATGW_CHARGE_DEFAULT;
-	}
-	if (conf->battery.max_discharge_w == 0) {
-		conf->battery.max_discharge_w = BATGW_DISCHARGE_MAX_DEFAULT;
-		conf->battery.discharge_w = BATGW_DISCHARGE_DEFAULT;
-	}
+		batgw_b_limits_config(b->b_conf);
+		b->b_driver->b_config(b->b_conf);
+		if (batgw_b_max_ages(b) != 0)
+			return (1);
 
-	bg->bg_battery->b_config(&conf->battery);
+		/* the packs share the inverter, so their limits add up */
+		bg->bg_max_charge_w += b->b_conf->charge_w;
+		bg->bg_max_discharge_w += b->b_conf->discharge_w;
+	}
 	bg->bg_inverter->i_config(&conf->inverter);
 
 	if (confcheck) {
@@ -290,9 +580,6 @@ main(int argc, char *argv[])
 
 	/* let's try and get going */
 
-	bg->bg_max_charge_w = conf->battery.charge_w;
-	bg->bg_max_discharge_w = conf->battery.discharge_w;
-
 	bg->bg_conf = conf;
 
 	bg->bg_evcfg = event_config_new();
@@ -305,24 +592,180 @@ main(int argc, char *argv[])
 	if (bg->bg_evbase == NULL)
 		errx(1, "new event_base failed");
 
-	bg->bg_battery_sc = bg->bg_battery->b_attach(bg);
+	batgw_db_init(bg);
+
+	bg->bg_rec_sig = evsignal_new(bg->bg_evbase, SIGUSR1,
+	    batgw_rec_signal, bg);
+	if (bg->bg_rec_sig == NULL)
+		errx(1, "new recorder signal event failed");
+	event_add(bg->bg_rec_sig, NULL);
+
+	bg->bg_term_sig = evsignal_new(bg->bg_evbase, SIGTERM,
+	    batgw_shutdown, bg);
+	bg->bg_int_sig = evsignal_new(bg->bg_evbase, SIGINT,
+	    batgw_shutdown, bg);
+	if (bg->bg_term_sig == NULL || bg->bg_int_sig == NULL)
+		errx(1, "new shutdown signal events failed");
+	event_add(bg->bg_term_sig, NULL);
+	event_add(bg->bg_int_sig, NULL);
+
+	bg->bg_hup_sig = evsignal_new(bg->bg_evbase, SIGHUP,
+	    batgw_reload_signal, bg);
+	bg->bg_reload_ev = evtimer_new(bg->bg_evbase, batgw_reload_ev, bg);
+	if (bg->bg_hup_sig == NULL || bg->bg_reload_ev == NULL)
+		errx(1, "new reload events failed");
+	event_add(bg->bg_hup_sig, NULL);
+
+	bg->bg_limits.l_ev = evtimer_new(bg->bg_evbase,
+	    batgw_limits_expire, bg);
+	if (bg->bg_limits.l_ev == NULL)
+		errx(1, "new limits event failed");
+
+	batgw_now(&bg->bg_now);
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		b->b_sc = b->b_driver->b_attach(bg, b);
+		batgw_energy_attach(bg, b);
+	}
 	bg->bg_inverter_sc = bg->bg_inverter->i_attach(bg);
 
+	/* a replay mustn't clobber the state of a real gateway */
+	if (bg->bg_replay == NULL)
+		batgw_snap_init(bg);
+
 	if (mqttconf != NULL)
 		batgw_mqtt_init(bg);
+	if (conf->http != NULL)
+		batgw_http_init(bg);
 
-	bg->bg_battery->b_dispatch(bg, bg->bg_battery_sc);
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		b->b_driver->b_dispatch(bg, b->b_sc);
+	}
 	bg->bg_inverter->i_dispatch(bg, bg->bg_inverter_sc);
 
+	if (bg->bg_replay != NULL)
+		batgw_replay_start(bg);
+	else if (conf->rt_priority != 0)
+		batgw_realtime(conf);
+
 	event_base_dispatch(bg->bg_evbase);
 
 	return (0);
 }
 
+/*
+ * the can loop is the only thing on this thread by now, the mqtt
+ * thread has already been started with the default policy.
+ */
+
+static void
+batgw_realtime(const struct batgw_config *conf)
+{
+	struct sched_param sp = { .sched_priority = conf->rt_priority };
+	cpu_set_t cpus;
+	int rv;
+
+	if (mlockall(MCL_CURRENT|MCL_FUTURE) == -1)
+		err(1, "mlockall");
+
+	if (conf->rt_cpu != -1) {
+		CPU_ZERO(&cpus);
+		CPU_SET(conf->rt_cpu, &cpus);
+		rv = pthread_setaffinity_np(pthread_self(),
+		    sizeof(cpus), &cpus);
+		if (rv != 0) {
+			errno = rv;
+			err(1, "realtime cpu %d", conf->rt_cpu);
+		}
+	}
+
+	rv = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+	if (rv != 0) {
+		errno = rv;
+		err(1, "realtime priority %d", conf->rt_priority);
+	}
+
+	linfo("realtime priority %d", conf->rt_priority);
+}
+
+static int
+batgw_mqtt_config(struct batgw *bg, struct batgw_config_mqtt *mqttconf)
+{
+	/* these get freed with the config */
+	if (mqttconf->port == NULL &&
+	    (mqttconf->port = strdup(BATGW_MQTT_PORT)) == NULL)
+		err(1, "mqtt port");
+	if (mqttconf->topic == NULL &&
+	    (mqttconf->topic = strdup(BATGW_MQTT_TOPIC)) == NULL)
+		err(1, "mqtt topic");
+	if (mqttconf->clientid == NULL) {
+		int rv = asprintf(&mqttconf->clientid, "%s-%d-%08x%08x",
+		    getprogname(), getpid(),
+		    arc4random(), arc4random());
+		if (rv == -1)
+			errx(1, "unable to create mqtt client id");
+	}
+
+	if (mqttconf->keepalive == BATGW_MQTT_KEEPALIVE_UNSET)
+		mqttconf->keepalive = BATGW_MQTT_KEEPALIVE_DEFAULT;
+	if (mqttconf->wm_high == 0) {
+		mqttconf->wm_low = BATGW_MQTT_WATERMARK_LOW;
+		mqttconf->wm_high = BATGW_MQTT_WATERMARK_HIGH;
+	}
+	if (mqttconf->publish_min == BATGW_MQTT_PUBLISH_UNSET)
+		mqttconf->publish_min = BATGW_MQTT_PUBLISH_MIN;
+	if (batgw_kv_deadbands(bg, mqttconf) != 0)
+		return (-1);
+	if (mqttconf->telemetry == BATGW_MQTT_TELEMETRY_UNSET)
+		mqttconf->telemetry = BATGW_MQTT_TELEMETRY_KV;
+	if (mqttconf->teleperiod == 0)
+		mqttconf->teleperiod = BATGW_MQTT_TELEPERIOD;
+	if (mqttconf->reconnect_tmo == 0)
+		mqttconf->reconnect_tmo = 30;
+	if (mqttconf->connect_tmo == 0)
+		mqttconf->connect_tmo = BATGW_MQTT_CONNECT_TMO;
+	if (mqttconf->qos == BATGW_MQTT_QOS_UNSET)
+		mqttconf->qos = 0;
+
+	return (0);
+}
+
+static void
+batgw_b_limits_config(struct batgw_config_battery *bconf)
+{
+	if (bconf->max_charge_w == 0) {
+		bconf->max_charge_w = BATGW_CHARGE_MAX_DEFAULT;
+		bconf->charge_w = BATGW_CHARGE_DEFAULT;
+	}
+	if (bconf->max_discharge_w == 0) {
+		bconf->max_discharge_w = BATGW_DISCHARGE_MAX_DEFAULT;
+		bconf->discharge_w = BATGW_DISCHARGE_DEFAULT;
+	}
+}
+
+static void
+dump_canfd(unsigned int canfd)
+{
+	if (!ISSET(canfd, BATGW_CAN_FD))
+		return;
+
+	printf("\t" "fd%s" "\n",
+	    ISSET(canfd, BATGW_CAN_FD_BRS) ? " brs" : "");
+}
+
 void
 dump_config(const struct batgw_config *conf)
 {
 	const struct batgw_config_mqtt *mqtt = conf->mqtt;
+	unsigned int i, n;
+
+	if (conf->rt_priority != 0) {
+		printf("realtime priority %d", conf->rt_priority);
+		if (conf->rt_cpu != -1)
+			printf(" cpu %d", conf->rt_cpu);
+		printf("\n\n");
+	}
 
 	if (mqtt != NULL) {
 		printf("mqtt {\n");
@@ -361,1032 +804,6990 @@ dump_config(const struct batgw_config *conf)
 				printf("%d", mqtt->keepalive);
 			printf("\n");
 		}
+		switch (mqtt->telemetry) {
+		case BATGW_MQTT_TELEMETRY_KV:
+			printf("\t" "telemetry kv" "\n");
+			break;
+		case BATGW_MQTT_TELEMETRY_JSON:
+			printf("\t" "telemetry json" "\n");
+			break;
+		case BATGW_MQTT_TELEMETRY_BINARY:
+			printf("\t" "telemetry binary" "\n");
+			break;
+		}
 		if (mqtt->teleperiod != 0) {
 			printf("\t" "teleperiod %u" "\n",
 			    mqtt->teleperiod);
 		}
+		if (mqtt->wm_high != 0) {
+			printf("\t" "watermark low %u high %u" "\n",
+			    mqtt->wm_low, mqtt->wm_high);
+		}
+		if (mqtt->thread)
+			printf("\t" "thread" "\n");
+		if (mqtt->rollup)
+			printf("\t" "rollup" "\n");
+		if (mqtt->qos > 0)
+			printf("\t" "qos %d" "\n", mqtt->qos);
+		if (mqtt->queue != 0) {
+			printf("\t" "queue %u rate %u" "\n",
+			    mqtt->queue, mqtt->queue_rate);
+		}
+		if (mqtt->publish_min != BATGW_MQTT_PUBLISH_UNSET) {
+			printf("\t" "publish interval %d", mqtt->publish_min);
+			if (mqtt->publish_max != 0)
+				printf(" max %u", mqtt->publish_max);
+			printf("\n");
+		}
+		for (i = 0; i < mqtt->ndeadbands; i++) {
+			printf("\t" "deadband \"%s\" %u" "\n",
+			    mqtt->deadbands[i].name, mqtt->deadbands[i].milli);
+		}
 		if (mqtt->connect_tmo != 0) {
 			printf("\t" "connect timeout %u" "\n",
 			    mqtt->connect_tmo);
 		}
 		if (mqtt->reconnect_tmo != 0) {
-			printf("\t" "reconnect timeout %u" "\n",
+			printf("\t" "reconnect %u" "\n",
 			    mqtt->reconnect_tmo);
 		}
 		printf("}\n\n");
 	}
 
-	printf("battery {\n");
-	printf("\t" "protocol \"%s\"" "\n", conf->battery.protocol);
-	if (conf->battery.ifname)
-		printf("\t" "interface \"%s\"" "\n", conf->battery.ifname);
-	if (conf->battery.max_charge_w != 0) {
-		printf("\t" "charge limit %u max %u\n",
-		    conf->battery.charge_w, conf->battery.max_charge_w);
+	if (conf->http != NULL) {
+		printf("http {\n");
+		printf("\t" "listen on \"%s\" port %d" "\n",
+		    conf->http->listen, conf->http->port);
+		printf("}\n\n");
 	}
-	if (conf->battery.max_discharge_w != 0) {
-		printf("\t" "discharge limit %u max %u\n",
-		    conf->battery.discharge_w, conf->battery.max_discharge_w);
+
+	for (n = 0; n < conf->nbatteries; n++) {
+		const struct batgw_config_battery *bconf =
+		    &conf->batteries[n];
+
+		printf("battery {\n");
+		printf("\t" "protocol \"%s\"" "\n", bconf->protocol);
+		if (bconf->ifname)
+			printf("\t" "interface \"%s\"" "\n", bconf->ifname);
+		if (bconf->bcm)
+			printf("\t" "bcm" "\n");
+		dump_canfd(bconf->canfd);
+		if (bconf->max_charge_w != 0) {
+			printf("\t" "charge limit %u max %u\n",
+			    bconf->charge_w, bconf->max_charge_w);
+		}
+		if (bconf->max_discharge_w != 0) {
+			printf("\t" "discharge limit %u max %u\n",
+			    bconf->discharge_w, bconf->max_discharge_w);
+		}
+		if (bconf->max_age_ms != 0)
+			printf("\t" "age limit %u" "\n", bconf->max_age_ms);
+		for (i = 0; i < bconf->nmax_ages; i++) {
+			printf("\t" "age limit \"%s\" %u" "\n",
+			    bconf->max_ages[i].name,
+			    bconf->max_ages[i].ms);
+		}
+		printf("}\n\n");
 	}
-	printf("}\n\n");
 
 	printf("inverter {\n");
 	printf("\t" "protocol \"%s\"" "\n", conf->inverter.protocol);
 	if (conf->inverter.ifname)
 		printf("\t" "interface \"%s\"" "\n", conf->inverter.ifname);
+	dump_canfd(conf->inverter.canfd);
 	printf("}\n");
 }
 
-static void
-batgw_evtimer_add(struct event *evt, time_t seconds)
-{
-	struct timeval tv = { .tv_sec = seconds };
-	evtimer_add(evt, &tv);
-}
-
 /*
- * mqtt functionality
+ * config reload. what can change while the packs and the inverter
+ * keep talking to us is applied in place. anything that needs the
+ * interfaces or drivers set up again is only done by restarting, and
+ * only if that's forced.
  */
 
-static void	batgw_mqtt_disconnect(struct batgw *);
-static void	batgw_mqtt_teleperiod(int, short, void *);
-
-struct batgw_mqtt {
-	struct evdns_base		*evdnsbase;
-	struct event			*ev_to_reconnect;
-	struct event			*ev_to_teleperiod;
+static const char *
+batgw_reload_check(const struct batgw_config *conf,
+    const struct batgw_config *nconf)
+{
+	const struct batgw_config_battery *bconf, *nbconf;
+	const char *topic, *ntopic;
+	unsigned int i, j;
+
+	if (nconf->nbatteries != conf->nbatteries)
+		return ("the number of batteries changed");
+	for (i = 0; i < conf->nbatteries; i++) {
+		bconf = &conf->batteries[i];
+		nbconf = &nconf->batteries[i];
+
+		if (strcmp(bconf->protocol, nbconf->protocol) != 0 ||
+		    batgw_strcmp(bconf->ifname, nbconf->ifname) != 0 ||
+		    bconf->bcm != nbconf->bcm ||
+		    bconf->canfd != nbconf->canfd)
+			return ("a battery interface or protocol changed");
+
+		if (bconf->max_age_ms != nbconf->max_age_ms ||
+		    bconf->nmax_ages != nbconf->nmax_ages)
+			return ("battery age limits changed");
+		for (j = 0; j < bconf->nmax_ages; j++) {
+			if (strcmp(bconf->max_ages[j].name,
+			    nbconf->max_ages[j].name) != 0 ||
+			    bconf->max_ages[j].ms != nbconf->max_ages[j].ms)
+				return ("battery age limits changed");
+		}
+	}
 
-	struct evutil_addrinfo		 hints;
-	struct evutil_addrinfo		*res0;
-	struct evutil_addrinfo		*resn;
-	struct evdns_getaddrinfo_request
-					*req;
+	if (strcmp(conf->inverter.protocol, nconf->inverter.protocol) != 0 ||
+	    batgw_strcmp(conf->inverter.ifname, nconf->inverter.ifname) != 0 ||
+	    conf->inverter.canfd != nconf->inverter.canfd)
+		return ("the inverter interface or protocol changed");
+
+	/* kv topics are built once when the drivers attach */
+	if ((conf->mqtt == NULL) != (nconf->mqtt == NULL))
+		return ("mqtt was added or removed");
+	if (conf->mqtt != NULL) {
+		topic = conf->mqtt->topic;
+		ntopic = nconf->mqtt->topic;
+		if (ntopic == NULL)
+			ntopic = BATGW_MQTT_TOPIC;
+		if (strcmp(topic, ntopic) != 0)
+			return ("the mqtt topic changed");
+		if (conf->mqtt->thread != nconf->mqtt->thread)
+			return ("the mqtt thread was added or removed");
+		if (conf->mqtt->queue != nconf->mqtt->queue)
+			return ("the mqtt queue size changed");
+		/* the id table is built once and published on connect */
+		if ((conf->mqtt->telemetry == BATGW_MQTT_TELEMETRY_BINARY) !=
+		    (nconf->mqtt->telemetry == BATGW_MQTT_TELEMETRY_BINARY))
+			return ("binary telemetry was turned on or off");
+	}
 
-	const char			*will_topic;
-	size_t				 will_topic_len;
-	const char			*cmnd_topic;
-	size_t				 cmnd_topic_len;
-	const char			*status_topic;
-	size_t				 status_topic_len;
+	if ((conf->http == NULL) != (nconf->http == NULL))
+		return ("http was added or removed");
+	if (conf->http != NULL &&
+	    (strcmp(conf->http->listen, nconf->http->listen) != 0 ||
+	    conf->http->port != nconf->http->port))
+		return ("the http listener changed");
 
-	struct mqtt_conn		*conn;
-	struct event			*ev_rd;
-	struct event			*ev_wr;
-	struct event			*ev_to;
+	if (conf->rt_priority != nconf->rt_priority ||
+	    conf->rt_cpu != nconf->rt_cpu)
+		return ("the realtime settings changed");
 
-	unsigned int			 resolved;
-	unsigned int			 running;
-};
+	return (NULL);
+}
 
-/* wrappers */
+__dead static void
+batgw_restart(struct batgw *bg)
+{
+	/* the snapshot gets the new process going again quickly */
+	batgw_snap_sync(bg);
 
-static void	batgw_mqtt_rd(int, short, void *);
-static void	batgw_mqtt_wr(int, short, void *);
-static void	batgw_mqtt_to(int, short, void *);
+	execv("/proc/self/exe", bg->bg_argv);
+	lerr(1, "restart");
+}
 
-/* callbacks */
+static void
+batgw_reload(struct batgw *bg, int force)
+{
+	struct batgw_config *conf = bg->bg_conf, *nconf;
+	struct batgw_config_battery *bconf, *nbconf;
+	unsigned int deadband[KV_T_MAXTYPE];
+	unsigned int i, limits = 0;
+	const char *why;
+
+	nconf = parse_config(bg->bg_conffile);
+	if (nconf == NULL) {
+		lwarnx("%s: reload failed", bg->bg_conffile);
+		return;
+	}
 
-static void	batgw_mqtt_want_output(struct mqtt_conn *);
-static ssize_t	batgw_mqtt_output(struct mqtt_conn *, const void *, size_t);
+	why = batgw_reload_check(conf, nconf);
+	if (why != NULL) {
+		if (!force) {
+			lwarnx("%s: %s, restart or force a reload",
+			    bg->bg_conffile, why);
+			clear_config(nconf);
+			return;
+		}
 
-static void	batgw_mqtt_on_connect(struct mqtt_conn *);
-static void	batgw_mqtt_on_suback(struct mqtt_conn *, void *,
-		    const uint8_t *, size_t);
-static void	batgw_mqtt_on_message(struct mqtt_conn *,
-		    char *, size_t, char *, size_t, enum mqtt_qos);
-static void	batgw_mqtt_dead(struct mqtt_conn *);
+		linfo("%s: %s, restarting", bg->bg_conffile, why);
+		batgw_restart(bg);
+	}
 
-static void	batgw_mqtt_want_timeout(struct mqtt_conn *,
-		    const struct timespec *);
+	if (nconf->mqtt != NULL) {
+		/* a generated client id shouldn't change under us */
+		if (nconf->mqtt->clientid == NULL &&
+		    (nconf->mqtt->clientid =
+		    strdup(conf->mqtt->clientid)) == NULL)
+			lerr(1, "mqtt client id");
+
+		memcpy(deadband, bg->bg_kv_deadband, sizeof(deadband));
+		memset(bg->bg_kv_deadband, 0, sizeof(bg->bg_kv_deadband));
+		if (batgw_mqtt_config(bg, nconf->mqtt) != 0) {
+			memcpy(bg->bg_kv_deadband, deadband,
+			    sizeof(bg->bg_kv_deadband));
+			lwarnx("%s: reload failed", bg->bg_conffile);
+			clear_config(nconf);
+			return;
+		}
+	}
 
-static const struct mqtt_settings batgw_mqtt_settings = {
-	.mqtt_want_output = batgw_mqtt_want_output,
-	.mqtt_output = batgw_mqtt_output,
-	.mqtt_want_timeout = batgw_mqtt_want_timeout,
+	for (i = 0; i < conf->nbatteries; i++) {
+		bconf = &conf->batteries[i];
+		nbconf = &nconf->batteries[i];
 
-	.mqtt_on_connect = batgw_mqtt_on_connect,
-	.mqtt_on_suback = batgw_mqtt_on_suback,
-	.mqtt_on_message = batgw_mqtt_on_message,
-	.mqtt_dead = batgw_mqtt_dead,
-};
+		batgw_b_limits_config(nbconf);
+		if (bconf->charge_w == nbconf->charge_w &&
+		    bconf->max_charge_w == nbconf->max_charge_w &&
+		    bconf->discharge_w == nbconf->discharge_w &&
+		    bconf->max_discharge_w == nbconf->max_discharge_w)
+			continue;
 
-void
-batgw_mqtt_rd(int fd, short events, void *arg)
-{
-	struct batgw *bg = arg;
-	struct mqtt_conn *mc = bg->bg_mqtt->conn;
-	char buf[16384];
-	ssize_t rv;
+		bconf->charge_w = nbconf->charge_w;
+		bconf->max_charge_w = nbconf->max_charge_w;
+		bconf->discharge_w = nbconf->discharge_w;
+		bconf->max_discharge_w = nbconf->max_discharge_w;
+		limits = 1;
+	}
 
-	rv = read(fd, buf, sizeof(buf));
-	switch (rv) {
-	case -1:
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-			return;
-		default:
-			break;
+	/* leave a limit set over mqtt alone unless the config moved */
+	if (limits) {
+		bg->bg_max_charge_w = 0;
+		bg->bg_max_discharge_w = 0;
+		for (i = 0; i < conf->nbatteries; i++) {
+			bg->bg_max_charge_w += conf->batteries[i].charge_w;
+			bg->bg_max_discharge_w +=
+			    conf->batteries[i].discharge_w;
 		}
-		err(1, "%s", __func__);
-		/* NOTREACHED */
-	case 0:
-		lwarnx("disconnected");
-		batgw_mqtt_disconnect(bg);
-		return;
-	default:
-		break;
+
+		SET(bg->bg_limits.l_dirty, BATGW_LIMITS_ALL);
+		batgw_limits_commit(bg);
 	}
 
-	mqtt_input(mc, buf, rv);
+	if (nconf->mqtt != NULL) {
+		batgw_mqtt_reload(bg, nconf->mqtt);
+		nconf->mqtt = NULL;
+	}
+	clear_config(nconf);
+
+	linfo("%s: reloaded", bg->bg_conffile);
 }
 
-void
-batgw_mqtt_wr(int fd, short events, void *arg)
+static void
+batgw_reload_signal(int sig, short events, void *arg)
 {
 	struct batgw *bg = arg;
-	struct mqtt_conn *mc = bg->bg_mqtt->conn;
 
-	mqtt_output(mc);
+	batgw_reload(bg, 0);
 }
 
 static void
-batgw_mqtt_want_output(struct mqtt_conn *mc)
+batgw_reload_ev(int nil, short events, void *arg)
 {
-	struct batgw *bg = mqtt_cookie(mc);
-	event_add(bg->bg_mqtt->ev_wr, NULL);
+	struct batgw *bg = arg;
+
+	batgw_reload(bg, bg->bg_reload_force);
 }
 
-static ssize_t
-batgw_mqtt_output(struct mqtt_conn *mc, const void *buf, size_t len)
+static void
+batgw_evtimer_add(struct event *evt, time_t seconds)
 {
-	struct batgw *bg = mqtt_cookie(mc);
-	int fd = EVENT_FD(bg->bg_mqtt->ev_wr);
-	ssize_t rv;
+	struct timeval tv = { .tv_sec = seconds };
+	evtimer_add(evt, &tv);
+}
 
-	rv = write(fd, buf, len);
-	if (rv == -1) {
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-			return (0);
-		default:
-			break;
-		}
+/*
+ * periodic tasks
+ *
+ * each task has an absolute deadline that advances by its period, so
+ * the time a callback takes doesn't push the next run back. a task that
+ * misses whole periods skips them and counts them as overruns.
+ */
 
-		err(1, "%s", __func__);
-		/* XXX reconnect */
-	}
+static void	batgw_task_run(int, short, void *);
 
-	return (rv);
+void
+batgw_now(struct timeval *tv)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		lerr(1, "clock_gettime");
+
+	TIMESPEC_TO_TIMEVAL(tv, &ts);
 }
 
+/* the event loop woke up, everything it runs now sees this time */
 static void
-batgw_mqtt_to(int nil, short events, void *arg)
+batgw_wakeup(struct batgw *bg, const struct timeval *now)
 {
-	struct batgw *bg = arg;
-	struct mqtt_conn *mc = bg->bg_mqtt->conn;
-
-	mqtt_timeout(mc);
+	bg->bg_now = *now;
 }
 
-static void
-batgw_mqtt_want_timeout(struct mqtt_conn *mc, const struct timespec *ts)
+/*
+ * latency histograms
+ */
+
+struct batgw_hist *
+batgw_hist_add(struct batgw *bg, const char *name)
 {
-	struct batgw *bg = mqtt_cookie(mc);
-	struct timeval tv;
+	struct batgw_hist *h;
 
-	TIMESPEC_TO_TIMEVAL(&tv, ts);
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		err(1, "%s histogram alloc", name);
 
-	event_add(bg->bg_mqtt->ev_to, &tv);
+	h->h_name = name;
+	TAILQ_INSERT_TAIL(&bg->bg_hists, h, h_entry);
+
+	return (h);
 }
 
-static void
-batgw_mqtt_on_connect(struct mqtt_conn *mc)
+static unsigned int
+batgw_hist_bucket(uint32_t v)
 {
-	struct batgw *bg = mqtt_cookie(mc);
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
-	static const char online[] = "Online";
+	unsigned int msb;
 
-	if (mqtt_publish(mc,
-	    bgm->will_topic, bgm->will_topic_len,
-	    online, sizeof(online) - 1, MQTT_QOS0, MQTT_RETAIN) == -1) {
-		warnx("mqtt publish %s %s", bg->bg_mqtt->will_topic, online);
-		batgw_mqtt_disconnect(bg);
-		return;
-	}
+	if (v < BATGW_HIST_SUB)
+		return (v);
 
-	if (mqtt_subscribe(mc, NULL,
-	    bgm->cmnd_topic, bgm->cmnd_topic_len, MQTT_QOS0) == -1) {
-		warnx("mqtt subscribe %s", bg->bg_mqtt->cmnd_topic);
-		batgw_mqtt_disconnect(bg);
-		return;
-	}
+	msb = 31 - __builtin_clz(v);
+	return (((msb - BATGW_HIST_SUB_BITS + 1) << BATGW_HIST_SUB_BITS) |
+	    ((v >> (msb - BATGW_HIST_SUB_BITS)) & (BATGW_HIST_SUB - 1)));
+}
+
+/* the biggest value that lands in bucket b */
+static uint32_t
+batgw_hist_value(unsigned int b)
+{
+	unsigned int major = b >> BATGW_HIST_SUB_BITS;
+	uint64_t sub = b & (BATGW_HIST_SUB - 1);
+	unsigned int shift;
 
-	bgm->running = 1;
+	if (major == 0)
+		return (b);
 
-	batgw_mqtt_teleperiod(0, 0, bg);
+	shift = major - 1;
+	return ((((BATGW_HIST_SUB + sub + 1) << shift) - 1) & 0xffffffff);
 }
 
-static void
-batgw_mqtt_on_suback(struct mqtt_conn *mc, void *cookie,
-    const uint8_t *rcodes, size_t nrcodes)
+void
+batgw_hist_record(struct batgw_hist *h, uint32_t v)
 {
-	/* cool */
+	h->h_buckets[batgw_hist_bucket(v)]++;
+	h->h_count++;
+	h->h_sum += v;
+	if (v > h->h_max)
+		h->h_max = v;
 }
 
-static int
-batgw_cmnd_onoff(const char *payload)
+static uint32_t
+batgw_hist_usec(const struct timeval *start, const struct timeval *end)
 {
-	if (payload == NULL)
-		return (-1);
+	struct timeval tv;
+	unsigned long long usec;
 
-	if (strcasecmp(payload, "on") == 0 || strcmp(payload, "1") == 0)
-		return (1);
-	if (strcasecmp(payload, "off") == 0 || strcmp(payload, "0") == 0)
+	if (!timercmp(end, start, >))
 		return (0);
-	return (-1);
+
+	timersub(end, start, &tv);
+	usec = (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+	if (usec > UINT32_MAX)
+		usec = UINT32_MAX;
+
+	return (usec);
 }
 
-static void
-batgw_mqtt_cmnd(struct batgw *bg,
-    const char *topic, size_t topic_len,
-    const char *payload, size_t payload_len)
-{
-	const struct batgw_config_battery *bconf = batgw_b_config(bg);
-	const char *errstr;
-	int v;
+/*
+ * record how long it's been since the frame being handled arrived
+ */
 
-	if (strcmp(topic, "charge") == 0) {
-		v = batgw_cmnd_onoff(payload);
-		if (v != -1)
-			bg->bg_charge_off = !v;
-	} else if (strcmp(topic, "discharge") == 0) {
-		v = batgw_cmnd_onoff(payload);
-		if (v != -1)
-			bg->bg_discharge_off = !v;
-	} else if (strcmp(topic, "max-charge") == 0) {
-		v = strtonum(payload, 0, bconf->max_charge_w, &errstr);
-		if (errstr == NULL)
-			bg->bg_max_charge_w = v;
-	} else if (strcmp(topic, "max-discharge") == 0) {
-		v = strtonum(payload, 0, bconf->max_discharge_w, &errstr);
-		if (errstr == NULL)
-			bg->bg_max_discharge_w = v;
-	}
+void
+batgw_hist_rx(struct batgw *bg, struct batgw_hist *h)
+{
+	struct timeval now;
 
-	batgw_mqtt_status(bg);
+	batgw_now(&now);
+	batgw_hist_record(h, batgw_hist_usec(&bg->bg_can_rx, &now));
 }
 
-static void
-batgw_mqtt_on_message(struct mqtt_conn *mc,
-    char *topic, size_t topic_len, char *payload, size_t payload_len,
-    enum mqtt_qos qos)
+static uint32_t
+batgw_hist_pct(const struct batgw_hist *h, unsigned int pct)
 {
-	struct batgw *bg = mqtt_cookie(mc);
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
-	size_t cmnd_len = bgm->cmnd_topic_len - 1; /* chop the # off the end */
+	uint64_t target, n = 0;
+	uint32_t v;
+	unsigned int b;
 
-	if (topic_len > cmnd_len &&
-	    strncmp(topic, bgm->cmnd_topic, cmnd_len) == 0) {
-		batgw_mqtt_cmnd(bg, topic + cmnd_len, topic_len - cmnd_len,
-		    payload, payload_len);
+	if (h->h_count == 0)
+		return (0);
+
+	target = (h->h_count * pct + 99) / 100;
+	for (b = 0; b < nitems(h->h_buckets); b++) {
+		n += h->h_buckets[b];
+		if (n >= target)
+			break;
 	}
 
-	free(topic);
-	free(payload);
+	v = batgw_hist_value(b);
+	if (v > h->h_max)
+		v = h->h_max;
+
+	return (v);
 }
 
 static void
-batgw_mqtt_dead(struct mqtt_conn *mc)
+batgw_hist_status(struct batgw *bg, struct evbuffer *b)
 {
-	lerr(1, "%s", __func__);
-}
+	struct batgw_hist *h;
+	const char *sep = "";
 
-static void	batgw_mqtt_connect(struct batgw *);
+	evbuffer_add_printf(b, "\"latency-us\":{");
 
-static inline void
-batgw_mqtt_reconnect(struct batgw *bg)
-{
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	TAILQ_FOREACH(h, &bg->bg_hists, h_entry) {
+		evbuffer_add_printf(b,
+		    "%s\"%s\":{\"n\":%llu,\"p50\":%u,\"p99\":%u,\"max\":%u}",
+		    sep, h->h_name, (unsigned long long)h->h_count,
+		    batgw_hist_pct(h, 50), batgw_hist_pct(h, 99), h->h_max);
+		sep = ",";
+	}
 
-	batgw_evtimer_add(bgm->ev_to_reconnect, mqttconf->reconnect_tmo);
+	evbuffer_add(b, "}", 1);
 }
 
-static void
-batgw_mqtt_disconnect(struct batgw *bg)
+struct batgw_task *
+batgw_task_add(struct batgw *bg, const char *name,
+    const struct timeval *period, const struct timeval *phase,
+    void (*fn)(struct batgw *, void *), void *arg)
 {
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
-	int s = EVENT_FD(bgm->ev_rd);
+	struct batgw_task *t;
+	unsigned long long usec;
 
-	bgm->running = 0;
+	if (!timerisset(period))
+		errx(1, "%s task: period is not set", name);
 
-	event_del(bgm->ev_to_teleperiod);
-	event_del(bgm->ev_to);
-	event_del(bgm->ev_wr);
-	event_del(bgm->ev_rd);
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		err(1, "%s task alloc", name);
 
-	mqtt_conn_destroy(bgm->conn);
+	t->t_ev = evtimer_new(bg->bg_evbase, batgw_task_run, t);
+	if (t->t_ev == NULL)
+		errx(1, "new %s task event failed", name);
 
-	event_free(bgm->ev_to);
-	event_free(bgm->ev_wr);
-	event_free(bgm->ev_rd);
+	t->t_bg = bg;
+	t->t_name = name;
+	t->t_hist = batgw_hist_add(bg, name);
+	t->t_period = *period;
+	t->t_fn = fn;
+	t->t_arg = arg;
 
-	close(s);
+	if (phase != NULL)
+		t->t_phase = *phase;
+	else {
+		usec = (unsigned long long)period->tv_sec * 1000000 +
+		    period->tv_usec;
+		usec = (bg->bg_ntasks * BATGW_TASK_STAGGER_USEC) % usec;
+		t->t_phase.tv_sec = usec / 1000000;
+		t->t_phase.tv_usec = usec % 1000000;
+	}
 
-	batgw_mqtt_reconnect(bg);
+	TAILQ_INSERT_TAIL(&bg->bg_tasks, t, t_entry);
+	bg->bg_ntasks++;
+
+	return (t);
 }
 
-static void
-batgw_mqtt_connected(struct batgw *bg, int s)
+void
+batgw_task_start(struct batgw_task *t)
 {
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct timeval now;
 
-	static const char offline[] = "Offline";
-	struct mqtt_conn_settings mcs = {
-		.clean_session = 1,
-		.keep_alive = mqttconf->keepalive,
+	batgw_now(&now);
+	timeradd(&now, &t->t_phase, &t->t_next);
+	evtimer_add(t->t_ev, &t->t_phase);
+}
 
-		.clientid = mqttconf->clientid,
-		.clientid_len = strlen(mqttconf->clientid),
+void
+batgw_task_stop(struct batgw_task *t)
+{
+	evtimer_del(t->t_ev);
+}
 
-		.will_topic = bgm->will_topic,
-		.will_topic_len = bgm->will_topic_len,
-		.will_payload = offline,
-		.will_payload_len = sizeof(offline) - 1,
-		.will_retain = 1,
-	};
-	struct mqtt_conn *mc;
+static void
+batgw_task_run(int nil, short events, void *arg)
+{
+	struct batgw_task *t = arg;
+	struct timeval now, tv;
+	uint32_t usec;
+
+	batgw_now(&now);
+	batgw_wakeup(t->t_bg, &now);
+	usec = batgw_hist_usec(&t->t_next, &now);
+	if (usec > BATGW_TASK_LATE_USEC)
+		t->t_late++;
+	batgw_hist_record(t->t_hist, usec);
+
+	t->t_runs++;
+	t->t_fn(t->t_bg, t->t_arg);
+
+	timeradd(&t->t_next, &t->t_period, &t->t_next);
+
+	batgw_now(&now);
+	while (!timercmp(&t->t_next, &now, >)) {
+		t->t_overruns++;
+		timeradd(&t->t_next, &t->t_period, &t->t_next);
+	}
 
-	evutil_freeaddrinfo(bgm->res0);
-	bgm->res0 = NULL;
+	timersub(&t->t_next, &now, &tv);
+	evtimer_add(t->t_ev, &tv);
+}
 
-	mc = mqtt_conn_create(&batgw_mqtt_settings, bg);
-	if (mc == NULL) {
-		lwarnx("unable to create mqtt connection");
-		goto reconnect;
+static void
+batgw_task_status(struct batgw *bg, struct evbuffer *b)
+{
+	struct batgw_task *t;
+	const char *sep = "";
+
+	evbuffer_add_printf(b, "\"tasks\":{");
+
+	TAILQ_FOREACH(t, &bg->bg_tasks, t_entry) {
+		evbuffer_add_printf(b,
+		    "%s\"%s\":{\"runs\":%llu,\"late\":%llu,"
+		    "\"overruns\":%llu}",
+		    sep, t->t_name, (unsigned long long)t->t_runs,
+		    (unsigned long long)t->t_late,
+		    (unsigned long long)t->t_overruns);
+		sep = ",";
 	}
 
-	bgm->ev_rd = event_new(bg->bg_evbase, s, EV_READ|EV_PERSIST,
-	    batgw_mqtt_rd, bg);
-	if (bgm->ev_rd == NULL) {
-		lwarnx("new mqtt ev rd failed");
-		goto destroy;
-	}
+	evbuffer_add(b, "}", 1);
+}
 
-	bgm->ev_wr = event_new(bg->bg_evbase, s, EV_WRITE,
-	    batgw_mqtt_wr, bg);
-	if (bgm->ev_wr == NULL) {
-		lwarnx("new mqtt ev wr failed");
-		goto rd_free;
-	}
+/*
+ * mqtt functionality
+ */
 
-	bgm->ev_to = evtimer_new(bg->bg_evbase,
-	    batgw_mqtt_to, bg);
-	if (bgm->ev_to == NULL) {
-		lwarnx("new mqtt ev to failed");
-		goto wr_free;
-	}
+static void	batgw_mqtt_disconnect(struct batgw *);
+static void	batgw_mqtt_teleperiod(int, short, void *);
+static void	batgw_kv_json_teleperiod(struct batgw *);
+static void	batgw_kv_bin_init(struct batgw *);
+static void	batgw_kv_bin_teleperiod(struct batgw *);
+static void	batgw_kv_rollups(struct batgw *);
+static void	batgw_kv_flush(int, short, void *);
+static void	batgw_kv_refresh(struct batgw *, void *);
+
+/* let changes pile up a bit before they go out */
+static const struct timeval batgw_kv_flush_tv = { 0, 250000 };
+static const struct timeval batgw_kv_refresh_tv = { 1, 0 };
+/* values held back by the publish interval or congestion wait this long */
+static const struct timeval batgw_kv_retry_tv = { 1, 0 };
 
-	bgm->conn = mc;
-	if (mqtt_connect(mc, &mcs) == -1) {
-		lwarnx("mqtt_connect server %s port %s",
-		    mqttconf->host, mqttconf->port);
-		goto to_free;
-	}
+/*
+ * with "thread" configured the mqtt connection gets its own thread
+ * and event base, so dns, connects, and a slow broker can't hold the
+ * can loop up. the can loop still decides what gets published, it
+ * just hands the messages over through a single producer, single
+ * consumer ring. connection state and commands come back the same
+ * way. each ring has an eventfd the consumer waits on, which only
+ * gets poked when the ring was empty.
+ */
 
-	linfo("connected to mqtt server %s port %s",
-	    mqttconf->host, mqttconf->port);
+struct batgw_spsc_msg {
+	uint32_t			 m_type;
+	uint32_t			 m_flags;
+	uint32_t			 m_tlen;
+	uint32_t			 m_plen;
+};
 
-	event_add(bgm->ev_rd, NULL);
-	return;
+#define BATGW_SPSC_PAD			0	/* skip to the start */
+#define BATGW_SPSC_PUBLISH		1
+#define BATGW_SPSC_RECONF		2
+#define BATGW_SPSC_UP			3
+#define BATGW_SPSC_DOWN			4
+#define BATGW_SPSC_CMND			5
+
+#define BATGW_SPSC_F_RECONNECT		(1 << 0)
+#define BATGW_SPSC_F_NOPAYLOAD		(1 << 1)
+
+struct batgw_spsc {
+	uint8_t				*q_buf;
+	size_t				 q_size;	/* power of 2 */
+	size_t				 q_prod;	/* free running */
+	size_t				 q_cons;
+	int				 q_fd;
+};
 
-to_free:
-	event_free(bgm->ev_to);
-wr_free:
-	event_free(bgm->ev_wr);
-rd_free:
-	event_free(bgm->ev_rd);
-destroy:
-	mqtt_conn_destroy(mc);
-reconnect:
-	close(s);
-	batgw_mqtt_reconnect(bg);
+static void
+batgw_spsc_init(struct batgw_spsc *q, size_t size)
+{
+	q->q_buf = malloc(size);
+	if (q->q_buf == NULL)
+		err(1, "mqtt queue alloc");
+	q->q_size = size;
+	q->q_prod = q->q_cons = 0;
+
+	q->q_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (q->q_fd == -1)
+		err(1, "mqtt queue eventfd");
 }
 
-static void
-batgw_mqtt_connected_ev(int s, short events, void *arg)
+static inline size_t
+batgw_spsc_len(size_t tlen, size_t plen)
 {
-	struct batgw *bg = arg;
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
-	int error;
-	socklen_t slen = sizeof(error);
+	const size_t align = sizeof(struct batgw_spsc_msg);
 
-	if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &slen) == -1)
-		lerr(1, "%s getsockopt");
-	if (error == EINPROGRESS)
-		return;
+	return (howmany(align + tlen + plen, align) * align);
+}
 
-	event_del(bg->bg_mqtt->ev_wr);
-	event_free(bg->bg_mqtt->ev_wr);
+static int
+batgw_spsc_put(struct batgw_spsc *q, unsigned int type, unsigned int flags,
+    const void *t, size_t tlen, const void *p, size_t plen)
+{
+	struct batgw_spsc_msg *m;
+	size_t len = batgw_spsc_len(tlen, plen);
+	size_t prod = q->q_prod;
+	size_t cons, off, skip = 0;
+	uint64_t one = 1;
+
+	cons = __atomic_load_n(&q->q_cons, __ATOMIC_ACQUIRE);
+	off = prod & (q->q_size - 1);
+	if (q->q_size - off < len)
+		skip = q->q_size - off; /* messages don't wrap */
+	if (q->q_size - (prod - cons) < skip + len)
+		return (-1);
 
-	if (error != 0) {
-		errno = error;
-		lwarn("mqtt server %s port %s connect",
-		    mqttconf->host, mqttconf->port);
-		close(s);
-		batgw_mqtt_connect(bg);
-		return;
+	if (skip != 0) {
+		m = (struct batgw_spsc_msg *)(q->q_buf + off);
+		m->m_type = BATGW_SPSC_PAD;
+		off = 0;
 	}
 
-	batgw_mqtt_connected(bg, s);
+	m = (struct batgw_spsc_msg *)(q->q_buf + off);
+	m->m_type = type;
+	m->m_flags = flags;
+	m->m_tlen = tlen;
+	m->m_plen = plen;
+	if (tlen > 0)
+		memcpy(m + 1, t, tlen);
+	if (plen > 0)
+		memcpy((uint8_t *)(m + 1) + tlen, p, plen);
+
+	__atomic_store_n(&q->q_prod, prod + skip + len, __ATOMIC_SEQ_CST);
+
+	/* the consumer can only be asleep if it had caught up */
+	if (__atomic_load_n(&q->q_cons, __ATOMIC_SEQ_CST) == prod) {
+		if (write(q->q_fd, &one, sizeof(one)) == -1 &&
+		    errno != EAGAIN)
+			lwarn("mqtt queue wakeup");
+	}
+
+	return (0);
 }
 
-static void
-batgw_mqtt_connect(struct batgw *bg)
+static struct batgw_spsc_msg *
+batgw_spsc_peek(struct batgw_spsc *q)
 {
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
-	struct evutil_addrinfo *res;
-	int s;
-
-	while ((res = bgm->resn) != NULL) {
-		bgm->resn = res->ai_next;
-
-		s = socket(res->ai_family, res->ai_socktype|SOCK_NONBLOCK,
-		    res->ai_protocol);
-		if (s == -1)
-			continue;
+	struct batgw_spsc_msg *m;
+	size_t off;
 
-		if (connect(s, res->ai_addr, res->ai_addrlen) == -1) {
-			if (errno == EINPROGRESS) {
-				bg->bg_mqtt->ev_wr = event_new(bg->bg_evbase,
-				    s, EV_WRITE|EV_PERSIST,
-				    batgw_mqtt_connected_ev, bg);
-				if (bg->bg_mqtt->ev_wr == NULL)
-					lerr(1, "mqtt connect event_new");
+	for (;;) {
+		if (q->q_cons == __atomic_load_n(&q->q_prod, __ATOMIC_ACQUIRE))
+			return (NULL);
 
-				event_add(bg->bg_mqtt->ev_wr, NULL);
-				return;
-			}
-
-			lwarn("mqtt server %s port %s connect",
-			    mqttconf->host, mqttconf->port);
-			close(s);
-			continue;
-		}
+		off = q->q_cons & (q->q_size - 1);
+		m = (struct batgw_spsc_msg *)(q->q_buf + off);
+		if (m->m_type != BATGW_SPSC_PAD)
+			return (m);
 
-		batgw_mqtt_connected(bg, s);
-		return;
+		__atomic_store_n(&q->q_cons, q->q_cons + (q->q_size - off),
+		    __ATOMIC_SEQ_CST);
 	}
-
-	errno = EHOSTUNREACH;
-	lwarn("mqtt server %s port %s", mqttconf->host, mqttconf->port);
-	evutil_freeaddrinfo(bgm->res0);
-	bgm->res0 = NULL;
-
-	batgw_mqtt_reconnect(bg);
 }
 
 static void
-batgw_mqtt_addrinfo(int errcode, struct evutil_addrinfo *res0, void *arg)
+batgw_spsc_take(struct batgw_spsc *q, const struct batgw_spsc_msg *m)
 {
-	struct batgw *bg = arg;
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
-	struct evutil_addrinfo *res;
-	int s = -1;
-	int serrno;
-	const char *cause;
+	__atomic_store_n(&q->q_cons,
+	    q->q_cons + batgw_spsc_len(m->m_tlen, m->m_plen),
+	    __ATOMIC_SEQ_CST);
+}
 
-	bgm->resolved = 1;
+/* the consumer does this before it drains the ring */
+static void
+batgw_spsc_clear(struct batgw_spsc *q)
+{
+	uint64_t n;
 
-	if (errcode != 0) {
-		lwarnx("mqtt server %s port %s: %s",
-		    mqttconf->host, mqttconf->port,
-		    evutil_gai_strerror(errcode));
-		batgw_mqtt_reconnect(bg);
+	if (read(q->q_fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+		lwarn("mqtt queue read");
+}
+
+static size_t
+batgw_spsc_queued(const struct batgw_spsc *q)
+{
+	return (q->q_prod - __atomic_load_n(&q->q_cons, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * with a "queue", telemetry published while the broker is away is
+ * held here instead of being dropped, and sent at the queue rate
+ * once it's back. a topic is only held once, so a kv that keeps
+ * changing only costs one slot, and it goes out with its newest
+ * value. while the queue drains, new publishes go through it too so
+ * they can't be overtaken by an older value.
+ */
+
+static const struct timeval batgw_mqtt_store_tv = { 0, 100000 };
+#define BATGW_MQTT_STORE_TICKS	10	/* per second */
+
+struct batgw_mqtt_held {
+	char			*h_topic;
+	size_t			 h_tlen;
+	char			*h_payload;
+	size_t			 h_plen;
+	uint32_t		 h_hash;
+};
+
+struct batgw_mqtt_store {
+	struct batgw_mqtt_held	*s_held;
+	unsigned int		 s_size;
+	unsigned int		 s_n;		/* held so far */
+	unsigned int		 s_next;	/* next one to send */
+
+	uint32_t		*s_index;	/* s_held + 1, 0 is free */
+	uint32_t		 s_mask;
+
+	struct event		*s_ev;
+};
+
+/*
+ * connects are staggered across the broker's addresses, happy eyeballs
+ * style, so a dead address only costs the attempt delay rather than a
+ * whole connect timeout. the first one through wins.
+ */
+
+#define BATGW_MQTT_ATTEMPTS		4
+#define BATGW_MQTT_ATTEMPT_DELAY	250000	/* usec */
+#define BATGW_MQTT_RES_TTL		60	/* seconds */
+#define BATGW_MQTT_BACKOFF		250	/* msec, doubled per failure */
+
+struct batgw_mqtt_attempt {
+	struct batgw			*a_bg;
+	int				 a_fd;
+	struct event			*a_ev;
+};
+
+struct batgw_mqtt {
+	/* the connection side, which may be on its own thread */
+	struct event_base		*evbase;
+	struct batgw_config_mqtt	*conf;
+	unsigned int			 threaded;
+	pthread_t			 thread;
+	struct batgw_spsc		 txq;	/* to the mqtt thread */
+	struct batgw_spsc		 rxq;	/* back to the can loop */
+	struct event			*ev_txq;
+	struct event			*ev_rxq;
+
+	struct evdns_base		*evdnsbase;
+	struct event			*ev_to_reconnect;
+	struct event			*ev_to_teleperiod;
+	unsigned int			 backoff;	/* failures in a row */
+	struct timeval			 up;		/* connected at */
+
+	/* resolved addresses are reused until they expire */
+	struct evutil_addrinfo		 hints;
+	struct evutil_addrinfo		*res0;
+	const struct evutil_addrinfo	**addrs;	/* in connect order */
+	unsigned int			 naddrs;
+	unsigned int			 addrn;		/* next to try */
+	struct timeval			 res_expire;
+	struct evdns_getaddrinfo_request
+					*req;
+
+	/* connects to several addresses racing each other */
+	struct batgw_mqtt_attempt	 attempts[BATGW_MQTT_ATTEMPTS];
+	unsigned int			 nattempts;
+	struct event			*ev_to_attempt;	/* start the next */
+	struct event			*ev_to_connect;	/* give up */
+
+	const char			*will_topic;
+	size_t				 will_topic_len;
+	const char			*cmnd_topic;
+	size_t				 cmnd_topic_len;
+	const char			*status_topic;
+	size_t				 status_topic_len;
+
+	struct evbuffer			*json;
+	struct event			*ev_kv_flush;
+
+	/* binary telemetry, see batgw_kv_bin_teleperiod */
+	const char			*bin_topic;
+	size_t				 bin_topic_len;
+	const char			*ids_topic;
+	size_t				 ids_topic_len;
+	char				*ids;		/* the id table */
+	size_t				 ids_len;
+	uint32_t			 ids_hash;
+	unsigned int			 nids;
+	uint8_t				*bin;		/* a whole frame */
+	uint32_t			 bin_seq;
+	unsigned int			 bin_frames;	/* since a keyframe */
+	struct batgw_task		*kv_refresh;
+
+	struct mqtt_conn		*conn;
+	struct event			*ev_rd;
+	struct event			*ev_wr;
+	struct event			*ev_to;
+
+	/* output ring, flushed with writev */
+	uint8_t				*obuf;
+	size_t				 obuf_off;
+	size_t				 obuf_len;
+	unsigned int			 obuf_short;
+	unsigned int			 congested;
+	uint64_t			 dropped;
+
+	struct batgw_mqtt_store		 store;	/* can loop side */
+
+	unsigned int			 resolved;
+	unsigned int			 running;
+};
+
+static inline enum mqtt_qos
+batgw_mqtt_qos(const struct batgw_config_mqtt *mqttconf)
+{
+	return (mqttconf->qos > 0 ? MQTT_QOS1 : MQTT_QOS0);
+}
+
+/* wrappers */
+
+static void	batgw_mqtt_rd(int, short, void *);
+static void	batgw_mqtt_wr(int, short, void *);
+static void	batgw_mqtt_to(int, short, void *);
+static void	batgw_mqtt_txq_drain(struct batgw *);
+static void	batgw_mqtt_state(struct batgw *, unsigned int);
+static void	batgw_mqtt_store_init(struct batgw *, unsigned int);
+static int	batgw_mqtt_storing(const struct batgw *);
+static void	batgw_mqtt_store_drain(int, short, void *);
+
+/* callbacks */
+
+static void	batgw_mqtt_want_output(struct mqtt_conn *);
+static ssize_t	batgw_mqtt_output(struct mqtt_conn *, const void *, size_t);
+
+static void	batgw_mqtt_on_connect(struct mqtt_conn *);
+static void	batgw_mqtt_on_suback(struct mqtt_conn *, void *,
+		    const uint8_t *, size_t);
+static void	batgw_mqtt_on_message(struct mqtt_conn *,
+		    char *, size_t, char *, size_t, enum mqtt_qos);
+static void	batgw_mqtt_dead(struct mqtt_conn *);
+
+static void	batgw_mqtt_want_timeout(struct mqtt_conn *,
+		    const struct timespec *);
+
+static const struct mqtt_settings batgw_mqtt_settings = {
+	.mqtt_want_output = batgw_mqtt_want_output,
+	.mqtt_output = batgw_mqtt_output,
+	.mqtt_want_timeout = batgw_mqtt_want_timeout,
+
+	.mqtt_on_connect = batgw_mqtt_on_connect,
+	.mqtt_on_suback = batgw_mqtt_on_suback,
+	.mqtt_on_message = batgw_mqtt_on_message,
+	.mqtt_dead = batgw_mqtt_dead,
+};
+
+void
+batgw_mqtt_rd(int fd, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	struct mqtt_conn *mc = bg->bg_mqtt->conn;
+	char buf[16384];
+	ssize_t rv;
+
+	rv = read(fd, buf, sizeof(buf));
+	switch (rv) {
+	case -1:
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			return;
+		default:
+			break;
+		}
+		lwarn("mqtt read");
+		batgw_mqtt_disconnect(bg);
+		return;
+	case 0:
+		lwarnx("disconnected");
+		batgw_mqtt_disconnect(bg);
 		return;
+	default:
+		break;
 	}
 
-	bgm->res0 = res0;
-	bgm->resn = res0;
+	mqtt_input(mc, buf, rv);
+}
 
-	batgw_mqtt_connect(bg);
+/*
+ * amqtt hands us packets via batgw_mqtt_output, which only copies
+ * them into a fixed ring. the write handler pushes the ring out with
+ * writev and then lets amqtt refill it. telemetry backs off while the
+ * ring is above the high watermark until it drains below the low one.
+ */
+
+static void
+batgw_mqtt_watermark(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	const struct batgw_config_mqtt *mqttconf = bgm->conf;
+
+	if (bgm->congested) {
+		if (bgm->obuf_len <= mqttconf->wm_low)
+			bgm->congested = 0;
+	} else {
+		if (bgm->obuf_len >= mqttconf->wm_high)
+			bgm->congested = 1;
+	}
+}
+
+static int
+batgw_mqtt_flush(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	int fd = EVENT_FD(bgm->ev_wr);
+	struct iovec iov[2];
+	int iovcnt = 0;
+	size_t len;
+	ssize_t rv;
+
+	if (bgm->obuf_len == 0)
+		return (0);
+
+	len = BATGW_MQTT_OBUF_SIZE - bgm->obuf_off;
+	if (len > bgm->obuf_len)
+		len = bgm->obuf_len;
+	iov[iovcnt].iov_base = bgm->obuf + bgm->obuf_off;
+	iov[iovcnt].iov_len = len;
+	iovcnt++;
+	if (len < bgm->obuf_len) {
+		iov[iovcnt].iov_base = bgm->obuf;
+		iov[iovcnt].iov_len = bgm->obuf_len - len;
+		iovcnt++;
+	}
+
+	rv = writev(fd, iov, iovcnt);
+	if (rv == -1) {
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			return (0);
+		default:
+			break;
+		}
+
+		lwarn("mqtt write");
+		return (-1);
+	}
+
+	bgm->obuf_len -= rv;
+	if (bgm->obuf_len == 0)
+		bgm->obuf_off = 0;
+	else {
+		bgm->obuf_off += rv;
+		if (bgm->obuf_off >= BATGW_MQTT_OBUF_SIZE)
+			bgm->obuf_off -= BATGW_MQTT_OBUF_SIZE;
+	}
+
+	return (0);
+}
+
+void
+batgw_mqtt_wr(int fd, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	size_t len;
+
+	do {
+		bgm->obuf_short = 0;
+		mqtt_output(bgm->conn);
+
+		len = bgm->obuf_len;
+		if (batgw_mqtt_flush(bg) == -1) {
+			batgw_mqtt_disconnect(bg);
+			return;
+		}
+
+		/* keep going if amqtt had more and we made room for it */
+	} while (bgm->obuf_short && bgm->obuf_len < len);
+
+	if (bgm->obuf_len > 0 || bgm->obuf_short)
+		event_add(bgm->ev_wr, NULL);
+
+	batgw_mqtt_watermark(bg);
+
+	/* pick up what the can loop queued while we were congested */
+	if (bgm->threaded && !bgm->congested)
+		batgw_mqtt_txq_drain(bg);
 }
 
 static void
-batgw_mqtt_start(struct batgw *bg)
+batgw_mqtt_want_output(struct mqtt_conn *mc)
 {
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	struct batgw *bg = mqtt_cookie(mc);
+	event_add(bg->bg_mqtt->ev_wr, NULL);
+}
+
+static ssize_t
+batgw_mqtt_output(struct mqtt_conn *mc, const void *buf, size_t len)
+{
+	struct batgw *bg = mqtt_cookie(mc);
 	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	size_t space = BATGW_MQTT_OBUF_SIZE - bgm->obuf_len;
+	size_t tail, n;
 
-	bgm->resolved = 0;
-	bgm->req = evdns_getaddrinfo(bgm->evdnsbase,
-	    mqttconf->host, mqttconf->port, &bgm->hints,
-	    batgw_mqtt_addrinfo, bg);
-	if (bgm->req == NULL && bgm->resolved == 0) {
-		lwarnx("mqtt server %s port %s: resolve failed",
-		    mqttconf->host, mqttconf->port);
-		batgw_mqtt_reconnect(bg);
+	if (len > space) {
+		len = space;
+		bgm->obuf_short = 1;
+	}
+
+	tail = bgm->obuf_off + bgm->obuf_len;
+	if (tail >= BATGW_MQTT_OBUF_SIZE)
+		tail -= BATGW_MQTT_OBUF_SIZE;
+
+	n = BATGW_MQTT_OBUF_SIZE - tail;
+	if (n > len)
+		n = len;
+	memcpy(bgm->obuf + tail, buf, n);
+	memcpy(bgm->obuf, (const uint8_t *)buf + n, len - n);
+	bgm->obuf_len += len;
+
+	batgw_mqtt_watermark(bg);
+
+	return (len);
+}
+
+static void
+batgw_mqtt_to(int nil, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	struct mqtt_conn *mc = bg->bg_mqtt->conn;
+
+	mqtt_timeout(mc);
+}
+
+static void
+batgw_mqtt_want_timeout(struct mqtt_conn *mc, const struct timespec *ts)
+{
+	struct batgw *bg = mqtt_cookie(mc);
+	struct timeval tv;
+
+	TIMESPEC_TO_TIMEVAL(&tv, ts);
+
+	event_add(bg->bg_mqtt->ev_to, &tv);
+}
+
+static void
+batgw_mqtt_on_connect(struct mqtt_conn *mc)
+{
+	struct batgw *bg = mqtt_cookie(mc);
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	static const char online[] = "Online";
+
+	if (mqtt_publish(mc,
+	    bgm->will_topic, bgm->will_topic_len,
+	    online, sizeof(online) - 1, batgw_mqtt_qos(bgm->conf),
+	    MQTT_RETAIN) == -1) {
+		warnx("mqtt publish %s %s", bg->bg_mqtt->will_topic, online);
+		batgw_mqtt_disconnect(bg);
+		return;
+	}
+
+	/* the frames mean nothing without it */
+	if (bgm->ids != NULL && mqtt_publish(mc,
+	    bgm->ids_topic, bgm->ids_topic_len,
+	    bgm->ids, bgm->ids_len, batgw_mqtt_qos(bgm->conf),
+	    MQTT_RETAIN) == -1) {
+		warnx("mqtt publish %s", bgm->ids_topic);
+		batgw_mqtt_disconnect(bg);
+		return;
+	}
+
+	if (mqtt_subscribe(mc, NULL,
+	    bgm->cmnd_topic, bgm->cmnd_topic_len,
+	    batgw_mqtt_qos(bgm->conf)) == -1) {
+		warnx("mqtt subscribe %s", bg->bg_mqtt->cmnd_topic);
+		batgw_mqtt_disconnect(bg);
 		return;
 	}
+
+	batgw_mqtt_state(bg, BATGW_SPSC_UP);
+}
+
+static void
+batgw_mqtt_on_suback(struct mqtt_conn *mc, void *cookie,
+    const uint8_t *rcodes, size_t nrcodes)
+{
+	/* cool */
+}
+
+static int
+batgw_cmnd_onoff(const char *payload)
+{
+	if (payload == NULL)
+		return (-1);
+
+	if (strcasecmp(payload, "on") == 0 || strcmp(payload, "1") == 0)
+		return (1);
+	if (strcasecmp(payload, "off") == 0 || strcmp(payload, "0") == 0)
+		return (0);
+	return (-1);
+}
+
+static void
+batgw_mqtt_cmnd(struct batgw *bg,
+    const char *topic, size_t topic_len,
+    const char *payload, size_t payload_len)
+{
+	const struct batgw_config *conf = bg->bg_conf;
+	unsigned int max_charge_w = 0, max_discharge_w = 0;
+	const char *errstr;
+	unsigned int i;
+	int v;
+
+	for (i = 0; i < conf->nbatteries; i++) {
+		max_charge_w += conf->batteries[i].max_charge_w;
+		max_discharge_w += conf->batteries[i].max_discharge_w;
+	}
+
+	if (strcmp(topic, "charge") == 0) {
+		v = batgw_cmnd_onoff(payload);
+		if (v != -1)
+			bg->bg_charge_off = !v;
+	} else if (strcmp(topic, "discharge") == 0) {
+		v = batgw_cmnd_onoff(payload);
+		if (v != -1)
+			bg->bg_discharge_off = !v;
+	} else if (strcmp(topic, "max-charge") == 0) {
+		v = strtonum(payload, 0, max_charge_w, &errstr);
+		if (errstr == NULL)
+			bg->bg_max_charge_w = v;
+	} else if (strcmp(topic, "max-discharge") == 0) {
+		v = strtonum(payload, 0, max_discharge_w, &errstr);
+		if (errstr == NULL)
+			bg->bg_max_discharge_w = v;
+	} else if (strcmp(topic, "record") == 0) {
+		batgw_rec_dump(bg);
+		return;
+	} else if (strcmp(topic, "reload") == 0) {
+		/* not from inside the mqtt callback */
+		bg->bg_reload_force = payload != NULL &&
+		    strcmp(payload, "force") == 0;
+		event_active(bg->bg_reload_ev, EV_TIMEOUT, 0);
+		return;
+	}
+
+	SET(bg->bg_limits.l_dirty, BATGW_LIMITS_ALL);
+	batgw_limits_commit(bg);
+
+	batgw_mqtt_status(bg);
+}
+
+/*
+ * the can loop owns the teleperiod and what gets published, so it
+ * has to hear about connection state changes and commands.
+ */
+
+static void
+batgw_mqtt_updown(struct batgw *bg, unsigned int state)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+
+	if (state == BATGW_SPSC_UP) {
+		bgm->running = 1;
+		bgm->bin_frames = 0;
+		batgw_mqtt_teleperiod(0, 0, bg);
+		if (bgm->store.s_n > 0)
+			batgw_mqtt_store_drain(0, 0, bg);
+	} else {
+		bgm->running = 0;
+		event_del(bgm->ev_to_teleperiod);
+	}
+}
+
+static void
+batgw_mqtt_state(struct batgw *bg, unsigned int state)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+
+	if (!bgm->threaded) {
+		batgw_mqtt_updown(bg, state);
+		return;
+	}
+
+	if (batgw_spsc_put(&bgm->rxq, state, 0, NULL, 0, NULL, 0) == -1)
+		lwarnx("mqtt state queue is full");
+}
+
+static void
+batgw_mqtt_cmnd_queue(struct batgw *bg,
+    const char *topic, size_t topic_len,
+    const char *payload, size_t payload_len)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	unsigned int flags = 0;
+	size_t plen = 0;
+
+	/* keep the nuls, batgw_mqtt_cmnd treats these as strings */
+	if (payload == NULL)
+		flags = BATGW_SPSC_F_NOPAYLOAD;
+	else
+		plen = payload_len + 1;
+
+	if (batgw_spsc_put(&bgm->rxq, BATGW_SPSC_CMND, flags,
+	    topic, topic_len + 1, payload, plen) == -1)
+		lwarnx("mqtt command queue is full");
+}
+
+static void
+batgw_mqtt_rxq(int fd, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct batgw_spsc_msg *m;
+	const char *t, *p;
+
+	batgw_spsc_clear(&bgm->rxq);
+
+	while ((m = batgw_spsc_peek(&bgm->rxq)) != NULL) {
+		switch (m->m_type) {
+		case BATGW_SPSC_UP:
+		case BATGW_SPSC_DOWN:
+			batgw_mqtt_updown(bg, m->m_type);
+			break;
+		case BATGW_SPSC_CMND:
+			t = (const char *)(m + 1);
+			p = t + m->m_tlen;
+			if (ISSET(m->m_flags, BATGW_SPSC_F_NOPAYLOAD)) {
+				batgw_mqtt_cmnd(bg, t, m->m_tlen - 1,
+				    NULL, 0);
+			} else {
+				batgw_mqtt_cmnd(bg, t, m->m_tlen - 1,
+				    p, m->m_plen - 1);
+			}
+			break;
+		}
+
+		batgw_spsc_take(&bgm->rxq, m);
+	}
+}
+
+static void
+batgw_mqtt_on_message(struct mqtt_conn *mc,
+    char *topic, size_t topic_len, char *payload, size_t payload_len,
+    enum mqtt_qos qos)
+{
+	struct batgw *bg = mqtt_cookie(mc);
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	size_t cmnd_len = bgm->cmnd_topic_len - 1; /* chop the # off the end */
+
+	if (topic_len > cmnd_len &&
+	    strncmp(topic, bgm->cmnd_topic, cmnd_len) == 0) {
+		if (bgm->threaded) {
+			batgw_mqtt_cmnd_queue(bg,
+			    topic + cmnd_len, topic_len - cmnd_len,
+			    payload, payload_len);
+		} else {
+			batgw_mqtt_cmnd(bg,
+			    topic + cmnd_len, topic_len - cmnd_len,
+			    payload, payload_len);
+		}
+	}
+
+	free(topic);
+	free(payload);
+}
+
+static void
+batgw_mqtt_dead(struct mqtt_conn *mc)
+{
+	lerr(1, "%s", __func__);
+}
+
+/*
+ * back off exponentially up to the reconnect timeout, with jitter so
+ * a fleet of gateways doesn't come back at the broker all at once.
+ */
+
+static void
+batgw_mqtt_reconnect(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	const struct batgw_config_mqtt *mqttconf = bgm->conf;
+	uint32_t ms = BATGW_MQTT_BACKOFF;
+	uint32_t max = mqttconf->reconnect_tmo * 1000;
+	struct timeval tv;
+
+	if (bgm->backoff < 16)
+		ms <<= bgm->backoff;
+	if (ms >= max)
+		ms = max;
+	else
+		bgm->backoff++;
+
+	ms = ms / 2 + arc4random_uniform(ms / 2 + 1);
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+
+	ldebug("mqtt reconnect in %u ms", ms);
+	evtimer_add(bgm->ev_to_reconnect, &tv);
+}
+
+static void
+batgw_mqtt_disconnect(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	int s = EVENT_FD(bgm->ev_rd);
+
+	batgw_mqtt_state(bg, BATGW_SPSC_DOWN);
+
+	event_del(bgm->ev_to);
+	event_del(bgm->ev_wr);
+	event_del(bgm->ev_rd);
+
+	mqtt_conn_destroy(bgm->conn);
+	bgm->conn = NULL;
+
+	event_free(bgm->ev_to);
+	event_free(bgm->ev_wr);
+	event_free(bgm->ev_rd);
+
+	close(s);
+
+	/* let whatever is still queued drain into the void */
+	bgm->congested = 0;
+
+	/* a connection that stayed up starts the backoff again */
+	if (timerisset(&bgm->up)) {
+		struct timeval now;
+
+		batgw_now(&now);
+		timersub(&now, &bgm->up, &now);
+		if (now.tv_sec >= bgm->conf->reconnect_tmo)
+			bgm->backoff = 0;
+		timerclear(&bgm->up);
+	}
+
+	batgw_mqtt_reconnect(bg);
+}
+
+static void
+batgw_mqtt_connected(struct batgw *bg, int s)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	const struct batgw_config_mqtt *mqttconf = bgm->conf;
+
+	static const char offline[] = "Offline";
+	struct mqtt_conn_settings mcs = {
+		.clean_session = 1,
+		.keep_alive = mqttconf->keepalive,
+
+		.clientid = mqttconf->clientid,
+		.clientid_len = strlen(mqttconf->clientid),
+
+		.will_topic = bgm->will_topic,
+		.will_topic_len = bgm->will_topic_len,
+		.will_payload = offline,
+		.will_payload_len = sizeof(offline) - 1,
+		.will_retain = 1,
+	};
+	struct mqtt_conn *mc;
+
+	mc = mqtt_conn_create(&batgw_mqtt_settings, bg);
+	if (mc == NULL) {
+		lwarnx("unable to create mqtt connection");
+		goto reconnect;
+	}
+
+	bgm->ev_rd = event_new(bgm->evbase, s, EV_READ|EV_PERSIST,
+	    batgw_mqtt_rd, bg);
+	if (bgm->ev_rd == NULL) {
+		lwarnx("new mqtt ev rd failed");
+		goto destroy;
+	}
+
+	bgm->ev_wr = event_new(bgm->evbase, s, EV_WRITE,
+	    batgw_mqtt_wr, bg);
+	if (bgm->ev_wr == NULL) {
+		lwarnx("new mqtt ev wr failed");
+		goto rd_free;
+	}
+
+	bgm->ev_to = evtimer_new(bgm->evbase,
+	    batgw_mqtt_to, bg);
+	if (bgm->ev_to == NULL) {
+		lwarnx("new mqtt ev to failed");
+		goto wr_free;
+	}
+
+	bgm->obuf_off = bgm->obuf_len = 0;
+	bgm->obuf_short = 0;
+	bgm->congested = 0;
+
+	bgm->conn = mc;
+	if (mqtt_connect(mc, &mcs) == -1) {
+		lwarnx("mqtt_connect server %s port %s",
+		    mqttconf->host, mqttconf->port);
+		goto to_free;
+	}
+
+	linfo("connected to mqtt server %s port %s",
+	    mqttconf->host, mqttconf->port);
+
+	batgw_now(&bgm->up);
+	event_add(bgm->ev_rd, NULL);
+	return;
+
+to_free:
+	event_free(bgm->ev_to);
+wr_free:
+	event_free(bgm->ev_wr);
+rd_free:
+	event_free(bgm->ev_rd);
+destroy:
+	mqtt_conn_destroy(mc);
+reconnect:
+	close(s);
+	batgw_mqtt_reconnect(bg);
+}
+
+static void
+batgw_mqtt_res_free(struct batgw_mqtt *bgm)
+{
+	if (bgm->res0 != NULL) {
+		evutil_freeaddrinfo(bgm->res0);
+		bgm->res0 = NULL;
+	}
+	free(bgm->addrs);
+	bgm->addrs = NULL;
+	bgm->naddrs = bgm->addrn = 0;
+}
+
+/*
+ * alternate the address families, starting with the one the resolver
+ * put first, so a broken family can't hold up the other one.
+ */
+
+static int
+batgw_mqtt_res_order(struct batgw_mqtt *bgm, struct evutil_addrinfo *res0)
+{
+	const struct evutil_addrinfo *res, *a, *b;
+	unsigned int n = 0;
+	int family;
+
+	for (res = res0; res != NULL; res = res->ai_next)
+		n++;
+	if (n == 0)
+		return (-1);
+
+	bgm->addrs = calloc(n, sizeof(*bgm->addrs));
+	if (bgm->addrs == NULL)
+		return (-1);
+
+	family = res0->ai_family;
+	a = b = res0;
+	while (bgm->naddrs < n) {
+		while (a != NULL && a->ai_family != family)
+			a = a->ai_next;
+		if (a != NULL) {
+			bgm->addrs[bgm->naddrs++] = a;
+			a = a->ai_next;
+		}
+
+		while (b != NULL && b->ai_family == family)
+			b = b->ai_next;
+		if (b != NULL) {
+			bgm->addrs[bgm->naddrs++] = b;
+			b = b->ai_next;
+		}
+	}
+
+	bgm->res0 = res0;
+	return (0);
+}
+
+static void
+batgw_mqtt_attempt_clear(struct batgw_mqtt_attempt *a)
+{
+	struct batgw_mqtt *bgm = a->a_bg->bg_mqtt;
+
+	event_free(a->a_ev);
+	a->a_ev = NULL;
+	if (a->a_fd != -1) {
+		close(a->a_fd);
+		a->a_fd = -1;
+	}
+	bgm->nattempts--;
+}
+
+static void
+batgw_mqtt_race_end(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	unsigned int i;
+
+	for (i = 0; i < nitems(bgm->attempts); i++) {
+		if (bgm->attempts[i].a_ev != NULL)
+			batgw_mqtt_attempt_clear(&bgm->attempts[i]);
+	}
+
+	evtimer_del(bgm->ev_to_attempt);
+	evtimer_del(bgm->ev_to_connect);
+}
+
+static void
+batgw_mqtt_race_lost(struct batgw *bg)
+{
+	batgw_mqtt_race_end(bg);
+	batgw_mqtt_reconnect(bg);
+}
+
+static void
+batgw_mqtt_won(struct batgw *bg, int s)
+{
+	batgw_mqtt_race_end(bg);
+	batgw_mqtt_connected(bg, s);
+}
+
+static void	batgw_mqtt_attempt_next(struct batgw *);
+
+static void
+batgw_mqtt_attempt_ev(int s, short events, void *arg)
+{
+	struct batgw_mqtt_attempt *a = arg;
+	struct batgw *bg = a->a_bg;
+	const struct batgw_config_mqtt *mqttconf = bg->bg_mqtt->conf;
+	int error;
+	socklen_t slen = sizeof(error);
+
+	if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &slen) == -1)
+		lerr(1, "%s getsockopt", __func__);
+	if (error == EINPROGRESS)
+		return;
+
+	if (error != 0) {
+		errno = error;
+		lwarn("mqtt server %s port %s connect",
+		    mqttconf->host, mqttconf->port);
+		batgw_mqtt_attempt_clear(a);
+
+		/* don't wait for the delay if this one is done already */
+		batgw_mqtt_attempt_next(bg);
+		return;
+	}
+
+	a->a_fd = -1;
+	batgw_mqtt_won(bg, s);
+}
+
+static void
+batgw_mqtt_attempt_next(struct batgw *bg)
+{
+	static const struct timeval delay = {
+	    0, BATGW_MQTT_ATTEMPT_DELAY };
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	const struct batgw_config_mqtt *mqttconf = bgm->conf;
+	const struct evutil_addrinfo *res;
+	struct batgw_mqtt_attempt *a;
+	unsigned int i;
+	int s;
+
+	while (bgm->addrn < bgm->naddrs &&
+	    bgm->nattempts < nitems(bgm->attempts)) {
+		res = bgm->addrs[bgm->addrn++];
+
+		s = socket(res->ai_family,
+		    res->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC,
+		    res->ai_protocol);
+		if (s == -1)
+			continue;
+
+		if (connect(s, res->ai_addr, res->ai_addrlen) == 0) {
+			batgw_mqtt_won(bg, s);
+			return;
+		}
+		if (errno != EINPROGRESS) {
+			lwarn("mqtt server %s port %s connect",
+			    mqttconf->host, mqttconf->port);
+			close(s);
+			continue;
+		}
+
+		for (i = 0; i < nitems(bgm->attempts); i++) {
+			a = &bgm->attempts[i];
+			if (a->a_ev == NULL)
+				break;
+		}
+
+		a->a_ev = event_new(bgm->evbase, s, EV_WRITE|EV_PERSIST,
+		    batgw_mqtt_attempt_ev, a);
+		if (a->a_ev == NULL)
+			lerr(1, "mqtt connect event_new");
+		a->a_fd = s;
+		bgm->nattempts++;
+		event_add(a->a_ev, NULL);
+
+		/* give this one a head start before trying the next */
+		if (bgm->addrn < bgm->naddrs)
+			evtimer_add(bgm->ev_to_attempt, &delay);
+		return;
+	}
+
+	if (bgm->nattempts > 0)
+		return;
+
+	errno = EHOSTUNREACH;
+	lwarn("mqtt server %s port %s", mqttconf->host, mqttconf->port);
+	batgw_mqtt_race_lost(bg);
+}
+
+static void
+batgw_mqtt_to_attempt(int nil, short events, void *arg)
+{
+	struct batgw *bg = arg;
+
+	batgw_mqtt_attempt_next(bg);
+}
+
+static void
+batgw_mqtt_to_connect(int nil, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	const struct batgw_config_mqtt *mqttconf = bg->bg_mqtt->conf;
+
+	lwarnx("mqtt server %s port %s: connect timed out",
+	    mqttconf->host, mqttconf->port);
+	batgw_mqtt_race_lost(bg);
+}
+
+static void
+batgw_mqtt_connect(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+
+	bgm->addrn = 0;
+	batgw_evtimer_add(bgm->ev_to_connect, bgm->conf->connect_tmo);
+	batgw_mqtt_attempt_next(bg);
+}
+
+static void
+batgw_mqtt_addrinfo(int errcode, struct evutil_addrinfo *res0, void *arg)
+{
+	struct batgw *bg = arg;
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	const struct batgw_config_mqtt *mqttconf = bgm->conf;
+	struct timeval now;
+
+	bgm->resolved = 1;
+
+	if (errcode != 0) {
+		lwarnx("mqtt server %s port %s: %s",
+		    mqttconf->host, mqttconf->port,
+		    evutil_gai_strerror(errcode));
+		batgw_mqtt_reconnect(bg);
+		return;
+	}
+
+	if (batgw_mqtt_res_order(bgm, res0) == -1) {
+		lwarnx("mqtt server %s port %s: no usable addresses",
+		    mqttconf->host, mqttconf->port);
+		evutil_freeaddrinfo(res0);
+		batgw_mqtt_reconnect(bg);
+		return;
+	}
+
+	batgw_now(&now);
+	bgm->res_expire = now;
+	bgm->res_expire.tv_sec += BATGW_MQTT_RES_TTL;
+
+	batgw_mqtt_connect(bg);
+}
+
+static void
+batgw_mqtt_start(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	const struct batgw_config_mqtt *mqttconf = bgm->conf;
+	struct timeval now;
+
+	/* skip the resolver while the last answer is fresh */
+	if (bgm->naddrs > 0) {
+		batgw_now(&now);
+		if (timercmp(&now, &bgm->res_expire, <)) {
+			batgw_mqtt_connect(bg);
+			return;
+		}
+		batgw_mqtt_res_free(bgm);
+	}
+
+	bgm->resolved = 0;
+	bgm->req = evdns_getaddrinfo(bgm->evdnsbase,
+	    mqttconf->host, mqttconf->port, &bgm->hints,
+	    batgw_mqtt_addrinfo, bg);
+	if (bgm->req == NULL && bgm->resolved == 0) {
+		lwarnx("mqtt server %s port %s: resolve failed",
+		    mqttconf->host, mqttconf->port);
+		batgw_mqtt_reconnect(bg);
+		return;
+	}
+}
+
+static void
+batgw_mqtt_to_reconnect(int nil, short events, void *arg)
+{
+	struct batgw *bg = arg;
+
+	ldebug("%s", __func__);
+	batgw_mqtt_start(bg);
+}
+
+static void	batgw_mqtt_reconf(struct batgw *,
+		    struct batgw_config_mqtt *, int);
+
+static void
+batgw_mqtt_txq_drain(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct batgw_config_mqtt *mqttconf;
+	struct batgw_spsc_msg *m;
+	const char *t;
+
+	while ((m = batgw_spsc_peek(&bgm->txq)) != NULL) {
+		t = (const char *)(m + 1);
+
+		switch (m->m_type) {
+		case BATGW_SPSC_PUBLISH:
+			/* leave it queued until the broker catches up */
+			if (bgm->congested)
+				return;
+			if (bgm->conn != NULL &&
+			    mqtt_publish(bgm->conn, t, m->m_tlen,
+			    t + m->m_tlen, m->m_plen,
+			    batgw_mqtt_qos(bgm->conf), 0) == -1)
+				batgw_mqtt_disconnect(bg);
+			break;
+		case BATGW_SPSC_RECONF:
+			memcpy(&mqttconf, t, sizeof(mqttconf));
+			batgw_mqtt_reconf(bg, mqttconf,
+			    ISSET(m->m_flags, BATGW_SPSC_F_RECONNECT));
+			break;
+		}
+
+		batgw_spsc_take(&bgm->txq, m);
+	}
+}
+
+static void
+batgw_mqtt_txq(int fd, short events, void *arg)
+{
+	struct batgw *bg = arg;
+
+	batgw_spsc_clear(&bg->bg_mqtt->txq);
+	batgw_mqtt_txq_drain(bg);
+}
+
+static void *
+batgw_mqtt_thread(void *arg)
+{
+	struct batgw *bg = arg;
+
+	batgw_mqtt_start(bg);
+	event_base_dispatch(bg->bg_mqtt->evbase);
+
+	lerrx(1, "mqtt thread event loop exited");
+	return (NULL);
+}
+
+static void
+batgw_mqtt_thread_start(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	sigset_t set, oset;
+	int rv;
+
+	batgw_spsc_init(&bgm->txq, BATGW_MQTT_TXQ_SIZE);
+	batgw_spsc_init(&bgm->rxq, BATGW_MQTT_RXQ_SIZE);
+
+	bgm->ev_txq = event_new(bgm->evbase, bgm->txq.q_fd,
+	    EV_READ|EV_PERSIST, batgw_mqtt_txq, bg);
+	bgm->ev_rxq = event_new(bg->bg_evbase, bgm->rxq.q_fd,
+	    EV_READ|EV_PERSIST, batgw_mqtt_rxq, bg);
+	if (bgm->ev_txq == NULL || bgm->ev_rxq == NULL)
+		errx(1, "mqtt queue events failed");
+	event_add(bgm->ev_txq, NULL);
+	event_add(bgm->ev_rxq, NULL);
+
+	/* the can loop has the signal handlers */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	rv = pthread_create(&bgm->thread, NULL, batgw_mqtt_thread, bg);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (rv != 0) {
+		errno = rv;
+		err(1, "mqtt thread");
+	}
+
+	pthread_setname_np(bgm->thread, "batgw-mqtt");
+}
+
+static void
+batgw_mqtt_init(struct batgw *bg)
+{
+	struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	struct batgw_mqtt *bgm;
+	char *topic;
+	unsigned int i;
+	int rv;
+
+	bgm = calloc(1, sizeof(*bgm));
+	if (bgm == NULL)
+		err(1, "mqtt state alloc");
+
+	bgm->conf = mqttconf;
+	bgm->threaded = mqttconf->thread && bg->bg_replay == NULL;
+	if (bgm->threaded) {
+		bgm->evbase = event_base_new();
+		if (bgm->evbase == NULL)
+			errx(1, "mqtt event_base_new failed");
+	} else
+		bgm->evbase = bg->bg_evbase;
+
+	bgm->ev_to_reconnect = evtimer_new(bgm->evbase,
+	    batgw_mqtt_to_reconnect, bg);
+	if (bgm->ev_to_reconnect == NULL)
+		errx(1, "mqtt ev_to_reconnect evtimer_new failed");
+	bgm->ev_to_attempt = evtimer_new(bgm->evbase,
+	    batgw_mqtt_to_attempt, bg);
+	if (bgm->ev_to_attempt == NULL)
+		errx(1, "mqtt ev_to_attempt evtimer_new failed");
+	bgm->ev_to_connect = evtimer_new(bgm->evbase,
+	    batgw_mqtt_to_connect, bg);
+	if (bgm->ev_to_connect == NULL)
+		errx(1, "mqtt ev_to_connect evtimer_new failed");
+	for (i = 0; i < nitems(bgm->attempts); i++) {
+		bgm->attempts[i].a_bg = bg;
+		bgm->attempts[i].a_fd = -1;
+	}
+
+	bgm->ev_to_teleperiod = evtimer_new(bg->bg_evbase,
+	    batgw_mqtt_teleperiod, bg);
+	if (bgm->ev_to_teleperiod == NULL)
+		errx(1, "mqtt ev_to_teleperiod evtimer_new failed");
+
+	rv = asprintf(&topic, "%s/%s", mqttconf->topic, BATGW_MQTT_LWT);
+	if (rv == -1)
+		errx(1, "mqtt lwt topic printf error");
+	bgm->will_topic = topic;
+	bgm->will_topic_len = rv;
+
+	rv = asprintf(&topic, "%s/%s/#", mqttconf->topic, BATGW_MQTT_CMND);
+	if (rv == -1)
+		errx(1, "mqtt cmnd topic printf error");
+	bgm->cmnd_topic = topic;
+	bgm->cmnd_topic_len = rv;
+
+	rv = asprintf(&topic, "%s/%s", mqttconf->topic, BATGW_MQTT_STATUS);
+	if (rv == -1)
+		errx(1, "mqtt status topic printf error");
+	bgm->status_topic = topic;
+	bgm->status_topic_len = rv;
+
+	bgm->obuf = malloc(BATGW_MQTT_OBUF_SIZE);
+	if (bgm->obuf == NULL)
+		err(1, "mqtt output buffer alloc");
+
+	bgm->json = evbuffer_new();
+	if (bgm->json == NULL)
+		errx(1, "mqtt json buffer alloc failed");
+
+	bgm->ev_kv_flush = evtimer_new(bg->bg_evbase, batgw_kv_flush, bg);
+	if (bgm->ev_kv_flush == NULL)
+		errx(1, "mqtt ev_kv_flush evtimer_new failed");
+
+	if (mqttconf->publish_max != 0) {
+		bgm->kv_refresh = batgw_task_add(bg, "mqtt kv refresh",
+		    &batgw_kv_refresh_tv, NULL, batgw_kv_refresh, NULL);
+		batgw_task_start(bgm->kv_refresh);
+	}
+
+	bgm->evdnsbase = evdns_base_new(bgm->evbase,
+	    EVDNS_BASE_INITIALIZE_NAMESERVERS);
+	if (bgm->evdnsbase == NULL)
+		errx(1, "mqtt evdns_base_new failed");
+
+	bgm->hints.ai_family = mqttconf->af;
+	bgm->hints.ai_socktype = SOCK_STREAM;
+	bgm->hints.ai_protocol = IPPROTO_TCP;
+
+	bg->bg_mqtt = bgm;
+	if (mqttconf->queue != 0)
+		batgw_mqtt_store_init(bg, mqttconf->queue);
+	if (mqttconf->telemetry == BATGW_MQTT_TELEMETRY_BINARY)
+		batgw_kv_bin_init(bg);
+
+	/* replays publish into the void */
+	if (bg->bg_replay != NULL) {
+		bgm->running = 1;
+		batgw_mqtt_teleperiod(0, 0, bg);
+		return;
+	}
+
+	if (bgm->threaded)
+		batgw_mqtt_thread_start(bg);
+	else
+		batgw_mqtt_start(bg);
+}
+
+/*
+ * swap in a reloaded mqtt config. the old one is left alone because
+ * a connection attempt in flight may still be looking at it.
+ */
+
+static int
+batgw_strcmp(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a != b);
+
+	return (strcmp(a, b));
+}
+
+static void
+batgw_mqtt_reload(struct batgw *bg, struct batgw_config_mqtt *mqttconf)
+{
+	const struct batgw_config_mqtt *omqttconf = bg->bg_conf->mqtt;
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct batgw_kv_scope *ks;
+	struct batgw_kv *kv;
+	size_t i, tlen;
+	int reconnect, teleperiod;
+
+	reconnect = omqttconf->af != mqttconf->af ||
+	    strcmp(omqttconf->host, mqttconf->host) != 0 ||
+	    strcmp(omqttconf->port, mqttconf->port) != 0 ||
+	    batgw_strcmp(omqttconf->user, mqttconf->user) != 0 ||
+	    batgw_strcmp(omqttconf->pass, mqttconf->pass) != 0 ||
+	    strcmp(omqttconf->clientid, mqttconf->clientid) != 0 ||
+	    omqttconf->keepalive != mqttconf->keepalive;
+	teleperiod = mqttconf->teleperiod != omqttconf->teleperiod;
+
+	bg->bg_conf->mqtt = mqttconf;
+
+	/* the topic can't change, so the deadband names haven't either */
+	tlen = strlen(mqttconf->topic) + 1;
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		if (ks->ks_block != NULL)
+			batgw_kv_block_deadband(bg, ks->ks_block);
+
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			kv = &ks->ks_kvs[i];
+			kv->kv_deadband = batgw_kv_deadband(bg,
+			    kv->kv_type, kv->kv_precision,
+			    kv->kv_topic + tlen);
+		}
+	}
+
+	if (mqttconf->publish_max != 0 && omqttconf->publish_max == 0) {
+		if (bgm->kv_refresh == NULL) {
+			bgm->kv_refresh = batgw_task_add(bg,
+			    "mqtt kv refresh", &batgw_kv_refresh_tv, NULL,
+			    batgw_kv_refresh, NULL);
+		}
+		batgw_task_start(bgm->kv_refresh);
+	} else if (mqttconf->publish_max == 0 && bgm->kv_refresh != NULL)
+		batgw_task_stop(bgm->kv_refresh);
+
+	/* the connection side frees the old config once it lets go */
+	if (bg->bg_replay != NULL) {
+		batgw_mqtt_reconf(bg, mqttconf, 0);
+		return;
+	}
+
+	/* the connection side gets its copy in its own time */
+	if (bgm->threaded) {
+		if (batgw_spsc_put(&bgm->txq, BATGW_SPSC_RECONF,
+		    reconnect ? BATGW_SPSC_F_RECONNECT : 0,
+		    &mqttconf, sizeof(mqttconf), NULL, 0) == -1)
+			lwarnx("mqtt queue is full, connection not reloaded");
+	} else
+		batgw_mqtt_reconf(bg, mqttconf, reconnect);
+	if (reconnect)
+		return;
+
+	if (bgm->running && teleperiod)
+		batgw_evtimer_add(bgm->ev_to_teleperiod, mqttconf->teleperiod);
+}
+
+static void
+batgw_mqtt_reconf(struct batgw *bg, struct batgw_config_mqtt *mqttconf,
+    int reconnect)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+
+	clear_config_mqtt(bgm->conf);
+	bgm->conf = mqttconf;
+	bgm->hints.ai_family = mqttconf->af;
+
+	if (!reconnect)
+		return;
+
+	linfo("mqtt server %s port %s, reconnecting",
+	    mqttconf->host, mqttconf->port);
+
+	/* the server may have moved */
+	batgw_mqtt_res_free(bgm);
+	bgm->backoff = 0;
+
+	/* an attempt in progress will use the new config */
+	if (bgm->conn != NULL)
+		batgw_mqtt_disconnect(bg);
+	if (evtimer_pending(bgm->ev_to_reconnect, NULL))
+		batgw_evtimer_add(bgm->ev_to_reconnect, 0);
+}
+
+static int
+batgw_mqtt_running(struct batgw *bg)
+{
+	const struct batgw_config_mqtt *mqttconf;
+	struct batgw_mqtt *bgm;
+
+	mqttconf = bg->bg_conf->mqtt;
+	if (mqttconf == NULL)
+		return (0);
+
+	bgm = bg->bg_mqtt;
+	if (bgm == NULL)
+		return (0);
+
+	return (bgm->running);
+}
+
+/*
+ * telemetry gets dropped rather than queued while the broker is slow,
+ * and while it's away unless there's a queue to hold it.
+ */
+
+static int
+batgw_mqtt_telemetry(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+
+	if (!batgw_mqtt_running(bg))
+		return (batgw_mqtt_storing(bg));
+
+	/* the mqtt thread has its own backlog, see batgw_mqtt_publish */
+	if (bgm->threaded)
+		return (1);
+
+	if (bgm->congested) {
+		bgm->dropped++;
+		return (0);
+	}
+
+	return (1);
+}
+
+static void
+batgw_mqtt_send(struct batgw *bg,
+    const char *t, size_t tlen, const char *p, size_t plen)
+{
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+
+	if (bgm->threaded) {
+		if (batgw_spsc_put(&bgm->txq, BATGW_SPSC_PUBLISH, 0,
+		    t, tlen, p, plen) == -1)
+			bgm->dropped++;
+		return;
+	}
+
+	if (bgm->conn == NULL)
+		return;
+
+	if (mqtt_publish(bgm->conn, t, tlen, p, plen,
+	    batgw_mqtt_qos(mqttconf), 0) == -1)
+		batgw_mqtt_disconnect(bg);
+}
+
+static void
+batgw_mqtt_store_init(struct batgw *bg, unsigned int size)
+{
+	struct batgw_mqtt_store *st = &bg->bg_mqtt->store;
+	uint32_t n = 1;
+
+	while (n < size * 2)
+		n <<= 1;
+
+	st->s_held = calloc(size, sizeof(*st->s_held));
+	st->s_index = calloc(n, sizeof(*st->s_index));
+	if (st->s_held == NULL || st->s_index == NULL)
+		err(1, "mqtt queue alloc");
+	st->s_size = size;
+	st->s_mask = n - 1;
+
+	st->s_ev = evtimer_new(bg->bg_evbase, batgw_mqtt_store_drain, bg);
+	if (st->s_ev == NULL)
+		errx(1, "mqtt queue evtimer_new failed");
+}
+
+static int
+batgw_mqtt_storing(const struct batgw *bg)
+{
+	return (bg->bg_mqtt != NULL && bg->bg_mqtt->store.s_size > 0);
+}
+
+static uint32_t
+batgw_mqtt_store_hash(const char *t, size_t tlen)
+{
+	uint32_t h = 2166136261U;	/* fnv-1a */
+	size_t i;
+
+	for (i = 0; i < tlen; i++) {
+		h ^= (uint8_t)t[i];
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+static char *
+batgw_mqtt_store_dup(const char *p, size_t plen)
+{
+	char *d;
+
+	d = malloc(plen > 0 ? plen : 1);
+	if (d != NULL)
+		memcpy(d, p, plen);
+
+	return (d);
+}
+
+static int
+batgw_mqtt_store_put(struct batgw *bg,
+    const char *t, size_t tlen, const char *p, size_t plen)
+{
+	struct batgw_mqtt_store *st = &bg->bg_mqtt->store;
+	struct batgw_mqtt_held *h;
+	uint32_t hash = batgw_mqtt_store_hash(t, tlen);
+	uint32_t i, slot, reuse = UINT32_MAX;
+	char *np;
+
+	for (i = hash & st->s_mask; (slot = st->s_index[i]) != 0;
+	    i = (i + 1) & st->s_mask) {
+		/* drained entries have let go of their topic */
+		if (slot - 1 < st->s_next) {
+			if (reuse == UINT32_MAX)
+				reuse = i;
+			continue;
+		}
+
+		h = &st->s_held[slot - 1];
+		if (h->h_hash != hash || h->h_tlen != tlen ||
+		    memcmp(h->h_topic, t, tlen) != 0)
+			continue;
+
+		np = batgw_mqtt_store_dup(p, plen);
+		if (np == NULL)
+			return (-1);
+		free(h->h_payload);
+		h->h_payload = np;
+		h->h_plen = plen;
+		return (0);
+	}
+
+	if (st->s_n >= st->s_size)
+		return (-1);
+
+	/* drained entries are never looked up again, take one over */
+	if (reuse != UINT32_MAX)
+		i = reuse;
+
+	h = &st->s_held[st->s_n];
+	h->h_topic = batgw_mqtt_store_dup(t, tlen);
+	h->h_payload = batgw_mqtt_store_dup(p, plen);
+	if (h->h_topic == NULL || h->h_payload == NULL) {
+		free(h->h_topic);
+		free(h->h_payload);
+		return (-1);
+	}
+	h->h_tlen = tlen;
+	h->h_plen = plen;
+	h->h_hash = hash;
+
+	st->s_index[i] = ++st->s_n;
+	return (0);
+}
+
+static void
+batgw_mqtt_store_drain(int nil, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct batgw_mqtt_store *st = &bgm->store;
+	struct batgw_mqtt_held *h;
+	unsigned int n;
+
+	if (!bgm->running)
+		return;
+
+	n = mqttconf->queue_rate / BATGW_MQTT_STORE_TICKS;
+	if (n == 0)
+		n = 1;
+
+	for (; n > 0 && st->s_next < st->s_n; n--) {
+		/* let the broker catch up first */
+		if (bgm->threaded ?
+		    batgw_spsc_queued(&bgm->txq) > bgm->txq.q_size / 2 :
+		    bgm->congested)
+			break;
+
+		h = &st->s_held[st->s_next++];
+		batgw_mqtt_send(bg, h->h_topic, h->h_tlen,
+		    h->h_payload, h->h_plen);
+		free(h->h_topic);
+		free(h->h_payload);
+		h->h_topic = h->h_payload = NULL;
+	}
+
+	if (st->s_next < st->s_n) {
+		evtimer_add(st->s_ev, &batgw_mqtt_store_tv);
+		return;
+	}
+
+	/* everything's gone out, start again from the top */
+	st->s_n = st->s_next = 0;
+	memset(st->s_index, 0, (st->s_mask + 1) * sizeof(*st->s_index));
+}
+
+static void
+batgw_mqtt_publish(struct batgw *bg,
+    const char *t, size_t tlen, const char *p, size_t plen)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct batgw_mqtt_store *st = &bgm->store;
+
+	if (st->s_size > 0 && (!bgm->running || st->s_n > 0)) {
+		if (batgw_mqtt_store_put(bg, t, tlen, p, plen) == -1)
+			bgm->dropped++;
+		else if (bgm->running && !evtimer_pending(st->s_ev, NULL))
+			evtimer_add(st->s_ev, &batgw_mqtt_store_tv);
+		return;
+	}
+
+	batgw_mqtt_send(bg, t, tlen, p, plen);
+}
+
+void
+batgw_publish(struct batgw *bg,
+    const char *t, size_t tlen, const char *p, size_t plen)
+{
+	if (!batgw_mqtt_running(bg) && !batgw_mqtt_storing(bg))
+		return;
+
+	batgw_mqtt_publish(bg, t, tlen, p, plen);
+}
+
+static void
+batgw_mqtt_status(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct evbuffer *b = bgm->json;
+	size_t len;
+
+	evbuffer_add_printf(b,
+	    "{"
+		"\"charge\":\"%s\",\"discharge\":\"%s\","
+		"\"max-charge\":%u,\"max-discharge\":%u,"
+		"\"mqtt\":{\"queued\":%zu,\"held\":%u,\"dropped\":%llu},"
+		"\"limits\":{\"evals\":%llu,\"pushes\":%llu},",
+	    bg->bg_charge_off ? "OFF" : "ON",
+	    bg->bg_discharge_off ? "OFF" : "ON",
+	    bg->bg_max_charge_w,
+	    bg->bg_max_discharge_w,
+	    bgm->threaded ? batgw_spsc_queued(&bgm->txq) : bgm->obuf_len,
+	    bgm->store.s_n - bgm->store.s_next,
+	    (unsigned long long)bgm->dropped,
+	    (unsigned long long)bg->bg_limits.l_evals,
+	    (unsigned long long)bg->bg_limits.l_pushes);
+	batgw_task_status(bg, b);
+	evbuffer_add(b, ",", 1);
+	batgw_hist_status(bg, b);
+	evbuffer_add(b, "}", 1);
+
+	len = evbuffer_get_length(b);
+	batgw_mqtt_publish(bg,
+	    bgm->status_topic, bgm->status_topic_len,
+	    (const char *)evbuffer_pullup(b, -1), len);
+	evbuffer_drain(b, len);
+}
+
+static void
+batgw_mqtt_teleperiod(int nil, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct batgw_b *b;
+	unsigned int i;
+
+	batgw_evtimer_add(bgm->ev_to_teleperiod, mqttconf->teleperiod);
+
+	batgw_mqtt_status(bg);
+
+	switch (mqttconf->telemetry) {
+	case BATGW_MQTT_TELEMETRY_JSON:
+		batgw_kv_json_teleperiod(bg);
+		break;
+	case BATGW_MQTT_TELEMETRY_BINARY:
+		batgw_kv_bin_teleperiod(bg);
+		break;
+	default:
+		for (i = 0; i < bg->bg_nbatteries; i++) {
+			b = &bg->bg_batteries[i];
+			b->b_driver->b_teleperiod(bg, b->b_sc);
+		}
+		bg->bg_inverter->i_teleperiod(bg, bg->bg_inverter_sc);
+		break;
+	}
+
+	batgw_kv_rollups(bg);
+}
+
+static const char *const batgw_kv_type_names[KV_T_MAXTYPE] = {
+	[KV_T_TEMP] =			"temperature",
+	[KV_T_VOLTAGE] =		"voltage",
+	[KV_T_CURRENT] =		"current",
+	[KV_T_POWER] =			"power",
+	[KV_T_AMPHOUR] =		"amphour",
+	[KV_T_WATTHOUR] =		"watthour",
+	[KV_T_ENERGY] =			"energy",
+	[KV_T_PERCENT] =		"percent",
+	[KV_T_COUNT] =			"count",
+	[KV_T_RAW] =			"raw",
+};
+
+void
+batgw_kv_init(struct batgw_kv *kv, const char *key, enum batgw_kv_type type,
+    unsigned int precision)
+{
+	memset(kv, 0, sizeof(*kv));
+	if (key != NULL) {
+		if (strlcpy(kv->kv_key, key, sizeof(kv->kv_key)) >=
+		    sizeof(kv->kv_key)) {
+			warnx("%s: key too long", __func__);
+			abort();
+		}
+	}
+	kv->kv_v = INT_MIN;
+	kv->kv_published = INT_MIN;
+	kv->kv_type = type;
+	kv->kv_precision = precision;
+}
+
+void
+batgw_kv_init_tpl(struct batgw_kv *kv, const struct batgw_kv_tpl *tpl)
+{
+	batgw_kv_init(kv, tpl->kv_key, tpl->kv_type, tpl->kv_precision);
+}
+
+/*
+ * deadbands are configured in thousandths of a unit, either for a
+ * whole kv type, or for a single kv by its scope/key/type name.
+ */
+
+static int
+batgw_kv_deadbands(struct batgw *bg, const struct batgw_config_mqtt *mqttconf)
+{
+	const struct batgw_config_deadband *db;
+	unsigned int i, t;
+	int rv = 0;
+
+	for (i = 0; i < mqttconf->ndeadbands; i++) {
+		db = &mqttconf->deadbands[i];
+		if (strchr(db->name, '/') != NULL)
+			continue;
+
+		for (t = 0; t < nitems(batgw_kv_type_names); t++) {
+			if (strcmp(db->name, batgw_kv_type_names[t]) == 0)
+				break;
+		}
+		if (t == nitems(batgw_kv_type_names)) {
+			fprintf(stderr, "mqtt deadband %s: unknown type\n",
+			    db->name);
+			rv = -1;
+			continue;
+		}
+
+		bg->bg_kv_deadband[t] = db->milli;
+	}
+
+	return (rv);
+}
+
+static unsigned int
+batgw_kv_deadband(const struct batgw *bg, enum batgw_kv_type type,
+    unsigned int precision, const char *name)
+{
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	unsigned long long milli = bg->bg_kv_deadband[type];
+	unsigned int i;
+
+	for (i = 0; i < mqttconf->ndeadbands; i++) {
+		if (strcmp(mqttconf->deadbands[i].name, name) == 0) {
+			milli = mqttconf->deadbands[i].milli;
+			break;
+		}
+	}
+
+	for (i = 0; i < precision; i++)
+		milli *= 10;
+
+	return ((milli + 500) / 1000);
+}
+
+static int
+batgw_kv_topic(const struct batgw *bg, const char *scope,
+    const struct batgw_kv *kv, char *t, size_t len)
+{
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	int rv;
+
+	if (kv->kv_key[0] != '\0') {
+		rv = snprintf(t, len, "%s/%s/%s/%s", mqttconf->topic,
+		    scope, kv->kv_key, batgw_kv_type_names[kv->kv_type]);
+	} else {
+		rv = snprintf(t, len, "%s/%s/%s", mqttconf->topic,
+		    scope, batgw_kv_type_names[kv->kv_type]);
+	}
+	if (rv == -1 || (size_t)rv >= len)
+		return (-1);
+
+	return (rv);
+}
+
+static struct batgw_kv_scope *
+batgw_kv_scope_attach(struct batgw *bg, const char *scope, const char *array,
+    struct batgw_kv *kvs, size_t nkvs)
+{
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	struct batgw_kv_scope *ks;
+	struct batgw_kv *kv;
+	char t[128];
+	size_t i;
+	int tlen;
+
+	ks = calloc(1, sizeof(*ks));
+	if (ks == NULL)
+		err(1, "%s kv scope alloc", scope);
+
+	ks->ks_scope = scope;
+	ks->ks_array = array;
+	ks->ks_kvs = kvs;
+	ks->ks_nkvs = nkvs;
+	TAILQ_INSERT_TAIL(&bg->bg_kv_scopes, ks, ks_entry);
+
+	if (mqttconf == NULL)
+		return (ks);
+
+	tlen = asprintf(&ks->ks_topic, "%s/%s/%s",
+	    mqttconf->topic, scope, BATGW_MQTT_SENSOR);
+	if (tlen == -1)
+		errx(1, "%s sensor topic printf error", scope);
+	ks->ks_topic_len = tlen;
+
+	for (i = 0; i < nkvs; i++) {
+		kv = &kvs[i];
+		kv->kv_scope = scope;
+
+		tlen = batgw_kv_topic(bg, scope, kv, t, sizeof(t));
+		if (tlen == -1)
+			errx(1, "%s %s topic too long", scope, kv->kv_key);
+
+		kv->kv_deadband = batgw_kv_deadband(bg,
+		    kv->kv_type, kv->kv_precision,
+		    t + strlen(mqttconf->topic) + 1);
+
+		free(kv->kv_topic);
+		kv->kv_topic = strndup(t, tlen);
+		if (kv->kv_topic == NULL)
+			err(1, "%s %s topic alloc", scope, kv->kv_key);
+		kv->kv_topic_len = tlen;
+	}
+
+	return (ks);
+}
+
+void
+batgw_kv_attach(struct batgw *bg, const char *scope,
+    struct batgw_kv *kvs, size_t nkvs)
+{
+	batgw_kv_scope_attach(bg, scope, NULL, kvs, nkvs);
+}
+
+void
+batgw_kv_attach_array(struct batgw *bg, const char *scope, const char *name,
+    struct batgw_kv *kvs, size_t nkvs)
+{
+	batgw_kv_scope_attach(bg, scope, name, kvs, nkvs);
+}
+
+/*
+ * turn a fixed point value into a decimal string without printf.
+ * the result is not nul terminated.
+ */
+
+#define BATGW_KV_FMT_LEN	24
+
+static size_t
+batgw_kv_fmt(char *buf, int v, unsigned int precision)
+{
+	char tmp[BATGW_KV_FMT_LEN];
+	char *p = tmp + sizeof(tmp);
+	unsigned int u;
+	unsigned int i;
+	size_t len;
+
+	assert(precision < 10);
+
+	u = v < 0 ? 0U - (unsigned int)v : (unsigned int)v;
+	if (precision > 0) {
+		for (i = 0; i < precision; i++) {
+			*--p = '0' + (u % 10);
+			u /= 10;
+		}
+		*--p = '.';
+	}
+	do {
+		*--p = '0' + (u % 10);
+		u /= 10;
+	} while (u > 0);
+	if (v < 0)
+		*--p = '-';
+
+	len = (tmp + sizeof(tmp)) - p;
+	memcpy(buf, p, len);
+
+	return (len);
+}
+
+/* sums outgrow an int, but they only go out once a teleperiod */
+static size_t
+batgw_kv_fmt64(char *buf, int64_t v, unsigned int precision)
+{
+	char tmp[BATGW_KV_FMT_LEN];
+	char *p = tmp + sizeof(tmp);
+	uint64_t u;
+	unsigned int i;
+	size_t len;
+
+	assert(precision < 10);
+
+	if (v >= INT_MIN && v <= INT_MAX)
+		return (batgw_kv_fmt(buf, v, precision));
+
+	u = v < 0 ? 0ULL - (uint64_t)v : (uint64_t)v;
+	if (precision > 0) {
+		for (i = 0; i < precision; i++) {
+			*--p = '0' + (u % 10);
+			u /= 10;
+		}
+		*--p = '.';
+	}
+	do {
+		*--p = '0' + (u % 10);
+		u /= 10;
+	} while (u > 0);
+	if (v < 0)
+		*--p = '-';
+
+	len = (tmp + sizeof(tmp)) - p;
+	memcpy(buf, p, len);
+
+	return (len);
+}
+
+void
+batgw_kv_publish(struct batgw *bg,
+    const char *scope, const struct batgw_kv *kv)
+{
+	const char *t;
+	char tbuf[128];
+	int tlen;
+	char p[BATGW_KV_FMT_LEN];
+	size_t plen;
+
+	if (!batgw_mqtt_telemetry(bg))
+		return;
+
+	if (kv->kv_topic != NULL) {
+		t = kv->kv_topic;
+		tlen = kv->kv_topic_len;
+	} else {
+		tlen = batgw_kv_topic(bg, scope, kv, tbuf, sizeof(tbuf));
+		if (tlen == -1)
+			return;
+		t = tbuf;
+	}
+
+	plen = batgw_kv_fmt(p, kv->kv_v, kv->kv_precision);
+
+	batgw_mqtt_publish(bg, t, tlen, p, plen);
+}
+
+static unsigned int
+batgw_kv_now(struct batgw *bg)
+{
+	struct timeval tv;
+
+	if (event_gettime_monotonic(bg->bg_evbase, &tv) == -1)
+		return (0);
+
+	return (tv.tv_sec);
+}
+
+static void
+batgw_kv_dirty(struct batgw *bg, struct batgw_kv *kv)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+
+	SET(kv->kv_flags, KV_F_DIRTY);
+	kv->kv_dirty = bg->bg_kv_dirty;
+	bg->bg_kv_dirty = kv;
+
+	if (bgm != NULL && !evtimer_pending(bgm->ev_kv_flush, NULL))
+		evtimer_add(bgm->ev_kv_flush, &batgw_kv_flush_tv);
+}
+
+/*
+ * publish the kvs that changed since the last flush, unless they went
+ * out too recently. those wait for a later flush.
+ */
+
+static void
+batgw_kv_flush(int nil, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct batgw_kv *kv, *next, *held = NULL;
+	struct batgw_kv_block *kb, *kbnext, *kbheld = NULL;
+	unsigned int now = batgw_kv_now(bg);
+	unsigned int min = mqttconf->publish_min;
+	int running = batgw_mqtt_running(bg);
+	int congested = running && !bgm->threaded && bgm->congested;
+
+	/* the queue holds on to them while the broker is away */
+	if (batgw_mqtt_storing(bg))
+		running = 1;
+
+	kv = bg->bg_kv_dirty;
+	bg->bg_kv_dirty = NULL;
+
+	for (; kv != NULL; kv = next) {
+		next = kv->kv_dirty;
+
+		/* hang on to the latest value while the broker is slow */
+		if (congested ||
+		    (running && (now - kv->kv_updated) < min)) {
+			kv->kv_dirty = held;
+			held = kv;
+			continue;
+		}
+
+		CLR(kv->kv_flags, KV_F_DIRTY);
+		kv->kv_dirty = NULL;
+
+		/* the teleperiod on connect will catch up on everything */
+		if (!running)
+			continue;
+
+		batgw_kv_publish(bg, kv->kv_scope, kv);
+		kv->kv_published = kv->kv_v;
+		kv->kv_updated = now;
+	}
+
+	kb = bg->bg_kv_block_dirty;
+	bg->bg_kv_block_dirty = NULL;
+
+	for (; kb != NULL; kb = kbnext) {
+		kbnext = kb->kb_dirty_next;
+
+		if (batgw_kv_block_flush(bg, kb, now, min,
+		    running, congested)) {
+			kb->kb_dirty_next = kbheld;
+			kbheld = kb;
+			continue;
+		}
+
+		kb->kb_queued = 0;
+		kb->kb_dirty_next = NULL;
+	}
+
+	bg->bg_kv_dirty = held;
+	bg->bg_kv_block_dirty = kbheld;
+	if (held != NULL || kbheld != NULL)
+		evtimer_add(bgm->ev_kv_flush, &batgw_kv_retry_tv);
+}
+
+/*
+ * republish values that haven't changed for a long time
+ */
+
+static void
+batgw_kv_refresh(struct batgw *bg, void *arg)
+{
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	struct batgw_kv_scope *ks;
+	struct batgw_kv *kv;
+	unsigned int now = batgw_kv_now(bg);
+	size_t i;
+
+	if (mqttconf->telemetry != BATGW_MQTT_TELEMETRY_KV)
+		return;
+
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		if (ks->ks_block != NULL) {
+			batgw_kv_block_refresh(bg, ks->ks_block,
+			    now, mqttconf->publish_max);
+		}
+
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			kv = &ks->ks_kvs[i];
+			if (kv->kv_v == INT_MIN ||
+			    ISSET(kv->kv_flags, KV_F_DIRTY))
+				continue;
+			if ((now - kv->kv_updated) < mqttconf->publish_max)
+				continue;
+
+			batgw_kv_dirty(bg, kv);
+		}
+	}
+}
+
+void
+batgw_kv_update(struct batgw *bg, const char *scope,
+    struct batgw_kv *kv, int v)
+{
+	if (kv->kv_n++ == 0) {
+		kv->kv_min = kv->kv_max = v;
+		kv->kv_sum = v;
+	} else {
+		if (v < kv->kv_min)
+			kv->kv_min = v;
+		if (v > kv->kv_max)
+			kv->kv_max = v;
+		kv->kv_sum += v;
+	}
+
+	if (kv->kv_v == v)
+		return;
+	kv->kv_v = v;
+
+	/* json telemetry only goes out on the teleperiod */
+	if (bg->bg_conf->mqtt == NULL ||
+	    bg->bg_conf->mqtt->telemetry != BATGW_MQTT_TELEMETRY_KV)
+		return;
+
+	if (ISSET(kv->kv_flags, KV_F_DIRTY))
+		return;
+
+	if (kv->kv_published != INT_MIN) {
+		long long d = (long long)v - kv->kv_published;
+		if (d < 0)
+			d = -d;
+		if (d < kv->kv_deadband)
+			return;
+	}
+
+	if (kv->kv_scope == NULL)
+		kv->kv_scope = scope;
+	batgw_kv_dirty(bg, kv);
+}
+
+int
+batgw_kv_get(const struct batgw_kv *kv)
+{
+	return (kv->kv_v);
+}
+
+/*
+ * the rollups cover every update since the last teleperiod, so
+ * peaks between the telemetry that's sent still show up.
+ */
+
+enum batgw_kv_rollup {
+	KV_R_MIN,
+	KV_R_MAX,
+	KV_R_AVG,
+	KV_R_N,
+	KV_R_SUM,
+
+	KV_R_COUNT
+};
+
+static const char *const batgw_kv_rollup_names[KV_R_COUNT] = {
+	[KV_R_MIN] =			"min",
+	[KV_R_MAX] =			"max",
+	[KV_R_AVG] =			"avg",
+	[KV_R_N] =			"count",
+	[KV_R_SUM] =			"sum",
+};
+
+static int64_t
+batgw_kv_rollup(const struct batgw_kv *kv, enum batgw_kv_rollup r)
+{
+	int64_t n = kv->kv_n;
+
+	switch (r) {
+	case KV_R_MIN:
+		return (kv->kv_min);
+	case KV_R_MAX:
+		return (kv->kv_max);
+	case KV_R_N:
+		return (n);
+	case KV_R_SUM:
+		return (kv->kv_sum);
+	case KV_R_AVG:
+	case KV_R_COUNT:
+		break;
+	}
+
+	/* round to the nearest, away from zero */
+	if (kv->kv_sum < 0)
+		return ((kv->kv_sum - n / 2) / n);
+	return ((kv->kv_sum + n / 2) / n);
+}
+
+/* the count is a plain number, the rest are in the value's units */
+static size_t
+batgw_kv_rollup_fmt(char *buf, const struct batgw_kv *kv,
+    enum batgw_kv_rollup r)
+{
+	return (batgw_kv_fmt64(buf, batgw_kv_rollup(kv, r),
+	    r == KV_R_N ? 0 : kv->kv_precision));
+}
+
+static void
+batgw_kv_rollup_publish(struct batgw *bg, const char *scope,
+    const struct batgw_kv *kv)
+{
+	char t[160];
+	char p[BATGW_KV_FMT_LEN];
+	int tlen, rlen;
+	unsigned int r;
+
+	if (kv->kv_topic != NULL) {
+		if (kv->kv_topic_len >= sizeof(t))
+			return;
+		memcpy(t, kv->kv_topic, kv->kv_topic_len);
+		tlen = kv->kv_topic_len;
+	} else {
+		tlen = batgw_kv_topic(bg, scope, kv, t, sizeof(t));
+		if (tlen == -1)
+			return;
+	}
+
+	for (r = 0; r < KV_R_COUNT; r++) {
+		rlen = snprintf(t + tlen, sizeof(t) - tlen, "/%s",
+		    batgw_kv_rollup_names[r]);
+		if (rlen == -1 || (size_t)rlen >= sizeof(t) - tlen)
+			return;
+
+		batgw_mqtt_publish(bg, t, tlen + rlen, p,
+		    batgw_kv_rollup_fmt(p, kv, r));
+	}
+}
+
+/* the teleperiod has gone out, start the next window */
+static void
+batgw_kv_rollups(struct batgw *bg)
+{
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	int publish = mqttconf->rollup &&
+	    mqttconf->telemetry == BATGW_MQTT_TELEMETRY_KV &&
+	    batgw_mqtt_telemetry(bg);
+	struct batgw_kv_scope *ks;
+	struct batgw_kv *kv;
+	size_t i;
+
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			kv = &ks->ks_kvs[i];
+			if (kv->kv_n == 0)
+				continue;
+
+			if (publish)
+				batgw_kv_rollup_publish(bg, ks->ks_scope, kv);
+			kv->kv_n = 0;
+		}
+	}
+}
+
+/*
+ * kv blocks
+ */
+
+struct batgw_kv_block *
+batgw_kv_block_attach(struct batgw *bg, const char *scope, const char *name,
+    enum batgw_kv_type type, unsigned int precision, unsigned int n)
+{
+	struct batgw_kv_block *kb;
+	struct batgw_kv_scope *ks;
+	unsigned int i;
+
+	kb = calloc(1, sizeof(*kb));
+	if (kb == NULL)
+		err(1, "%s %s kv block alloc", scope, name);
+
+	kb->kb_scope = scope;
+	kb->kb_name = name;
+	kb->kb_type = type;
+	kb->kb_precision = precision;
+	kb->kb_n = n;
+	kb->kb_nwords = howmany(n, BATGW_KV_BLOCK_BITS);
+
+	kb->kb_v = calloc(n, sizeof(*kb->kb_v));
+	kb->kb_published = calloc(n, sizeof(*kb->kb_published));
+	kb->kb_updated = calloc(n, sizeof(*kb->kb_updated));
+	kb->kb_valid = calloc(kb->kb_nwords, sizeof(*kb->kb_valid));
+	kb->kb_dirty = calloc(kb->kb_nwords, sizeof(*kb->kb_dirty));
+	if (kb->kb_v == NULL || kb->kb_published == NULL ||
+	    kb->kb_updated == NULL || kb->kb_valid == NULL ||
+	    kb->kb_dirty == NULL)
+		err(1, "%s %u %s kv block alloc", scope, n, name);
+
+	for (i = 0; i < n; i++)
+		kb->kb_published[i] = INT_MIN;
+
+	if (bg->bg_conf->mqtt != NULL) {
+		/* the topic can't change on a reload */
+		int rv = asprintf(&kb->kb_topic, "%s/%s/%s",
+		    bg->bg_conf->mqtt->topic, scope, name);
+		if (rv == -1)
+			err(1, "%s %s kv block topic", scope, name);
+		kb->kb_topic_len = rv;
+
+		batgw_kv_block_deadband(bg, kb);
+	}
+
+	ks = batgw_kv_scope_attach(bg, scope, name, NULL, 0);
+	ks->ks_block = kb;
+
+	return (kb);
+}
+
+static void
+batgw_kv_block_deadband(const struct batgw *bg, struct batgw_kv_block *kb)
+{
+	char name[64];
+
+	/* the whole block shares "scope/name/type" */
+	snprintf(name, sizeof(name), "%s/%s/%s", kb->kb_scope, kb->kb_name,
+	    batgw_kv_type_names[kb->kb_type]);
+	kb->kb_deadband = batgw_kv_deadband(bg, kb->kb_type,
+	    kb->kb_precision, name);
+}
+
+static inline int
+batgw_kv_block_isset(const uint64_t *map, unsigned int i)
+{
+	return ((map[i / BATGW_KV_BLOCK_BITS] >>
+	    (i % BATGW_KV_BLOCK_BITS)) & 1);
+}
+
+static inline void
+batgw_kv_block_set(uint64_t *map, unsigned int i)
+{
+	map[i / BATGW_KV_BLOCK_BITS] |= 1ULL << (i % BATGW_KV_BLOCK_BITS);
+}
+
+/* the next bit set in map from i on, or n if there isn't one */
+static unsigned int
+batgw_kv_block_next(const uint64_t *map, unsigned int n, unsigned int i)
+{
+	unsigned int w = i / BATGW_KV_BLOCK_BITS;
+	uint64_t bits;
+
+	if (i >= n)
+		return (n);
+
+	bits = map[w] & (~0ULL << (i % BATGW_KV_BLOCK_BITS));
+	while (bits == 0) {
+		if (++w >= howmany(n, BATGW_KV_BLOCK_BITS))
+			return (n);
+		bits = map[w];
+	}
+
+	i = w * BATGW_KV_BLOCK_BITS + __builtin_ctzll(bits);
+	return (i < n ? i : n);
+}
+
+#define KV_BLOCK_FOREACH(_i, _map, _n)					\
+	for ((_i) = batgw_kv_block_next((_map), (_n), 0);		\
+	    (_i) < (_n);						\
+	    (_i) = batgw_kv_block_next((_map), (_n), (_i) + 1))
+
+static void
+batgw_kv_block_dirty(struct batgw *bg, struct batgw_kv_block *kb,
+    unsigned int i)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+
+	batgw_kv_block_set(kb->kb_dirty, i);
+	if (kb->kb_queued)
+		return;
+
+	kb->kb_queued = 1;
+	kb->kb_dirty_next = bg->bg_kv_block_dirty;
+	bg->bg_kv_block_dirty = kb;
+
+	if (bgm != NULL && !evtimer_pending(bgm->ev_kv_flush, NULL))
+		evtimer_add(bgm->ev_kv_flush, &batgw_kv_flush_tv);
+}
+
+void
+batgw_kv_block_update(struct batgw *bg, struct batgw_kv_block *kb,
+    unsigned int i, int v)
+{
+	long long d;
+
+	if (i >= kb->kb_n)
+		return;
+
+	if (batgw_kv_block_isset(kb->kb_valid, i)) {
+		if (kb->kb_v[i] == v)
+			return;
+	} else
+		batgw_kv_block_set(kb->kb_valid, i);
+	kb->kb_v[i] = v;
+
+	/* the same rules as batgw_kv_update */
+	if (bg->bg_conf->mqtt == NULL ||
+	    bg->bg_conf->mqtt->telemetry != BATGW_MQTT_TELEMETRY_KV)
+		return;
+
+	if (batgw_kv_block_isset(kb->kb_dirty, i))
+		return;
+
+	if (kb->kb_published[i] != INT_MIN) {
+		d = (long long)v - kb->kb_published[i];
+		if (d < 0)
+			d = -d;
+		if (d < kb->kb_deadband)
+			return;
+	}
+
+	batgw_kv_block_dirty(bg, kb, i);
+}
+
+int
+batgw_kv_block_get(const struct batgw_kv_block *kb, unsigned int i)
+{
+	if (i >= kb->kb_n || !batgw_kv_block_isset(kb->kb_valid, i))
+		return (INT_MIN);
+
+	return (kb->kb_v[i]);
+}
+
+static void
+batgw_kv_block_publish_one(struct batgw *bg, const struct batgw_kv_block *kb,
+    unsigned int i)
+{
+	const char *type = batgw_kv_type_names[kb->kb_type];
+	char t[128];
+	char p[BATGW_KV_FMT_LEN];
+	char d[16], *dp = d + sizeof(d);
+	size_t dlen, tylen, tlen;
+	unsigned int n = i;
+
+	do {
+		*--dp = '0' + (n % 10);
+		n /= 10;
+	} while (n != 0);
+	dlen = d + sizeof(d) - dp;
+	tylen = strlen(type);
+
+	tlen = kb->kb_topic_len + dlen + 1 + tylen;
+	if (kb->kb_topic == NULL || tlen > sizeof(t))
+		return;
+
+	memcpy(t, kb->kb_topic, kb->kb_topic_len);
+	memcpy(t + kb->kb_topic_len, dp, dlen);
+	t[kb->kb_topic_len + dlen] = '/';
+	memcpy(t + kb->kb_topic_len + dlen + 1, type, tylen);
+
+	batgw_mqtt_publish(bg, t, tlen,
+	    p, batgw_kv_fmt(p, kb->kb_v[i], kb->kb_precision));
+}
+
+void
+batgw_kv_block_publish(struct batgw *bg, const struct batgw_kv_block *kb)
+{
+	unsigned int i;
+
+	if (!batgw_mqtt_telemetry(bg))
+		return;
+
+	KV_BLOCK_FOREACH(i, kb->kb_valid, kb->kb_n)
+		batgw_kv_block_publish_one(bg, kb, i);
+}
+
+/* returns non-zero if some entries have to wait for a later flush */
+static int
+batgw_kv_block_flush(struct batgw *bg, struct batgw_kv_block *kb,
+    unsigned int now, unsigned int min, int running, int congested)
+{
+	unsigned int i;
+	int held = 0;
+
+	KV_BLOCK_FOREACH(i, kb->kb_dirty, kb->kb_n) {
+		if (congested ||
+		    (running && (now - kb->kb_updated[i]) < min)) {
+			held = 1;
+			continue;
+		}
+
+		kb->kb_dirty[i / BATGW_KV_BLOCK_BITS] &=
+		    ~(1ULL << (i % BATGW_KV_BLOCK_BITS));
+		if (!running)
+			continue;
+
+		batgw_kv_block_publish_one(bg, kb, i);
+		kb->kb_published[i] = kb->kb_v[i];
+		kb->kb_updated[i] = now;
+	}
+
+	return (held);
+}
+
+static void
+batgw_kv_block_refresh(struct batgw *bg, struct batgw_kv_block *kb,
+    unsigned int now, unsigned int max)
+{
+	unsigned int i;
+
+	KV_BLOCK_FOREACH(i, kb->kb_valid, kb->kb_n) {
+		if (batgw_kv_block_isset(kb->kb_dirty, i))
+			continue;
+		if ((now - kb->kb_updated[i]) < max)
+			continue;
+
+		batgw_kv_block_dirty(bg, kb, i);
+	}
+}
+
+/*
+ * json telemetry. every kv attached to a scope goes into one document,
+ * keyed by "key/type". arrays are packed into a list with null for
+ * values we haven't seen yet.
+ */
+
+static void
+batgw_json_key(struct evbuffer *b, const char *sep,
+    const char *key, const char *type)
+{
+	evbuffer_add(b, sep, 1);
+	evbuffer_add(b, "\"", 1);
+	if (key != NULL && key[0] != '\0') {
+		evbuffer_add(b, key, strlen(key));
+		evbuffer_add(b, "/", 1);
+	}
+	evbuffer_add(b, type, strlen(type));
+	evbuffer_add(b, "\":", 2);
+}
+
+static void
+batgw_json_value(struct evbuffer *b, const struct batgw_kv *kv)
+{
+	char p[BATGW_KV_FMT_LEN];
+
+	if (kv->kv_v == INT_MIN) {
+		evbuffer_add(b, "null", 4);
+		return;
+	}
+
+	evbuffer_add(b, p, batgw_kv_fmt(p, kv->kv_v, kv->kv_precision));
+}
+
+static void
+batgw_kv_block_json(struct evbuffer *b, const char *sep,
+    const struct batgw_kv_block *kb)
+{
+	char p[BATGW_KV_FMT_LEN];
+	unsigned int i;
+
+	batgw_json_key(b, sep, kb->kb_name, batgw_kv_type_names[kb->kb_type]);
+	evbuffer_add(b, "[", 1);
+	for (i = 0; i < kb->kb_n; i++) {
+		if (i > 0)
+			evbuffer_add(b, ",", 1);
+		if (!batgw_kv_block_isset(kb->kb_valid, i))
+			evbuffer_add(b, "null", 4);
+		else {
+			evbuffer_add(b, p,
+			    batgw_kv_fmt(p, kb->kb_v[i], kb->kb_precision));
+		}
+	}
+	evbuffer_add(b, "]", 1);
+}
+
+/* "key/type/min":v,... after the value itself */
+static void
+batgw_json_rollup(struct evbuffer *b, const struct batgw_kv *kv)
+{
+	const char *type = batgw_kv_type_names[kv->kv_type];
+	char p[BATGW_KV_FMT_LEN];
+	unsigned int r;
+
+	for (r = 0; r < KV_R_COUNT; r++) {
+		evbuffer_add(b, ",\"", 2);
+		if (kv->kv_key[0] != '\0') {
+			evbuffer_add(b, kv->kv_key, strlen(kv->kv_key));
+			evbuffer_add(b, "/", 1);
+		}
+		evbuffer_add(b, type, strlen(type));
+		evbuffer_add(b, "/", 1);
+		evbuffer_add(b, batgw_kv_rollup_names[r],
+		    strlen(batgw_kv_rollup_names[r]));
+		evbuffer_add(b, "\":", 2);
+		evbuffer_add(b, p, batgw_kv_rollup_fmt(p, kv, r));
+	}
+}
+
+static void
+batgw_kv_json(struct batgw *bg, const struct batgw_kv_scope *ks0)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct evbuffer *b = bgm->json;
+	const struct batgw_kv_scope *ks;
+	const struct batgw_kv *kv;
+	const char *sep = "{";
+	int rollup = bg->bg_conf->mqtt->rollup;
+	size_t i, len;
+
+	if (!batgw_mqtt_telemetry(bg))
+		return;
+
+	for (ks = ks0; ks != NULL; ks = TAILQ_NEXT(ks, ks_entry)) {
+		if (strcmp(ks->ks_scope, ks0->ks_scope) != 0)
+			continue;
+
+		if (ks->ks_block != NULL) {
+			batgw_kv_block_json(b, sep, ks->ks_block);
+			sep = ",";
+			continue;
+		}
+
+		if (ks->ks_array != NULL) {
+			if (ks->ks_nkvs == 0)
+				continue;
+
+			kv = &ks->ks_kvs[0];
+			batgw_json_key(b, sep, ks->ks_array,
+			    batgw_kv_type_names[kv->kv_type]);
+			evbuffer_add(b, "[", 1);
+			for (i = 0; i < ks->ks_nkvs; i++) {
+				if (i > 0)
+					evbuffer_add(b, ",", 1);
+				batgw_json_value(b, &ks->ks_kvs[i]);
+			}
+			evbuffer_add(b, "]", 1);
+			sep = ",";
+			continue;
+		}
+
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			kv = &ks->ks_kvs[i];
+			if (kv->kv_v == INT_MIN)
+				continue;
+
+			batgw_json_key(b, sep, kv->kv_key,
+			    batgw_kv_type_names[kv->kv_type]);
+			batgw_json_value(b, kv);
+			sep = ",";
+
+			if (rollup && kv->kv_n > 0)
+				batgw_json_rollup(b, kv);
+		}
+	}
+
+	if (*sep == '{')
+		evbuffer_add(b, sep, 1);
+	evbuffer_add(b, "}", 1);
+
+	len = evbuffer_get_length(b);
+	batgw_mqtt_publish(bg, ks0->ks_topic, ks0->ks_topic_len,
+	    (const char *)evbuffer_pullup(b, -1), len);
+	evbuffer_drain(b, len);
+}
+
+static void
+batgw_kv_json_teleperiod(struct batgw *bg)
+{
+	const struct batgw_kv_scope *ks, *oks;
+
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		/* only the first entry for each scope starts a document */
+		for (oks = TAILQ_FIRST(&bg->bg_kv_scopes); oks != ks;
+		    oks = TAILQ_NEXT(oks, ks_entry)) {
+			if (strcmp(oks->ks_scope, ks->ks_scope) == 0)
+				break;
+		}
+		if (oks != ks)
+			continue;
+
+		batgw_kv_json(bg, ks);
+	}
+}
+
+/*
+ * binary telemetry for links that charge by the byte. every kv gets
+ * a number, in the order the kvs were attached, and the table of
+ * them is published (retained) on connect as lines of
+ * "<id> <scope>/<key>/<type> <precision>" after a "batgw-binary 1
+ * <hash>" header. each teleperiod then publishes one frame:
+ *
+ *	u8	 version << 4 | flags
+ *	varint	 sequence, one more than the last frame's
+ *	le32	 table hash, keyframes only
+ *	then for each value that's in the frame:
+ *	varint	 id gap, ie, how many ids were skipped since the last
+ *	varint	 zigzag of the value, less the last one sent
+ *
+ * values are in their kv's precision. keyframes send every value
+ * that is set, each less 0. the frames in between only carry values
+ * that moved by at least their deadband since they were last sent.
+ * a reader that misses a frame has to wait for the next keyframe.
+ */
+
+#define BATGW_KV_BIN_VERSION		1
+#define BATGW_KV_BIN_F_KEY		(1 << 0)
+#define BATGW_KV_BIN_KEYFRAMES		16	/* one frame in this many */
+#define BATGW_KV_BIN_HDR_LEN		(1 + 5 + 4)
+#define BATGW_KV_BIN_ENTRY_LEN		(5 + 10)
+
+static void
+batgw_kv_bin_id(struct evbuffer *b, unsigned int id, const char *scope,
+    const char *key, int idx, enum batgw_kv_type type,
+    unsigned int precision)
+{
+	evbuffer_add_printf(b, "%u %s/", id, scope);
+	if (key != NULL && key[0] != '\0')
+		evbuffer_add_printf(b, "%s/", key);
+	if (idx != -1)
+		evbuffer_add_printf(b, "%d/", idx);
+	evbuffer_add_printf(b, "%s %u\n", batgw_kv_type_names[type],
+	    precision);
+}
+
+static void
+batgw_kv_bin_init(struct batgw *bg)
+{
+	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	const struct batgw_kv_scope *ks;
+	const struct batgw_kv_block *kb;
+	const struct batgw_kv *kv;
+	struct evbuffer *b;
+	const uint8_t *ids;
+	uint32_t hash = 2166136261U;	/* fnv-1a */
+	unsigned int id = 0;
+	size_t i, len;
+	char *topic;
+	int rv;
+
+	b = evbuffer_new();
+	if (b == NULL)
+		errx(1, "mqtt binary id table alloc failed");
+
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		kb = ks->ks_block;
+		for (i = 0; kb != NULL && i < kb->kb_n; i++) {
+			batgw_kv_bin_id(b, id++, ks->ks_scope, kb->kb_name,
+			    i, kb->kb_type, kb->kb_precision);
+		}
+
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			kv = &ks->ks_kvs[i];
+			if (ks->ks_array != NULL) {
+				batgw_kv_bin_id(b, id++, ks->ks_scope,
+				    ks->ks_array, i, kv->kv_type,
+				    kv->kv_precision);
+			} else {
+				batgw_kv_bin_id(b, id++, ks->ks_scope,
+				    kv->kv_key, -1, kv->kv_type,
+				    kv->kv_precision);
+			}
+		}
+	}
+
+	len = evbuffer_get_length(b);
+	ids = evbuffer_pullup(b, -1);
+	for (i = 0; i < len; i++) {
+		hash ^= ids[i];
+		hash *= 16777619U;
+	}
+
+	rv = asprintf(&bgm->ids, "batgw-binary %u %08x\n%.*s",
+	    BATGW_KV_BIN_VERSION, hash, (int)len, ids);
+	if (rv == -1)
+		errx(1, "mqtt binary id table printf error");
+	bgm->ids_len = rv;
+	bgm->ids_hash = hash;
+	bgm->nids = id;
+	evbuffer_free(b);
+
+	/* the kvs are all attached by now, so a frame can't get bigger */
+	bgm->bin = malloc(BATGW_KV_BIN_HDR_LEN +
+	    (size_t)id * BATGW_KV_BIN_ENTRY_LEN);
+	if (bgm->bin == NULL)
+		err(1, "mqtt binary frame alloc");
+
+	rv = asprintf(&topic, "%s/%s", mqttconf->topic, BATGW_MQTT_BINARY);
+	if (rv == -1)
+		errx(1, "mqtt binary topic printf error");
+	bgm->bin_topic = topic;
+	bgm->bin_topic_len = rv;
+
+	rv = asprintf(&topic, "%s/%s", mqttconf->topic,
+	    BATGW_MQTT_BINARY_IDS);
+	if (rv == -1)
+		errx(1, "mqtt binary ids topic printf error");
+	bgm->ids_topic = topic;
+	bgm->ids_topic_len = rv;
+}
+
+static inline uint8_t *
+batgw_kv_bin_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+
+	return (p);
+}
+
+struct batgw_kv_bin {
+	uint8_t			*p;
+	unsigned int		 id;	/* of the next value */
+	unsigned int		 next;	/* what the reader expects */
+	unsigned int		 key;
+	unsigned int		 n;
+};
+
+static void
+batgw_kv_bin_value(struct batgw_kv_bin *bin, int v, int *published,
+    unsigned int deadband)
+{
+	unsigned int id = bin->id++;
+	int64_t d = v;
+
+	if (v == INT_MIN) {
+		/* the reader forgets everything on a keyframe */
+		if (bin->key)
+			*published = INT_MIN;
+		return;
+	}
+
+	if (!bin->key && *published != INT_MIN) {
+		d -= *published;
+		if (d == 0 || (d < 0 ? -d : d) < deadband)
+			return;
+	}
+
+	bin->p = batgw_kv_bin_varint(bin->p, id - bin->next);
+	bin->p = batgw_kv_bin_varint(bin->p,
+	    ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+	bin->next = id + 1;
+	bin->n++;
+	*published = v;
+}
+
+static void
+batgw_kv_bin_teleperiod(struct batgw *bg)
+{
+	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	struct batgw_kv_scope *ks;
+	struct batgw_kv_block *kb;
+	struct batgw_kv *kv;
+	struct batgw_kv_bin bin;
+	uint64_t dropped;
+	size_t i;
+
+	/* a queue only keeps the newest frame, which breaks the chain */
+	if (!bgm->running)
+		return;
+	if (!batgw_mqtt_telemetry(bg)) {
+		bgm->bin_frames = 0;
+		return;
+	}
+
+	memset(&bin, 0, sizeof(bin));
+	bin.p = bgm->bin;
+	bin.key = bgm->bin_frames == 0;
+
+	*bin.p++ = BATGW_KV_BIN_VERSION << 4 |
+	    (bin.key ? BATGW_KV_BIN_F_KEY : 0);
+	bin.p = batgw_kv_bin_varint(bin.p, bgm->bin_seq);
+	if (bin.key) {
+		*bin.p++ = bgm->ids_hash;
+		*bin.p++ = bgm->ids_hash >> 8;
+		*bin.p++ = bgm->ids_hash >> 16;
+		*bin.p++ = bgm->ids_hash >> 24;
+	}
+
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		kb = ks->ks_block;
+		for (i = 0; kb != NULL && i < kb->kb_n; i++) {
+			if (bin.id >= bgm->nids)
+				break;
+			batgw_kv_bin_value(&bin,
+			    batgw_kv_block_isset(kb->kb_valid, i) ?
+			    kb->kb_v[i] : INT_MIN,
+			    &kb->kb_published[i], kb->kb_deadband);
+		}
+
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			if (bin.id >= bgm->nids)
+				break;
+			kv = &ks->ks_kvs[i];
+			batgw_kv_bin_value(&bin, kv->kv_v,
+			    &kv->kv_published, kv->kv_deadband);
+		}
+	}
+
+	/* nothing moved, so there's nothing to pay for */
+	if (!bin.key && bin.n == 0)
+		return;
+
+	dropped = bgm->dropped;
+	batgw_mqtt_send(bg, bgm->bin_topic, bgm->bin_topic_len,
+	    (const char *)bgm->bin, bin.p - bgm->bin);
+	if (bgm->dropped != dropped) {
+		bgm->bin_frames = 0;
+		return;
+	}
+
+	bgm->bin_seq++;
+	if (++bgm->bin_frames >= BATGW_KV_BIN_KEYFRAMES)
+		bgm->bin_frames = 0;
+}
+
+/*
+ * cell voltages. packs report a few cells per frame, so they're kept
+ * in a flat array with running sums for the mean and variance. the
+ * lowest and highest cells are followed as readings come in, and the
+ * array is only scanned again when one of them moves back towards
+ * the rest. each cell also has a moving average of its own so a cell
+ * that starts wandering shows up before it becomes an extreme.
+ */
+
+#define BATGW_CELLS_EWMA_SHIFT	4	/* new readings count for 1/16 */
+#define BATGW_CELLS_MAX_AGE	5	/* seconds */
+
+enum batgw_cells_kv {
+	BATGW_CELLS_KV_LOW,
+	BATGW_CELLS_KV_LOW_CELL,
+	BATGW_CELLS_KV_HIGH,
+	BATGW_CELLS_KV_HIGH_CELL,
+	BATGW_CELLS_KV_MEAN,
+	BATGW_CELLS_KV_STDDEV,
+	BATGW_CELLS_KV_DRIFT,
+	BATGW_CELLS_KV_DRIFT_CELL,
+
+	BATGW_CELLS_KV_COUNT
+};
+
+static const struct batgw_kv_tpl batgw_cells_kvs_tpl[BATGW_CELLS_KV_COUNT] = {
+	[BATGW_CELLS_KV_LOW] =
+		{ "cell-low",		KV_T_VOLTAGE,	3 },
+	[BATGW_CELLS_KV_LOW_CELL] =
+		{ "cell-low",		KV_T_COUNT,	0 },
+	[BATGW_CELLS_KV_HIGH] =
+		{ "cell-high",		KV_T_VOLTAGE,	3 },
+	[BATGW_CELLS_KV_HIGH_CELL] =
+		{ "cell-high",		KV_T_COUNT,	0 },
+	[BATGW_CELLS_KV_MEAN] =
+		{ "cell-mean",		KV_T_VOLTAGE,	4 },
+	[BATGW_CELLS_KV_STDDEV] =
+		{ "cell-stddev",	KV_T_VOLTAGE,	4 },
+	[BATGW_CELLS_KV_DRIFT] =
+		{ "cell-drift",		KV_T_VOLTAGE,	3 },
+	[BATGW_CELLS_KV_DRIFT_CELL] =
+		{ "cell-drift",		KV_T_COUNT,	0 },
+};
+
+struct batgw_cells {
+	struct batgw_b		*c_b;
+	const char		*c_name;
+	unsigned int		 c_ncells;
+
+	uint16_t		*c_mv;		/* 0 hasn't reported yet */
+	uint32_t		*c_avg;		/* scaled by the ewma shift */
+	int16_t			*c_drift;	/* mv against c_avg */
+
+	unsigned int		 c_nvalid;
+	uint32_t		 c_sum;
+	uint64_t		 c_sumsq;
+
+	unsigned int		 c_low;		/* cell indexes */
+	unsigned int		 c_high;
+	unsigned int		 c_drifter;
+	unsigned int		 c_rescan;
+	struct timeval		 c_updated;
+
+	struct batgw_kv		 c_kvs[BATGW_CELLS_KV_COUNT];
+	struct batgw_kv_block	*c_block;	/* the cells themselves */
+};
+
+struct batgw_cells *
+batgw_cells_create(struct batgw *bg, struct batgw_b *b, const char *name,
+    unsigned int ncells)
+{
+	const char *scope = batgw_b_scope(b);
+	struct batgw_cells *c;
+	unsigned int i;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		err(1, "%s %s alloc", scope, name);
+
+	c->c_b = b;
+	c->c_name = name;
+	c->c_ncells = ncells;
+
+	c->c_mv = calloc(ncells, sizeof(*c->c_mv));
+	c->c_avg = calloc(ncells, sizeof(*c->c_avg));
+	c->c_drift = calloc(ncells, sizeof(*c->c_drift));
+	if (c->c_mv == NULL || c->c_avg == NULL || c->c_drift == NULL)
+		err(1, "%s %u %s alloc", scope, ncells, name);
+
+	for (i = 0; i < nitems(c->c_kvs); i++)
+		batgw_kv_init_tpl(&c->c_kvs[i], &batgw_cells_kvs_tpl[i]);
+	batgw_kv_attach(bg, scope, c->c_kvs, nitems(c->c_kvs));
+	c->c_block = batgw_kv_block_attach(bg, scope, name,
+	    KV_T_VOLTAGE, 3, ncells);
+
+	return (c);
+}
+
+static inline unsigned int
+batgw_cells_abs(int v)
+{
+	return (v < 0 ? -v : v);
+}
+
+void
+batgw_cells_set(struct batgw_cells *c, unsigned int cell, unsigned int mv)
+{
+	unsigned int omv;
+	int drift, odrift;
+	int32_t avg;
+
+	if (cell >= c->c_ncells || mv == 0 || mv > UINT16_MAX)
+		return;
+
+	omv = c->c_mv[cell];
+	if (omv == 0) {
+		c->c_nvalid++;
+		c->c_avg[cell] = mv << BATGW_CELLS_EWMA_SHIFT;
+	} else {
+		c->c_sum -= omv;
+		c->c_sumsq -= (uint64_t)omv * omv;
+	}
+	c->c_sum += mv;
+	c->c_sumsq += (uint64_t)mv * mv;
+	c->c_mv[cell] = mv;
+	batgw_kv_block_update(c->c_b->b_bg, c->c_block, cell, mv);
+
+	/* an extreme moving inwards means another cell could be it now */
+	if (cell == c->c_low) {
+		if (mv > omv)
+			SET(c->c_rescan, 1);
+	} else if (c->c_mv[c->c_low] == 0 || mv < c->c_mv[c->c_low])
+		c->c_low = cell;
+
+	if (cell == c->c_high) {
+		if (mv < omv)
+			SET(c->c_rescan, 1);
+	} else if (c->c_mv[c->c_high] == 0 || mv > c->c_mv[c->c_high])
+		c->c_high = cell;
+
+	avg = c->c_avg[cell];
+	drift = (int)mv - (avg >> BATGW_CELLS_EWMA_SHIFT);
+	avg += ((int32_t)(mv << BATGW_CELLS_EWMA_SHIFT) - avg) /
+	    (1 << BATGW_CELLS_EWMA_SHIFT);
+	c->c_avg[cell] = avg;
+
+	odrift = c->c_drift[cell];
+	c->c_drift[cell] = drift;
+	if (cell == c->c_drifter) {
+		if (batgw_cells_abs(drift) < batgw_cells_abs(odrift))
+			SET(c->c_rescan, 1);
+	} else if (batgw_cells_abs(drift) >
+	    batgw_cells_abs(c->c_drift[c->c_drifter]))
+		c->c_drifter = cell;
+}
+
+static void
+batgw_cells_rescan(struct batgw_cells *c)
+{
+	unsigned int low = 0, high = 0, drifter = 0;
+	unsigned int i, mv;
+
+	for (i = 0; i < c->c_ncells; i++) {
+		mv = c->c_mv[i];
+		if (mv == 0)
+			continue;
+
+		if (c->c_mv[low] == 0 || mv < c->c_mv[low])
+			low = i;
+		if (c->c_mv[high] == 0 || mv > c->c_mv[high])
+			high = i;
+		if (batgw_cells_abs(c->c_drift[i]) >
+		    batgw_cells_abs(c->c_drift[drifter]))
+			drifter = i;
+	}
+
+	c->c_low = low;
+	c->c_high = high;
+	c->c_drifter = drifter;
+	c->c_rescan = 0;
+}
+
+static uint32_t
+batgw_isqrt(uint64_t v)
+{
+	uint64_t r = 0, bit = 1ULL << 62;
+
+	while (bit > v)
+		bit >>= 2;
+
+	while (bit != 0) {
+		if (v >= r + bit) {
+			v -= r + bit;
+			r = (r >> 1) + bit;
+		} else
+			r >>= 1;
+		bit >>= 2;
+	}
+
+	return (r);
+}
+
+/* once the frame with the readings has been handled */
+void
+batgw_cells_commit(struct batgw *bg, struct batgw_cells *c)
+{
+	const char *scope = batgw_b_scope(c->c_b);
+	struct batgw_kv *kvs = c->c_kvs;
+	uint64_t n = c->c_nvalid;
+	uint64_t var;
+
+	if (n == 0)
+		return;
+
+	if (c->c_rescan)
+		batgw_cells_rescan(c);
+	c->c_updated = bg->bg_now;
+
+	batgw_kv_update(bg, scope, &kvs[BATGW_CELLS_KV_LOW],
+	    c->c_mv[c->c_low]);
+	batgw_kv_update(bg, scope, &kvs[BATGW_CELLS_KV_LOW_CELL], c->c_low);
+	batgw_kv_update(bg, scope, &kvs[BATGW_CELLS_KV_HIGH],
+	    c->c_mv[c->c_high]);
+	batgw_kv_update(bg, scope, &kvs[BATGW_CELLS_KV_HIGH_CELL], c->c_high);
+
+	/* tenths of a mV */
+	batgw_kv_update(bg, scope, &kvs[BATGW_CELLS_KV_MEAN],
+	    (c->c_sum * 10 + n / 2) / n);
+	var = n * c->c_sumsq - (uint64_t)c->c_sum * c->c_sum;
+	batgw_kv_update(bg, scope, &kvs[BATGW_CELLS_KV_STDDEV],
+	    batgw_isqrt(var * 100 / (n * n)));
+
+	batgw_kv_update(bg, scope, &kvs[BATGW_CELLS_KV_DRIFT],
+	    c->c_drift[c->c_drifter]);
+	batgw_kv_update(bg, scope, &kvs[BATGW_CELLS_KV_DRIFT_CELL],
+	    c->c_drifter);
+
+	/* the limits only hear about a full set of cells */
+	if (c->c_nvalid == c->c_ncells) {
+		batgw_b_set_min_cell_voltage_mv(c->c_b, c->c_mv[c->c_low]);
+		batgw_b_set_max_cell_voltage_mv(c->c_b, c->c_mv[c->c_high]);
+	}
+}
+
+/* is the state getting its cell voltages from here? */
+int
+batgw_cells_fresh(struct batgw *bg, const struct batgw_cells *c)
+{
+	struct timeval tv;
+
+	if (c->c_nvalid != c->c_ncells)
+		return (0);
+
+	timersub(&bg->bg_now, &c->c_updated, &tv);
+	return (tv.tv_sec < BATGW_CELLS_MAX_AGE);
+}
+
+void
+batgw_cells_publish(struct batgw *bg, const struct batgw_cells *c)
+{
+	batgw_kv_block_publish(bg, c->c_block);
+}
+
+/*
+ * CAN related code
+ */
+
+#define CAN_RECV_BATCH		16
+
+int
+can_open(const char *scope, const char *name,
+    const struct can_filter *filters, size_t nfilters, unsigned int canfd)
+{
+	struct ifreq ifr;
+	struct sockaddr_can can;
+	can_err_mask_t errmask = CAN_ERR_MASK;
+	int fd;
+	int on = 1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	if (strlcpy(ifr.ifr_name, name, sizeof(ifr.ifr_name)) >=
+	    sizeof(ifr.ifr_name))
+		errx(1, "%s %s: name too long", scope, name);
+
+	fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+	if (fd == -1)
+		err(1, "%s %s socket", scope, name);
+
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) == -1)
+		err(1, "%s %s index", scope, name);
+
+	if (ISSET(canfd, BATGW_CAN_FD)) {
+		/* the interface has to be able to carry them too */
+		if (ioctl(fd, SIOCGIFMTU, &ifr) == -1)
+			err(1, "%s %s mtu", scope, name);
+		if (ifr.ifr_mtu != CANFD_MTU)
+			errx(1, "%s %s: CAN FD is not enabled", scope, name);
+
+		if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+		    &on, sizeof(on)) == -1)
+			err(1, "%s %s fd frames", scope, name);
+	}
+
+	memset(&can, 0, sizeof(can));
+	can.can_family = AF_CAN;
+	can.can_ifindex = ifr.ifr_ifindex;
+
+	/* the kernel gives us everything unless we say otherwise */
+	if (nfilters > 0 && setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER,
+	    filters, nfilters * sizeof(*filters)) == -1)
+		err(1, "%s %s filter", scope, name);
+
+	/* error frames get past the filters, but only if they're asked for */
+	if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER,
+	    &errmask, sizeof(errmask)) == -1)
+		err(1, "%s %s error filter", scope, name);
+
+	/* have the kernel say how many frames didn't fit in the queue */
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1)
+		err(1, "%s %s overflow counter", scope, name);
+
+	/* the kernel knows when frames really arrived */
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS,
+	    &on, sizeof(on)) == -1)
+		err(1, "%s %s timestamps", scope, name);
+
+	if (bind(fd, (struct sockaddr *)&can, sizeof(can)) == -1)
+		err(1, "%s %s bind", scope, name);
+
+	return (fd);
+}
+
+/*
+ * flight recorder. every frame in or out of an interface goes into a
+ * ring, which can be written out to a file when someone asks. only
+ * the event loop writes to the ring, so it needs no locking.
+ */
+
+struct batgw_rec {
+	uint64_t		 r_nsec;	/* realtime */
+	uint32_t		 r_id;
+	uint8_t			 r_len;
+	uint8_t			 r_flags;
+#define BATGW_REC_F_TX			(1 << 0)
+#define BATGW_REC_F_FD			(1 << 1)
+#define BATGW_REC_F_BRS			(1 << 2)
+	uint8_t			 r_pad[2];
+	uint8_t			 r_data[CANFD_MAX_DLEN];
+};
+
+/* version 1 records stopped at 8 bytes of data */
+#define BATGW_REC_V1_LEN	offsetof(struct batgw_rec, r_data[CAN_MAX_DLEN])
+
+struct batgw_rec_hdr {
+	char			 h_magic[8];
+#define BATGW_REC_MAGIC			"batgwrec"
+	uint32_t		 h_version;
+#define BATGW_REC_VERSION		2
+	uint32_t		 h_reclen;
+	uint64_t		 h_nrecs;
+	uint64_t		 h_dropped;	/* overwritten in the ring */
+	char			 h_ifname[IFNAMSIZ];
+};
+
+#define BATGW_REC_FRAMES	8192	/* must be a power of 2 */
+#define BATGW_DB_DIR		"/var/lib/batgw"
+
+struct batgw_can {
+	TAILQ_ENTRY(batgw_can)	 c_entry;
+	const char		*c_scope;
+	const char		*c_ifname;
+	int			 c_fd;
+	unsigned int		 c_canfd;	/* BATGW_CAN_FD flags */
+	struct batgw_canif	*c_if;
+
+	uint64_t		 c_rx;
+	uint64_t		 c_rx_bytes;
+	uint64_t		 c_tx_frames;
+	uint64_t		 c_tx_bytes;
+	uint32_t		 c_dropped;	/* by the socket queue */
+	uint64_t		 c_rx_nsec;	/* benchmarking */
+
+	/* replay */
+	int			 c_peer;
+	struct event		*c_peer_ev;
+	struct can_filter	*c_filters;
+	size_t			 c_nfilters;
+	uint64_t		 c_fed;
+	uint64_t		 c_tx;
+
+	uint64_t		 c_prod;
+	struct batgw_rec	 c_ring[BATGW_REC_FRAMES];
+};
+
+/*
+ * a replay stands in for the interface with one end of a socketpair.
+ * the kernel isn't there to filter, so the replay does it instead.
+ */
+
+static int
+batgw_can_open(struct batgw *bg, const char *scope, const char *ifname,
+    struct can_filter *filters, size_t nfilters, unsigned int canfd)
+{
+	struct batgw_can *c;
+	int fds[2];
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		err(1, "%s %s recorder alloc", scope, ifname);
+
+	c->c_scope = scope;
+	c->c_ifname = ifname;
+	c->c_canfd = canfd;
+	c->c_peer = -1;
+
+	if (bg->bg_replay == NULL) {
+		c->c_fd = can_open(scope, ifname, filters, nfilters, canfd);
+		free(filters);
+	} else {
+		if (socketpair(AF_UNIX,
+		    SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+		    fds) == -1)
+			err(1, "%s %s replay socketpair", scope, ifname);
+
+		c->c_fd = fds[0];
+		c->c_peer = fds[1];
+		c->c_filters = filters;
+		c->c_nfilters = nfilters;
+
+		c->c_peer_ev = event_new(bg->bg_evbase, c->c_peer,
+		    EV_READ|EV_PERSIST, batgw_replay_drain, c);
+		if (c->c_peer_ev == NULL)
+			errx(1, "%s %s replay event failed", scope, ifname);
+		event_add(c->c_peer_ev, NULL);
+	}
+
+	TAILQ_INSERT_TAIL(&bg->bg_cans, c, c_entry);
+	c->c_if = batgw_canif_get(bg, c);
+
+	return (c->c_fd);
+}
+
+static struct batgw_can *
+batgw_can_lookup(struct batgw *bg, int fd)
+{
+	struct batgw_can *c;
+
+	TAILQ_FOREACH(c, &bg->bg_cans, c_entry) {
+		if (c->c_fd == fd)
+			return (c);
+	}
+
+	return (NULL);
+}
+
+static void
+batgw_rec(struct batgw_can *c, const struct timespec *ts,
+    const struct canfd_frame *frame, unsigned int flags)
+{
+	struct batgw_rec *r;
+	size_t len = frame->len;
+
+	if (len > sizeof(r->r_data))
+		len = sizeof(r->r_data);
+
+	r = &c->c_ring[c->c_prod++ & (BATGW_REC_FRAMES - 1)];
+	r->r_nsec = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+	r->r_id = frame->can_id;
+	r->r_len = len;
+	r->r_flags = flags;
+	if (CAN_ISFD(frame)) {
+		SET(r->r_flags, BATGW_REC_F_FD);
+		if (ISSET(frame->flags, CANFD_BRS))
+			SET(r->r_flags, BATGW_REC_F_BRS);
+	}
+	memcpy(r->r_data, frame->data, len);
+}
+
+static inline size_t
+can_mtu(const struct canfd_frame *frame)
+{
+	return (CAN_ISFD(frame) ? CANFD_MTU : CAN_MTU);
+}
+
+int
+can_send(struct batgw *bg, int fd, const struct canfd_frame *frame)
+{
+	struct canfd_frame brs;
+	struct batgw_can *c;
+	struct timespec ts;
+
+	c = batgw_can_lookup(bg, fd);
+
+	/* the interface decides if fd frames get the fast data phase */
+	if (c != NULL && ISSET(c->c_canfd, BATGW_CAN_FD_BRS) &&
+	    CAN_ISFD(frame) && !ISSET(frame->flags, CANFD_BRS)) {
+		brs = *frame;
+		SET(brs.flags, CANFD_FDF|CANFD_BRS);
+		frame = &brs;
+	}
+
+	if (send(fd, frame, can_mtu(frame), 0) == -1)
+		return (-1);
+
+	if (c != NULL) {
+		c->c_tx_frames++;
+		c->c_tx_bytes += frame->len;
+		if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+			lerr(1, "clock_gettime realtime");
+		batgw_rec(c, &ts, frame, BATGW_REC_F_TX);
+	}
+
+	return (0);
+}
+
+/*
+ * the files batgw writes go in a directory that nobody else can
+ * put things in, so they can't be swapped for links to other files.
+ */
+
+static void
+batgw_db_init(struct batgw *bg)
+{
+	struct stat st;
+
+	if (mkdir(BATGW_DB_DIR, 0700) == -1 && errno != EEXIST) {
+		lwarn("%s", BATGW_DB_DIR);
+		return;
+	}
+
+	if (lstat(BATGW_DB_DIR, &st) == -1) {
+		lwarn("%s", BATGW_DB_DIR);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		lwarnx("%s is not a directory", BATGW_DB_DIR);
+		return;
+	}
+	if (st.st_uid != geteuid()) {
+		lwarnx("%s is owned by uid %u", BATGW_DB_DIR,
+		    (unsigned int)st.st_uid);
+		return;
+	}
+	if (ISSET(st.st_mode, S_IWGRP|S_IWOTH)) {
+		lwarnx("%s is writable by others", BATGW_DB_DIR);
+		return;
+	}
+
+	bg->bg_db = 1;
+}
+
+static int
+batgw_rec_dump_can(const struct batgw_can *c)
+{
+	struct batgw_rec_hdr *h;
+	uint64_t n = c->c_prod, start;
+	size_t len, first;
+	char path[PATH_MAX];
+	int fd, rv = -1;
+	void *map;
+	int plen;
+
+	if (n > BATGW_REC_FRAMES)
+		n = BATGW_REC_FRAMES;
+
+	plen = snprintf(path, sizeof(path), "%s/batgw-%s.rec",
+	    BATGW_DB_DIR, c->c_ifname);
+	if (plen == -1 || (size_t)plen >= sizeof(path)) {
+		lwarnx("%s recorder path is too long", c->c_ifname);
+		return (-1);
+	}
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if (fd == -1) {
+		lwarn("%s", path);
+		return (-1);
+	}
+
+	len = sizeof(*h) + n * sizeof(struct batgw_rec);
+	if (ftruncate(fd, len) == -1) {
+		lwarn("%s truncate", path);
+		goto close;
+	}
+
+	map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		lwarn("%s mmap", path);
+		goto close;
+	}
+
+	h = map;
+	memcpy(h->h_magic, BATGW_REC_MAGIC, sizeof(h->h_magic));
+	h->h_version = BATGW_REC_VERSION;
+	h->h_reclen = sizeof(struct batgw_rec);
+	h->h_nrecs = n;
+	h->h_dropped = c->c_prod - n;
+	strlcpy(h->h_ifname, c->c_ifname, sizeof(h->h_ifname));
+
+	/* oldest first */
+	start = (c->c_prod - n) & (BATGW_REC_FRAMES - 1);
+	first = BATGW_REC_FRAMES - start;
+	if (first > n)
+		first = n;
+	memcpy(h + 1, c->c_ring + start, first * sizeof(struct batgw_rec));
+	memcpy((struct batgw_rec *)(h + 1) + first, c->c_ring,
+	    (n - first) * sizeof(struct batgw_rec));
+
+	if (munmap(map, len) == -1)
+		lwarn("%s munmap", path);
+
+	linfo("%s: %llu frames", path, (unsigned long long)n);
+	rv = 0;
+close:
+	close(fd);
+	return (rv);
+}
+
+static void
+batgw_rec_dump(struct batgw *bg)
+{
+	struct batgw_can *c;
+
+	if (!bg->bg_db) {
+		lwarnx("%s isn't usable, recordings can't be saved",
+		    BATGW_DB_DIR);
+		return;
+	}
+
+	TAILQ_FOREACH(c, &bg->bg_cans, c_entry)
+		batgw_rec_dump_can(c);
+}
+
+static void
+batgw_rec_signal(int sig, short events, void *arg)
+{
+	struct batgw *bg = arg;
+
+	batgw_rec_dump(bg);
+}
+
+/*
+ * map a dump for reading. returns NULL if the file isn't one.
+ */
+
+static const struct batgw_rec_hdr *
+batgw_rec_map(const char *path, size_t *lenp)
+{
+	const struct batgw_rec_hdr *h;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		err(1, "%s", path);
+	if (fstat(fd, &st) == -1)
+		err(1, "%s stat", path);
+	if ((size_t)st.st_size < sizeof(*h)) {
+		close(fd);
+		return (NULL);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		err(1, "%s mmap", path);
+	close(fd);
+
+	h = map;
+	if (memcmp(h->h_magic, BATGW_REC_MAGIC, sizeof(h->h_magic)) != 0) {
+		munmap(map, st.st_size);
+		return (NULL);
+	}
+	switch (h->h_version) {
+	case 1:
+		if (h->h_reclen != BATGW_REC_V1_LEN)
+			goto unsupported;
+		break;
+	case BATGW_REC_VERSION:
+		if (h->h_reclen != sizeof(struct batgw_rec))
+			goto unsupported;
+		break;
+	default:
+	unsupported:
+		errx(1, "%s: unsupported version %u", path, h->h_version);
+	}
+	if (h->h_nrecs > (st.st_size - sizeof(*h)) / h->h_reclen)
+		errx(1, "%s: truncated", path);
+
+	*lenp = st.st_size;
+	return (h);
+}
+
+static inline const struct batgw_rec *
+batgw_rec_at(const struct batgw_rec_hdr *h, uint64_t i)
+{
+	return ((const struct batgw_rec *)((const uint8_t *)(h + 1) +
+	    i * h->h_reclen));
+}
+
+/*
+ * turn a dump into candump -l text so the usual tools can use it.
+ * that format has nowhere to say which way a frame went.
+ */
+
+static int
+batgw_rec_export(const char *path)
+{
+	const struct batgw_rec_hdr *h;
+	const struct batgw_rec *r;
+	uint64_t i;
+	unsigned int j, dlen;
+	size_t len;
+
+	h = batgw_rec_map(path, &len);
+	if (h == NULL)
+		errx(1, "%s: not a recording", path);
+
+	dlen = h->h_reclen - offsetof(struct batgw_rec, r_data);
+	for (i = 0; i < h->h_nrecs; i++) {
+		r = batgw_rec_at(h, i);
+		printf("(%llu.%06llu) %.*s ",
+		    (unsigned long long)(r->r_nsec / 1000000000),
+		    (unsigned long long)(r->r_nsec % 1000000000) / 1000,
+		    (int)sizeof(h->h_ifname), h->h_ifname);
+		if (ISSET(r->r_id, CAN_ERR_FLAG)) {
+			printf("%08X#",
+			    r->r_id & (CAN_ERR_FLAG|CAN_ERR_MASK));
+		} else if (ISSET(r->r_id, CAN_EFF_FLAG))
+			printf("%08X#", r->r_id & CAN_EFF_MASK);
+		else
+			printf("%03X#", r->r_id & CAN_SFF_MASK);
+		if (ISSET(r->r_flags, BATGW_REC_F_FD)) {
+			printf("#%X", ISSET(r->r_flags, BATGW_REC_F_BRS) ?
+			    CANFD_BRS : 0);
+		}
+		for (j = 0; j < r->r_len && j < dlen; j++)
+			printf("%02X", r->r_data[j]);
+		printf("\n");
+	}
+
+	return (0);
+}
+
+/*
+ * replay a recording into the drivers, either at the pace it was
+ * recorded or as fast as they can take it. a recording is either a
+ * dump from the flight recorder or candump -l text.
+ */
+
+struct batgw_replay_frame {
+	uint64_t		 rf_nsec;
+	size_t			 rf_seq;
+	const char		*rf_ifname;
+	struct canfd_frame	 rf_frame;
+};
+
+struct batgw_replay {
+	struct batgw_replay_frame
+				*rp_frames;
+	size_t			 rp_nframes;
+	size_t			 rp_size;
+	char			*rp_ifnames[8];
+	size_t			 rp_nifnames;
+	int			 rp_bench;
+
+	struct event		*rp_ev;
+	struct timeval		 rp_start;
+	struct timespec		 rp_t0;
+	uint64_t		 rp_nsec0;
+
+	size_t			 rp_next;
+	struct batgw_can	*rp_c;		/* blocked part way through */
+	unsigned int		 rp_matched;
+	uint64_t		 rp_skipped;
+};
+
+static const struct timeval batgw_replay_idle_tv = { 0, 10000 };
+
+static struct batgw_replay_frame *
+batgw_replay_frame(struct batgw_replay *rp, const char *ifname)
+{
+	struct batgw_replay_frame *rf;
+	size_t i;
+
+	if (rp->rp_nframes == rp->rp_size) {
+		size_t size = rp->rp_size ? rp->rp_size * 2 : 4096;
+		rf = reallocarray(rp->rp_frames, size, sizeof(*rf));
+		if (rf == NULL)
+			err(1, "replay frames");
+		rp->rp_frames = rf;
+		rp->rp_size = size;
+	}
+
+	rf = &rp->rp_frames[rp->rp_nframes];
+	memset(rf, 0, sizeof(*rf));
+	rf->rf_seq = rp->rp_nframes++;
+
+	for (i = 0; i < rp->rp_nifnames; i++) {
+		if (strcmp(rp->rp_ifnames[i], ifname) == 0) {
+			rf->rf_ifname = rp->rp_ifnames[i];
+			return (rf);
+		}
+	}
+
+	if (rp->rp_nifnames >= nitems(rp->rp_ifnames))
+		errx(1, "replay %s: too many interfaces", ifname);
+	rf->rf_ifname = rp->rp_ifnames[rp->rp_nifnames++] = strdup(ifname);
+	if (rf->rf_ifname == NULL)
+		err(1, "replay %s", ifname);
+
+	return (rf);
+}
+
+static void
+batgw_replay_candump(struct batgw_replay *rp, const char *path)
+{
+	struct batgw_replay_frame *rf;
+	struct canfd_frame *frame;
+	unsigned long long sec, usec;
+	unsigned long id;
+	unsigned int byte, max;
+	char ifname[IFNAMSIZ];
+	char *line = NULL;
+	size_t linesize = 0;
+	unsigned int lineno = 0;
+	char *p, *ep;
+	FILE *f;
+	int off;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		err(1, "%s", path);
+
+	while (getline(&line, &linesize, f) != -1) {
+		lineno++;
+		if (line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "(%llu.%6llu) %15s %n",
+		    &sec, &usec, ifname, &off) != 3)
+			errx(1, "%s:%u: not candump -l output", path, lineno);
+
+		p = line + off;
+		id = strtoul(p, &ep, 16);
+		if (ep == p || *ep != '#')
+			errx(1, "%s:%u: bad frame", path, lineno);
+		rf = batgw_replay_frame(rp, ifname);
+		rf->rf_nsec = sec * 1000000000ULL + usec * 1000;
+		frame = &rf->rf_frame;
+		frame->can_id = id;
+		/* error frames are written out with long ids */
+		if (ep - p > 3 && !ISSET(id, CAN_ERR_FLAG))
+			SET(frame->can_id, CAN_EFF_FLAG);
+
+		p = ep + 1;
+		if (*p == '#') {
+			/* fd frames have a nibble of flags first */
+			if (sscanf(p + 1, "%1x", &byte) != 1)
+				errx(1, "%s:%u: bad fd frame", path, lineno);
+			frame->flags = CANFD_FDF | (byte & CANFD_BRS);
+			p += 2;
+			max = CANFD_MAX_DLEN;
+		} else if (*p == 'R') {
+			SET(frame->can_id, CAN_RTR_FLAG);
+			continue;
+		} else
+			max = CAN_MAX_DLEN;
+
+		while (sscanf(p, "%2x", &byte) == 1) {
+			if (frame->len >= max)
+				errx(1, "%s:%u: frame is too long",
+				    path, lineno);
+			frame->data[frame->len++] = byte;
+			p += 2;
+		}
+	}
+	if (ferror(f))
+		err(1, "%s", path);
+
+	free(line);
+	fclose(f);
+}
+
+static void
+batgw_replay_load(struct batgw *bg, const char *path, int bench)
+{
+	struct batgw_replay *rp = bg->bg_replay;
+	struct batgw_replay_frame *rf;
+	const struct batgw_rec_hdr *h;
+	const struct batgw_rec *r;
+	char ifname[IFNAMSIZ + 1];
+	uint64_t i;
+	size_t len, dlen;
+
+	if (rp == NULL) {
+		rp = calloc(1, sizeof(*rp));
+		if (rp == NULL)
+			err(1, "replay alloc");
+		bg->bg_replay = rp;
+	}
+	if (bench)
+		rp->rp_bench = 1;
+
+	h = batgw_rec_map(path, &len);
+	if (h == NULL) {
+		batgw_replay_candump(rp, path);
+		return;
+	}
+
+	memcpy(ifname, h->h_ifname, sizeof(h->h_ifname));
+	ifname[sizeof(h->h_ifname)] = '\0';
+
+	dlen = h->h_reclen - offsetof(struct batgw_rec, r_data);
+	for (i = 0; i < h->h_nrecs; i++) {
+		r = batgw_rec_at(h, i);
+
+		/* the drivers will send their own */
+		if (ISSET(r->r_flags, BATGW_REC_F_TX))
+			continue;
+
+		rf = batgw_replay_frame(rp, ifname);
+		rf->rf_nsec = r->r_nsec;
+		rf->rf_frame.can_id = r->r_id;
+		rf->rf_frame.len = r->r_len < dlen ? r->r_len : dlen;
+		if (ISSET(r->r_flags, BATGW_REC_F_FD)) {
+			rf->rf_frame.flags = CANFD_FDF;
+			if (ISSET(r->r_flags, BATGW_REC_F_BRS))
+				SET(rf->rf_frame.flags, CANFD_BRS);
+		}
+		memcpy(rf->rf_frame.data, r->r_data, rf->rf_frame.len);
+	}
+
+	munmap((void *)h, len);
+}
+
+static int
+batgw_replay_cmp(const void *a, const void *b)
+{
+	const struct batgw_replay_frame *rfa = a, *rfb = b;
+
+	if (rfa->rf_nsec != rfb->rf_nsec)
+		return (rfa->rf_nsec < rfb->rf_nsec ? -1 : 1);
+	if (rfa->rf_seq != rfb->rf_seq)
+		return (rfa->rf_seq < rfb->rf_seq ? -1 : 1);
+	return (0);
+}
+
+static int
+batgw_replay_match(const struct batgw_can *c,
+    const struct batgw_replay_frame *rf)
+{
+	const struct can_filter *f;
+	canid_t id = rf->rf_frame.can_id;
+	canid_t fid;
+	size_t i;
+	int m;
+
+	if (c->c_peer == -1 || strcmp(c->c_ifname, rf->rf_ifname) != 0)
+		return (0);
+	/* like the kernel, only sockets that asked for fd frames get them */
+	if (CAN_ISFD(&rf->rf_frame) && !ISSET(c->c_canfd, BATGW_CAN_FD))
+		return (0);
+	/* every socket asks for every error frame */
+	if (c->c_nfilters == 0 || ISSET(id, CAN_ERR_FLAG))
+		return (1);
+
+	for (i = 0; i < c->c_nfilters; i++) {
+		f = &c->c_filters[i];
+		fid = f->can_id & ~CAN_INV_FILTER;
+
+		m = (id & f->can_mask) == (fid & f->can_mask);
+		if (ISSET(f->can_id, CAN_INV_FILTER))
+			m = !m;
+		if (m)
+			return (1);
+	}
+
+	return (0);
+}
+
+static void
+batgw_replay_drain(int fd, short events, void *arg)
+{
+	struct batgw_can *c = arg;
+	struct canfd_frame frame;
+
+	/* whatever the drivers send falls on the floor */
+	while (recv(fd, &frame, sizeof(frame), 0) != -1)
+		c->c_tx++;
+}
+
+static void
+batgw_replay_feed(int nil, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	struct batgw_replay *rp = bg->bg_replay;
+	struct batgw_replay_frame *rf;
+	struct batgw_can *c;
+	struct timeval now, due, tv;
+	uint64_t nsec;
+
+	batgw_now(&now);
+
+	for (; rp->rp_next < rp->rp_nframes; rp->rp_next++) {
+		rf = &rp->rp_frames[rp->rp_next];
+
+		if (!rp->rp_bench) {
+			nsec = rf->rf_nsec - rp->rp_nsec0;
+			tv.tv_sec = nsec / 1000000000;
+			tv.tv_usec = (nsec % 1000000000) / 1000;
+			timeradd(&rp->rp_start, &tv, &due);
+			if (timercmp(&due, &now, >)) {
+				timersub(&due, &now, &tv);
+				evtimer_add(rp->rp_ev, &tv);
+				return;
+			}
+		}
+
+		c = rp->rp_c != NULL ? rp->rp_c : TAILQ_FIRST(&bg->bg_cans);
+		for (; c != NULL; c = TAILQ_NEXT(c, c_entry)) {
+			if (!batgw_replay_match(c, rf))
+				continue;
+
+			if (send(c->c_peer, &rf->rf_frame,
+			    can_mtu(&rf->rf_frame), 0) == -1) {
+				if (errno != EAGAIN && errno != ENOBUFS) {
+					lerr(1, "%s %s replay", c->c_scope,
+					    c->c_ifname);
+				}
+
+				/* come back when the driver catches up */
+				rp->rp_c = c;
+				if (event_base_once(bg->bg_evbase, c->c_peer,
+				    EV_WRITE, batgw_replay_feed, bg,
+				    NULL) == -1)
+					lerrx(1, "replay wait failed");
+				return;
+			}
+
+			c->c_fed++;
+			rp->rp_matched = 1;
+		}
+
+		if (!rp->rp_matched)
+			rp->rp_skipped++;
+		rp->rp_matched = 0;
+		rp->rp_c = NULL;
+	}
+
+	/* let the drivers finish what they've been given */
+	TAILQ_FOREACH(c, &bg->bg_cans, c_entry) {
+		if (c->c_rx < c->c_fed) {
+			evtimer_add(rp->rp_ev, &batgw_replay_idle_tv);
+			return;
+		}
+	}
+
+	if (rp->rp_bench)
+		batgw_bench_report(bg);
+	else {
+		linfo("replay finished, %zu frames, %llu skipped",
+		    rp->rp_nframes, (unsigned long long)rp->rp_skipped);
+	}
+
+	event_base_loopexit(bg->bg_evbase, NULL);
+}
+
+static void
+batgw_replay_start(struct batgw *bg)
+{
+	struct batgw_replay *rp = bg->bg_replay;
+
+	qsort(rp->rp_frames, rp->rp_nframes, sizeof(*rp->rp_frames),
+	    batgw_replay_cmp);
+	if (rp->rp_nframes > 0)
+		rp->rp_nsec0 = rp->rp_frames[0].rf_nsec;
+
+	rp->rp_ev = evtimer_new(bg->bg_evbase, batgw_replay_feed, bg);
+	if (rp->rp_ev == NULL)
+		errx(1, "new replay event failed");
+
+	batgw_now(&rp->rp_start);
+	if (clock_gettime(CLOCK_MONOTONIC, &rp->rp_t0) == -1)
+		err(1, "clock_gettime monotonic");
+
+	event_active(rp->rp_ev, EV_TIMEOUT, 0);
+}
+
+/*
+ * benchmark results go to stdout so they can be compared between
+ * builds, including the state the drivers were left in.
+ */
+
+#define BATGW_BENCH_KV_CALLS	1000000
+
+static uint64_t
+batgw_bench_nsec(const struct timespec *t0, const struct timespec *t1)
+{
+	struct timespec d;
+
+	timespecsub(t1, t0, &d);
+	return ((uint64_t)d.tv_sec * 1000000000 + d.tv_nsec);
+}
+
+static void
+batgw_bench_rate(const char *what, uint64_t n, uint64_t nsec)
+{
+	printf("%s: %llu in %llu us", what, (unsigned long long)n,
+	    (unsigned long long)(nsec / 1000));
+	if (n > 0 && nsec > 0) {
+		printf(", %llu ns each, %llu/s",
+		    (unsigned long long)(nsec / n),
+		    (unsigned long long)(n * 1000000000 / nsec));
+	}
+	printf("\n");
+}
+
+static void
+batgw_kv_block_bench(const char *scope, const struct batgw_kv_block *kb)
+{
+	char p[BATGW_KV_FMT_LEN];
+	unsigned int i;
+	int v;
+
+	for (i = 0; i < kb->kb_n; i++) {
+		printf("kv %s/%s/%u/%s ", scope, kb->kb_name, i,
+		    batgw_kv_type_names[kb->kb_type]);
+		v = batgw_kv_block_get(kb, i);
+		if (v == INT_MIN)
+			printf("-\n");
+		else {
+			printf("%.*s\n",
+			    (int)batgw_kv_fmt(p, v, kb->kb_precision), p);
+		}
+	}
+}
+
+static void
+batgw_bench_state(struct batgw *bg)
+{
+	const struct batgw_b_state *bs;
+	const struct batgw_energy *be;
+	const struct batgw_kv_scope *ks;
+	const struct batgw_kv *kv;
+	const char *scope;
+	char p[BATGW_KV_FMT_LEN];
+	size_t i, plen;
+	unsigned int safety;
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		bs = &bg->bg_batteries[i].b_state;
+		scope = bg->bg_batteries[i].b_scope;
+
+		printf("%s running %u\n", scope, bs->bs_running);
+		printf("%s soc %u\n", scope, bs->bs_soc_cpct);
+		printf("%s voltage %u\n", scope, bs->bs_voltage_dv);
+		printf("%s current %d\n", scope, bs->bs_current_da);
+		printf("%s temp %d %d %d\n", scope, bs->bs_min_temp_dc,
+		    bs->bs_avg_temp_dc, bs->bs_max_temp_dc);
+		printf("%s cell voltage %u %u\n", scope,
+		    bs->bs_min_cell_voltage_mv, bs->bs_max_cell_voltage_mv);
+		be = &bg->bg_batteries[i].b_energy;
+		printf("%s charge mas %llu %llu energy mj %llu %llu\n", scope,
+		    (unsigned long long)be->be_total[BATGW_E_CHARGED_MAS],
+		    (unsigned long long)be->be_total[BATGW_E_DISCHARGED_MAS],
+		    (unsigned long long)be->be_total[BATGW_E_CHARGED_MJ],
+		    (unsigned long long)be->be_total[BATGW_E_DISCHARGED_MJ]);
+	}
+	printf("inverter running %u contactor %u\n",
+	    bg->bg_inverter_state.is_running,
+	    bg->bg_inverter_state.is_contactor);
+	safety = batgw_i_get_safety(bg);
+	printf("limits %s charge %u discharge %u\n",
+	    safety == v_safe ? "safe" : "unsafe",
+	    batgw_i_get_charge_da(bg, safety),
+	    batgw_i_get_discharge_da(bg, safety));
+
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		if (ks->ks_block != NULL)
+			batgw_kv_block_bench(ks->ks_scope, ks->ks_block);
+
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			kv = &ks->ks_kvs[i];
+
+			printf("kv %s/", ks->ks_scope);
+			if (ks->ks_array != NULL)
+				printf("%s/%zu/", ks->ks_array, i);
+			else if (kv->kv_key[0] != '\0')
+				printf("%s/", kv->kv_key);
+			printf("%s ", batgw_kv_type_names[kv->kv_type]);
+
+			if (kv->kv_v == INT_MIN)
+				printf("-\n");
+			else {
+				plen = batgw_kv_fmt(p, kv->kv_v,
+				    kv->kv_precision);
+				printf("%.*s\n", (int)plen, p);
+			}
+		}
+	}
+}
+
+static void
+batgw_bench_kv(struct batgw *bg, int publish)
+{
+	struct batgw_kv_scope *ks;
+	struct batgw_kv_block *kb;
+	struct batgw_kv *kv;
+	struct timespec t0, t1;
+	uint64_t n = 0;
+	size_t i;
+
+	if (TAILQ_EMPTY(&bg->bg_kv_scopes))
+		return;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t0) == -1)
+		lerr(1, "clock_gettime monotonic");
+	while (n < BATGW_BENCH_KV_CALLS) {
+		TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+			kb = ks->ks_block;
+			for (i = 0; kb != NULL && i < kb->kb_n; i++) {
+				if (publish)
+					batgw_kv_block_publish_one(bg, kb, i);
+				else {
+					batgw_kv_block_update(bg, kb, i,
+					    kb->kb_v[i] ^ 1);
+				}
+				n++;
+			}
+
+			for (i = 0; i < ks->ks_nkvs; i++) {
+				kv = &ks->ks_kvs[i];
+				if (publish)
+					batgw_kv_publish(bg, ks->ks_scope, kv);
+				else {
+					batgw_kv_update(bg, ks->ks_scope, kv,
+					    kv->kv_v ^ 1);
+				}
+				n++;
+			}
+		}
+	}
+	if (clock_gettime(CLOCK_MONOTONIC, &t1) == -1)
+		lerr(1, "clock_gettime monotonic");
+
+	batgw_bench_rate(publish ? "kv publish" : "kv update",
+	    n, batgw_bench_nsec(&t0, &t1));
+}
+
+static void
+batgw_bench_report(struct batgw *bg)
+{
+	struct batgw_replay *rp = bg->bg_replay;
+	struct batgw_can *c;
+	struct timespec t1;
+	char what[64];
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t1) == -1)
+		lerr(1, "clock_gettime monotonic");
+
+	batgw_bench_rate("replay", rp->rp_nframes,
+	    batgw_bench_nsec(&rp->rp_t0, &t1));
+	printf("replay skipped %llu\n", (unsigned long long)rp->rp_skipped);
+
+	TAILQ_FOREACH(c, &bg->bg_cans, c_entry) {
+		snprintf(what, sizeof(what), "%s %s decode",
+		    c->c_scope, c->c_ifname);
+		batgw_bench_rate(what, c->c_rx, c->c_rx_nsec);
+		printf("%s %s sent %llu\n", c->c_scope, c->c_ifname,
+		    (unsigned long long)c->c_tx);
+	}
+
+	batgw_bench_state(bg);
+
+	/* these make a mess of the state, so they go last */
+	batgw_bench_kv(bg, 0);
+	if (batgw_mqtt_running(bg))
+		batgw_bench_kv(bg, 1);
+
+	fflush(stdout);
+}
+
+/*
+ * the kernel stamps frames with the realtime clock, but everything
+ * else runs off the monotonic clock. work out how old the frame is
+ * and take that off the monotonic time.
+ */
+
+static void
+can_rx_time(struct msghdr *msg, const struct timespec *real,
+    const struct timeval *mono, struct timeval *rx, struct timespec *stamp)
+{
+	struct cmsghdr *cmsg;
+	struct timespec ts, age;
+	struct timeval tv;
+
+	*rx = *mono;
+	*stamp = *real;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_TIMESTAMPNS)
+			continue;
+
+		memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+		*stamp = ts;
+		if (!timespeccmp(real, &ts, >))
+			return;
+
+		timespecsub(real, &ts, &age);
+		TIMESPEC_TO_TIMEVAL(&tv, &age);
+		if (timercmp(&tv, mono, <))
+			timersub(mono, &tv, rx);
+		return;
+	}
+}
+
+/*
+ * the kernel only says how many frames the socket has dropped when
+ * there has been at least one.
+ */
+
+static void
+can_rx_dropped(struct msghdr *msg, uint32_t *dropped)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(dropped, CMSG_DATA(cmsg), sizeof(*dropped));
+			return;
+		}
+	}
+}
+
+/*
+ * pull as many frames as we can off the socket in one go and feed
+ * them to the driver. the socket is level triggered, so anything
+ * left over will wake us up again.
+ */
+
+void
+can_recv(struct batgw *bg, int fd, const char *scope,
+    void (*input)(struct batgw *, void *, const struct canfd_frame *),
+    void *arg)
+{
+	struct canfd_frame frames[CAN_RECV_BATCH];
+	struct iovec iovs[CAN_RECV_BATCH];
+	struct mmsghdr msgs[CAN_RECV_BATCH];
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(struct timespec)) +
+		    CMSG_SPACE(sizeof(uint32_t))];
+	} cmsgs[CAN_RECV_BATCH];
+	struct timespec real, stamp, t0, t1;
+	struct timeval mono;
+	struct batgw_can *c;
+	int bench;
+	int i, n;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < CAN_RECV_BATCH; i++) {
+		iovs[i].iov_base = &frames[i];
+		iovs[i].iov_len = sizeof(frames[i]);
+
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = cmsgs[i].buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i].buf);
+	}
+
+	n = recvmmsg(fd, msgs, nitems(msgs), MSG_DONTWAIT, NULL);
+	if (n == -1) {
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			break;
+		default:
+			lwarn("%s can recv", scope);
+			break;
+		}
+		return;
+	}
+
+	/* one pair of clock reads covers the whole batch */
+	if (clock_gettime(CLOCK_REALTIME, &real) == -1)
+		lerr(1, "clock_gettime realtime");
+	batgw_now(&mono);
+	batgw_wakeup(bg, &mono);
+	c = batgw_can_lookup(bg, fd);
+
+	bench = c != NULL && bg->bg_replay != NULL && bg->bg_replay->rp_bench;
+	if (bench && clock_gettime(CLOCK_MONOTONIC, &t0) == -1)
+		lerr(1, "clock_gettime monotonic");
+
+	for (i = 0; i < n; i++) {
+		switch (msgs[i].msg_len) {
+		case CAN_MTU:
+			/* these bytes are padding in a classic frame */
+			frames[i].flags = 0;
+			frames[i].__res0 = frames[i].__res1 = 0;
+			break;
+		case CANFD_MTU:
+			/* older kernels don't mark them */
+			SET(frames[i].flags, CANFD_FDF);
+			break;
+		default:
+			/* this is unexpected */
+			continue;
+		}
+
+		can_rx_time(&msgs[i].msg_hdr, &real, &mono, &bg->bg_can_rx,
+		    &stamp);
+		if (c != NULL) {
+			c->c_rx++;
+			c->c_rx_bytes += frames[i].len;
+			batgw_rec(c, &stamp, &frames[i], 0);
+
+			/* the drivers only want to hear from the bus */
+			if (ISSET(frames[i].can_id, CAN_ERR_FLAG)) {
+				batgw_canif_error(bg, c, &frames[i]);
+				continue;
+			}
+		} else if (ISSET(frames[i].can_id, CAN_ERR_FLAG))
+			continue;
+		input(bg, arg, &frames[i]);
+	}
+
+	/* the count is cumulative, so the newest frame has the latest */
+	if (c != NULL && n > 0)
+		can_rx_dropped(&msgs[n - 1].msg_hdr, &c->c_dropped);
+
+	batgw_limits_commit(bg);
+
+	if (bench) {
+		if (clock_gettime(CLOCK_MONOTONIC, &t1) == -1)
+			lerr(1, "clock_gettime monotonic");
+		c->c_rx_nsec += batgw_bench_nsec(&t0, &t1);
+	}
+}
+
+/*
+ * per interface stats. the sockets see the frames that get past the
+ * filters and the error frames the kernel sends up, but they can't
+ * say how busy the rest of the bus is. once a second the interface
+ * itself is asked for its counters, its bit rates and its state. a
+ * replay has no interface to ask, so it makes do with the sockets.
+ */
+
+#define BATGW_CANIF_FRAME_BITS	55	/* sof to ifs with worst case */
+#define BATGW_CANIF_BYTE_BITS	10	/* stuffing, near enough for fd */
+#define BATGW_CANIF_NERRS	9	/* CAN_ERR_TX_TIMEOUT to RESTARTED */
+#define BATGW_CANIF_RESTART_MIN	1	/* seconds */
+#define BATGW_CANIF_RESTART_MAX	32
+
+static const struct timeval batgw_canif_tv = { 1, 0 };
+
+enum batgw_canif_kv {
+	BATGW_CANIF_KV_RX_FRAMES,
+	BATGW_CANIF_KV_RX_BYTES,
+	BATGW_CANIF_KV_TX_FRAMES,
+	BATGW_CANIF_KV_TX_BYTES,
+	BATGW_CANIF_KV_LOAD,
+	BATGW_CANIF_KV_STATE,
+	BATGW_CANIF_KV_DROPPED,
+	BATGW_CANIF_KV_IF_DROPPED,
+	BATGW_CANIF_KV_TX_TIMEOUT,
+	BATGW_CANIF_KV_LOST_ARB,
+	BATGW_CANIF_KV_CTRL,
+	BATGW_CANIF_KV_PROT,
+	BATGW_CANIF_KV_TRX,
+	BATGW_CANIF_KV_ACK,
+	BATGW_CANIF_KV_BUS_OFF,
+	BATGW_CANIF_KV_BUS_ERROR,
+	BATGW_CANIF_KV_RESTARTED,
+
+	BATGW_CANIF_KV_COUNT
+};
+
+static const struct batgw_kv_tpl batgw_canif_kvs_tpl[BATGW_CANIF_KV_COUNT] = {
+	/* per second */
+	[BATGW_CANIF_KV_RX_FRAMES] =
+		{ "rx-frames",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_RX_BYTES] =
+		{ "rx-bytes",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_TX_FRAMES] =
+		{ "tx-frames",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_TX_BYTES] =
+		{ "tx-bytes",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_LOAD] =
+		{ "bus-load",		KV_T_PERCENT,	1 },
+	[BATGW_CANIF_KV_STATE] =
+		{ "bus-state",		KV_T_RAW,	0 },
+
+	/* since the gateway started */
+	[BATGW_CANIF_KV_DROPPED] =
+		{ "rx-dropped",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_IF_DROPPED] =
+		{ "if-dropped",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_TX_TIMEOUT] =
+		{ "err-tx-timeout",	KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_LOST_ARB] =
+		{ "err-lost-arb",	KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_CTRL] =
+		{ "err-ctrl",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_PROT] =
+		{ "err-prot",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_TRX] =
+		{ "err-trx",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_ACK] =
+		{ "err-ack",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_BUS_OFF] =
+		{ "bus-off",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_BUS_ERROR] =
+		{ "err-bus",		KV_T_COUNT,	0 },
+	[BATGW_CANIF_KV_RESTARTED] =
+		{ "restarts",		KV_T_COUNT,	0 },
+};
+
+/* error classes are bits in the id, in the same order as the kvs */
+#define BATGW_CANIF_KV_ERRS	BATGW_CANIF_KV_TX_TIMEOUT
+
+struct batgw_canif_counts {
+	uint64_t		 cn_rx_frames;
+	uint64_t		 cn_rx_bytes;
+	uint64_t		 cn_tx_frames;
+	uint64_t		 cn_tx_bytes;
+	uint64_t		 cn_dropped;	/* by the interface */
+};
+
+struct batgw_canif_link {
+	struct batgw_canif_counts
+				 ln_counts;
+	unsigned int		 ln_can;	/* the rest is valid */
+	uint32_t		 ln_state;
+	uint32_t		 ln_bitrate;
+	uint32_t		 ln_dbitrate;
+	uint32_t		 ln_restart_ms;
+};
+
+struct batgw_canif {
+	TAILQ_ENTRY(batgw_canif) if_entry;
+	const char		*if_name;
+	char			*if_scope;	/* "can/<name>" */
+	unsigned int		 if_index;
+	unsigned int		 if_canfd;
+	struct batgw_can	*if_can;	/* counts the error frames */
+
+	struct batgw_canif_counts
+				 if_last;
+	struct timeval		 if_last_tv;	/* not set for a new source */
+	unsigned int		 if_link;	/* counts are the kernel's */
+
+	uint32_t		 if_state;	/* CAN_STATE_* */
+	struct timeval		 if_restart;
+	unsigned int		 if_backoff;
+	uint64_t		 if_errs[BATGW_CANIF_NERRS];
+
+	struct batgw_kv		 if_kvs[BATGW_CANIF_KV_COUNT];
+};
+
+static void	batgw_canif_tick(struct batgw *, void *);
+
+/*
+ * rtnetlink. the kernel handles a request before send returns, so
+ * the answer is already waiting by the time we go to read it.
+ */
+
+static int
+can_nl_open(void)
+{
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    NETLINK_ROUTE);
+	if (fd == -1)
+		err(1, "rtnetlink socket");
+
+	return (fd);
+}
+
+static struct rtattr *
+can_nl_attr(struct nlmsghdr *nh, unsigned short type,
+    const void *v, size_t len)
+{
+	struct rtattr *rta;
+
+	rta = (struct rtattr *)((uint8_t *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (len > 0)
+		memcpy(RTA_DATA(rta), v, len);
+	nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+	return (rta);
+}
+
+static void
+can_nl_nest_end(struct nlmsghdr *nh, struct rtattr *rta)
+{
+	rta->rta_len = (uint8_t *)nh + nh->nlmsg_len - (uint8_t *)rta;
+}
+
+static struct nlmsghdr *
+can_nl_talk(int nl, struct nlmsghdr *req, void *buf, size_t len)
+{
+	static uint32_t seq;
+	struct nlmsghdr *nh = buf;
+	struct nlmsgerr *nle;
+	ssize_t rv;
+
+	req->nlmsg_seq = ++seq;
+	if (send(nl, req, req->nlmsg_len, 0) == -1)
+		return (NULL);
+
+	do {
+		rv = recv(nl, buf, len, 0);
+		if (rv == -1)
+			return (NULL);
+		if (!NLMSG_OK(nh, (int)rv)) {
+			errno = EBADMSG;
+			return (NULL);
+		}
+		/* anything else is left over from an earlier request */
+	} while (nh->nlmsg_seq != seq);
+
+	if (nh->nlmsg_type == NLMSG_ERROR) {
+		nle = NLMSG_DATA(nh);
+		if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*nle))) {
+			errno = EBADMSG;
+			return (NULL);
+		}
+		if (nle->error != 0) {
+			errno = -nle->error;
+			return (NULL);
+		}
+	}
+
+	return (nh);
+}
+
+static void
+can_link_data(struct rtattr *data, struct batgw_canif_link *ln)
+{
+	struct can_bittiming bt;
+	struct rtattr *rta;
+	int len = RTA_PAYLOAD(data);
+
+	for (rta = RTA_DATA(data); RTA_OK(rta, len);
+	    rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_CAN_STATE:
+			if (RTA_PAYLOAD(rta) >= sizeof(ln->ln_state)) {
+				memcpy(&ln->ln_state, RTA_DATA(rta),
+				    sizeof(ln->ln_state));
+			}
+			break;
+		case IFLA_CAN_RESTART_MS:
+			if (RTA_PAYLOAD(rta) >= sizeof(ln->ln_restart_ms)) {
+				memcpy(&ln->ln_restart_ms, RTA_DATA(rta),
+				    sizeof(ln->ln_restart_ms));
+			}
+			break;
+		case IFLA_CAN_BITTIMING:
+			if (RTA_PAYLOAD(rta) >= sizeof(bt)) {
+				memcpy(&bt, RTA_DATA(rta), sizeof(bt));
+				ln->ln_bitrate = bt.bitrate;
+			}
+			break;
+		case IFLA_CAN_DATA_BITTIMING:
+			if (RTA_PAYLOAD(rta) >= sizeof(bt)) {
+				memcpy(&bt, RTA_DATA(rta), sizeof(bt));
+				ln->ln_dbitrate = bt.bitrate;
+			}
+			break;
+		}
+	}
+}
+
+static void
+can_link_info(struct rtattr *info, struct batgw_canif_link *ln)
+{
+	struct rtattr *rta, *kind = NULL, *data = NULL;
+	int len = RTA_PAYLOAD(info);
+
+	for (rta = RTA_DATA(info); RTA_OK(rta, len);
+	    rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_INFO_KIND:
+			kind = rta;
+			break;
+		case IFLA_INFO_DATA:
+			data = rta;
+			break;
+		}
+	}
+
+	/* vcan and friends don't have any of this */
+	if (kind == NULL || data == NULL ||
+	    strncmp(RTA_DATA(kind), "can", RTA_PAYLOAD(kind)) != 0)
+		return;
+
+	ln->ln_can = 1;
+	can_link_data(data, ln);
+}
+
+static int
+can_link_get(int nl, unsigned int ifindex, struct batgw_canif_link *ln)
+{
+	static uint8_t buf[16384];
+	struct {
+		struct nlmsghdr		nh;
+		struct ifinfomsg	ifi;
+	} req;
+	struct rtnl_link_stats64 st;
+	struct nlmsghdr *nh;
+	struct rtattr *rta;
+	int len;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = ifindex;
+
+	nh = can_nl_talk(nl, &req.nh, buf, sizeof(buf));
+	if (nh == NULL)
+		return (-1);
+	if (nh->nlmsg_type != RTM_NEWLINK) {
+		errno = EBADMSG;
+		return (-1);
+	}
+
+	memset(ln, 0, sizeof(*ln));
+	len = IFLA_PAYLOAD(nh);
+	for (rta = IFLA_RTA(NLMSG_DATA(nh)); RTA_OK(rta, len);
+	    rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_STATS64:
+			if (RTA_PAYLOAD(rta) < sizeof(st))
+				break;
+			memcpy(&st, RTA_DATA(rta), sizeof(st));
+			ln->ln_counts.cn_rx_frames = st.rx_packets;
+			ln->ln_counts.cn_rx_bytes = st.rx_bytes;
+			ln->ln_counts.cn_tx_frames = st.tx_packets;
+			ln->ln_counts.cn_tx_bytes = st.tx_bytes;
+			ln->ln_counts.cn_dropped = st.rx_dropped +
+			    st.rx_over_errors + st.rx_fifo_errors;
+			break;
+		case IFLA_LINKINFO:
+			can_link_info(rta, ln);
+			break;
+		}
+	}
+
+	return (0);
+}
+
+/* only does anything if the interface is bus off and restart-ms is 0 */
+static int
+can_link_restart(int nl, unsigned int ifindex)
+{
+	static uint8_t buf[1024];
+	struct {
+		struct nlmsghdr		nh;
+		struct ifinfomsg	ifi;
+		uint8_t			attrs[64];
+	} req;
+	struct rtattr *info, *data;
+	uint32_t one = 1;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type = RTM_NEWLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = ifindex;
+
+	info = can_nl_attr(&req.nh, IFLA_LINKINFO, NULL, 0);
+	can_nl_attr(&req.nh, IFLA_INFO_KIND, "can", 3);
+	data = can_nl_attr(&req.nh, IFLA_INFO_DATA, NULL, 0);
+	can_nl_attr(&req.nh, IFLA_CAN_RESTART, &one, sizeof(one));
+	can_nl_nest_end(&req.nh, data);
+	can_nl_nest_end(&req.nh, info);
+
+	if (can_nl_talk(nl, &req.nh, buf, sizeof(buf)) == NULL)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * sockets on the same interface share its stats. the first one to
+ * open it counts the error frames, the others get copies of them.
+ */
+
+static struct batgw_canif *
+batgw_canif_get(struct batgw *bg, struct batgw_can *c)
+{
+	struct batgw_canif *ifp;
+	size_t i;
+
+	TAILQ_FOREACH(ifp, &bg->bg_canifs, if_entry) {
+		if (strcmp(ifp->if_name, c->c_ifname) == 0) {
+			ifp->if_canfd |= c->c_canfd;
+			return (ifp);
+		}
+	}
+
+	ifp = calloc(1, sizeof(*ifp));
+	if (ifp == NULL)
+		err(1, "%s %s stats alloc", c->c_scope, c->c_ifname);
+
+	ifp->if_name = c->c_ifname;
+	ifp->if_canfd = c->c_canfd;
+	ifp->if_can = c;
+	ifp->if_state = CAN_STATE_ERROR_ACTIVE;
+	if (asprintf(&ifp->if_scope, "can/%s", c->c_ifname) == -1)
+		errx(1, "%s %s stats scope printf error",
+		    c->c_scope, c->c_ifname);
+
+	if (bg->bg_replay == NULL) {
+		ifp->if_index = if_nametoindex(c->c_ifname);
+		if (ifp->if_index == 0)
+			err(1, "%s %s index", c->c_scope, c->c_ifname);
+		if (bg->bg_nl == -1)
+			bg->bg_nl = can_nl_open();
+	}
+
+	for (i = 0; i < nitems(ifp->if_kvs); i++)
+		batgw_kv_init_tpl(&ifp->if_kvs[i], &batgw_canif_kvs_tpl[i]);
+	batgw_kv_attach(bg, ifp->if_scope, ifp->if_kvs, nitems(ifp->if_kvs));
+
+	TAILQ_INSERT_TAIL(&bg->bg_canifs, ifp, if_entry);
+
+	if (bg->bg_canif_task == NULL) {
+		bg->bg_canif_task = batgw_task_add(bg, "can stats",
+		    &batgw_canif_tv, NULL, batgw_canif_tick, NULL);
+		batgw_task_start(bg->bg_canif_task);
+	}
+
+	return (ifp);
+}
+
+static void
+batgw_canif_state(struct batgw *bg, struct batgw_canif *ifp, uint32_t state)
+{
+	if (state == ifp->if_state)
+		return;
+
+	if (state == CAN_STATE_BUS_OFF) {
+		lwarnx("%s: bus off", ifp->if_name);
+
+		/* give the kernel a chance to restart it on its own */
+		ifp->if_backoff = BATGW_CANIF_RESTART_MIN;
+		ifp->if_restart = bg->bg_now;
+		ifp->if_restart.tv_sec += ifp->if_backoff;
+	} else if (ifp->if_state == CAN_STATE_BUS_OFF)
+		linfo("%s: bus is back", ifp->if_name);
+
+	ifp->if_state = state;
+}
+
+static void
+batgw_canif_error(struct batgw *bg, struct batgw_can *c,
+    const struct canfd_frame *frame)
+{
+	struct batgw_canif *ifp = c->c_if;
+	canid_t class = frame->can_id & CAN_ERR_MASK;
+	uint32_t state;
+	uint8_t crtl;
+	unsigned int i;
+
+	if (ifp->if_can != c)
+		return;
+
+	for (i = 0; i < nitems(ifp->if_errs); i++) {
+		if (ISSET(class, 1U << i))
+			ifp->if_errs[i]++;
+	}
+
+	if (ISSET(class, CAN_ERR_BUSOFF))
+		state = CAN_STATE_BUS_OFF;
+	else if (ISSET(class, CAN_ERR_RESTARTED))
+		state = CAN_STATE_ERROR_ACTIVE;
+	else if (ISSET(class, CAN_ERR_CRTL) && frame->len > 1) {
+		crtl = frame->data[1];
+		if (ISSET(crtl,
+		    CAN_ERR_CRTL_RX_PASSIVE|CAN_ERR_CRTL_TX_PASSIVE))
+			state = CAN_STATE_ERROR_PASSIVE;
+		else if (ISSET(crtl,
+		    CAN_ERR_CRTL_RX_WARNING|CAN_ERR_CRTL_TX_WARNING))
+			state = CAN_STATE_ERROR_WARNING;
+		else if (ISSET(crtl, CAN_ERR_CRTL_ACTIVE))
+			state = CAN_STATE_ERROR_ACTIVE;
+		else
+			return;
+	} else
+		return;
+
+	batgw_canif_state(bg, ifp, state);
+}
+
+static inline int
+batgw_canif_count(uint64_t n)
+{
+	return (n > INT_MAX ? INT_MAX : n);
+}
+
+static inline uint64_t
+batgw_canif_delta(uint64_t n, uint64_t on)
+{
+	/* the interface could have been put back together */
+	return (n < on ? n : n - on);
+}
+
+/*
+ * how long the frames would have kept the bus busy. the counters
+ * don't say which frames were fd, so if the interface switches bit
+ * rates all the data is assumed to go at the faster one.
+ */
+
+static uint64_t
+batgw_canif_busy_nsec(const struct batgw_canif *ifp,
+    const struct batgw_canif_link *ln, uint64_t frames, uint64_t bytes)
+{
+	uint64_t dbitrate = ln->ln_bitrate;
+
+	if (ISSET(ifp->if_canfd, BATGW_CAN_FD_BRS) && ln->ln_dbitrate != 0)
+		dbitrate = ln->ln_dbitrate;
+
+	return (frames * BATGW_CANIF_FRAME_BITS * 1000000000ULL /
+	    ln->ln_bitrate +
+	    bytes * BATGW_CANIF_BYTE_BITS * 1000000000ULL / dbitrate);
+}
+
+static void
+batgw_canif_update(struct batgw *bg, struct batgw_canif *ifp)
+{
+	struct batgw_kv *kvs = ifp->if_kvs;
+	const char *scope = ifp->if_scope;
+	struct batgw_canif_link ln;
+	struct batgw_canif_counts *cn = &ln.ln_counts;
+	struct batgw_can *c;
+	struct timeval tv;
+	uint64_t rx_frames, rx_bytes, tx_frames, tx_bytes;
+	uint64_t usec, busy, dropped = 0;
+	unsigned int link = 0;
+	unsigned int i;
+
+	TAILQ_FOREACH(c, &bg->bg_cans, c_entry) {
+		if (c->c_if == ifp)
+			dropped += c->c_dropped;
+	}
+
+	if (bg->bg_nl != -1) {
+		if (can_link_get(bg->bg_nl, ifp->if_index, &ln) == 0)
+			link = 1;
+		else if (ifp->if_link)
+			lwarn("%s link stats", ifp->if_name);
+	}
+	if (!link) {
+		memset(&ln, 0, sizeof(ln));
+		TAILQ_FOREACH(c, &bg->bg_cans, c_entry) {
+			if (c->c_if != ifp)
+				continue;
+			cn->cn_rx_frames += c->c_rx;
+			cn->cn_rx_bytes += c->c_rx_bytes;
+			cn->cn_tx_frames += c->c_tx_frames;
+			cn->cn_tx_bytes += c->c_tx_bytes;
+		}
+	}
+
+	/* counts from somewhere else can't be compared with the last ones */
+	if (link != ifp->if_link) {
+		ifp->if_link = link;
+		timerclear(&ifp->if_last_tv);
+	}
+
+	if (timerisset(&ifp->if_last_tv)) {
+		timersub(&bg->bg_now, &ifp->if_last_tv, &tv);
+		usec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	} else
+		usec = 0;
+
+	if (usec > 0) {
+		rx_frames = batgw_canif_delta(cn->cn_rx_frames,
+		    ifp->if_last.cn_rx_frames);
+		rx_bytes = batgw_canif_delta(cn->cn_rx_bytes,
+		    ifp->if_last.cn_rx_bytes);
+		tx_frames = batgw_canif_delta(cn->cn_tx_frames,
+		    ifp->if_last.cn_tx_frames);
+		tx_bytes = batgw_canif_delta(cn->cn_tx_bytes,
+		    ifp->if_last.cn_tx_bytes);
+
+		batgw_kv_update(bg, scope, &kvs[BATGW_CANIF_KV_RX_FRAMES],
+		    batgw_canif_count(rx_frames * 1000000 / usec));
+		batgw_kv_update(bg, scope, &kvs[BATGW_CANIF_KV_RX_BYTES],
+		    batgw_canif_count(rx_bytes * 1000000 / usec));
+		batgw_kv_update(bg, scope, &kvs[BATGW_CANIF_KV_TX_FRAMES],
+		    batgw_canif_count(tx_frames * 1000000 / usec));
+		batgw_kv_update(bg, scope, &kvs[BATGW_CANIF_KV_TX_BYTES],
+		    batgw_canif_count(tx_bytes * 1000000 / usec));
+
+		/* nsec busy per usec is permille, ie, percent to one place */
+		if (ln.ln_bitrate != 0) {
+			busy = batgw_canif_busy_nsec(ifp, &ln,
+			    rx_frames + tx_frames, rx_bytes + tx_bytes);
+			batgw_kv_update(bg, scope, &kvs[BATGW_CANIF_KV_LOAD],
+			    batgw_canif_count(busy / usec));
+		}
+	}
+	ifp->if_last = *cn;
+	ifp->if_last_tv = bg->bg_now;
+
+	batgw_kv_update(bg, scope, &kvs[BATGW_CANIF_KV_DROPPED],
+	    batgw_canif_count(dropped));
+	if (link) {
+		batgw_kv_update(bg, scope, &kvs[BATGW_CANIF_KV_IF_DROPPED],
+		    batgw_canif_count(cn->cn_dropped));
+	}
+	for (i = 0; i < nitems(ifp->if_errs); i++) {
+		batgw_kv_update(bg, scope, &kvs[BATGW_CANIF_KV_ERRS + i],
+		    batgw_canif_count(ifp->if_errs[i]));
+	}
+
+	/* the kernel knows better than the error frames */
+	if (ln.ln_can)
+		batgw_canif_state(bg, ifp, ln.ln_state);
+	batgw_kv_update(bg, scope, &kvs[BATGW_CANIF_KV_STATE], ifp->if_state);
+
+	/* if the kernel isn't going to restart it, we have to */
+	if (ifp->if_state != CAN_STATE_BUS_OFF || !ln.ln_can ||
+	    ln.ln_restart_ms != 0 || timercmp(&bg->bg_now, &ifp->if_restart, <))
+		return;
+
+	if (can_link_restart(bg->bg_nl, ifp->if_index) == -1)
+		lwarn("%s restart", ifp->if_name);
+	else
+		linfo("%s: restarted after bus off", ifp->if_name);
+
+	if (ifp->if_backoff < BATGW_CANIF_RESTART_MAX)
+		ifp->if_backoff *= 2;
+	ifp->if_restart = bg->bg_now;
+	ifp->if_restart.tv_sec += ifp->if_backoff;
+}
+
+static void
+batgw_canif_tick(struct batgw *bg, void *arg)
+{
+	struct batgw_canif *ifp;
+
+	TAILQ_FOREACH(ifp, &bg->bg_canifs, if_entry)
+		batgw_canif_update(bg, ifp);
+}
+
+/*
+ * cyclic transmit
+ */
+
+struct can_cyclic {
+	struct batgw		*cc_bg;
+	const char		*cc_scope;
+	int			 cc_fd;
+	int			 cc_bcm;
+	struct timeval		 cc_ival;
+
+	struct batgw_task	*cc_task;	/* !cc_bcm */
+	unsigned int		 cc_idx;
+
+	size_t			 cc_nframes;
+	struct canfd_frame	 cc_frames[CAN_CYCLIC_MAX];
+	unsigned int		 cc_canfd;	/* some frames are fd */
+	unsigned int		 cc_brs;
+};
+
+static void	can_cyclic_tick(struct batgw *, void *);
+
+static int
+can_bcm_open(const char *scope, const char *name)
+{
+	struct sockaddr_can can;
+	int fd;
+
+	memset(&can, 0, sizeof(can));
+	can.can_family = AF_CAN;
+	can.can_ifindex = if_nametoindex(name);
+	if (can.can_ifindex == 0)
+		err(1, "%s %s index", scope, name);
+
+	fd = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    CAN_BCM);
+	if (fd == -1)
+		err(1, "%s %s bcm socket", scope, name);
+
+	if (connect(fd, (struct sockaddr *)&can, sizeof(can)) == -1)
+		err(1, "%s %s bcm connect", scope, name);
+
+	return (fd);
+}
+
+static int
+can_cyclic_bcm(struct can_cyclic *cc, uint32_t flags)
+{
+	struct {
+		struct bcm_msg_head	head;
+		union {
+			struct can_frame	can[CAN_CYCLIC_MAX];
+			struct canfd_frame	canfd[CAN_CYCLIC_MAX];
+		}			frames;
+	} msg;
+	size_t i, len;
+	ssize_t rv;
+
+	memset(&msg.head, 0, sizeof(msg.head));
+	msg.head.opcode = TX_SETUP;
+	msg.head.flags = flags;
+	msg.head.can_id = cc->cc_frames[0].can_id;
+	msg.head.ival2.tv_sec = cc->cc_ival.tv_sec;
+	msg.head.ival2.tv_usec = cc->cc_ival.tv_usec;
+	msg.head.nframes = cc->cc_nframes;
+
+	/* the bcm wants every frame in the sequence the same size */
+	len = sizeof(msg.head);
+	if (cc->cc_canfd) {
+		SET(msg.head.flags, CAN_FD_FRAME);
+		memcpy(msg.frames.canfd, cc->cc_frames,
+		    cc->cc_nframes * sizeof(*cc->cc_frames));
+		for (i = 0; cc->cc_brs && i < cc->cc_nframes; i++)
+			SET(msg.frames.canfd[i].flags, CANFD_FDF|CANFD_BRS);
+		len += cc->cc_nframes * sizeof(*msg.frames.canfd);
+	} else {
+		for (i = 0; i < cc->cc_nframes; i++) {
+			memcpy(&msg.frames.can[i], &cc->cc_frames[i],
+			    sizeof(msg.frames.can[i]));
+		}
+		len += cc->cc_nframes * sizeof(*msg.frames.can);
+	}
+
+	rv = write(cc->cc_fd, &msg, len);
+	if (rv == -1)
+		return (-1);
+
+	return (0);
+}
+
+static void
+can_cyclic_set(struct can_cyclic *cc, const struct canfd_frame *frames,
+    size_t nframes)
+{
+	size_t i;
+
+	if (nframes == 0 || nframes > nitems(cc->cc_frames))
+		errx(1, "%s cyclic 0x%03x: %zu frames", cc->cc_scope,
+		    frames[0].can_id, nframes);
+
+	memcpy(cc->cc_frames, frames, nframes * sizeof(*frames));
+	cc->cc_nframes = nframes;
+
+	cc->cc_canfd = 0;
+	for (i = 0; i < nframes; i++) {
+		if (CAN_ISFD(&frames[i]))
+			cc->cc_canfd = 1;
+	}
+}
+
+struct can_cyclic *
+batgw_b_can_cyclic(struct batgw_b *b, const char *scope, int fd,
+    const struct timeval *ival, const struct canfd_frame *frames,
+    size_t nframes)
+{
+	struct batgw *bg = b->b_bg;
+	const struct batgw_config_battery *bconf = b->b_conf;
+	struct can_cyclic *cc;
+
+	cc = calloc(1, sizeof(*cc));
+	if (cc == NULL)
+		err(1, "%s cyclic alloc", scope);
+
+	cc->cc_bg = bg;
+	cc->cc_scope = scope;
+	cc->cc_ival = *ival;
+	cc->cc_brs = ISSET(bconf->canfd, BATGW_CAN_FD_BRS);
+	can_cyclic_set(cc, frames, nframes);
+
+	/* a replay has no interface for the bcm to send on */
+	if (bconf->bcm && bg->bg_replay == NULL) {
+		cc->cc_bcm = 1;
+		cc->cc_fd = can_bcm_open(scope, bconf->ifname);
+	} else {
+		cc->cc_fd = fd;
+		cc->cc_task = batgw_task_add(bg, scope, ival, NULL,
+		    can_cyclic_tick, cc);
+	}
+
+	return (cc);
+}
+
+void
+can_cyclic_start(struct can_cyclic *cc)
+{
+	if (cc->cc_bcm) {
+		if (can_cyclic_bcm(cc, SETTIMER|STARTTIMER|TX_ANNOUNCE) == -1) {
+			err(1, "%s cyclic 0x%03x bcm setup", cc->cc_scope,
+			    cc->cc_frames[0].can_id);
+		}
+		return;
+	}
+
+	cc->cc_idx = 0;
+	batgw_task_start(cc->cc_task);
+}
+
+/*
+ * replace the payloads in place. the sequence keeps its position
+ * and timing, it just picks up the new data on the next interval.
+ */
+
+void
+can_cyclic_update(struct can_cyclic *cc, const struct canfd_frame *frames,
+    size_t nframes)
+{
+	can_cyclic_set(cc, frames, nframes);
+
+	if (cc->cc_bcm) {
+		if (can_cyclic_bcm(cc, 0) == -1) {
+			lwarn("%s cyclic 0x%03x bcm update", cc->cc_scope,
+			    cc->cc_frames[0].can_id);
+		}
+		return;
+	}
+
+	if (cc->cc_idx >= cc->cc_nframes)
+		cc->cc_idx = 0;
+}
+
+static void
+can_cyclic_tick(struct batgw *bg, void *arg)
+{
+	struct can_cyclic *cc = arg;
+	const struct canfd_frame *frame;
+	unsigned int idx;
+	ssize_t rv;
+
+	idx = cc->cc_idx;
+	frame = &cc->cc_frames[idx];
+	if (++idx >= cc->cc_nframes)
+		idx = 0;
+	cc->cc_idx = idx;
+
+	rv = can_send(cc->cc_bg, cc->cc_fd, frame);
+	if (rv == -1)
+		lwarn("%s cyclic 0x%03x send", cc->cc_scope, frame->can_id);
+}
+
+/*
+ * decoder tables
+ */
+
+static inline unsigned int
+can_decode_hash(canid_t id)
+{
+	return (((uint32_t)id * 2654435761U) >> 16) & (CAN_DECODE_SLOTS - 1);
+}
+
+void
+can_decoder_init(const char *scope, const struct can_decoder *cdr)
+{
+	struct can_decode_index *ci = cdr->cdr_index;
+	const struct can_decode *cd;
+	canid_t id = 0;
+	size_t i, nids = 0;
+	unsigned int h;
+
+	if (ci == NULL)
+		errx(1, "%s decoder: no index", scope);
+	if (cdr->cdr_ntable >= UINT8_MAX)
+		errx(1, "%s decoder: too many entries", scope);
+
+	memset(ci, 0, sizeof(*ci));
+
+	for (i = 0; i < cdr->cdr_ntable; i++) {
+		cd = &cdr->cdr_table[i];
+
+		if (cd->cd_id < id) {
+			errx(1, "%s decoder: 0x%03x is out of order",
+			    scope, cd->cd_id);
+		}
+
+		if (cd->cd_bits > 32 || cd->cd_off + howmany(cd->cd_bits, 8) >
+		    CANFD_MAX_DLEN) {
+			errx(1, "%s decoder: 0x%03x value is too big",
+			    scope, cd->cd_id);
+		}
+		if (cd->cd_bits > 0 && cd->cd_kv >= cdr->cdr_nkvs) {
+			errx(1, "%s decoder: 0x%03x kv %u is out of range",
+			    scope, cd->cd_id, cd->cd_kv);
+		}
+
+		if (i > 0 && cd->cd_id == id)
+			continue;
+		id = cd->cd_id;
+
+		/* keep the load at half so probes stay short */
+		if (++nids > CAN_DECODE_SLOTS / 2)
+			errx(1, "%s decoder: too many ids", scope);
+
+		h = can_decode_hash(id);
+		while (ci->ci_slots[h] != 0)
+			h = (h + 1) & (CAN_DECODE_SLOTS - 1);
+		ci->ci_slots[h] = i + 1;
+	}
+}
+
+/*
+ * the kernel filter is built from the ids in the decoder table,
+ * plus whatever else the driver wants to see.
+ */
+static struct can_filter *
+can_decoder_filters(const char *scope, const struct can_decoder *cdr,
+    const struct can_filter *extra, size_t nextra, size_t *nfiltersp)
+{
+	struct can_filter *filters;
+	size_t nfilters = 0;
+	size_t i;
+	canid_t id;
+
+	if (cdr != NULL)
+		can_decoder_init(scope, cdr);
+
+	filters = calloc(nextra + (cdr == NULL ? 0 : cdr->cdr_ntable),
+	    sizeof(*filters));
+	if (filters == NULL)
+		err(1, "%s can filters", scope);
+
+	for (i = 0; i < nextra; i++)
+		filters[nfilters++] = extra[i];
+
+	if (cdr != NULL) {
+		for (i = 0; i < cdr->cdr_ntable; i++) {
+			id = cdr->cdr_table[i].cd_id;
+			if (i > 0 && cdr->cdr_table[i - 1].cd_id == id)
+				continue;
+
+			filters[nfilters].can_id = id;
+			filters[nfilters].can_mask =
+			    CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
+			nfilters++;
+		}
+	}
+
+	*nfiltersp = nfilters;
+	return (filters);
 }
 
-static void
-batgw_mqtt_to_reconnect(int nil, short events, void *arg)
+static uint32_t
+can_decode_raw(const struct canfd_frame *frame, size_t o, unsigned int bits,
+    unsigned int le)
 {
-	struct batgw *bg = arg;
+	const uint8_t *data = frame->data + o;
+	unsigned int bytes = howmany(bits, 8);
+	uint32_t raw = 0;
+	unsigned int i;
+
+	for (i = 0; i < bytes; i++) {
+		if (le)
+			raw |= (uint32_t)data[i] << (i * 8);
+		else
+			raw = (raw << 8) | data[i];
+	}
 
-	ldebug("%s", __func__);
-	batgw_mqtt_start(bg);
+	if (bits < 32)
+		raw &= (1U << bits) - 1;
+
+	return (raw);
 }
 
-static void
-batgw_mqtt_init(struct batgw *bg)
+static int
+can_decode_mux(const struct can_decode *cd, const struct canfd_frame *frame)
 {
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm;
-	char *topic;
-	int rv;
+	unsigned int mux;
 
-	bgm = calloc(1, sizeof(*bgm));
-	if (bgm == NULL)
-		err(1, "mqtt state alloc");
+	if (ISSET(cd->cd_flags, CAN_D_MUX16))
+		mux = can_betoh16(frame, cd->cd_mux_off);
+	else if (ISSET(cd->cd_flags, CAN_D_MUX))
+		mux = frame->data[cd->cd_mux_off];
+	else
+		return (1);
 
-	bgm->ev_to_reconnect = evtimer_new(bg->bg_evbase,
-	    batgw_mqtt_to_reconnect, bg);
-	if (bgm->ev_to_reconnect == NULL)
-		errx(1, "mqtt ev_to_connect evtimer_new failed");
+	if (cd->cd_mux_mask != 0)
+		mux &= cd->cd_mux_mask;
 
-	bgm->ev_to_teleperiod = evtimer_new(bg->bg_evbase,
-	    batgw_mqtt_teleperiod, bg);
-	if (bgm->ev_to_teleperiod == NULL)
-		errx(1, "mqtt ev_to_teleperiod evtimer_new failed");
+	return (mux == cd->cd_mux);
+}
 
-	rv = asprintf(&topic, "%s/%s", mqttconf->topic, BATGW_MQTT_LWT);
-	if (rv == -1)
-		errx(1, "mqtt lwt topic printf error");
-	bgm->will_topic = topic;
-	bgm->will_topic_len = rv;
+unsigned int
+can_decode(struct batgw *bg, struct batgw_b *b, const struct can_decoder *cdr,
+    struct batgw_kv *kvs, const struct canfd_frame *frame)
+{
+	const struct can_decode *table = cdr->cdr_table;
+	const struct can_decode *cd;
+	const char *scope = b != NULL ? b->b_scope : cdr->cdr_scope;
+	const uint8_t *slots = cdr->cdr_index->ci_slots;
+	canid_t id = frame->can_id;
+	unsigned int h = can_decode_hash(id);
+	unsigned int flags = 0;
+	size_t i;
+	uint32_t raw;
+	int v;
 
-	rv = asprintf(&topic, "%s/%s/#", mqttconf->topic, BATGW_MQTT_CMND);
-	if (rv == -1)
-		errx(1, "mqtt cmnd topic printf error");
-	bgm->cmnd_topic = topic;
-	bgm->cmnd_topic_len = rv;
+	for (;;) {
+		i = slots[h];
+		if (i == 0)
+			return (0);
+		if (table[--i].cd_id == id)
+			break;
+		h = (h + 1) & (CAN_DECODE_SLOTS - 1);
+	}
 
-	rv = asprintf(&topic, "%s/%s", mqttconf->topic, BATGW_MQTT_STATUS);
-	if (rv == -1)
-		errx(1, "mqtt status topic printf error");
-	bgm->status_topic = topic;
-	bgm->status_topic_len = rv;
+	for (; i < cdr->cdr_ntable; i++) {
+		cd = &table[i];
+		if (cd->cd_id != id)
+			break;
+		if (!can_decode_mux(cd, frame))
+			continue;
 
-	bgm->evdnsbase = evdns_base_new(bg->bg_evbase,
-	    EVDNS_BASE_INITIALIZE_NAMESERVERS);
-	if (bgm->evdnsbase == NULL)
-		errx(1, "mqtt evdns_base_new failed");
+		flags |= cd->cd_flags;
+		if (cd->cd_bits == 0)
+			continue;
 
-	bgm->hints.ai_family = mqttconf->af;
-	bgm->hints.ai_socktype = SOCK_STREAM;
-	bgm->hints.ai_protocol = IPPROTO_TCP;
+		raw = can_decode_raw(frame, cd->cd_off, cd->cd_bits,
+		    ISSET(cd->cd_flags, CAN_D_LE));
+		if (ISSET(cd->cd_flags, CAN_D_SIGNED) && cd->cd_bits < 32 &&
+		    ISSET(raw, 1U << (cd->cd_bits - 1)))
+			raw |= ~((1U << cd->cd_bits) - 1);
 
-	bg->bg_mqtt = bgm;
+		v = (int)raw + cd->cd_add;
+		if (cd->cd_mul != 0)
+			v *= cd->cd_mul;
+		if (cd->cd_div != 0)
+			v /= cd->cd_div;
 
-	batgw_mqtt_start(bg);
+		batgw_kv_update(bg, scope, &kvs[cd->cd_kv], v);
+
+		if (b != NULL && cd->cd_field != BATGW_B_F_NONE) {
+			if (cd->cd_field_mul != 0)
+				v *= cd->cd_field_mul;
+			batgw_b_set(b, cd->cd_field, v);
+		}
+	}
+
+	return (flags);
 }
 
-static int
-batgw_mqtt_running(struct batgw *bg)
+uint16_t
+can_betoh16(const struct canfd_frame *frame, size_t o)
 {
-	const struct batgw_config_mqtt *mqttconf;
-	struct batgw_mqtt *bgm;
-
-	mqttconf = bg->bg_conf->mqtt;
-	if (mqttconf == NULL)
-		return (0);
+	uint16_t h16;
 
-	bgm = bg->bg_mqtt;
-	if (bgm == NULL)
-		return (0);
+	h16 = (uint16_t)frame->data[o + 0] << 8;
+	h16 |= (uint16_t)frame->data[o + 1] << 0;
 
-	return (bgm->running);
+	return (h16);
 }
 
-static void
-batgw_mqtt_publish(struct batgw *bg,
-    const char *t, size_t tlen, const char *p, size_t plen)
+uint32_t
+can_betoh32(const struct canfd_frame *frame, size_t o)
 {
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	uint32_t h32;
 
-	if (mqtt_publish(bgm->conn, t, tlen, p, plen, MQTT_QOS0, 0) == -1)
-		batgw_mqtt_disconnect(bg);
+	h32 = (uint16_t)frame->data[o + 0] << 24;
+	h32 |= (uint16_t)frame->data[o + 1] << 16;
+	h32 |= (uint16_t)frame->data[o + 2] << 8;
+	h32 |= (uint16_t)frame->data[o + 3] << 0;
+
+	return (h32);
 }
 
 void
-batgw_publish(struct batgw *bg,
-    const char *t, size_t tlen, const char *p, size_t plen)
+can_htobe16(struct canfd_frame *frame, size_t o, uint16_t h16)
 {
-	if (!batgw_mqtt_running(bg))
-		return;
-
-	batgw_mqtt_publish(bg, t, tlen, p, plen);
+	frame->data[o + 0] = h16 >> 8;
+	frame->data[o + 1] = h16 >> 0;
 }
 
-static void
-batgw_mqtt_status(struct batgw *bg)
+uint16_t
+can_letoh16(const struct canfd_frame *frame, size_t o)
 {
-	const struct batgw_config_battery *bconf = batgw_b_config(bg);
-	static char payload[1024]; /* how long is a string? */
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
-	size_t payload_len;
-	int rv;
+	uint16_t h16;
 
-	rv = snprintf(payload, sizeof(payload),
-	    "{"
-		"\"charge\":\"%s\",\"discharge\":\"%s\","
-		"\"max-charge\":%u,\"max-discharge\":%u"
-	    "}",
-	    bg->bg_charge_off ? "OFF" : "ON",
-	    bg->bg_discharge_off ? "OFF" : "ON",
-	    bg->bg_max_charge_w,
-	    bg->bg_max_discharge_w);
-	if (rv == -1)
-		return;
-	payload_len = rv;
+	h16 = (uint16_t)frame->data[o + 0] << 0;
+	h16 |= (uint16_t)frame->data[o + 1] << 8;
 
-	batgw_mqtt_publish(bg,
-	    bgm->status_topic, bgm->status_topic_len,
-	    payload, payload_len);
+	return (h16);
 }
 
-static void
-batgw_mqtt_teleperiod(int nil, short events, void *arg)
+void
+can_htole16(struct canfd_frame *frame, size_t o, uint16_t h16)
 {
-	struct batgw *bg = arg;
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	frame->data[o + 0] = h16 >> 0;
+	frame->data[o + 1] = h16 >> 8;
+}
 
-	batgw_evtimer_add(bgm->ev_to_teleperiod, mqttconf->teleperiod);
+void
+can_htobe64(struct canfd_frame *frame, uint64_t h64)
+{
+	frame->data[0] = h64 >> 56;
+	frame->data[1] = h64 >> 48;
+	frame->data[2] = h64 >> 40;
+	frame->data[3] = h64 >> 32;
+	frame->data[4] = h64 >> 24;
+	frame->data[5] = h64 >> 16;
+	frame->data[6] = h64 >>  8;
+	frame->data[7] = h64 >>  0;
+}
 
-	batgw_mqtt_status(bg);
-	bg->bg_battery->b_teleperiod(bg, bg->bg_battery_sc);
-	bg->bg_inverter->i_teleperiod(bg, bg->bg_inverter_sc);
+struct event_base *
+batgw_event_base(struct batgw *bg)
+{
+	return (bg->bg_evbase);
 }
 
-static const char *const batgw_kv_type_names[KV_T_MAXTYPE] = {
-	[KV_T_TEMP] =			"temperature",
-	[KV_T_VOLTAGE] =		"voltage",
-	[KV_T_CURRENT] =		"current",
-	[KV_T_POWER] =			"power",
-	[KV_T_AMPHOUR] =		"amphour",
-	[KV_T_WATTHOUR] =		"watthour",
-	[KV_T_ENERGY] =			"energy",
-	[KV_T_PERCENT] =		"percent",
-	[KV_T_COUNT] =			"count",
-	[KV_T_RAW] =			"raw",
-};
+unsigned int
+batgw_verbose(const struct batgw *bg)
+{
+	return (bg->bg_verbose);
+}
 
-void
-batgw_kv_init(struct batgw_kv *kv, const char *key, enum batgw_kv_type type,
-    unsigned int precision)
+/*
+ * let the recorder see the whole bus when we're this verbose.
+ */
+static int
+batgw_sniff(const struct batgw *bg)
 {
-	memset(kv, 0, sizeof(*kv));
-	if (key != NULL) {
-		if (strlcpy(kv->kv_key, key, sizeof(kv->kv_key)) >=
-		    sizeof(kv->kv_key)) {
-			warnx("%s: key too long", __func__);
-			abort();
-		}
-	}
-	kv->kv_v = INT_MIN;
-	kv->kv_type = type;
-	kv->kv_precision = precision;
+	return (bg->bg_verbose > 1);
 }
 
-void
-batgw_kv_init_tpl(struct batgw_kv *kv, const struct batgw_kv_tpl *tpl)
+const struct batgw_config_battery *
+batgw_b_config(const struct batgw_b *b)
 {
-	batgw_kv_init(kv, tpl->kv_key, tpl->kv_type, tpl->kv_precision);
+	return (b->b_conf);
 }
 
-void
-batgw_kv_publish(struct batgw *bg,
-    const char *scope, const struct batgw_kv *kv)
+const char *
+batgw_b_scope(const struct batgw_b *b)
 {
-	const struct batgw_config_mqtt *mqttconf = bg->bg_conf->mqtt;
-	struct batgw_mqtt *bgm = bg->bg_mqtt;
+	return (b->b_scope);
+}
 
-	char t[128];
-	int tlen;
-	char p[128];
-	int plen;
-	int div = 1;
-	int len;
+/*
+ * tasks and histograms are reported by name, so each pack needs its
+ * own. this puts the pack's scope between the prefix and suffix.
+ */
 
-	if (!batgw_mqtt_running(bg))
-		return;
+const char *
+batgw_b_name(const struct batgw_b *b, const char *prefix, const char *suffix)
+{
+	char *name;
 
-	/* XXX this should handle snprintf return values better */
+	if (asprintf(&name, "%s%s%s %s", prefix == NULL ? "" : prefix,
+	    prefix == NULL ? "" : " ", b->b_scope, suffix) == -1)
+		errx(1, "%s %s name", b->b_scope, suffix);
 
-	tlen = snprintf(t, sizeof(t), "%s", mqttconf->topic);
-	if (scope != NULL) {
-		len = snprintf(t + tlen, sizeof(t) - tlen,
-		    "/%s", scope);
-		tlen += len;
-	}
-	if (kv->kv_key[0] != '\0') {
-		len = snprintf(t + tlen, sizeof(t) - tlen,
-		    "/%s", kv->kv_key);
-		tlen += len;
-	}
-	len = snprintf(t + tlen, sizeof(t) - tlen,
-	    "/%s", batgw_kv_type_names[kv->kv_type]);
-	tlen += len;
+	return (name);
+}
 
-	if (kv->kv_precision == 0)
-		plen = snprintf(p, sizeof(p), "%d", kv->kv_v);
-	else {
-		static unsigned int divs[] = { 1, 10, 100, 1000, 10000 };
-		const char *neg = "";
-		unsigned int div;
-		unsigned int v;
-		assert(kv->kv_precision < nitems(divs));
-		div = divs[kv->kv_precision];
-		if (kv->kv_v < 0) {
-			v = 0 - kv->kv_v;
-			neg = "-";
-		} else
-			v = kv->kv_v;
-		plen = snprintf(p, sizeof(p), "%s%u.%0*u",
-		    neg, v / div, kv->kv_precision, v % div);
-	}
+int
+batgw_b_can_open(struct batgw_b *b, const char *scope)
+{
+	const struct batgw_battery *driver = b->b_driver;
+	struct can_filter *filters;
+	size_t nfilters;
+
+	filters = can_decoder_filters(scope, driver->b_decoder,
+	    driver->b_filters, driver->b_nfilters, &nfilters);
+	if (batgw_sniff(b->b_bg))
+		nfilters = 0;
 
-	mqtt_publish(bgm->conn, t, tlen, p, plen, MQTT_QOS0, 0);
+	return (batgw_can_open(b->b_bg, scope, b->b_conf->ifname,
+	    filters, nfilters, b->b_conf->canfd));
 }
 
 void
-batgw_kv_update(struct batgw *bg, const char *scope,
-    struct batgw_kv *kv, int v)
+batgw_b_set(struct batgw_b *b, enum batgw_b_field f, int v)
 {
-	struct timeval tv;
-
-	if (kv->kv_v == v)
-		return;
-	kv->kv_v = v;
-
-	if (event_gettime_monotonic(bg->bg_evbase, &tv) == 0) {
-		unsigned int now = (unsigned int)tv.tv_sec;
-		if ((now - kv->kv_updated) < 10)
-			return;
-		kv->kv_updated = now;
+	switch (f) {
+	case BATGW_B_F_NONE:
+	case BATGW_B_F_COUNT:
+		break;
+	case BATGW_B_F_SOC_CPCT:
+		batgw_b_set_soc_c_pct(b, v);
+		break;
+	case BATGW_B_F_VOLTAGE_DV:
+		batgw_b_set_voltage_dv(b, v);
+		break;
+	case BATGW_B_F_CURRENT_DA:
+		batgw_b_set_current_da(b, v);
+		break;
+	case BATGW_B_F_MIN_TEMP_DC:
+		batgw_b_set_min_temp_dc(b, v);
+		break;
+	case BATGW_B_F_MAX_TEMP_DC:
+		batgw_b_set_max_temp_dc(b, v);
+		break;
+	case BATGW_B_F_AVG_TEMP_DC:
+		batgw_b_set_avg_temp_dc(b, v);
+		break;
+	case BATGW_B_F_MIN_CELL_VOLTAGE_MV:
+		batgw_b_set_min_cell_voltage_mv(b, v);
+		break;
+	case BATGW_B_F_MAX_CELL_VOLTAGE_MV:
+		batgw_b_set_max_cell_voltage_mv(b, v);
+		break;
+	case BATGW_B_F_CHARGE_W:
+		batgw_b_set_charge_w(b, v);
+		break;
+	case BATGW_B_F_DISCHARGE_W:
+		batgw_b_set_discharge_w(b, v);
+		break;
 	}
+}
 
-	batgw_kv_publish(bg, scope, kv);
+void
+batgw_b_set_running(struct batgw_b *b)
+{
+	if (!b->b_state.bs_running)
+		SET(b->b_bg->bg_limits.l_dirty, BATGW_LIMITS_ALL);
+	b->b_state.bs_running = 1;
+}
+
+void
+batgw_b_set_stopped(struct batgw_b *b)
+{
+	b->b_state.bs_running = 0;
+	SET(b->b_bg->bg_limits.l_dirty, BATGW_LIMITS_ALL);
+	batgw_limits_commit(b->b_bg);
 }
 
 int
-batgw_kv_get(const struct batgw_kv *kv)
+batgw_b_get_running(const struct batgw *bg)
 {
-	return (kv->kv_v);
+	unsigned int i;
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		if (bg->bg_batteries[i].b_state.bs_running)
+			return (1);
+	}
+
+	return (0);
 }
 
 /*
- * CAN related code
+ * battery state freshness. setters stamp fields with the time cached
+ * when the event loop woke up, rather than reading the clock for each
+ * one.
  */
 
-int
-can_open(const char *scope, const char *name)
+static const char *batgw_b_field_names[BATGW_B_F_COUNT] = {
+	[BATGW_B_F_SOC_CPCT] =			"soc",
+	[BATGW_B_F_VOLTAGE_DV] =		"voltage",
+	[BATGW_B_F_CURRENT_DA] =		"current",
+	[BATGW_B_F_MIN_TEMP_DC] =		"min-temp",
+	[BATGW_B_F_MAX_TEMP_DC] =		"max-temp",
+	[BATGW_B_F_AVG_TEMP_DC] =		"avg-temp",
+	[BATGW_B_F_MIN_CELL_VOLTAGE_MV] =	"min-cell-voltage",
+	[BATGW_B_F_MAX_CELL_VOLTAGE_MV] =	"max-cell-voltage",
+	[BATGW_B_F_CHARGE_W] =			"charge",
+	[BATGW_B_F_DISCHARGE_W] =		"discharge",
+};
+
+static int
+batgw_b_max_ages(struct batgw_b *b)
 {
-	struct ifreq ifr;
-	struct sockaddr_can can;
-	int fd;
+	const struct batgw_config_battery *bconf = b->b_conf;
+	struct batgw_b_state *bs = &b->b_state;
+	const struct batgw_config_max_age *ma;
+	unsigned int ms = bconf->max_age_ms;
+	unsigned int i, f;
+	char *name;
+	int rv = 0;
+
+	if (ms == 0)
+		ms = BATGW_BATTERY_MAX_AGE_MS;
+
+	for (f = BATGW_B_F_NONE + 1; f < BATGW_B_F_COUNT; f++) {
+		bs->bs_max_age[f].tv_sec = ms / 1000;
+		bs->bs_max_age[f].tv_usec = (ms % 1000) * 1000;
+
+		if (asprintf(&name, "%s %s age", b->b_scope,
+		    batgw_b_field_names[f]) == -1)
+			errx(1, "battery age hist name");
+		bs->bs_age[f] = batgw_hist_add(b->b_bg, name);
+	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	if (strlcpy(ifr.ifr_name, name, sizeof(ifr.ifr_name)) >=
-	    sizeof(ifr.ifr_name))
-		errx(1, "%s %s: name too long", scope, name);
+	for (i = 0; i < bconf->nmax_ages; i++) {
+		ma = &bconf->max_ages[i];
 
-	fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
-	if (fd == -1)
-		err(1, "%s %s socket", scope, name);
+		for (f = BATGW_B_F_NONE + 1; f < BATGW_B_F_COUNT; f++) {
+			if (strcmp(ma->name, batgw_b_field_names[f]) == 0)
+				break;
+		}
+		if (f == BATGW_B_F_COUNT) {
+			fprintf(stderr, "battery age limit %s: unknown field\n",
+			    ma->name);
+			rv = -1;
+			continue;
+		}
 
-	if (ioctl(fd, SIOCGIFINDEX, &ifr) == -1)
-		err(1, "%s %s index", scope, name);
+		bs->bs_max_age[f].tv_sec = ma->ms / 1000;
+		bs->bs_max_age[f].tv_usec = (ma->ms % 1000) * 1000;
+	}
 
-	memset(&can, 0, sizeof(can));
-	can.can_family = AF_CAN;
-	can.can_ifindex = ifr.ifr_ifindex;
+	return (rv);
+}
 
-	if (bind(fd, (struct sockaddr *)&can, sizeof(can)) == -1)
-		err(1, "%s %s bind", scope, name);
+static int
+batgw_b_stale(const struct batgw_b *b, enum batgw_b_field f)
+{
+	const struct batgw_b_state *bs = &b->b_state;
+	struct timeval age;
 
-	return (fd);
+	if (!timerisset(&bs->bs_updated[f]))
+		return (1);
+
+	timersub(&b->b_bg->bg_now, &bs->bs_updated[f], &age);
+	return (timercmp(&age, &bs->bs_max_age[f], >));
 }
 
-uint16_t
-can_betoh16(const struct can_frame *frame, size_t o)
+static inline void
+batgw_b_touch(struct batgw_b *b, enum batgw_b_field f, int changed)
 {
-	uint16_t h16;
+	struct batgw_b_state *bs = &b->b_state;
 
-	h16 = (uint16_t)frame->data[o + 0] << 8;
-	h16 |= (uint16_t)frame->data[o + 1] << 0;
+	/*
+	 * a field coming back from stale changes the verdict too, and
+	 * so does a real reading confirming a provisional one.
+	 */
+	if (ISSET(BATGW_LIMITS_FIELDS, 1U << f) &&
+	    (changed || ISSET(bs->bs_provisional, 1U << f) ||
+	     batgw_b_stale(b, f)))
+		SET(b->b_bg->bg_limits.l_dirty, 1U << f);
 
-	return (h16);
+	CLR(bs->bs_provisional, 1U << f);
+	bs->bs_updated[f] = b->b_bg->bg_now;
 }
 
-uint32_t
-can_betoh32(const struct can_frame *frame, size_t o)
+static int
+batgw_b_fresh(const struct batgw_b *b, enum batgw_b_field f)
 {
-	uint32_t h32;
+	const struct batgw_b_state *bs = &b->b_state;
+	const struct timeval *now = &b->b_bg->bg_now;
+	struct timeval age;
 
-	h32 = (uint16_t)frame->data[o + 0] << 24;
-	h32 |= (uint16_t)frame->data[o + 1] << 16;
-	h32 |= (uint16_t)frame->data[o + 2] << 8;
-	h32 |= (uint16_t)frame->data[o + 3] << 0;
+	if (!timerisset(&bs->bs_updated[f]))
+		return (0);
 
-	return (h32);
+	timersub(now, &bs->bs_updated[f], &age);
+	batgw_hist_record(bs->bs_age[f],
+	    batgw_hist_usec(&bs->bs_updated[f], now));
+
+	return (timercmp(&age, &bs->bs_max_age[f], <=));
 }
 
 void
-can_htobe16(struct can_frame *frame, size_t o, uint16_t h16)
+batgw_b_set_rated_capacity_ah(struct batgw_b *b, unsigned int ah)
 {
-	frame->data[o + 0] = h16 >> 8;
-	frame->data[o + 1] = h16 >> 0;
+	b->b_state.bs_rated_capacity_ah = ah;
 }
 
-uint16_t
-can_letoh16(const struct can_frame *frame, size_t o)
+void
+batgw_b_set_rated_voltage_dv(struct batgw_b *b, unsigned int dv)
 {
-	uint16_t h16;
+	b->b_state.bs_rated_voltage_dv = dv;
+}
 
-	h16 = (uint16_t)frame->data[o + 0] << 0;
-	h16 |= (uint16_t)frame->data[o + 1] << 8;
+void
+batgw_b_set_soc_c_pct(struct batgw_b *b, unsigned int soc)
+{
+	struct batgw_b_state *bs = &b->b_state;
 
-	return (h16);
+	batgw_b_touch(b, BATGW_B_F_SOC_CPCT, bs->bs_soc_cpct != soc);
+	bs->bs_soc_cpct = soc;
+
+	/* the estimate starts again from here */
+	b->b_energy.be_soc_cpct = soc;
+	b->b_energy.be_soc_mas =
+	    (int64_t)b->b_energy.be_total[BATGW_E_CHARGED_MAS] -
+	    (int64_t)b->b_energy.be_total[BATGW_E_DISCHARGED_MAS];
+	b->b_energy.be_soc_valid = 1;
 }
 
 void
-can_htole16(struct can_frame *frame, size_t o, uint16_t h16)
+batgw_b_set_min_voltage_dv(struct batgw_b *b, unsigned int dv)
 {
-	frame->data[o + 0] = h16 >> 0;
-	frame->data[o + 1] = h16 >> 8;
+	b->b_state.bs_min_voltage_dv = dv;
 }
 
 void
-can_htobe64(struct can_frame *frame, uint64_t h64)
+batgw_b_set_max_voltage_dv(struct batgw_b *b, unsigned int dv)
 {
-	frame->data[0] = h64 >> 56;
-	frame->data[1] = h64 >> 48;
-	frame->data[2] = h64 >> 40;
-	frame->data[3] = h64 >> 32;
-	frame->data[4] = h64 >> 24;
-	frame->data[5] = h64 >> 16;
-	frame->data[6] = h64 >>  8;
-	frame->data[7] = h64 >>  0;
+	b->b_state.bs_max_voltage_dv = dv;
 }
 
-struct event_base *
-batgw_event_base(struct batgw *bg)
+void
+batgw_b_set_voltage_dv(struct batgw_b *b, unsigned int dv)
 {
-	return (bg->bg_evbase);
+	struct batgw_b_state *bs = &b->b_state;
+
+	batgw_b_touch(b, BATGW_B_F_VOLTAGE_DV, bs->bs_voltage_dv != dv);
+	bs->bs_voltage_dv = dv;
+	batgw_energy_sample(b);
 }
 
-unsigned int
-batgw_verbose(const struct batgw *bg)
+void
+batgw_b_set_current_da(struct batgw_b *b, int da)
 {
-	return (bg->bg_verbose);
+	struct batgw_b_state *bs = &b->b_state;
+
+	batgw_b_touch(b, BATGW_B_F_CURRENT_DA, bs->bs_current_da != da);
+	bs->bs_current_da = da;
+	batgw_energy_sample(b);
 }
 
-const struct batgw_config_battery *
-batgw_b_config(struct batgw *bg)
+void
+batgw_b_set_min_temp_dc(struct batgw_b *b, int temp)
 {
-	return (&bg->bg_conf->battery);
+	struct batgw_b_state *bs = &b->b_state;
+
+	batgw_b_touch(b, BATGW_B_F_MIN_TEMP_DC, bs->bs_min_temp_dc != temp);
+	bs->bs_min_temp_dc = temp;
 }
 
-void *
-batgw_b_softc(struct batgw *bg)
+void
+batgw_b_set_max_temp_dc(struct batgw_b *b, int temp)
 {
-	return (bg->bg_battery_sc);
+	struct batgw_b_state *bs = &b->b_state;
+
+	batgw_b_touch(b, BATGW_B_F_MAX_TEMP_DC, bs->bs_max_temp_dc != temp);
+	bs->bs_max_temp_dc = temp;
 }
 
 void
-batgw_b_set_running(struct batgw *bg)
+batgw_b_set_avg_temp_dc(struct batgw_b *b, int temp)
 {
-	bg->bg_battery_state.bs_running = 1;
+	struct batgw_b_state *bs = &b->b_state;
+
+	batgw_b_touch(b, BATGW_B_F_AVG_TEMP_DC, bs->bs_avg_temp_dc != temp);
+	bs->bs_avg_temp_dc = temp;
 }
 
 void
-batgw_b_set_stopped(struct batgw *bg)
+batgw_b_set_charge_w(struct batgw_b *b, unsigned int w)
 {
-	bg->bg_battery_state.bs_running = 0;
+	struct batgw_b_state *bs = &b->b_state;
+
+	batgw_b_touch(b, BATGW_B_F_CHARGE_W, bs->bs_max_charge_w != w);
+	bs->bs_max_charge_w = w;
 }
 
-int
-batgw_b_get_running(const struct batgw *bg)
+void
+batgw_b_set_discharge_w(struct batgw_b *b, unsigned int w)
 {
-	return (bg->bg_battery_state.bs_running);
+	struct batgw_b_state *bs = &b->b_state;
+
+	batgw_b_touch(b, BATGW_B_F_DISCHARGE_W, bs->bs_max_discharge_w != w);
+	bs->bs_max_discharge_w = w;
 }
 
 void
-batgw_b_set_rated_capacity_ah(struct batgw *bg, unsigned int ah)
+batgw_b_set_min_cell_voltage_mv(struct batgw_b *b, unsigned int mv)
 {
-	bg->bg_battery_state.bs_rated_capacity_ah = ah;
+	struct batgw_b_state *bs = &b->b_state;
+
+	batgw_b_touch(b, BATGW_B_F_MIN_CELL_VOLTAGE_MV,
+	    bs->bs_min_cell_voltage_mv != mv);
+	bs->bs_min_cell_voltage_mv = mv;
 }
 
 void
-batgw_b_set_rated_voltage_dv(struct batgw *bg, unsigned int dv)
+batgw_b_set_max_cell_voltage_mv(struct batgw_b *b, unsigned int mv)
 {
-	bg->bg_battery_state.bs_rated_voltage_dv = dv;
+	struct batgw_b_state *bs = &b->b_state;
+
+	batgw_b_touch(b, BATGW_B_F_MAX_CELL_VOLTAGE_MV,
+	    bs->bs_max_cell_voltage_mv != mv);
+	bs->bs_max_cell_voltage_mv = mv;
 }
 
-void
-batgw_b_set_soc_c_pct(struct batgw *bg, unsigned int soc)
+/*
+ * energy accounting. every current or voltage reading is a sample,
+ * and the area between it and the one before goes into the charged
+ * or discharged counters, split where the line crosses zero. a gap
+ * longer than the current is allowed to get stale isn't counted.
+ * the counters are kept in mAs and mJ and survive restarts in the
+ * snapshot.
+ */
+
+#define BATGW_E_MAS_RAW		10000LL		/* dA us in a mAs */
+#define BATGW_E_MJ_RAW		100000LL	/* cW us in a mJ */
+
+static const struct batgw_kv_tpl batgw_energy_kvs_tpl[BATGW_E_KV_COUNT] = {
+	[BATGW_E_KV_CHARGED_AH] =
+		{ "meter-in",		KV_T_AMPHOUR,	3 },
+	[BATGW_E_KV_DISCHARGED_AH] =
+		{ "meter-out",		KV_T_AMPHOUR,	3 },
+	[BATGW_E_KV_CHARGED_KWH] =
+		{ "meter-in",		KV_T_ENERGY,	3 },
+	[BATGW_E_KV_DISCHARGED_KWH] =
+		{ "meter-out",		KV_T_ENERGY,	3 },
+	[BATGW_E_KV_SOC] =
+		{ "meter-soc",		KV_T_PERCENT,	2 },
+};
+
+static void
+batgw_energy_attach(struct batgw *bg, struct batgw_b *b)
 {
-	SET(bg->bg_battery_state.bs_valid, BATGW_B_VALID_SOC);
-	bg->bg_battery_state.bs_soc_cpct = soc;
+	struct batgw_energy *be = &b->b_energy;
+	unsigned int i;
+
+	for (i = 0; i < nitems(be->be_kvs); i++)
+		batgw_kv_init_tpl(&be->be_kvs[i], &batgw_energy_kvs_tpl[i]);
+	batgw_kv_attach(bg, b->b_scope, be->be_kvs, nitems(be->be_kvs));
 }
 
-void
-batgw_b_set_min_voltage_dv(struct batgw *bg, unsigned int dv)
+/* a is in units, us in microseconds */
+static void
+batgw_energy_area(struct batgw_energy *be, enum batgw_energy_counter pos,
+    enum batgw_energy_counter neg, int64_t unit,
+    int64_t a0, int64_t a1, int64_t us)
 {
-	bg->bg_battery_state.bs_min_voltage_dv = dv;
+	int64_t area, t0;
+
+	if ((a0 < 0) == (a1 < 0)) {
+		area = (a0 + a1) * us / 2;
+		if (area < 0)
+			be->be_acc[neg] -= area;
+		else
+			be->be_acc[pos] += area;
+	} else {
+		/* it crosses zero this much of the way in */
+		t0 = us * llabs(a0) / (llabs(a0) + llabs(a1));
+		area = a0 * t0 / 2;
+		be->be_acc[a0 < 0 ? neg : pos] += llabs(area);
+		area = a1 * (us - t0) / 2;
+		be->be_acc[a1 < 0 ? neg : pos] += llabs(area);
+	}
+
+	be->be_total[pos] += be->be_acc[pos] / unit;
+	be->be_acc[pos] %= unit;
+	be->be_total[neg] += be->be_acc[neg] / unit;
+	be->be_acc[neg] %= unit;
 }
 
-void
-batgw_b_set_max_voltage_dv(struct batgw *bg, unsigned int dv)
+static void
+batgw_energy_kvs(struct batgw_b *b)
 {
-	bg->bg_battery_state.bs_max_voltage_dv = dv;
+	struct batgw_energy *be = &b->b_energy;
+	const struct batgw_b_state *bs = &b->b_state;
+	struct batgw_kv *kvs = be->be_kvs;
+	struct batgw *bg = b->b_bg;
+	int64_t net, cap, soc;
+
+	batgw_kv_update(bg, b->b_scope, &kvs[BATGW_E_KV_CHARGED_AH],
+	    be->be_total[BATGW_E_CHARGED_MAS] / 3600);
+	batgw_kv_update(bg, b->b_scope, &kvs[BATGW_E_KV_DISCHARGED_AH],
+	    be->be_total[BATGW_E_DISCHARGED_MAS] / 3600);
+	batgw_kv_update(bg, b->b_scope, &kvs[BATGW_E_KV_CHARGED_KWH],
+	    be->be_total[BATGW_E_CHARGED_MJ] / 3600000);
+	batgw_kv_update(bg, b->b_scope, &kvs[BATGW_E_KV_DISCHARGED_KWH],
+	    be->be_total[BATGW_E_DISCHARGED_MJ] / 3600000);
+
+	/* mAs against the rated capacity in mAs, in hundredths of a % */
+	cap = (int64_t)bs->bs_rated_capacity_ah * 3600 * 1000;
+	if (!be->be_soc_valid || cap == 0)
+		return;
+
+	net = (int64_t)be->be_total[BATGW_E_CHARGED_MAS] -
+	    (int64_t)be->be_total[BATGW_E_DISCHARGED_MAS] - be->be_soc_mas;
+	soc = be->be_soc_cpct + net * 10000 / cap;
+	if (soc < 0)
+		soc = 0;
+	else if (soc > 10000)
+		soc = 10000;
+
+	batgw_kv_update(bg, b->b_scope, &kvs[BATGW_E_KV_SOC], soc);
 }
 
-void
-batgw_b_set_voltage_dv(struct batgw *bg, unsigned int dv)
+static void
+batgw_energy_sample(struct batgw_b *b)
 {
-	SET(bg->bg_battery_state.bs_valid, BATGW_B_VALID_VOLTAGE);
-	bg->bg_battery_state.bs_voltage_dv = dv;
+	struct batgw_energy *be = &b->b_energy;
+	const struct batgw_b_state *bs = &b->b_state;
+	const struct timeval *now = &b->b_bg->bg_now;
+	struct timeval tv;
+	int64_t us;
+	int da = bs->bs_current_da;
+	int cw = INT_MIN;
+
+	if (batgw_b_stale(b, BATGW_B_F_CURRENT_DA))
+		return;
+	if (!batgw_b_stale(b, BATGW_B_F_VOLTAGE_DV))
+		cw = da * (int)bs->bs_voltage_dv;
+
+	if (timerisset(&be->be_t)) {
+		timersub(now, &be->be_t, &tv);
+		if (timercmp(&tv, &bs->bs_max_age[BATGW_B_F_CURRENT_DA], >))
+			goto restart;
+
+		us = tv.tv_sec * 1000000LL + tv.tv_usec;
+		batgw_energy_area(be,
+		    BATGW_E_CHARGED_MAS, BATGW_E_DISCHARGED_MAS,
+		    BATGW_E_MAS_RAW, be->be_da, da, us);
+		if (be->be_cw != INT_MIN && cw != INT_MIN) {
+			batgw_energy_area(be,
+			    BATGW_E_CHARGED_MJ, BATGW_E_DISCHARGED_MJ,
+			    BATGW_E_MJ_RAW, be->be_cw, cw, us);
+		}
+
+		batgw_energy_kvs(b);
+	}
+
+restart:
+	be->be_t = *now;
+	be->be_da = da;
+	be->be_cw = cw;
 }
 
-void
-batgw_b_set_current_da(struct batgw *bg, int da)
+/*
+ * warm start. the battery state and kvs are copied into a small
+ * mapped file every so often and on the way out, and loaded again at
+ * startup so the inverter has something to go on before the first
+ * readings arrive. loaded fields are provisional: they go stale like
+ * any other, and a pack doesn't get any current until its own
+ * readings have replaced them. the energy counters are loaded however
+ * old the snapshot is.
+ */
+
+#define BATGW_SNAP_PATH		BATGW_DB_DIR "/batgw.state"
+#define BATGW_SNAP_MAX_AGE	300	/* seconds */
+
+static const struct timeval batgw_snap_tv = { 10, 0 };
+
+struct batgw_snap_hdr {
+	char			 sh_magic[8];
+#define BATGW_SNAP_MAGIC		"batgwsnp"
+	uint32_t		 sh_version;
+#define BATGW_SNAP_VERSION		2
+	uint32_t		 sh_gen;	/* odd while it's written */
+	int64_t			 sh_time;	/* realtime */
+	uint32_t		 sh_npacks;
+	uint32_t		 sh_nkvs;
+};
+
+struct batgw_snap_pack {
+	char			 sp_ifname[IFNAMSIZ];
+	char			 sp_protocol[16];
+	uint32_t		 sp_fields;
+	int32_t			 sp_v[BATGW_B_F_COUNT];
+	uint64_t		 sp_energy[BATGW_E_COUNT];
+};
+
+struct batgw_snap_kv {
+	char			 sk_scope[16];
+	char			 sk_key[16];
+	uint32_t		 sk_type;
+	int32_t			 sk_v;
+};
+
+static int
+batgw_b_field(const struct batgw_b_state *bs, enum batgw_b_field f)
 {
-	SET(bg->bg_battery_state.bs_valid, BATGW_B_VALID_CURRENT);
-	bg->bg_battery_state.bs_current_da = da;
+	switch (f) {
+	case BATGW_B_F_NONE:
+	case BATGW_B_F_COUNT:
+		break;
+	case BATGW_B_F_SOC_CPCT:
+		return (bs->bs_soc_cpct);
+	case BATGW_B_F_VOLTAGE_DV:
+		return (bs->bs_voltage_dv);
+	case BATGW_B_F_CURRENT_DA:
+		return (bs->bs_current_da);
+	case BATGW_B_F_MIN_TEMP_DC:
+		return (bs->bs_min_temp_dc);
+	case BATGW_B_F_MAX_TEMP_DC:
+		return (bs->bs_max_temp_dc);
+	case BATGW_B_F_AVG_TEMP_DC:
+		return (bs->bs_avg_temp_dc);
+	case BATGW_B_F_MIN_CELL_VOLTAGE_MV:
+		return (bs->bs_min_cell_voltage_mv);
+	case BATGW_B_F_MAX_CELL_VOLTAGE_MV:
+		return (bs->bs_max_cell_voltage_mv);
+	case BATGW_B_F_CHARGE_W:
+		return (bs->bs_max_charge_w);
+	case BATGW_B_F_DISCHARGE_W:
+		return (bs->bs_max_discharge_w);
+	}
+
+	return (0);
 }
 
-void
-batgw_b_set_min_temp_dc(struct batgw *bg, int temp)
+static size_t
+batgw_snap_nkvs(const struct batgw *bg)
 {
-	SET(bg->bg_battery_state.bs_valid, BATGW_B_VALID_MIN_TEMP);
-	bg->bg_battery_state.bs_min_temp_dc = temp;
+	const struct batgw_kv_scope *ks;
+	size_t n = 0;
+
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry)
+		n += ks->ks_nkvs;
+
+	return (n);
 }
 
-void
-batgw_b_set_max_temp_dc(struct batgw *bg, int temp)
+static struct batgw_kv *
+batgw_snap_kv(struct batgw *bg, const struct batgw_snap_kv *sk,
+    const char **scopep)
 {
-	SET(bg->bg_battery_state.bs_valid, BATGW_B_VALID_MAX_TEMP);
-	bg->bg_battery_state.bs_max_temp_dc = temp;
+	struct batgw_kv_scope *ks;
+	struct batgw_kv *kv;
+	size_t i;
+
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		if (strncmp(ks->ks_scope, sk->sk_scope,
+		    sizeof(sk->sk_scope)) != 0)
+			continue;
+
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			kv = &ks->ks_kvs[i];
+			if (kv->kv_type == sk->sk_type &&
+			    strncmp(kv->kv_key, sk->sk_key,
+			    sizeof(sk->sk_key)) == 0) {
+				*scopep = ks->ks_scope;
+				return (kv);
+			}
+		}
+	}
+
+	return (NULL);
 }
 
-void
-batgw_b_set_avg_temp_dc(struct batgw *bg, int temp)
+static void
+batgw_snap_pack(struct batgw_b *b, const struct batgw_snap_pack *sp,
+    int fields, unsigned int *nfields)
 {
-	struct batgw_b_state *bs = &bg->bg_battery_state;
+	struct batgw_b_state *bs = &b->b_state;
+	struct batgw_energy *be = &b->b_energy;
+	unsigned int f;
+	int v;
 
-	SET(bs->bs_valid, BATGW_B_VALID_AVG_TEMP);
-	bs->bs_avg_temp_dc = temp;
+	memcpy(be->be_total, sp->sp_energy, sizeof(be->be_total));
+	batgw_energy_kvs(b);
+	if (!fields)
+		return;
+
+	for (f = BATGW_B_F_NONE + 1; f < BATGW_B_F_COUNT; f++) {
+		if (!ISSET(sp->sp_fields, 1U << f))
+			continue;
+
+		/* whatever was flowing then isn't now */
+		v = (f == BATGW_B_F_CURRENT_DA) ? 0 : sp->sp_v[f];
+
+		batgw_b_set(b, f, v);
+		SET(bs->bs_provisional, 1U << f);
+		(*nfields)++;
+	}
+
+	/* a loaded current isn't a sample to count from */
+	timerclear(&be->be_t);
 }
 
-void
-batgw_b_set_charge_w(struct batgw *bg, unsigned int w)
+static void
+batgw_snap_load(struct batgw *bg, const void *map, size_t len)
 {
-	struct batgw_b_state *bs = &bg->bg_battery_state;
-	bs->bs_max_charge_w = w;
+	const struct batgw_snap_hdr *h = map;
+	const struct batgw_snap_pack *sp;
+	const struct batgw_snap_kv *sk;
+	struct batgw_kv *kv;
+	const char *scope;
+	struct batgw_b *b;
+	unsigned int nfields = 0, nkvs = 0;
+	size_t i, j;
+	time_t age;
+	int young;
+
+	if (len < sizeof(*h) ||
+	    memcmp(h->sh_magic, BATGW_SNAP_MAGIC, sizeof(h->sh_magic)) != 0 ||
+	    h->sh_version != BATGW_SNAP_VERSION)
+		return;
+	if (h->sh_gen & 1) {
+		lwarnx("%s: snapshot was not finished", BATGW_SNAP_PATH);
+		return;
+	}
+	if (h->sh_npacks > BATGW_BATTERIES ||
+	    (len - sizeof(*h)) / sizeof(*sk) < h->sh_nkvs ||
+	    len - sizeof(*h) - h->sh_nkvs * sizeof(*sk) <
+	    h->sh_npacks * sizeof(*sp)) {
+		lwarnx("%s: snapshot is truncated", BATGW_SNAP_PATH);
+		return;
+	}
+
+	age = time(NULL) - h->sh_time;
+	young = age >= 0 && age <= BATGW_SNAP_MAX_AGE;
+
+	sp = (const struct batgw_snap_pack *)(h + 1);
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+
+		for (j = 0; j < h->sh_npacks; j++) {
+			if (strncmp(sp[j].sp_ifname, b->b_conf->ifname,
+			    sizeof(sp[j].sp_ifname)) == 0 &&
+			    strncmp(sp[j].sp_protocol, b->b_conf->protocol,
+			    sizeof(sp[j].sp_protocol)) == 0) {
+				batgw_snap_pack(b, &sp[j], young, &nfields);
+				break;
+			}
+		}
+	}
+
+	if (!young) {
+		linfo("%s: energy counters from %llds ago", BATGW_SNAP_PATH,
+		    (long long)age);
+		return;
+	}
+
+	sk = (const struct batgw_snap_kv *)(sp + h->sh_npacks);
+	for (i = 0; i < h->sh_nkvs; i++) {
+		kv = batgw_snap_kv(bg, &sk[i], &scope);
+		if (kv == NULL)
+			continue;
+
+		batgw_kv_update(bg, scope, kv, sk[i].sk_v);
+		nkvs++;
+	}
+
+	linfo("%s: %u fields and %u kvs from %llds ago", BATGW_SNAP_PATH,
+	    nfields, nkvs, (long long)age);
 }
 
-void
-batgw_b_set_discharge_w(struct batgw *bg, unsigned int w)
+static void
+batgw_snap_task(struct batgw *bg, void *arg)
 {
-	struct batgw_b_state *bs = &bg->bg_battery_state;
-	bs->bs_max_discharge_w = w;
+	batgw_snap_save(bg);
 }
 
-void
-batgw_b_set_min_cell_voltage_mv(struct batgw *bg, unsigned int mv)
+static void
+batgw_snap_init(struct batgw *bg)
 {
-	struct batgw_b_state *bs = &bg->bg_battery_state;
-	bs->bs_min_cell_voltage_mv = mv;
+	struct stat st;
+	size_t len;
+	void *map;
+	int fd;
+
+	if (!bg->bg_db) {
+		lwarnx("%s isn't usable, the state won't be saved",
+		    BATGW_DB_DIR);
+		return;
+	}
+
+	fd = open(BATGW_SNAP_PATH, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if (fd == -1) {
+		lwarn("%s", BATGW_SNAP_PATH);
+		return;
+	}
+	if (fstat(fd, &st) == -1) {
+		lwarn("%s stat", BATGW_SNAP_PATH);
+		goto close;
+	}
+
+	/* the state is trusted, so only load what we wrote */
+	if (!S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+	    st.st_uid != geteuid() ||
+	    ISSET(st.st_mode, S_IRWXG|S_IRWXO)) {
+		lwarnx("%s: wrong type, owner or mode, ignoring it",
+		    BATGW_SNAP_PATH);
+		goto close;
+	}
+
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			lwarn("%s mmap", BATGW_SNAP_PATH);
+			goto close;
+		}
+		batgw_snap_load(bg, map, st.st_size);
+		munmap(map, st.st_size);
+	}
+
+	/* the kvs are all attached by now, so the size is fixed */
+	len = sizeof(struct batgw_snap_hdr) +
+	    BATGW_BATTERIES * sizeof(struct batgw_snap_pack) +
+	    batgw_snap_nkvs(bg) * sizeof(struct batgw_snap_kv);
+	if (ftruncate(fd, len) == -1) {
+		lwarn("%s truncate", BATGW_SNAP_PATH);
+		goto close;
+	}
+
+	map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		lwarn("%s mmap", BATGW_SNAP_PATH);
+		goto close;
+	}
+
+	bg->bg_snap = map;
+	bg->bg_snap_len = len;
+	bg->bg_snap_task = batgw_task_add(bg, "snapshot", &batgw_snap_tv,
+	    NULL, batgw_snap_task, NULL);
+	batgw_task_start(bg->bg_snap_task);
+
+close:
+	close(fd);
 }
 
-void
-batgw_b_set_max_cell_voltage_mv(struct batgw *bg, unsigned int mv)
+static void
+batgw_snap_save(struct batgw *bg)
 {
-	struct batgw_b_state *bs = &bg->bg_battery_state;
-	bs->bs_max_cell_voltage_mv = mv;
+	struct batgw_snap_hdr *h = bg->bg_snap;
+	struct batgw_snap_pack *sp;
+	struct batgw_snap_kv *sk;
+	const struct batgw_kv_scope *ks;
+	const struct batgw_kv *kv;
+	const struct batgw_b *b;
+	size_t i, n = 0;
+	unsigned int f;
+
+	if (h == NULL)
+		return;
+
+	/* a load that sees an odd generation caught us in the middle */
+	h->sh_gen |= 1;
+	__sync_synchronize();
+
+	sp = (struct batgw_snap_pack *)(h + 1);
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+
+		memset(&sp[i], 0, sizeof(sp[i]));
+		strlcpy(sp[i].sp_ifname, b->b_conf->ifname,
+		    sizeof(sp[i].sp_ifname));
+		strlcpy(sp[i].sp_protocol, b->b_conf->protocol,
+		    sizeof(sp[i].sp_protocol));
+
+		/* don't let a snapshot outlive the readings behind it */
+		for (f = BATGW_B_F_NONE + 1; f < BATGW_B_F_COUNT; f++) {
+			if (batgw_b_stale(b, f) ||
+			    ISSET(b->b_state.bs_provisional, 1U << f))
+				continue;
+
+			SET(sp[i].sp_fields, 1U << f);
+			sp[i].sp_v[f] = batgw_b_field(&b->b_state, f);
+		}
+
+		memcpy(sp[i].sp_energy, b->b_energy.be_total,
+		    sizeof(sp[i].sp_energy));
+	}
+
+	sk = (struct batgw_snap_kv *)(sp + bg->bg_nbatteries);
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			kv = &ks->ks_kvs[i];
+			if (kv->kv_v == INT_MIN)
+				continue;
+
+			strlcpy(sk[n].sk_scope, ks->ks_scope,
+			    sizeof(sk[n].sk_scope));
+			strlcpy(sk[n].sk_key, kv->kv_key,
+			    sizeof(sk[n].sk_key));
+			sk[n].sk_type = kv->kv_type;
+			sk[n].sk_v = kv->kv_v;
+			n++;
+		}
+	}
+
+	memcpy(h->sh_magic, BATGW_SNAP_MAGIC, sizeof(h->sh_magic));
+	h->sh_version = BATGW_SNAP_VERSION;
+	h->sh_time = time(NULL);
+	h->sh_npacks = bg->bg_nbatteries;
+	h->sh_nkvs = n;
+
+	__sync_synchronize();
+	h->sh_gen++;
+}
+
+/* save a snapshot and make sure it's on disk before we go */
+static void
+batgw_snap_sync(struct batgw *bg)
+{
+	batgw_snap_save(bg);
+	if (bg->bg_snap != NULL &&
+	    msync(bg->bg_snap, bg->bg_snap_len, MS_SYNC) == -1)
+		lwarn("%s msync", BATGW_SNAP_PATH);
+}
+
+static void
+batgw_shutdown(int sig, short events, void *arg)
+{
+	struct batgw *bg = arg;
+
+	linfo("%s, shutting down", strsignal(sig));
+
+	batgw_snap_sync(bg);
+	event_base_loopexit(bg->bg_evbase, NULL);
 }
 
 const struct batgw_config_inverter *
@@ -1401,6 +7802,23 @@ batgw_i_softc(struct batgw *bg)
 	return (bg->bg_inverter_sc);
 }
 
+int
+batgw_i_can_open(struct batgw *bg, const char *scope)
+{
+	const struct batgw_inverter *i = bg->bg_inverter;
+	const struct batgw_config_inverter *iconf = batgw_i_config(bg);
+	struct can_filter *filters;
+	size_t nfilters;
+
+	filters = can_decoder_filters(scope, i->i_decoder,
+	    i->i_filters, i->i_nfilters, &nfilters);
+	if (batgw_sniff(bg))
+		nfilters = 0;
+
+	return (batgw_can_open(bg, scope, iconf->ifname, filters, nfilters,
+	    iconf->canfd));
+}
+
 void
 batgw_i_set_running(struct batgw *bg)
 {
@@ -1422,19 +7840,55 @@ batgw_i_set_contactor(struct batgw *bg, unsigned int closed)
 unsigned int
 batgw_b_get_contactor(const struct batgw *bg)
 {
-	return (bg->bg_inverter_state.is_contactor);
+	return (bg->bg_inverter_state.is_contactor);
+}
+
+static inline int
+isset(unsigned int v, unsigned int m)
+{
+	return ((v & m) == m);
+}
+
+/*
+ * the inverter sees the packs as one big battery. a pack that has
+ * stopped is left out so the others can carry on without it, unless
+ * none of them are running, in which case they all count.
+ */
+static int
+batgw_b_counted(const struct batgw *bg, const struct batgw_b *b)
+{
+	return (b->b_state.bs_running || !batgw_b_get_running(bg));
 }
 
-static inline int
-isset(unsigned int v, unsigned int m)
+/* an aggregate is only as fresh as the oldest pack feeding it */
+static int
+batgw_b_all_fresh(const struct batgw *bg, enum batgw_b_field f)
 {
-	return ((v & m) == m);
+	const struct batgw_b *b;
+	unsigned int i;
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		if (batgw_b_counted(bg, b) && !batgw_b_fresh(b, f))
+			return (0);
+	}
+
+	return (1);
 }
 
 int
 batgw_i_get_min_voltage_dv(const struct batgw *bg, unsigned int *dvp)
 {
-	unsigned int dv = bg->bg_battery_state.bs_min_voltage_dv;
+	const struct batgw_b *b;
+	unsigned int i, dv = 0;
+
+	/* the packs share a bus, so they get the narrowest window */
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		if (batgw_b_counted(bg, b) &&
+		    b->b_state.bs_min_voltage_dv > dv)
+			dv = b->b_state.bs_min_voltage_dv;
+	}
 
 	if (dv != 0) {
 		*dvp = dv;
@@ -1447,7 +7901,17 @@ batgw_i_get_min_voltage_dv(const struct batgw *bg, unsigned int *dvp)
 int
 batgw_i_get_max_voltage_dv(const struct batgw *bg, unsigned int *dvp)
 {
-	unsigned int dv = bg->bg_battery_state.bs_max_voltage_dv;
+	const struct batgw_b *b;
+	unsigned int i, dv = 0;
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		if (!batgw_b_counted(bg, b) ||
+		    b->b_state.bs_max_voltage_dv == 0)
+			continue;
+		if (dv == 0 || b->b_state.bs_max_voltage_dv < dv)
+			dv = b->b_state.bs_max_voltage_dv;
+	}
 
 	if (dv != 0) {
 		*dvp = dv;
@@ -1460,55 +7924,81 @@ batgw_i_get_max_voltage_dv(const struct batgw *bg, unsigned int *dvp)
 int
 batgw_i_get_soc_cpct(const struct batgw *bg, unsigned int *cpctp)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
+	const struct batgw_b_state *bs;
+	uint64_t sum = 0, weight = 0;
+	unsigned int i, w;
 
-	if (ISSET(bs->bs_valid, BATGW_B_VALID_SOC)) {
-		*cpctp = bs->bs_soc_cpct;
-		return (0);
+	if (!batgw_b_all_fresh(bg, BATGW_B_F_SOC_CPCT))
+		return (-1);
+
+	/* weight each pack by how much charge it holds */
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		if (!batgw_b_counted(bg, &bg->bg_batteries[i]))
+			continue;
+		bs = &bg->bg_batteries[i].b_state;
+
+		w = bs->bs_rated_capacity_ah;
+		if (w == 0)
+			w = 1;
+		sum += (uint64_t)bs->bs_soc_cpct * w;
+		weight += w;
 	}
 
-	return (-1);
+	*cpctp = sum / weight;
+	return (0);
 }
 
 int
 batgw_i_get_voltage_dv(const struct batgw *bg, unsigned int *dvp)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
+	unsigned int i, n = 0, sum = 0;
 
-	if (ISSET(bs->bs_valid, BATGW_B_VALID_VOLTAGE)) {
-		*dvp = bs->bs_voltage_dv;
-		return (0);
+	if (!batgw_b_all_fresh(bg, BATGW_B_F_VOLTAGE_DV))
+		return (-1);
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		if (!batgw_b_counted(bg, &bg->bg_batteries[i]))
+			continue;
+		sum += bg->bg_batteries[i].b_state.bs_voltage_dv;
+		n++;
 	}
 
-	return (-1);
+	*dvp = sum / n;
+	return (0);
 }
 
 int
 batgw_i_get_current_da(const struct batgw *bg, int *dap)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
+	unsigned int i;
+	int sum = 0;
 
-	if (ISSET(bs->bs_valid, BATGW_B_VALID_CURRENT)) {
-		*dap = bs->bs_current_da;
-		return (0);
+	if (!batgw_b_all_fresh(bg, BATGW_B_F_CURRENT_DA))
+		return (-1);
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		if (!batgw_b_counted(bg, &bg->bg_batteries[i]))
+			continue;
+		sum += bg->bg_batteries[i].b_state.bs_current_da;
 	}
 
-	return (-1);
+	*dap = sum;
+	return (0);
 }
 
-int
-batgw_i_get_avg_temp_dc(const struct batgw *bg, int *tempp)
+static int
+batgw_b_avg_temp_dc(const struct batgw_b *b, int *tempp)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
+	const struct batgw_b_state *bs = &b->b_state;
 	int diff;
 
-	if (ISSET(bs->bs_valid, BATGW_B_VALID_AVG_TEMP)) {
+	if (batgw_b_fresh(b, BATGW_B_F_AVG_TEMP_DC)) {
 		*tempp = bs->bs_avg_temp_dc;
 		return (0);
 	}
 
-	if (!isset(bs->bs_valid,
-	    BATGW_B_VALID_MIN_TEMP|BATGW_B_VALID_MAX_TEMP))
+	if (!batgw_b_fresh(b, BATGW_B_F_MIN_TEMP_DC) ||
+	    !batgw_b_fresh(b, BATGW_B_F_MAX_TEMP_DC))
 		return (-1);
 
 	diff = bs->bs_max_temp_dc - bs->bs_min_temp_dc;
@@ -1516,39 +8006,82 @@ batgw_i_get_avg_temp_dc(const struct batgw *bg, int *tempp)
 	return (0);
 }
 
+int
+batgw_i_get_avg_temp_dc(const struct batgw *bg, int *tempp)
+{
+	const struct batgw_b *b;
+	unsigned int i, n = 0;
+	int temp, sum = 0;
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		if (!batgw_b_counted(bg, b))
+			continue;
+		if (batgw_b_avg_temp_dc(b, &temp) != 0)
+			return (-1);
+
+		sum += temp;
+		n++;
+	}
+
+	*tempp = sum / (int)n;
+	return (0);
+}
+
 int
 batgw_i_get_min_temp_dc(const struct batgw *bg, int *tempp)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
-	int diff;
+	const struct batgw_b_state *bs;
+	unsigned int i, n = 0;
+	int temp = 0;
 
-	if (ISSET(bs->bs_valid, BATGW_B_VALID_MIN_TEMP)) {
-		*tempp = bs->bs_min_temp_dc;
-		return (0);
+	if (!batgw_b_all_fresh(bg, BATGW_B_F_MIN_TEMP_DC))
+		return (-1);
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		if (!batgw_b_counted(bg, &bg->bg_batteries[i]))
+			continue;
+		bs = &bg->bg_batteries[i].b_state;
+		if (n++ == 0 || bs->bs_min_temp_dc < temp)
+			temp = bs->bs_min_temp_dc;
 	}
 
-	return (-1);
+	*tempp = temp;
+	return (0);
 }
 
 int
 batgw_i_get_max_temp_dc(const struct batgw *bg, int *tempp)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
-	int diff;
+	const struct batgw_b_state *bs;
+	unsigned int i, n = 0;
+	int temp = 0;
 
-	if (ISSET(bs->bs_valid, BATGW_B_VALID_MAX_TEMP)) {
-		*tempp = bs->bs_max_temp_dc;
-		return (0);
+	if (!batgw_b_all_fresh(bg, BATGW_B_F_MAX_TEMP_DC))
+		return (-1);
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		if (!batgw_b_counted(bg, &bg->bg_batteries[i]))
+			continue;
+		bs = &bg->bg_batteries[i].b_state;
+		if (n++ == 0 || bs->bs_max_temp_dc > temp)
+			temp = bs->bs_max_temp_dc;
 	}
 
-	return (-1);
+	*tempp = temp;
+	return (0);
 }
 
 int
 batgw_i_get_rated_capacity_ah(const struct batgw *bg, unsigned int *ahp)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
-	unsigned int ah = bs->bs_rated_capacity_ah;
+	unsigned int i, ah = 0;
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		if (!batgw_b_counted(bg, &bg->bg_batteries[i]))
+			continue;
+		ah += bg->bg_batteries[i].b_state.bs_rated_capacity_ah;
+	}
 
 	if (ah != 0) {
 		*ahp = ah;
@@ -1561,29 +8094,36 @@ batgw_i_get_rated_capacity_ah(const struct batgw *bg, unsigned int *ahp)
 int
 batgw_i_get_rated_capacity_wh(const struct batgw *bg, unsigned int *whp)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
-	unsigned int wh;
+	const struct batgw_b_state *bs;
+	unsigned int i, wh = 0;
 
-	if (bs->bs_rated_capacity_wh != 0) {
-		*whp = bs->bs_rated_capacity_wh;
-		return (0);
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		if (!batgw_b_counted(bg, &bg->bg_batteries[i]))
+			continue;
+		bs = &bg->bg_batteries[i].b_state;
+
+		/* this will be 0 if either or both are 0 */
+		if (bs->bs_rated_capacity_wh != 0)
+			wh += bs->bs_rated_capacity_wh;
+		else {
+			wh += (bs->bs_rated_capacity_ah *
+			    bs->bs_rated_voltage_dv) / 10;
+		}
 	}
 
-	/* this will be 0 if either or both are 0 */
-	wh = bs->bs_rated_capacity_ah * bs->bs_rated_voltage_dv;
 	if (wh != 0) {
-		*whp = wh / 10;
+		*whp = wh;
 		return (0);
 	}
 
 	return (-1);
 }
 
-unsigned int
-batgw_i_get_safety(struct batgw *bg)
+static int
+batgw_b_safe(struct batgw_b *b)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
-	const struct batgw_config_battery *bconf = batgw_b_config(bg);
+	const struct batgw_b_state *bs = &b->b_state;
+	const struct batgw_config_battery *bconf = b->b_conf;
 	const char *reason;
 	int diff;
 
@@ -1604,10 +8144,10 @@ batgw_i_get_safety(struct batgw *bg)
 	}			\
 } while (0)
 
-	CHECK(ISSET(bs->bs_valid, BATGW_B_VALID_MIN_TEMP),
-	    "minimum battery temperature has not been reported");
-	CHECK(ISSET(bs->bs_valid, BATGW_B_VALID_MAX_TEMP),
-	    "maximum battery temperature has not been reported");
+	CHECK(batgw_b_fresh(b, BATGW_B_F_MIN_TEMP_DC),
+	    "minimum battery temperature is stale");
+	CHECK(batgw_b_fresh(b, BATGW_B_F_MAX_TEMP_DC),
+	    "maximum battery temperature is stale");
 
 	CHECK(bs->bs_min_temp_dc >= -250 /* bconf->min_temp_dc */,
 	    "battery is too cold");
@@ -1619,6 +8159,10 @@ batgw_i_get_safety(struct batgw *bg)
 	CHECK(diff < 150 /* bconf->dev_tmp_dc */,
 	    "battery temperature difference is too high");
 
+	CHECK(batgw_b_fresh(b, BATGW_B_F_MIN_CELL_VOLTAGE_MV),
+	    "minimum cell voltage is stale");
+	CHECK(batgw_b_fresh(b, BATGW_B_F_MAX_CELL_VOLTAGE_MV),
+	    "maximum cell voltage is stale");
 	CHECK(bs->bs_min_cell_voltage_mv != 0,
 	    "minimum cell voltage has not been reported");
 	CHECK(bs->bs_max_cell_voltage_mv != 0,
@@ -1629,80 +8173,582 @@ batgw_i_get_safety(struct batgw *bg)
 	CHECK(diff < bconf->dev_cell_voltage_mv,
 	    "battery cell voltage difference is too high");
 
-	bg->bg_unsafe_reason = NULL;
-	return (v_safe);
+	b->b_unsafe_reason = NULL;
+	return (1);
 
 unsafe:
-	if (bg->bg_unsafe_reason != reason) {
-		lwarnx("battery unsafe: %s", reason);
-		bg->bg_unsafe_reason = reason;
+	if (b->b_unsafe_reason != reason) {
+		lwarnx("%s unsafe: %s", b->b_scope, reason);
+		b->b_unsafe_reason = reason;
 	}
-	return (v_unsafe);
+	return (0);
 }
 
-int
-batgw_i_issafe(struct batgw *bg, unsigned int safety)
+static unsigned int
+batgw_b_charge_w(const struct batgw_b *b)
 {
-	if (safety == v_safe)
-		return (1);
-	if (safety == v_unsafe)
+	const struct batgw_b_state *bs = &b->b_state;
+
+	if (bs->bs_max_cell_voltage_mv > b->b_conf->max_cell_voltage_mv)
 		return (0);
-	abort();
+	if (!batgw_b_fresh(b, BATGW_B_F_CHARGE_W))
+		return (0);
+
+	return (bs->bs_max_charge_w);
 }
 
 static unsigned int
-batgw_get_safety_limited_da(struct batgw *bg,
-    unsigned int w, unsigned int wlimit)
+batgw_b_discharge_w(const struct batgw_b *b)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
-	unsigned int dv, da;
+	const struct batgw_b_state *bs = &b->b_state;
 
-	dv = bs->bs_voltage_dv;
-	if (dv == 0)
+	if (bs->bs_min_cell_voltage_mv < b->b_conf->min_cell_voltage_mv)
+		return (0);
+	if (!batgw_b_fresh(b, BATGW_B_F_DISCHARGE_W))
 		return (0);
 
-	if (w > wlimit)
-		w = wlimit;
+	return (bs->bs_max_discharge_w);
+}
+
+/*
+ * the packs are in parallel, so the current the safe ones can take
+ * adds up. the gateway limit is in watts across all of them and is
+ * applied at their average voltage.
+ */
+
+static unsigned int
+batgw_get_safety_limited_da(struct batgw *bg,
+    unsigned int (*pack_w)(const struct batgw_b *), unsigned int wlimit)
+{
+	const struct batgw_b *b;
+	unsigned int i, n = 0, sum = 0;
+	unsigned int w, dv, da = 0, lda;
+
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		if (!b->b_safe || !batgw_b_fresh(b, BATGW_B_F_VOLTAGE_DV))
+			continue;
+		/* nothing flows on the word of a snapshot alone */
+		if (b->b_state.bs_provisional & BATGW_LIMITS_FIELDS)
+			continue;
+		dv = b->b_state.bs_voltage_dv;
+		if (dv == 0)
+			continue;
+
+		w = pack_w(b);
+		if (w > wlimit)
+			w = wlimit;
+
+		da += (w * 100) / dv;
+		sum += dv;
+		n++;
+	}
+
+	if (n == 0)
+		return (0);
 
-	da = (w * 100) / dv;
+	lda = (wlimit * 100) / (sum / n);
+	if (da > lda)
+		da = lda;
 
 	return (da);
 }
 
+/*
+ * work the verdict and limits out again if something they depend on
+ * changed. returns non-zero if the current the inverter may use went
+ * down.
+ */
+
+static int
+batgw_limits_update(struct batgw *bg)
+{
+	struct batgw_limits *l = &bg->bg_limits;
+	const struct batgw_b_state *bs;
+	unsigned int ocharge, odischarge, charge, discharge;
+	struct timeval expire, tv;
+	struct batgw_b *b;
+	unsigned int i, f;
+	int safe, unsafe;
+
+	if (l->l_dirty == 0 && (!timerisset(&l->l_expire) ||
+	    timercmp(&bg->bg_now, &l->l_expire, <)))
+		return (0);
+
+	ocharge = batgw_i_issafe(bg, l->l_safety) ? l->l_charge_da : 0;
+	odischarge = batgw_i_issafe(bg, l->l_safety) ? l->l_discharge_da : 0;
+
+	/*
+	 * one safe pack is enough to keep going and stopped packs sit
+	 * out, but a pack that is running and unsafe is still on the bus
+	 * with its contactors closed, so it stops everything.
+	 */
+	safe = unsafe = 0;
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		b->b_safe = batgw_b_safe(b);
+		if (b->b_safe)
+			safe = 1;
+		else if (b->b_state.bs_running)
+			unsafe = 1;
+	}
+	l->l_safety = (safe && !unsafe) ? v_safe : v_unsafe;
+
+	l->l_charge_da = bg->bg_charge_off ? 0 :
+	    batgw_get_safety_limited_da(bg,
+	    batgw_b_charge_w, bg->bg_max_charge_w);
+	l->l_discharge_da = bg->bg_discharge_off ? 0 :
+	    batgw_get_safety_limited_da(bg,
+	    batgw_b_discharge_w, bg->bg_max_discharge_w);
+	l->l_dirty = 0;
+	l->l_evals++;
+
+	/* the verdict holds until the first fresh input goes stale */
+	timerclear(&l->l_expire);
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		bs = &b->b_state;
+
+		for (f = BATGW_B_F_NONE + 1; f < BATGW_B_F_COUNT; f++) {
+			if (!ISSET(BATGW_LIMITS_FIELDS, 1U << f) ||
+			    batgw_b_stale(b, f))
+				continue;
+
+			timeradd(&bs->bs_updated[f], &bs->bs_max_age[f],
+			    &expire);
+			if (!timerisset(&l->l_expire) ||
+			    timercmp(&expire, &l->l_expire, <))
+				l->l_expire = expire;
+		}
+	}
+
+	if (timerisset(&l->l_expire)) {
+		timersub(&l->l_expire, &bg->bg_now, &tv);
+		/* the field is stale once it is older than the max age */
+		tv.tv_usec += 1;
+		evtimer_add(l->l_ev, &tv);
+	} else
+		evtimer_del(l->l_ev);
+
+	charge = batgw_i_issafe(bg, l->l_safety) ? l->l_charge_da : 0;
+	discharge = batgw_i_issafe(bg, l->l_safety) ? l->l_discharge_da : 0;
+
+	return (charge < ocharge || discharge < odischarge);
+}
+
+/*
+ * called after a batch of battery updates. if the inverter has to
+ * back off, tell it now instead of waiting for its next tick.
+ */
+
+static void
+batgw_limits_commit(struct batgw *bg)
+{
+	const struct batgw_inverter *i = bg->bg_inverter;
+
+	if (!batgw_limits_update(bg))
+		return;
+
+	if (!bg->bg_inverter_state.is_running || i->i_limits == NULL)
+		return;
+
+	bg->bg_limits.l_pushes++;
+	i->i_limits(bg, bg->bg_inverter_sc);
+}
+
+static void
+batgw_limits_expire(int nil, short events, void *arg)
+{
+	struct batgw *bg = arg;
+	struct timeval now;
+
+	batgw_now(&now);
+	batgw_wakeup(bg, &now);
+	batgw_limits_commit(bg);
+}
+
 unsigned int
-batgw_i_get_charge_da(struct batgw *bg, unsigned int safety)
+batgw_i_get_safety(struct batgw *bg)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
-	const struct batgw_config_battery *bconf = batgw_b_config(bg);
+	batgw_limits_update(bg);
+
+	return (bg->bg_limits.l_safety);
+}
 
-	if (bg->bg_charge_off)
+int
+batgw_i_issafe(struct batgw *bg, unsigned int safety)
+{
+	if (safety == v_safe)
+		return (1);
+	if (safety == v_unsafe)
 		return (0);
+	abort();
+}
 
+unsigned int
+batgw_i_get_charge_da(struct batgw *bg, unsigned int safety)
+{
 	if (!batgw_i_issafe(bg, safety))
 		return (0);
 
-	if (bs->bs_max_cell_voltage_mv > bconf->max_cell_voltage_mv)
-		return (0);
+	batgw_limits_update(bg);
 
-	return (batgw_get_safety_limited_da(bg,
-	    bs->bs_max_charge_w, bg->bg_max_charge_w));
+	return (bg->bg_limits.l_charge_da);
 }
 
 unsigned int
 batgw_i_get_discharge_da(struct batgw *bg, unsigned int safety)
 {
-	const struct batgw_b_state *bs = &bg->bg_battery_state;
-	const struct batgw_config_battery *bconf = batgw_b_config(bg);
-
-	if (bg->bg_discharge_off)
-		return (0);
-
 	if (!batgw_i_issafe(bg, safety))
 		return (0);
 
-	if (bs->bs_min_cell_voltage_mv < bconf->min_cell_voltage_mv)
-		return (0);
+	batgw_limits_update(bg);
+
+	return (bg->bg_limits.l_discharge_da);
+}
+
+/*
+ * prometheus metrics. the page is rendered into a buffer that is
+ * kept between scrapes, and at most once a second, so however hard
+ * it gets scraped it can't take much time away from the can sockets
+ * sharing this loop.
+ */
+
+#define BATGW_HTTP_PAGE		16384
+#define BATGW_HTTP_TIMEOUT	5	/* seconds */
+#define BATGW_HTTP_HEADERS	8192
+
+struct batgw_http {
+	struct evhttp		*h_http;
+
+	char			*h_page;
+	size_t			 h_size;
+	size_t			 h_len;
+	unsigned int		 h_error;
+	unsigned int		 h_valid;
+	struct timeval		 h_rendered;
+};
+
+static const struct timeval batgw_http_tv = { 1, 0 };
+
+static void
+batgw_http_printf(struct batgw_http *h, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *page;
+	int rv;
+
+	if (h->h_error)
+		return;
+
+	for (;;) {
+		va_start(ap, fmt);
+		rv = vsnprintf(h->h_page + h->h_len, h->h_size - h->h_len,
+		    fmt, ap);
+		va_end(ap);
+		if (rv == -1) {
+			h->h_error = 1;
+			return;
+		}
+		if ((size_t)rv < h->h_size - h->h_len)
+			break;
+
+		/* the buffer stays this big for the next scrape */
+		size = h->h_size * 2;
+		page = realloc(h->h_page, size);
+		if (page == NULL) {
+			lwarn("http page %zu", size);
+			h->h_error = 1;
+			return;
+		}
+		h->h_page = page;
+		h->h_size = size;
+	}
+
+	h->h_len += rv;
+}
+
+static void
+batgw_http_kv(struct batgw_http *h, const char *scope, const char *key,
+    enum batgw_kv_type type, int idx, int v, unsigned int precision)
+{
+	char p[BATGW_KV_FMT_LEN];
+	size_t plen;
+
+	plen = batgw_kv_fmt(p, v, precision);
+	if (idx == -1) {
+		batgw_http_printf(h,
+		    "batgw_kv{scope=\"%s\",key=\"%s\",type=\"%s\"} %.*s\n",
+		    scope, key, batgw_kv_type_names[type], (int)plen, p);
+	} else {
+		batgw_http_printf(h, "batgw_kv{scope=\"%s\",key=\"%s\","
+		    "type=\"%s\",index=\"%d\"} %.*s\n",
+		    scope, key, batgw_kv_type_names[type], idx, (int)plen, p);
+	}
+}
+
+static void
+batgw_http_kvs(struct batgw *bg, struct batgw_http *h)
+{
+	const struct batgw_kv_scope *ks;
+	const struct batgw_kv_block *kb;
+	const struct batgw_kv *kv;
+	size_t i;
+
+	batgw_http_printf(h, "# TYPE batgw_kv gauge\n");
+
+	TAILQ_FOREACH(ks, &bg->bg_kv_scopes, ks_entry) {
+		kb = ks->ks_block;
+		if (kb != NULL) {
+			for (i = 0; i < kb->kb_n; i++) {
+				if (!batgw_kv_block_isset(kb->kb_valid, i))
+					continue;
+				batgw_http_kv(h, ks->ks_scope, kb->kb_name,
+				    kb->kb_type, i, kb->kb_v[i],
+				    kb->kb_precision);
+			}
+		}
+
+		for (i = 0; i < ks->ks_nkvs; i++) {
+			kv = &ks->ks_kvs[i];
+			if (kv->kv_v == INT_MIN)
+				continue;
+
+			if (ks->ks_array != NULL) {
+				batgw_http_kv(h, ks->ks_scope, ks->ks_array,
+				    kv->kv_type, i, kv->kv_v,
+				    kv->kv_precision);
+			} else {
+				batgw_http_kv(h, ks->ks_scope, kv->kv_key,
+				    kv->kv_type, -1, kv->kv_v,
+				    kv->kv_precision);
+			}
+		}
+	}
+}
+
+static void
+batgw_http_batteries(struct batgw *bg, struct batgw_http *h)
+{
+	const struct batgw_b *b;
+	unsigned int i, f;
+
+	batgw_http_printf(h, "# TYPE batgw_battery_running gauge\n");
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		batgw_http_printf(h, "batgw_battery_running{scope=\"%s\"} %u\n",
+		    b->b_scope, b->b_state.bs_running);
+	}
+
+	/* in the units the drivers set them in, eg, dV and dA */
+	batgw_http_printf(h, "# TYPE batgw_battery_field gauge\n");
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		for (f = BATGW_B_F_NONE + 1; f < BATGW_B_F_COUNT; f++) {
+			batgw_http_printf(h, "batgw_battery_field"
+			    "{scope=\"%s\",field=\"%s\"} %d\n",
+			    b->b_scope, batgw_b_field_names[f],
+			    batgw_b_field(&b->b_state, f));
+		}
+	}
+
+	batgw_http_printf(h, "# TYPE batgw_battery_fresh gauge\n");
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		for (f = BATGW_B_F_NONE + 1; f < BATGW_B_F_COUNT; f++) {
+			batgw_http_printf(h, "batgw_battery_fresh"
+			    "{scope=\"%s\",field=\"%s\"} %d\n",
+			    b->b_scope, batgw_b_field_names[f],
+			    !batgw_b_stale(b, f));
+		}
+	}
+
+	batgw_http_printf(h, "# TYPE batgw_battery_safe gauge\n");
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		batgw_http_printf(h, "batgw_battery_safe{scope=\"%s\"} %u\n",
+		    b->b_scope, b->b_safe);
+	}
+
+	batgw_http_printf(h, "# TYPE batgw_battery_unsafe gauge\n");
+	for (i = 0; i < bg->bg_nbatteries; i++) {
+		b = &bg->bg_batteries[i];
+		if (b->b_unsafe_reason == NULL)
+			continue;
+		batgw_http_printf(h, "batgw_battery_unsafe"
+		    "{scope=\"%s\",reason=\"%s\"} 1\n",
+		    b->b_scope, b->b_unsafe_reason);
+	}
+}
+
+/* the same percentiles the mqtt status has */
+static void
+batgw_http_hists(struct batgw *bg, struct batgw_http *h)
+{
+	const struct batgw_hist *hh;
+
+	batgw_http_printf(h, "# TYPE batgw_latency_us summary\n");
+	TAILQ_FOREACH(hh, &bg->bg_hists, h_entry) {
+		batgw_http_printf(h,
+		    "batgw_latency_us{name=\"%s\",quantile=\"0.5\"} %u\n"
+		    "batgw_latency_us{name=\"%s\",quantile=\"0.99\"} %u\n"
+		    "batgw_latency_us_sum{name=\"%s\"} %llu\n"
+		    "batgw_latency_us_count{name=\"%s\"} %llu\n",
+		    hh->h_name, batgw_hist_pct(hh, 50),
+		    hh->h_name, batgw_hist_pct(hh, 99),
+		    hh->h_name, (unsigned long long)hh->h_sum,
+		    hh->h_name, (unsigned long long)hh->h_count);
+	}
+
+	batgw_http_printf(h, "# TYPE batgw_latency_us_max gauge\n");
+	TAILQ_FOREACH(hh, &bg->bg_hists, h_entry) {
+		batgw_http_printf(h, "batgw_latency_us_max{name=\"%s\"} %u\n",
+		    hh->h_name, hh->h_max);
+	}
+}
+
+static void
+batgw_http_tasks(struct batgw *bg, struct batgw_http *h)
+{
+	const struct batgw_task *t;
+
+	batgw_http_printf(h, "# TYPE batgw_task_runs_total counter\n");
+	TAILQ_FOREACH(t, &bg->bg_tasks, t_entry) {
+		batgw_http_printf(h,
+		    "batgw_task_runs_total{task=\"%s\"} %llu\n",
+		    t->t_name, (unsigned long long)t->t_runs);
+	}
+
+	batgw_http_printf(h, "# TYPE batgw_task_late_total counter\n");
+	TAILQ_FOREACH(t, &bg->bg_tasks, t_entry) {
+		batgw_http_printf(h,
+		    "batgw_task_late_total{task=\"%s\"} %llu\n",
+		    t->t_name, (unsigned long long)t->t_late);
+	}
+
+	batgw_http_printf(h, "# TYPE batgw_task_overruns_total counter\n");
+	TAILQ_FOREACH(t, &bg->bg_tasks, t_entry) {
+		batgw_http_printf(h,
+		    "batgw_task_overruns_total{task=\"%s\"} %llu\n",
+		    t->t_name, (unsigned long long)t->t_overruns);
+	}
+}
+
+static void
+batgw_http_render(struct batgw *bg, struct batgw_http *h)
+{
+	const struct batgw_limits *l = &bg->bg_limits;
+	const struct batgw_mqtt *bgm = bg->bg_mqtt;
+	const struct batgw_can *c;
+
+	h->h_len = 0;
+	h->h_error = 0;
+
+	batgw_http_kvs(bg, h);
+	batgw_http_batteries(bg, h);
+	batgw_http_tasks(bg, h);
+	batgw_http_hists(bg, h);
+
+	/* what the inverter was last told, without working it out again */
+	batgw_http_printf(h, "# TYPE batgw_limits_safe gauge\n"
+	    "batgw_limits_safe %u\n", l->l_safety == v_safe);
+	batgw_http_printf(h, "# TYPE batgw_limits_charge_da gauge\n"
+	    "batgw_limits_charge_da %u\n", l->l_charge_da);
+	batgw_http_printf(h, "# TYPE batgw_limits_discharge_da gauge\n"
+	    "batgw_limits_discharge_da %u\n", l->l_discharge_da);
+	batgw_http_printf(h, "# TYPE batgw_limits_evals_total counter\n"
+	    "batgw_limits_evals_total %llu\n",
+	    (unsigned long long)l->l_evals);
+	batgw_http_printf(h, "# TYPE batgw_limits_pushes_total counter\n"
+	    "batgw_limits_pushes_total %llu\n",
+	    (unsigned long long)l->l_pushes);
+
+	batgw_http_printf(h, "# TYPE batgw_inverter_running gauge\n"
+	    "batgw_inverter_running %u\n",
+	    bg->bg_inverter_state.is_running);
+	batgw_http_printf(h, "# TYPE batgw_inverter_contactor gauge\n"
+	    "batgw_inverter_contactor %u\n",
+	    bg->bg_inverter_state.is_contactor);
+
+	batgw_http_printf(h, "# TYPE batgw_can_rx_frames_total counter\n");
+	TAILQ_FOREACH(c, &bg->bg_cans, c_entry) {
+		batgw_http_printf(h, "batgw_can_rx_frames_total"
+		    "{scope=\"%s\",interface=\"%s\"} %llu\n",
+		    c->c_scope, c->c_ifname, (unsigned long long)c->c_rx);
+	}
+
+	if (bgm != NULL) {
+		batgw_http_printf(h, "# TYPE batgw_mqtt_running gauge\n"
+		    "batgw_mqtt_running %u\n", bgm->running);
+		batgw_http_printf(h, "# TYPE batgw_mqtt_held gauge\n"
+		    "batgw_mqtt_held %u\n",
+		    bgm->store.s_n - bgm->store.s_next);
+		batgw_http_printf(h, "# TYPE batgw_mqtt_dropped_total counter\n"
+		    "batgw_mqtt_dropped_total %llu\n",
+		    (unsigned long long)bgm->dropped);
+	}
+}
+
+static void
+batgw_http_metrics(struct evhttp_request *req, void *arg)
+{
+	struct batgw *bg = arg;
+	struct batgw_http *h = bg->bg_http;
+	struct timeval now, diff;
+
+	batgw_now(&now);
+	batgw_wakeup(bg, &now);
+
+	timersub(&now, &h->h_rendered, &diff);
+	if (!h->h_valid || timercmp(&diff, &batgw_http_tv, >=)) {
+		batgw_http_render(bg, h);
+		h->h_rendered = now;
+		h->h_valid = !h->h_error;
+	}
+
+	if (h->h_error) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Content-Type", "text/plain; version=0.0.4");
+	evbuffer_add(evhttp_request_get_output_buffer(req),
+	    h->h_page, h->h_len);
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+static void
+batgw_http_init(struct batgw *bg)
+{
+	const struct batgw_config_http *httpconf = bg->bg_conf->http;
+	struct batgw_http *h;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		err(1, "http alloc");
+
+	h->h_size = BATGW_HTTP_PAGE;
+	h->h_page = malloc(h->h_size);
+	if (h->h_page == NULL)
+		err(1, "http page");
+
+	h->h_http = evhttp_new(bg->bg_evbase);
+	if (h->h_http == NULL)
+		errx(1, "http new failed");
+
+	evhttp_set_allowed_methods(h->h_http, EVHTTP_REQ_GET);
+	evhttp_set_timeout(h->h_http, BATGW_HTTP_TIMEOUT);
+	evhttp_set_max_headers_size(h->h_http, BATGW_HTTP_HEADERS);
+	if (evhttp_set_cb(h->h_http, "/metrics", batgw_http_metrics, bg) != 0)
+		errx(1, "http metrics callback");
+
+	if (evhttp_bind_socket(h->h_http, httpconf->listen,
+	    httpconf->port) != 0) {
+		err(1, "http listen on %s port %d",
+		    httpconf->listen, httpconf->port);
+	}
 
-	return (batgw_get_safety_limited_da(bg,
-	    bs->bs_max_discharge_w, bg->bg_max_discharge_w));
+	bg->bg_http = h;
 }
@@ -19,6 +19,7 @@
 #include <event.h>
 
 struct batgw;
+struct batgw_b;		/* one battery pack */
 
 enum batgw_kv_type {
 	KV_T_TEMP,
@@ -41,6 +42,22 @@ struct batgw_kv {
 	unsigned int		 kv_updated;
 	enum batgw_kv_type	 kv_type;
 	unsigned int		 kv_precision;
+
+	char			*kv_topic;	/* built by batgw_kv_attach */
+	size_t			 kv_topic_len;
+
+	const char		*kv_scope;
+	int			 kv_published;
+	unsigned int		 kv_deadband;	/* in kv_precision units */
+	unsigned int		 kv_flags;
+#define KV_F_DIRTY			(1 << 0)
+	struct batgw_kv		*kv_dirty;
+
+	/* every update since the last teleperiod */
+	unsigned int		 kv_n;
+	int			 kv_min;
+	int			 kv_max;
+	int64_t			 kv_sum;
 };
 
 void	batgw_kv_init(struct batgw_kv *, const char *key,
@@ -59,12 +76,139 @@ struct batgw_kv_tpl {
 
 void	batgw_kv_init_tpl(struct batgw_kv *, const struct batgw_kv_tpl *);
 
+/*
+ * let the core know about a driver's kvs once they're initialised
+ */
+void	batgw_kv_attach(struct batgw *, const char *,
+	    struct batgw_kv *, size_t);
+void	batgw_kv_attach_array(struct batgw *, const char *, const char *,
+	    struct batgw_kv *, size_t);
+
+/*
+ * a run of values sharing a name, type and precision, stored as
+ * plain arrays. entries are published as "name<i>/type".
+ */
+struct batgw_kv_block;
+
+struct batgw_kv_block *
+	batgw_kv_block_attach(struct batgw *, const char *, const char *,
+	    enum batgw_kv_type, unsigned int, unsigned int);
+void	batgw_kv_block_update(struct batgw *, struct batgw_kv_block *,
+	    unsigned int, int);
+int	batgw_kv_block_get(const struct batgw_kv_block *, unsigned int);
+void	batgw_kv_block_publish(struct batgw *,
+	    const struct batgw_kv_block *);
+
+/*
+ * match a single standard frame id, or a range of them
+ */
+#define CAN_FILTER(_id) \
+	{ .can_id = (_id), .can_mask = CAN_EFF_FLAG|CAN_RTR_FLAG|CAN_SFF_MASK }
+#define CAN_FILTER_MASK(_id, _m) \
+	{ .can_id = (_id), .can_mask = CAN_EFF_FLAG|CAN_RTR_FLAG|(_m) }
+
+/*
+ * classic frames are carried in a canfd_frame too, they're just no
+ * longer than 8 bytes and don't have CANFD_FDF set.
+ */
+#ifndef CANFD_FDF
+#define CANFD_FDF		0x04
+#endif
+#define CAN_ISFD(_f) \
+	((_f)->len > CAN_MAX_DLEN || ISSET((_f)->flags, CANFD_FDF))
+
+/*
+ * battery state that drivers can feed from a decoder table
+ */
+enum batgw_b_field {
+	BATGW_B_F_NONE,
+
+	BATGW_B_F_SOC_CPCT,
+	BATGW_B_F_VOLTAGE_DV,
+	BATGW_B_F_CURRENT_DA,
+	BATGW_B_F_MIN_TEMP_DC,
+	BATGW_B_F_MAX_TEMP_DC,
+	BATGW_B_F_AVG_TEMP_DC,
+	BATGW_B_F_MIN_CELL_VOLTAGE_MV,
+	BATGW_B_F_MAX_CELL_VOLTAGE_MV,
+	BATGW_B_F_CHARGE_W,
+	BATGW_B_F_DISCHARGE_W,
+
+	BATGW_B_F_COUNT
+};
+
+/*
+ * a decoder table maps bits of frames to kvs and battery state.
+ *
+ * the table must be sorted by cd_id. an entry with cd_bits set to 0
+ * carries no value, it only contributes its flags when the id matches.
+ * values are decoded as ((raw + cd_add) * cd_mul) / cd_div, where a
+ * cd_mul or cd_div of 0 is treated as 1. the kv gets that value, while
+ * the battery state field gets it multiplied by cd_field_mul. fields
+ * are only set when decoding for a pack, and the kvs then go under the
+ * pack's scope instead of cdr_scope.
+ *
+ * frames are found through a hash of the ids that points at the first
+ * entry for each one. drivers provide the storage for it, and it is
+ * filled in by can_decoder_init(), which the core runs on the tables
+ * that are set up as b_decoder or i_decoder. other tables have to be
+ * passed to it by the driver before they're used.
+ */
+struct can_decode {
+	canid_t			 cd_id;
+	unsigned int		 cd_flags;
+#define CAN_D_ALIVE			(1 << 0) /* the peer is running */
+#define CAN_D_MUX			(1 << 1) /* byte at cd_mux_off */
+#define CAN_D_MUX16			(1 << 2) /* be16 at cd_mux_off */
+#define CAN_D_LE			(1 << 3) /* value is little endian */
+#define CAN_D_SIGNED			(1 << 4) /* sign extend the value */
+
+	uint8_t			 cd_mux_off;
+	uint16_t		 cd_mux_mask;	/* 0 compares all bits */
+	uint16_t		 cd_mux;
+
+	uint8_t			 cd_off;
+	uint8_t			 cd_bits;
+	int			 cd_add;
+	int			 cd_mul;
+	int			 cd_div;
+
+	unsigned int		 cd_kv;
+	enum batgw_b_field	 cd_field;
+	int			 cd_field_mul;
+};
+
+#define CAN_DECODE_SLOTS	64	/* power of 2, at least twice the ids */
+
+struct can_decode_index {
+	uint8_t			 ci_slots[CAN_DECODE_SLOTS]; /* entry + 1 */
+};
+
+struct can_decoder {
+	const char		*cdr_scope;
+	const struct can_decode	*cdr_table;
+	size_t			 cdr_ntable;
+	size_t			 cdr_nkvs;
+	struct can_decode_index	*cdr_index;
+};
+
+void		 can_decoder_init(const char *, const struct can_decoder *);
+unsigned int	 can_decode(struct batgw *, struct batgw_b *,
+		     const struct can_decoder *, struct batgw_kv *,
+		     const struct canfd_frame *);
+
 struct batgw_battery {
 	int	 (*b_check)(const struct batgw_config_battery *);
 	void	 (*b_config)(struct batgw_config_battery *);
-	void	*(*b_attach)(struct batgw *);
+	void	*(*b_attach)(struct batgw *, struct batgw_b *);
 	void	 (*b_dispatch)(struct batgw *, void *);
 	void	 (*b_teleperiod)(struct batgw *, void *);
+
+	const struct can_decoder
+		*b_decoder;
+	const struct can_filter
+		*b_filters;	/* in addition to the decoder ids */
+	size_t	 b_nfilters;
 };
 
 struct batgw_inverter {
@@ -73,43 +217,99 @@ struct batgw_inverter {
 	void	*(*i_attach)(struct batgw *);
 	void	 (*i_dispatch)(struct batgw *, void *);
 	void	 (*i_teleperiod)(struct batgw *, void *);
+	/* the allowed current went down, tell the inverter now */
+	void	 (*i_limits)(struct batgw *, void *);
+
+	const struct can_decoder
+		*i_decoder;
+	const struct can_filter
+		*i_filters;	/* in addition to the decoder ids */
+	size_t	 i_nfilters;
 };
 
 struct event_base	*batgw_event_base(struct batgw *);
+void			 batgw_now(struct timeval *);	/* monotonic */
+
+/*
+ * periodic work. the period is measured from absolute deadlines, and
+ * the phase offsets the first deadline from the start. a NULL phase
+ * staggers the task against the ones registered before it.
+ */
+struct batgw_task;
+
+struct batgw_task	*batgw_task_add(struct batgw *, const char *,
+			     const struct timeval *, const struct timeval *,
+			     void (*)(struct batgw *, void *), void *);
+void			 batgw_task_start(struct batgw_task *);
+void			 batgw_task_stop(struct batgw_task *);
+
+/*
+ * latency histograms, in microseconds. they're reported in STATUS.
+ */
+struct batgw_hist;
+
+struct batgw_hist	*batgw_hist_add(struct batgw *, const char *);
+void			 batgw_hist_record(struct batgw_hist *, uint32_t);
+void			 batgw_hist_rx(struct batgw *, struct batgw_hist *);
 unsigned int		 batgw_verbose(const struct batgw *);
 void			 batgw_publish(struct batgw *,
 			     const char *, size_t, const char *, size_t);
 
-void		*batgw_b_softc(struct batgw *);
+/*
+ * per cell voltages, kept in a kv block with running statistics.
+ * the lowest and highest cells feed the battery state once every
+ * cell has reported.
+ */
+struct batgw_cells;
+
+struct batgw_cells	*batgw_cells_create(struct batgw *, struct batgw_b *,
+			     const char *, unsigned int);
+void			 batgw_cells_set(struct batgw_cells *, unsigned int,
+			     unsigned int);
+void			 batgw_cells_commit(struct batgw *,
+			     struct batgw_cells *);
+int			 batgw_cells_fresh(struct batgw *,
+			     const struct batgw_cells *);
+void			 batgw_cells_publish(struct batgw *,
+			     const struct batgw_cells *);
+
 const struct batgw_config_battery *
-		 batgw_b_config(struct batgw *);
-
-void		 batgw_b_set_running(struct batgw *);
-void		 batgw_b_set_stopped(struct batgw *);
-void		 batgw_b_set_rated_capacity_ah(struct batgw *, unsigned int);
-void		 batgw_b_set_rated_voltage_dv(struct batgw *, unsigned int);
-void		 batgw_b_set_rated_capacity_wh(struct batgw *, unsigned int);
-void		 batgw_b_set_max_voltage_dv(struct batgw *, unsigned int);
-void		 batgw_b_set_min_voltage_dv(struct batgw *, unsigned int);
-void		 batgw_b_set_max_voltage_dv(struct batgw *, unsigned int);
-void		 batgw_b_set_soc_c_pct(struct batgw *, unsigned int);
-void		 batgw_b_set_voltage_dv(struct batgw *, unsigned int);
-void		 batgw_b_set_current_da(struct batgw *, int);
-void		 batgw_b_set_min_temp_dc(struct batgw *, int);
-void		 batgw_b_set_max_temp_dc(struct batgw *, int);
-void		 batgw_b_set_avg_temp_dc(struct batgw *, int);
-void		 batgw_b_set_min_cell_voltage_mv(struct batgw *, unsigned int);
-void		 batgw_b_set_max_cell_voltage_mv(struct batgw *, unsigned int);
-
-void		 batgw_b_set_charge_w(struct batgw *, unsigned int);
-void		 batgw_b_set_discharge_w(struct batgw *, unsigned int);
+		 batgw_b_config(const struct batgw_b *);
+const char	*batgw_b_scope(const struct batgw_b *);
+const char	*batgw_b_name(const struct batgw_b *, const char *,
+		     const char *);
+int		 batgw_b_can_open(struct batgw_b *, const char *);
+
+void		 batgw_b_set(struct batgw_b *, enum batgw_b_field, int);
+void		 batgw_b_set_running(struct batgw_b *);
+void		 batgw_b_set_stopped(struct batgw_b *);
+void		 batgw_b_set_rated_capacity_ah(struct batgw_b *, unsigned int);
+void		 batgw_b_set_rated_voltage_dv(struct batgw_b *, unsigned int);
+void		 batgw_b_set_rated_capacity_wh(struct batgw_b *, unsigned int);
+void		 batgw_b_set_min_voltage_dv(struct batgw_b *, unsigned int);
+void		 batgw_b_set_max_voltage_dv(struct batgw_b *, unsigned int);
+void		 batgw_b_set_soc_c_pct(struct batgw_b *, unsigned int);
+void		 batgw_b_set_voltage_dv(struct batgw_b *, unsigned int);
+void		 batgw_b_set_current_da(struct batgw_b *, int);
+void		 batgw_b_set_min_temp_dc(struct batgw_b *, int);
+void		 batgw_b_set_max_temp_dc(struct batgw_b *, int);
+void		 batgw_b_set_avg_temp_dc(struct batgw_b *, int);
+void		 batgw_b_set_min_cell_voltage_mv(struct batgw_b *,
+		     unsigned int);
+void		 batgw_b_set_max_cell_voltage_mv(struct batgw_b *,
+		     unsigned int);
 
+void		 batgw_b_set_charge_w(struct batgw_b *, unsigned int);
+void		 batgw_b_set_discharge_w(struct batgw_b *, unsigned int);
+
+/* these look across all the packs */
 int		 batgw_b_get_running(const struct batgw *);
 unsigned int	 batgw_b_get_contactor(const struct batgw *);
 
 void		*batgw_i_softc(struct batgw *);
 const struct batgw_config_inverter *
 		 batgw_i_config(struct batgw *);
+int		 batgw_i_can_open(struct batgw *, const char *);
 
 void		 batgw_i_set_running(struct batgw *);
 void		 batgw_i_set_stopped(struct batgw *);
@@ -137,11 +337,82 @@ int		 batgw_i_issafe(struct batgw *, unsigned int);
 unsigned int	 batgw_i_get_charge_da(struct batgw *, unsigned int);
 unsigned int	 batgw_i_get_discharge_da(struct batgw *, unsigned int);
 
-int		 can_open(const char *, const char *);
-uint16_t	 can_betoh16(const struct can_frame *, size_t);
-uint32_t	 can_betoh32(const struct can_frame *, size_t);
-uint16_t	 can_letoh16(const struct can_frame *, size_t);
-void		 can_htobe16(struct can_frame *, size_t, uint16_t);
-void		 can_htole16(struct can_frame *, size_t, uint16_t);
+int		 can_open(const char *, const char *,
+		     const struct can_filter *, size_t, unsigned int);
+
+/*
+ * cyclic transmit. each interval sends the next frame in the
+ * sequence, wrapping at the end. the kernel broadcast manager does
+ * the timing if it is enabled in the config, otherwise an evtimer
+ * sends the frames on the raw socket.
+ */
+#define CAN_CYCLIC_MAX		16
+
+struct can_cyclic;
+
+struct can_cyclic *
+		 batgw_b_can_cyclic(struct batgw_b *, const char *, int,
+		     const struct timeval *, const struct canfd_frame *,
+		     size_t);
+void		 can_cyclic_start(struct can_cyclic *);
+void		 can_cyclic_update(struct can_cyclic *,
+		     const struct canfd_frame *, size_t);
+void		 can_recv(struct batgw *, int, const char *,
+		     void (*)(struct batgw *, void *,
+		      const struct canfd_frame *), void *);
+int		 can_send(struct batgw *, int, const struct canfd_frame *);
+uint16_t	 can_betoh16(const struct canfd_frame *, size_t);
+uint32_t	 can_betoh32(const struct canfd_frame *, size_t);
+uint16_t	 can_letoh16(const struct canfd_frame *, size_t);
+void		 can_htobe16(struct canfd_frame *, size_t, uint16_t);
+void		 can_htole16(struct canfd_frame *, size_t, uint16_t);
+
+void		 can_htobe64(struct canfd_frame *, uint64_t);
+
+/*
+ * iso-tp transport, see isotp.c. the input callback gets each
+ * reassembled message, or a NULL buffer and an errno if a transfer
+ * in either direction failed.
+ */
+#define ISOTP_MAX		4095
+
+struct isotp_params {
+	unsigned int		 ip_bs;		/* block size we ask for */
+	unsigned int		 ip_stmin_us;	/* gap we ask for */
+	struct timeval		 ip_timeout;	/* N_Bs and N_Cr */
+	uint8_t			 ip_pad;
+};
+
+struct isotp;
+
+struct isotp	*isotp_create(struct batgw *, const char *, int,
+		     canid_t, canid_t, const struct isotp_params *,
+		     void (*)(struct batgw *, void *,
+		      const uint8_t *, size_t, int), void *);
+int		 isotp_write(struct isotp *, const void *, size_t);
+int		 isotp_input(struct isotp *, const struct canfd_frame *);
+
+/*
+ * uds ReadDataByIdentifier client on top of iso-tp. each did in the
+ * answer is handed to the did callback, then the done callback says
+ * how the request went.
+ */
+#define UDS_MAX_DIDS		8
+
+struct uds_did {
+	uint16_t		 did;
+	uint8_t			 len;	/* of the data in the answer */
+};
+
+struct uds;
 
-void		 can_htobe64(struct can_frame *, uint64_t);
+struct uds	*uds_create(struct batgw *, const char *, int,
+		     canid_t, canid_t, const struct isotp_params *,
+		     unsigned int,
+		     void (*)(struct batgw *, void *, uint16_t,
+		      const uint8_t *, size_t),
+		     void (*)(struct batgw *, void *, int), void *);
+unsigned int	 uds_maxdids(const struct uds *);
+int		 uds_busy(const struct uds *);
+size_t		 uds_read(struct uds *, const struct uds_did *, size_t);
+int		 uds_can_input(struct uds *, const struct canfd_frame *);
@@ -20,6 +20,8 @@
 #define BATGW_MQTT_PORT			"1883"
 #define BATGW_MQTT_TOPIC		"battery-gateway"
 
+#define BATGW_MQTT_CONNECT_TMO		10 /* seconds */
+
 #define BATGW_MQTT_TELEPERIOD		300 /* seconds */
 #define BATGW_MQTT_TELEPERIOD_MIN	4
 #define BATGW_MQTT_TELEPERIOD_MAX	3600
@@ -28,6 +30,35 @@
 #define BATGW_MQTT_KEEPALIVE_OFF	0
 #define BATGW_MQTT_KEEPALIVE_DEFAULT	30
 
+#define BATGW_MQTT_PUBLISH_UNSET	-1
+#define BATGW_MQTT_PUBLISH_MIN		10 /* seconds */
+#define BATGW_MQTT_PUBLISH_MAX		3600
+
+#define BATGW_MQTT_DEADBANDS		32
+
+#define BATGW_MQTT_OBUF_SIZE		65536
+#define BATGW_MQTT_WATERMARK_LOW	(BATGW_MQTT_OBUF_SIZE / 4)
+#define BATGW_MQTT_WATERMARK_HIGH	(BATGW_MQTT_OBUF_SIZE * 3 / 4)
+
+#define BATGW_MQTT_QOS_UNSET		-1
+
+#define BATGW_MQTT_QUEUE_MAX		65536	/* topics held offline */
+#define BATGW_MQTT_QUEUE_RATE		100	/* per second */
+#define BATGW_MQTT_QUEUE_RATE_MAX	10000
+
+#define BATGW_MQTT_TXQ_SIZE		262144	/* to the mqtt thread */
+#define BATGW_MQTT_RXQ_SIZE		16384	/* back to the can loop */
+
+struct batgw_config_deadband {
+	char		*name;		/* kv type, or scope/key/type */
+	unsigned int	 milli;		/* thousandths of the unit */
+};
+
+#define BATGW_MQTT_TELEMETRY_UNSET	0
+#define BATGW_MQTT_TELEMETRY_KV		1	/* a topic per kv */
+#define BATGW_MQTT_TELEMETRY_JSON	2	/* a document per scope */
+#define BATGW_MQTT_TELEMETRY_BINARY	3	/* varint deltas by kv id */
+
 struct batgw_config_mqtt {
 	int		 af;
 	char		*host;
@@ -38,9 +69,32 @@ struct batgw_config_mqtt {
 	char		*topic;
 
 	int		 keepalive;
+	int		 telemetry;
 	unsigned int	 teleperiod;
 	unsigned int	 connect_tmo;		/* approx seconds */
 	unsigned int	 reconnect_tmo;		/* approx seconds */
+
+	unsigned int	 wm_low;		/* bytes */
+	unsigned int	 wm_high;		/* bytes */
+	unsigned int	 thread;		/* own thread and event base */
+	unsigned int	 rollup;		/* min/max/avg per teleperiod */
+	int		 qos;
+	unsigned int	 queue;			/* topics, 0 is off */
+	unsigned int	 queue_rate;		/* per second */
+
+	int		 publish_min;		/* seconds */
+	unsigned int	 publish_max;		/* seconds, 0 is off */
+	struct batgw_config_deadband
+			 deadbands[BATGW_MQTT_DEADBANDS];
+	unsigned int	 ndeadbands;
+};
+
+#define BATGW_BATTERY_MAX_AGE_MS	30000
+#define BATGW_BATTERY_MAX_AGES		16
+
+struct batgw_config_max_age {
+	char		*name;		/* battery state field */
+	unsigned int	 ms;
 };
 
 #define BATGW_CHARGE_MAX_DEFAULT	10000
@@ -49,9 +103,14 @@ struct batgw_config_mqtt {
 #define BATGW_DISCHARGE_MAX_DEFAULT	10000
 #define BATGW_DISCHARGE_DEFAULT		BATGW_DISCHARGE_MAX_DEFAULT
 
+#define BATGW_CAN_FD			(1 << 0)
+#define BATGW_CAN_FD_BRS		(1 << 1)
+
 struct batgw_config_battery {
 	char		*protocol;
 	char		*ifname;
+	int		 bcm;
+	unsigned int	 canfd;			/* BATGW_CAN_FD flags */
 
 	unsigned int	 rated_capacity_ah;
 	unsigned int	 rated_voltage_dv;
@@ -69,20 +128,45 @@ struct batgw_config_battery {
 	unsigned int	 charge_w;
 	unsigned int	 max_discharge_w;
 	unsigned int	 discharge_w;
+
+	unsigned int	 max_age_ms;		/* 0 is the default */
+	struct batgw_config_max_age
+			 max_ages[BATGW_BATTERY_MAX_AGES];
+	unsigned int	 nmax_ages;
 };
 
 struct batgw_config_inverter {
 	char		*protocol;
 	char		*ifname;
+	unsigned int	 canfd;			/* BATGW_CAN_FD flags */
+};
+
+#define BATGW_BATTERIES			4	/* packs in parallel */
+
+#define BATGW_RT_PRIORITY_MIN		1	/* SCHED_FIFO */
+#define BATGW_RT_PRIORITY_MAX		99
+#define BATGW_RT_CPU_MAX		1023
+
+#define BATGW_HTTP_PORT			9150
+
+struct batgw_config_http {
+	char		*listen;
+	int		 port;
 };
 
 struct batgw_config {
 	struct batgw_config_mqtt	*mqtt;
-	struct batgw_config_battery	 battery;
+	struct batgw_config_http	*http;
+	struct batgw_config_battery	 batteries[BATGW_BATTERIES];
+	unsigned int			 nbatteries;
 	struct batgw_config_inverter	 inverter;
+
+	int				 rt_priority;	/* 0 is off */
+	int				 rt_cpu;	/* -1 is any */
 };
 
 struct batgw_config	*parse_config(const char *);
 void			 dump_config(const struct batgw_config *);
 void			 clear_config(struct batgw_config *);
+void			 clear_config_mqtt(struct batgw_config_mqtt *);
 int			 cmdline_symset(const char *);
@@ -19,6 +19,8 @@
 #include "../compat.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <err.h>
 #include <limits.h>
 
@@ -36,6 +38,7 @@
 #define BYD_MIN_CELL_VOLTAGE_MV		2800
 #define BYD_MAX_CELL_VOLTAGE_MV		3800
 #define BYD_DEV_CELL_VOLTAGE_MV		300
+#define BYD_NPACKS			10	/* temperature sensors */
 
 #define BYD_PID_BATTERY_SOC		0x0005
 #define BYD_PID_BATTERY_VOLTAGE		0x0008
@@ -53,6 +56,10 @@
 #define BYD_PID_TOTAL_CHARGED_KWH	0x0011
 #define BYD_PID_TOTAL_DISCHARGED_KWH	0x0012
 
+#define BYD_UDS_TX			0x7e7
+#define BYD_UDS_RX			0x7ef
+#define BYD_UDS_MAXDIDS			4	/* falls back to 1 */
+
 /*
  * bytes 6 and 7 in the 50ms message decrement the top nibble by 1.
  * the low nibble stays the same.
@@ -60,6 +67,7 @@
 #define BYD_50MS_6_INITIALIZER		0xbf
 #define BYD_50MS_7_INITIALIZER		0x59
 #define BYD_50MS_DECR			0x10
+#define BYD_50MS_NFRAMES		(0x100 / BYD_50MS_DECR)
 
 static const struct timeval byd_50ms_change_tv = { 1, 150000 };
 
@@ -69,18 +77,10 @@ static const struct timeval byd_50ms_change_tv = { 1, 150000 };
 
 static int	 byd_b_check(const struct batgw_config_battery *);
 static void	 byd_b_config(struct batgw_config_battery *);
-static void	*byd_b_attach(struct batgw *);
+static void	*byd_b_attach(struct batgw *, struct batgw_b *);
 static void	 byd_b_dispatch(struct batgw *, void *);
 static void	 byd_b_teleperiod(struct batgw *, void *);
 
-const struct batgw_battery battery_byd = {
-	.b_check =			byd_b_check,
-	.b_config =			byd_b_config,
-	.b_attach =			byd_b_attach,
-	.b_dispatch =			byd_b_dispatch,
-	.b_teleperiod =			byd_b_teleperiod,
-};
-
 /*
  * byd software driver
  */
@@ -153,38 +153,211 @@ static const struct batgw_kv_tpl byd_kvs_tpl[BYD_KV_COUNT] = {
 		{ "discharged",		KV_T_ENERGY,	0 },
 };
 
+static const struct can_decode byd_decode[] = {
+	{ 0x244, CAN_D_ALIVE },
+	{ 0x245, CAN_D_ALIVE },
+	{ 0x245, CAN_D_MUX, .cd_mux_off = 0, .cd_mux = 0x01,
+	    .cd_off = 4, .cd_bits = 8, .cd_add = -40,
+	    .cd_kv = BYD_KV_AMBIENT },
+	{ 0x286, CAN_D_ALIVE },
+	{ 0x344, CAN_D_ALIVE },
+	{ 0x345, CAN_D_ALIVE },
+	{ 0x347, CAN_D_ALIVE },
+	{ 0x34a, CAN_D_ALIVE },
+	{ 0x35e, CAN_D_ALIVE },
+	{ 0x360, CAN_D_ALIVE },
+	{ 0x36c, CAN_D_ALIVE },
+	{ 0x438, CAN_D_ALIVE },
+	{ 0x43a, CAN_D_ALIVE },
+	{ 0x43b, CAN_D_ALIVE },
+	{ 0x43c, CAN_D_ALIVE },		/* pack temps, see byd_can_input */
+	{ 0x43d, CAN_D_ALIVE },		/* cell voltages, see byd_can_input */
+	{ 0x444, CAN_D_ALIVE|CAN_D_LE,
+	    .cd_off = 0, .cd_bits = 16,
+	    .cd_kv = BYD_KV_VOLTAGE },
+	{ 0x445, CAN_D_ALIVE },
+	{ 0x446, CAN_D_ALIVE },
+	{ 0x447, CAN_D_ALIVE|CAN_D_LE,
+	    .cd_off = 4, .cd_bits = 16,
+	    .cd_kv = BYD_KV_SOC },
+	{ 0x47b, CAN_D_ALIVE },
+	{ 0x524, CAN_D_ALIVE },
+};
+
+static struct can_decode_index byd_decode_index;
+
+static const struct can_decoder byd_decoder = {
+	.cdr_scope =			"battery",
+	.cdr_table =			byd_decode,
+	.cdr_ntable =			nitems(byd_decode),
+	.cdr_nkvs =			BYD_KV_COUNT,
+	.cdr_index =			&byd_decode_index,
+};
+
+/*
+ * the uds answers go through a decoder too. cd_id holds the did and
+ * the data is copied into a frame on its own.
+ */
+
+#define BYD_PID(_pid, _bits, _kv, ...) {				\
+	.cd_id = (_pid), .cd_flags = CAN_D_LE,				\
+	.cd_off = 0, .cd_bits = (_bits), .cd_kv = (_kv), __VA_ARGS__	\
+}
+
+static const struct can_decode byd_pid_decode[] = {
+	BYD_PID(BYD_PID_BATTERY_SOC, 8, BYD_KV_PID_SOC,
+	    .cd_field = BATGW_B_F_SOC_CPCT, .cd_field_mul = 100),
+	BYD_PID(BYD_PID_BATTERY_VOLTAGE, 16, BYD_KV_PID_VOLTAGE,
+	    .cd_field = BATGW_B_F_VOLTAGE_DV, .cd_field_mul = 10),
+	BYD_PID(BYD_PID_BATTERY_CURRENT, 16, BYD_KV_PID_CURRENT,
+	    .cd_add = -5000, .cd_mul = -1,
+	    .cd_field = BATGW_B_F_CURRENT_DA),
+	BYD_PID(BYD_PID_MAX_CHARGE_POWER, 16, BYD_KV_PID_CHARGE_POWER,
+	    .cd_mul = 100,
+	    .cd_field = BATGW_B_F_CHARGE_W),
+	BYD_PID(BYD_PID_CHARGE_TIMES, 16, BYD_KV_PID_CHARGE_COUNT),
+	BYD_PID(BYD_PID_MAX_DISCHARGE_POWER, 16, BYD_KV_PID_DISCHARGE_POWER,
+	    .cd_mul = 100,
+	    .cd_field = BATGW_B_F_DISCHARGE_W),
+	BYD_PID(BYD_PID_TOTAL_CHARGED_AH, 16, BYD_KV_PID_CHARGED_AH),
+	BYD_PID(BYD_PID_TOTAL_DISCHARGED_AH, 16, BYD_KV_PID_DISCHARGED_AH),
+	BYD_PID(BYD_PID_TOTAL_CHARGED_KWH, 16, BYD_KV_PID_CHARGED_KWH),
+	BYD_PID(BYD_PID_TOTAL_DISCHARGED_KWH, 16, BYD_KV_PID_DISCHARGED_KWH),
+	/* the cell frames feed the state, see byd_can_poll_did */
+	BYD_PID(BYD_PID_CELL_MV_MIN, 16, BYD_KV_PID_MV_MIN),
+	BYD_PID(BYD_PID_CELL_MV_MAX, 16, BYD_KV_PID_MV_MAX),
+	BYD_PID(BYD_PID_CELL_TEMP_MIN, 8, BYD_KV_PID_TEMP_MIN,
+	    .cd_add = -40,
+	    .cd_field = BATGW_B_F_MIN_TEMP_DC, .cd_field_mul = 10),
+	BYD_PID(BYD_PID_CELL_TEMP_MAX, 8, BYD_KV_PID_TEMP_MAX,
+	    .cd_add = -40,
+	    .cd_field = BATGW_B_F_MAX_TEMP_DC, .cd_field_mul = 10),
+	BYD_PID(BYD_PID_CELL_TEMP_AVG, 8, BYD_KV_PID_TEMP_AVG,
+	    .cd_add = -40,
+	    .cd_field = BATGW_B_F_AVG_TEMP_DC, .cd_field_mul = 10),
+};
+
+static struct can_decode_index byd_pid_decode_index;
+
+static const struct can_decoder byd_pid_decoder = {
+	.cdr_scope =			"battery",
+	.cdr_table =			byd_pid_decode,
+	.cdr_ntable =			nitems(byd_pid_decode),
+	.cdr_nkvs =			BYD_KV_COUNT,
+	.cdr_index =			&byd_pid_decode_index,
+};
+
+static const struct can_filter byd_filters[] = {
+	CAN_FILTER(BYD_UDS_RX),
+};
+
+static const struct isotp_params byd_isotp = {
+	.ip_bs =			8,
+	.ip_stmin_us =			5000,
+	.ip_timeout =			{ 1, 0 },
+	.ip_pad =			0x00,
+};
+
+const struct batgw_battery battery_byd = {
+	.b_check =			byd_b_check,
+	.b_config =			byd_b_config,
+	.b_attach =			byd_b_attach,
+	.b_dispatch =			byd_b_dispatch,
+	.b_teleperiod =			byd_b_teleperiod,
+
+	.b_decoder =			&byd_decoder,
+	.b_filters =			byd_filters,
+	.b_nfilters =			nitems(byd_filters),
+};
+
+/*
+ * each pid has a target age. the ones that are furthest past their
+ * target (relative to the target) are asked for as soon as the
+ * previous answer arrives, as many in one request as the bms takes.
+ * the list is in priority order, which settles ties.
+ *
+ * a pid that goes unanswered, or is refused, is left alone for its
+ * target age, doubling each time it fails again up to a minute. it
+ * is then asked for on its own so it can't take others down with it.
+ */
+
+struct byd_poll_pid {
+	uint16_t		 pid;
+	uint8_t			 len;
+	const char		*name;
+	struct timeval		 age;
+};
+
+static const struct byd_poll_pid byd_poll_pids[] = {
+	{ BYD_PID_BATTERY_CURRENT, 2,	"pid current",		{ 1, 0 } },
+	{ BYD_PID_CELL_MV_MIN, 2,	"pid mv-min",		{ 1, 0 } },
+	{ BYD_PID_CELL_MV_MAX, 2,	"pid mv-max",		{ 1, 0 } },
+	{ BYD_PID_CELL_TEMP_MIN, 1,	"pid temp-min",		{ 2, 0 } },
+	{ BYD_PID_CELL_TEMP_MAX, 1,	"pid temp-max",		{ 2, 0 } },
+	{ BYD_PID_MAX_CHARGE_POWER, 2,	"pid charge",		{ 2, 0 } },
+	{ BYD_PID_MAX_DISCHARGE_POWER, 2, "pid discharge",	{ 2, 0 } },
+	{ BYD_PID_BATTERY_VOLTAGE, 2,	"pid voltage",		{ 2, 0 } },
+	{ BYD_PID_BATTERY_SOC, 1,	"pid soc",		{ 10, 0 } },
+	{ BYD_PID_CELL_TEMP_AVG, 1,	"pid temp-avg",		{ 10, 0 } },
+	{ BYD_PID_CHARGE_TIMES, 2,	"pid cycles",		{ 60, 0 } },
+	{ BYD_PID_TOTAL_CHARGED_AH, 2,	"pid charged-ah",	{ 60, 0 } },
+	{ BYD_PID_TOTAL_DISCHARGED_AH, 2, "pid discharged-ah", { 60, 0 } },
+	{ BYD_PID_TOTAL_CHARGED_KWH, 2,	"pid charged-kwh",	{ 60, 0 } },
+	{ BYD_PID_TOTAL_DISCHARGED_KWH, 2, "pid discharged-kwh", { 60, 0 } },
+};
+
+#define BYD_POLL_NPIDS		nitems(byd_poll_pids)
+#define BYD_POLL_BACKOFF_MAX	60	/* seconds */
+
+struct byd_poll {
+	struct timeval		 p_done;	/* last answer */
+	struct timeval		 p_retry;	/* not before this if failing */
+	unsigned int		 p_fails;
+	struct batgw_hist	*p_hist;	/* achieved refresh */
+};
+
 struct byd_softc {
+	struct batgw		*bg;
+	struct batgw_b		*b;
+
 	int			 can;
 	struct event		*can_recv;
 
-	uint8_t			 can_50ms_6;
-	uint8_t			 can_50ms_7;
-	struct event		*can_50ms;
+	struct can_cyclic	*can_50ms;
 	struct event		*can_50ms_change;
 
-	struct event		*can_100ms;
+	struct can_cyclic	*can_100ms;
+	int			 can_100ms_v;
 
-	struct event		*can_poll;
-	unsigned int		 can_poll_idx;
+	struct uds		*can_uds;
+	struct batgw_task	*can_poll;
+	unsigned int		 can_poll_req[UDS_MAX_DIDS];
+	size_t			 can_poll_nreq;	/* outstanding */
+	struct timeval		 can_poll_sent;
+	struct byd_poll		 can_polls[BYD_POLL_NPIDS];
 	struct event		*can_wdog;
 
 	struct batgw_kv		 kvs[BYD_KV_COUNT];
-	struct batgw_kv		 pack[10];
+	struct batgw_kv_block	*pack;
 
-	struct batgw_kv		*cell;
-	unsigned int		 ncell;
+	struct batgw_cells	*cells;
 };
 
-static void	byd_can_50ms(int, short, void *);
+static void	byd_can_50ms(struct canfd_frame *, size_t, int);
 static void	byd_can_50ms_change(int, short, void *);
-static void	byd_can_100ms(int, short, void *);
-static void	byd_can_poll(int, short, void *);
+static void	byd_can_100ms(struct canfd_frame *, int);
+static void	byd_can_poll(struct batgw *, void *);
+static void	byd_can_poll_did(struct batgw *, void *, uint16_t,
+		    const uint8_t *, size_t);
+static void	byd_can_poll_done(struct batgw *, void *, int);
 static void	byd_can_recv(int, short, void *);
+static void	byd_can_input(struct batgw *, void *,
+		    const struct canfd_frame *);
 static void	byd_can_wdog(int, short, void *);
 
 static const struct timeval byd_50ms = { 0, 50000 };
 static const struct timeval byd_100ms = { 0, 100000 };
-static const struct timeval byd_200ms = { 0, 200000 };
+static const struct timeval byd_poll_tv = { 0, 100000 };
 static const struct timeval byd_wdog_tv = { 10, 0 };
 
 static int
@@ -234,69 +407,71 @@ byd_b_config(struct batgw_config_battery *bconf)
 }
 
 static void *
-byd_b_attach(struct batgw *bg)
+byd_b_attach(struct batgw *bg, struct batgw_b *b)
 {
-	const struct batgw_config_battery *bconf = batgw_b_config(bg);
+	const struct batgw_config_battery *bconf = batgw_b_config(b);
+	const char *scope = batgw_b_scope(b);
 	struct byd_softc *sc;
+	struct canfd_frame frames[BYD_50MS_NFRAMES];
 	int fd;
 	unsigned int i;
-	char key[16];
 
 	sc = calloc(1, sizeof(*sc));
 	if (sc == NULL)
 		err(1, "%s alloc", __func__);
 
-	fd = can_open("byd battery", bconf->ifname);
+	sc->bg = bg;
+	sc->b = b;
+
+	fd = batgw_b_can_open(b, "byd battery");
 
 	sc->can = fd;
 
 	sc->can_recv = event_new(batgw_event_base(bg), fd, EV_READ|EV_PERSIST,
-	    byd_can_recv, bg);
+	    byd_can_recv, sc);
 	if (sc->can_recv == NULL)
 		errx(1, "new byd battery can recv event failed");
 
-	sc->can_50ms_6 = BYD_50MS_6_INITIALIZER;
-	sc->can_50ms_7 = BYD_50MS_7_INITIALIZER;
-	sc->can_50ms = evtimer_new(batgw_event_base(bg),
-	    byd_can_50ms, bg);
-	if (sc->can_50ms == NULL)
-		errx(1, "new byd battery can 50ms event failed");
+	byd_can_50ms(frames, BYD_50MS_NFRAMES, 0);
+	sc->can_50ms = batgw_b_can_cyclic(b,
+	    batgw_b_name(b, "byd", "50ms"), fd,
+	    &byd_50ms, frames, BYD_50MS_NFRAMES);
 	sc->can_50ms_change = evtimer_new(batgw_event_base(bg),
-	    byd_can_50ms_change, bg);
-	if (sc->can_50ms == NULL)
-		errx(1, "new byd battery can 50ms event failed");
-
-	sc->can_100ms = evtimer_new(batgw_event_base(bg),
-	    byd_can_100ms, bg);
-	if (sc->can_100ms == NULL)
-		errx(1, "new byd battery can 100ms event failed");
-
-	sc->can_poll = evtimer_new(batgw_event_base(bg),
-	    byd_can_poll, bg);
-	if (sc->can_poll == NULL)
-		errx(1, "new byd battery can poll event failed");
+	    byd_can_50ms_change, sc);
+	if (sc->can_50ms_change == NULL)
+		errx(1, "new byd battery can 50ms change event failed");
+
+	sc->can_100ms_v = 0;
+	byd_can_100ms(frames, sc->can_100ms_v);
+	sc->can_100ms = batgw_b_can_cyclic(b,
+	    batgw_b_name(b, "byd", "100ms"), fd, &byd_100ms, frames, 1);
+
+	/* the core only sets up the frame decoder */
+	can_decoder_init(scope, &byd_pid_decoder);
+
+	/* the task only kicks things off and catches lost answers */
+	sc->can_poll = batgw_task_add(bg, batgw_b_name(b, "byd", "poll"),
+	    &byd_poll_tv, NULL, byd_can_poll, sc);
+	sc->can_uds = uds_create(bg, batgw_b_name(b, "byd", "uds"), fd,
+	    BYD_UDS_TX, BYD_UDS_RX, &byd_isotp, BYD_UDS_MAXDIDS,
+	    byd_can_poll_did, byd_can_poll_done, sc);
+	for (i = 0; i < nitems(sc->can_polls); i++) {
+		sc->can_polls[i].p_hist = batgw_hist_add(bg,
+		    batgw_b_name(b, NULL, byd_poll_pids[i].name));
+	}
 
 	sc->can_wdog = evtimer_new(batgw_event_base(bg),
-	    byd_can_wdog, bg);
+	    byd_can_wdog, sc);
 	if (sc->can_wdog == NULL)
 		errx(1, "new byd battery can wdog event failed");
 
 	for (i = 0; i < nitems(sc->kvs); i++)
 		batgw_kv_init_tpl(&sc->kvs[i], &byd_kvs_tpl[i]);
 
-	for (i = 0; i < nitems(sc->pack); i++) {
-		snprintf(key, sizeof(key), "pack%u", i); /* XXX rv */
-		batgw_kv_init(&sc->pack[i], key, KV_T_TEMP, 0);
-	}
-
-	sc->cell = calloc(bconf->ncells, sizeof(*sc->cell));
-	if (sc->cell == NULL)
-		err(1, "%u cell alloc", bconf->ncells);
-	for (i = 0; i < bconf->ncells; i++) {
-		snprintf(key, sizeof(key), "cell%u", i); /* XXX rv */
-		batgw_kv_init(&sc->cell[i], key, KV_T_VOLTAGE, 3);
-	}
-	sc->ncell = bconf->ncells;
+	batgw_kv_attach(bg, scope, sc->kvs, nitems(sc->kvs));
+	sc->pack = batgw_kv_block_attach(bg, scope, "pack",
+	    KV_T_TEMP, 0, BYD_NPACKS);
+	sc->cells = batgw_cells_create(bg, b, "cell", bconf->ncells);
 
 	return (sc);
 }
@@ -304,26 +479,28 @@ byd_b_attach(struct batgw *bg)
 static void
 byd_b_dispatch(struct batgw *bg, void *arg)
 {
-	const struct batgw_config_battery *bconf = batgw_b_config(bg);
 	struct byd_softc *sc = arg;
+	struct batgw_b *b = sc->b;
+	const struct batgw_config_battery *bconf = batgw_b_config(b);
 
-	batgw_b_set_rated_capacity_ah(bg, bconf->rated_capacity_ah);
-	batgw_b_set_rated_voltage_dv(bg, bconf->rated_voltage_dv);
+	batgw_b_set_rated_capacity_ah(b, bconf->rated_capacity_ah);
+	batgw_b_set_rated_voltage_dv(b, bconf->rated_voltage_dv);
 
-	batgw_b_set_min_voltage_dv(bg, 3800);
-	batgw_b_set_max_voltage_dv(bg, 4410);
+	batgw_b_set_min_voltage_dv(b, 3800);
+	batgw_b_set_max_voltage_dv(b, 4410);
 
 	event_add(sc->can_recv, NULL);
-	byd_can_50ms(0, 0, bg);
+	can_cyclic_start(sc->can_50ms);
 	evtimer_add(sc->can_50ms_change, &byd_50ms_change_tv);
-	byd_can_100ms(0, 0, bg);
-	byd_can_poll(0, 0, bg);
+	can_cyclic_start(sc->can_100ms);
+	batgw_task_start(sc->can_poll);
 }
 
 static void
 byd_b_teleperiod(struct batgw *bg, void *arg)
 {
 	struct byd_softc *sc = arg;
+	const char *scope = batgw_b_scope(sc->b);
 	const struct batgw_kv *kv;
 	unsigned int i;
 
@@ -332,166 +509,295 @@ byd_b_teleperiod(struct batgw *bg, void *arg)
 		if (kv->kv_v == INT_MIN)
 			continue;
 
-		batgw_kv_publish(bg, "battery", kv);
-	}
-
-	for (i = 0; i < nitems(sc->pack); i++) {
-		kv = &sc->pack[i];
-		if (kv->kv_v == INT_MIN)
-			continue;
-
-		batgw_kv_publish(bg, "battery", kv);
+		batgw_kv_publish(bg, scope, kv);
 	}
 
-	for (i = 0; i < sc->ncell; i++) {
-		kv = &sc->cell[i];
-		if (kv->kv_v == INT_MIN)
-			continue;
-
-		batgw_kv_publish(bg, "battery", kv);
-	}
+	batgw_kv_block_publish(bg, sc->pack);
+	batgw_cells_publish(bg, sc->cells);
 }
 
 static void
 byd_can_50ms_change(int nil, short events, void *arg)
 {
-	/*
-	 * nop
-	 *
-	 * byd_can_50ms checks whether this evtimer is pending.
-	 */
+	struct byd_softc *sc = arg;
+	struct canfd_frame frames[BYD_50MS_NFRAMES];
+
+	byd_can_50ms(frames, nitems(frames), 1);
+	can_cyclic_update(sc->can_50ms, frames, nitems(frames));
 }
 
+/*
+ * the top nibble of bytes 6 and 7 counts down on every frame, so the
+ * 50ms message is a sequence of 16 frames that the kernel can cycle
+ * through by itself.
+ */
+
 static void
-byd_can_50ms(int nil, short events, void *arg)
+byd_can_50ms(struct canfd_frame *frames, size_t nframes, int changed)
 {
-	struct batgw *bg = arg;
-	struct byd_softc *sc = batgw_b_softc(bg);
-	struct can_frame frame = {
+	static const struct canfd_frame frame = {
 		.can_id = 0x12d,
 		.len = 8,
 		.data = { 0xa0, 0x28, 0x02, 0xa0, 0x0c, 0x71, 0x00, 0x00 },
 	};
-	ssize_t rv;
-
-	evtimer_add(sc->can_50ms, &byd_50ms);
+	uint8_t can_50ms_6 = BYD_50MS_6_INITIALIZER;
+	uint8_t can_50ms_7 = BYD_50MS_7_INITIALIZER;
+	size_t i;
 
-	if (!evtimer_pending(sc->can_50ms_change, NULL)) {
-		frame.data[2] = 0x00;
-		frame.data[3] = 0x22;
-		frame.data[5] = 0x31;
-	}
+	for (i = 0; i < nframes; i++) {
+		struct canfd_frame *f = &frames[i];
 
-	frame.data[6] = (sc->can_50ms_6 -= BYD_50MS_DECR);
-	frame.data[7] = (sc->can_50ms_7 -= BYD_50MS_DECR);
+		*f = frame;
+		if (changed) {
+			f->data[2] = 0x00;
+			f->data[3] = 0x22;
+			f->data[5] = 0x31;
+		}
 
-	rv = send(EVENT_FD(sc->can_recv), &frame, sizeof(frame), 0);
-	if (rv == -1) {
-		lwarn("byd battery 50ms send");
-		return;
+		f->data[6] = (can_50ms_6 -= BYD_50MS_DECR);
+		f->data[7] = (can_50ms_7 -= BYD_50MS_DECR);
 	}
 }
 
 static void
-byd_can_100ms(int nil, short events, void *arg)
+byd_can_100ms(struct canfd_frame *f, int v) /* volts */
 {
-	struct batgw *bg = arg;
-	struct byd_softc *sc = batgw_b_softc(bg);
-	struct can_frame frame = {
+	static const struct canfd_frame frame = {
 		.can_id = 0x441,
 		.len = 8,
 		.data = { 0x98, 0x3a, 0x88, 0x13, 0x00, 0x00, 0xff, 0x00 },
 	};
-	ssize_t rv;
-	int v; /* volts */
 	unsigned int csum = 0;
 	size_t i;
 
-	evtimer_add(sc->can_100ms, &byd_100ms);
-
-	v = batgw_kv_get(&sc->kvs[BYD_KV_VOLTAGE]);
 	if (v <= 12)
 		v = 12;
 
-	can_htole16(&frame, 4, v);
+	*f = frame;
+	can_htole16(f, 4, v);
+
+	for (i = 0; i < CAN_MAX_DLEN - 1; i++)
+		csum += f->data[i];
+	f->data[7] = ~csum;
+}
+
+/*
+ * how far past its target age a pid is, in thousandths of the target.
+ * anything under 1000 is still fresh enough.
+ */
+
+static unsigned long long
+byd_can_poll_score(const struct byd_poll *p, const struct byd_poll_pid *pp,
+    const struct timeval *now)
+{
+	struct timeval tv;
+	unsigned long long age, target;
 
-	for (i = 0; i < sizeof(frame.data) - 1; i++)
-		csum += frame.data[i];
-	frame.data[7] = ~csum;
+	if (p->p_fails > 0 && timercmp(now, &p->p_retry, <))
+		return (0);
+	if (!timerisset(&p->p_done))
+		return (ULLONG_MAX);
 
-	rv = send(EVENT_FD(sc->can_recv), &frame, sizeof(frame), 0);
-	if (rv == -1) {
-		lwarn("byd battery 100ms send");
+	timersub(now, &p->p_done, &tv);
+	age = (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+	target = (unsigned long long)pp->age.tv_sec * 1000000 +
+	    pp->age.tv_usec;
+
+	return (age * 1000 / target);
+}
+
+static void
+byd_can_poll_next(struct batgw *bg, struct byd_softc *sc,
+    const struct timeval *now)
+{
+	unsigned long long scores[BYD_POLL_NPIDS];
+	unsigned long long best;
+	struct uds_did dids[UDS_MAX_DIDS];
+	unsigned int req[UDS_MAX_DIDS];
+	size_t i, n, max;
+	int idx;
+
+	for (i = 0; i < nitems(scores); i++) {
+		scores[i] = byd_can_poll_score(&sc->can_polls[i],
+		    &byd_poll_pids[i], now);
+	}
+
+	/* pick the stalest pids, a few at a time */
+	max = uds_maxdids(sc->can_uds);
+	n = 0;
+	while (n < max) {
+		best = 0;
+		idx = -1;
+		for (i = 0; i < nitems(scores); i++) {
+			if (scores[i] < 1000 || scores[i] <= best)
+				continue;
+
+			best = scores[i];
+			idx = i;
+		}
+		if (idx == -1)
+			break;
+
+		scores[idx] = 0;
+		if (sc->can_polls[idx].p_fails > 0) {
+			if (n > 0)
+				continue;
+			max = 1;
+		}
+
+		req[n] = idx;
+		dids[n].did = byd_poll_pids[idx].pid;
+		dids[n].len = byd_poll_pids[idx].len;
+		n++;
+	}
+
+	if (n == 0) {
+		/* everything is fresh, leave the bus alone */
 		return;
 	}
+
+	n = uds_read(sc->can_uds, dids, n);
+	for (i = 0; i < n; i++)
+		sc->can_poll_req[i] = req[i];
+	sc->can_poll_nreq = n;
+	sc->can_poll_sent = *now;
 }
 
-static const uint16_t byd_poll_pids[] = {
-	BYD_PID_BATTERY_SOC,
-	BYD_PID_BATTERY_VOLTAGE,
-	BYD_PID_BATTERY_CURRENT,
-	BYD_PID_CELL_TEMP_MIN,
-	BYD_PID_CELL_TEMP_MAX,
-	BYD_PID_CELL_TEMP_AVG,
-	BYD_PID_CELL_MV_MIN,
-	BYD_PID_CELL_MV_MAX,
-	BYD_PID_MAX_CHARGE_POWER,
-	BYD_PID_MAX_DISCHARGE_POWER,
-	BYD_PID_CHARGE_TIMES,
-	BYD_PID_TOTAL_CHARGED_AH,
-	BYD_PID_TOTAL_DISCHARGED_AH,
-	BYD_PID_TOTAL_CHARGED_KWH,
-	BYD_PID_TOTAL_DISCHARGED_KWH,
-};
+static void
+byd_can_poll_fail(struct byd_softc *sc, int idx, const struct timeval *now)
+{
+	const struct byd_poll_pid *pp = &byd_poll_pids[idx];
+	struct byd_poll *p = &sc->can_polls[idx];
+	struct timeval tv;
+	unsigned long long usec;
+
+	usec = (unsigned long long)pp->age.tv_sec * 1000000 +
+	    pp->age.tv_usec;
+	usec <<= p->p_fails < 6 ? p->p_fails : 6;
+	if (usec > BYD_POLL_BACKOFF_MAX * 1000000ULL)
+		usec = BYD_POLL_BACKOFF_MAX * 1000000ULL;
+	p->p_fails++;
+
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+	timeradd(now, &tv, &p->p_retry);
+}
 
 static void
-byd_can_poll(int nil, short events, void *arg)
+byd_can_poll(struct batgw *bg, void *arg)
 {
-	struct batgw *bg = arg;
-	struct byd_softc *sc = batgw_b_softc(bg);
+	struct byd_softc *sc = arg;
+	struct timeval now;
 
-	unsigned int idx = sc->can_poll_idx;
-	uint16_t pid;
-	struct can_frame frame = {
-		.can_id = 0x7e7,
-		.len = 8,
-		.data = { 0x03, 0x22, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-	};
-	ssize_t rv;
+	/* the uds client times out requests that go unanswered */
+	if (uds_busy(sc->can_uds))
+		return;
 
-	idx = sc->can_poll_idx;
-	pid = byd_poll_pids[idx];
-	if (++idx >= nitems(byd_poll_pids))
-		idx = 0;
-	sc->can_poll_idx = idx;
+	batgw_now(&now);
+	byd_can_poll_next(bg, sc, &now);
+}
+
+static void
+byd_can_poll_did(struct batgw *bg, void *arg, uint16_t did,
+    const uint8_t *data, size_t len)
+{
+	struct byd_softc *sc = arg;
+	struct canfd_frame frame = { .can_id = did, .len = len };
+	struct byd_poll *p;
+	struct timeval now, tv;
+	size_t i;
+	int sv;
+
+	batgw_now(&now);
 
-	evtimer_add(sc->can_poll, &byd_200ms);
+	for (i = 0; i < sc->can_poll_nreq; i++) {
+		p = &sc->can_polls[sc->can_poll_req[i]];
+		if (byd_poll_pids[sc->can_poll_req[i]].pid != did)
+			continue;
 
-	frame.data[2] = pid >> 8;
-	frame.data[3] = pid >> 0;
+		if (timerisset(&p->p_done)) {
+			timersub(&now, &p->p_done, &tv);
+			batgw_hist_record(p->p_hist,
+			    (unsigned long long)tv.tv_sec * 1000000 +
+			    tv.tv_usec);
+		}
+		p->p_done = now;
+		p->p_fails = 0;
+		break;
+	}
 
-	rv = send(EVENT_FD(sc->can_recv), &frame, sizeof(frame), 0);
-	if (rv == -1) {
-		lwarn("byd battery can send");
+	if (len > CAN_MAX_DLEN)
 		return;
+	memcpy(frame.data, data, len);
+	can_decode(bg, sc->b, &byd_pid_decoder, sc->kvs, &frame);
+
+	/* fall back to the pids until every cell has reported */
+	if (!batgw_cells_fresh(bg, sc->cells)) {
+		switch (did) {
+		case BYD_PID_CELL_MV_MIN:
+			batgw_b_set_min_cell_voltage_mv(sc->b,
+			    batgw_kv_get(&sc->kvs[BYD_KV_PID_MV_MIN]));
+			break;
+		case BYD_PID_CELL_MV_MAX:
+			batgw_b_set_max_cell_voltage_mv(sc->b,
+			    batgw_kv_get(&sc->kvs[BYD_KV_PID_MV_MAX]));
+			break;
+		}
+	}
+
+	if (did == BYD_PID_CELL_MV_MAX) {
+		sv = batgw_kv_get(&sc->kvs[BYD_KV_PID_MV_MAX]) -
+		    batgw_kv_get(&sc->kvs[BYD_KV_PID_MV_MIN]);
+		if (sv >= 0) {
+			batgw_kv_update(bg, batgw_b_scope(sc->b),
+			    &sc->kvs[BYD_KV_PID_MV_DELTA], sv);
+		}
 	}
 }
 
+static void
+byd_can_poll_done(struct batgw *bg, void *arg, int error)
+{
+	struct byd_softc *sc = arg;
+	const struct byd_poll *p;
+	struct timeval now;
+	size_t i;
+
+	batgw_now(&now);
+
+	/* back off the pids that didn't get an answer */
+	for (i = 0; i < sc->can_poll_nreq; i++) {
+		p = &sc->can_polls[sc->can_poll_req[i]];
+		if (!timerisset(&p->p_done) ||
+		    timercmp(&p->p_done, &sc->can_poll_sent, <))
+			byd_can_poll_fail(sc, sc->can_poll_req[i], &now);
+	}
+	sc->can_poll_nreq = 0;
+
+	if (error != 0) {
+		/* let the poll task try again later */
+		return;
+	}
+
+	byd_can_poll_next(bg, sc, &now);
+}
+
 static void
 byd_can_wdog(int nil, short events, void *arg)
 {
-	struct batgw *bg = arg;
-	batgw_b_set_stopped(bg);
+	struct byd_softc *sc = arg;
+
+	batgw_b_set_stopped(sc->b);
 }
 
 static uint16_t
-bydtoh12(const struct can_frame *frame, size_t o)
+bydtoh12(const struct canfd_frame *frame, size_t o)
 {
         return (can_letoh16(frame, o) & 0xfff);
 }
 
 static int
-bydtodegc(const struct can_frame *frame, size_t o)
+bydtodegc(const struct canfd_frame *frame, size_t o)
 {
         return ((int)frame->data[o] - 40);
 }
@@ -499,219 +805,59 @@ bydtodegc(const struct can_frame *frame, size_t o)
 static void
 byd_can_recv(int fd, short events, void *arg)
 {
-	struct batgw *bg = arg;
-	struct byd_softc *sc = batgw_b_softc(bg);
-	struct can_frame frame;
-	ssize_t rv;
+	struct byd_softc *sc = arg;
+
+	can_recv(sc->bg, fd, "byd battery", byd_can_input, sc);
+}
+
+static void
+byd_can_input(struct batgw *bg, void *arg, const struct canfd_frame *frame)
+{
+	struct byd_softc *sc = arg;
 	size_t i;
-	unsigned int uv;
 	int sv;
 	unsigned int k;
+	unsigned int flags;
 
-	rv = recv(fd, &frame, sizeof(frame), 0);
-	if (rv == -1) {
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-			break;
-		default:
-			lwarn("byd battery can recv");
-			break;
-		}
-		return;
-	}
-
-	if (frame.len != 8) {
+	if (frame->len != 8) {
 		/* this is unexpected */
 		return;
 	}
 
-	switch (frame.can_id) {
-	case 0x244:
-	case 0x245:
-	case 0x286:
-	case 0x344:
-	case 0x345:
-	case 0x347:
-	case 0x34a:
-	case 0x35e:
-	case 0x360:
-	case 0x36c:
-	case 0x438:
-	case 0x43a:
-	case 0x43b:
-	case 0x43c:
-	case 0x43d:
-	case 0x444:
-	case 0x445:
-	case 0x446:
-	case 0x447:
-	case 0x47b:
-	case 0x524:
-		batgw_b_set_running(bg);
+	flags = can_decode(bg, sc->b, &byd_decoder, sc->kvs, frame);
+	if (ISSET(flags, CAN_D_ALIVE)) {
+		batgw_b_set_running(sc->b);
 		evtimer_add(sc->can_wdog, &byd_wdog_tv);
-		break;
 	}
 
-	if (batgw_verbose(bg) > 1) {
-		printf("0x%03x [%u]", frame.can_id, frame.len);
-		for (i = 0; i < frame.len; i++) {
-			printf(" %02x", frame.data[i]);
-		}
-		printf("\n");
-	}
+	switch (frame->can_id) {
+	case 0x444:
+		sv = batgw_kv_get(&sc->kvs[BYD_KV_VOLTAGE]);
+		if (sv != sc->can_100ms_v) {
+			struct canfd_frame f;
 
-	switch (frame.can_id) {
-	case 0x245:
-		switch (frame.data[0]) {
-		case 0x01:
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_AMBIENT], bydtodegc(&frame, 4));
-			break;
+			sc->can_100ms_v = sv;
+			byd_can_100ms(&f, sv);
+			can_cyclic_update(sc->can_100ms, &f, 1);
 		}
 		break;
 	case 0x43c:
-		k = frame.data[0] * 6;
+		k = frame->data[0] * 6;
 		for (i = 0; i < 6; i++) {
-			unsigned int key = k + i;
-			if (key >= nitems(sc->pack))
-				break;
-
-			batgw_kv_update(bg, "battery",
-			    &sc->pack[key], bydtodegc(&frame, 1 + i));
+			batgw_kv_block_update(bg, sc->pack, k + i,
+			    bydtodegc(frame, 1 + i));
 		}
 		break;
 	case 0x43d:
-		k = frame.data[0] * 3;
-		for (int i = 0; i < 3; i++) {
-			unsigned int key = k + i;
-			if (key >= sc->ncell)
-				break;
-
-			batgw_kv_update(bg, "battery",
-			    sc->cell + key, can_letoh16(&frame, 1 + (2 * i)));
+		k = frame->data[0] * 3;
+		for (i = 0; i < 3; i++) {
+			batgw_cells_set(sc->cells, k + i,
+			    can_letoh16(frame, 1 + (2 * i)));
 		}
+		batgw_cells_commit(bg, sc->cells);
 		break;
-	case 0x444:
-		batgw_kv_update(bg, "battery",
-		    &sc->kvs[BYD_KV_VOLTAGE], can_letoh16(&frame, 0));
-		break;
-	case 0x447:
-		uv = can_letoh16(&frame, 4);
-		batgw_kv_update(bg, "battery",
-		    &sc->kvs[BYD_KV_SOC], uv);
-		//printf("lo temp? %u\n", frame.data[1] - 40);
-		//printf("hi temp? %u\n", frame.data[3] - 40);
-		break;
-	case 0x7ef:
-		if (frame.data[0] == 0x10) {
-			static const struct can_frame ack = {
-				.can_id = 0x7e7,
-				.len = 8,
-				.data = { 0x30, 0x08, 0x05, 0x00,
-				    0x00, 0x00, 0x00, 0x00 },
-			};
-
-			rv = send(fd, &ack, sizeof(ack), 0);
-			if (rv == -1)
-				lwarn("byd battery pid ack write");
-		}
-
-		switch (can_betoh16(&frame, 2)) {
-		case BYD_PID_BATTERY_SOC:
-			uv = frame.data[4];
-			batgw_b_set_soc_c_pct(bg, uv * 100);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_SOC], uv);
-			break;
-		case BYD_PID_BATTERY_VOLTAGE:
-			uv = can_letoh16(&frame, 4);
-			batgw_b_set_voltage_dv(bg, uv * 10);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_VOLTAGE], uv);
-			break;
-		case BYD_PID_BATTERY_CURRENT:
-			sv = can_letoh16(&frame, 4);
-			sv -= 5000;
-			sv = 0 - sv;
-			batgw_b_set_current_da(bg, sv);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_CURRENT], sv);
-			break;
-		case BYD_PID_CELL_TEMP_MIN:
-			sv = bydtodegc(&frame, 4);
-			batgw_b_set_min_temp_dc(bg, sv * 10);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_TEMP_MIN], sv);
-			break;
-		case BYD_PID_CELL_TEMP_MAX:
-			sv = bydtodegc(&frame, 4);
-			batgw_b_set_max_temp_dc(bg, sv * 10);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_TEMP_MAX], sv);
-			break;
-		case BYD_PID_CELL_TEMP_AVG:
-			sv = bydtodegc(&frame, 4);
-			batgw_b_set_avg_temp_dc(bg, sv * 10);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_TEMP_AVG], sv);
-			break;
-		case BYD_PID_CELL_MV_MIN:
-			uv = can_letoh16(&frame, 4);
-			batgw_b_set_min_cell_voltage_mv(bg, uv);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_MV_MIN], uv);
-			break;
-		case BYD_PID_CELL_MV_MAX:
-			uv = can_letoh16(&frame, 4);
-			batgw_b_set_max_cell_voltage_mv(bg, uv);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_MV_MAX], uv);
-
-			sv = uv - batgw_kv_get(&sc->kvs[BYD_KV_PID_MV_MIN]);
-			if (sv >= 0) {
-				batgw_kv_update(bg, "battery",
-				    &sc->kvs[BYD_KV_PID_MV_DELTA], sv);
-			}
-			break;
-		case BYD_PID_MAX_CHARGE_POWER:
-			uv = can_letoh16(&frame, 4) * 100;
-			batgw_b_set_charge_w(bg, uv);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_CHARGE_POWER], uv);
-			break;
-		case BYD_PID_MAX_DISCHARGE_POWER:
-			uv = can_letoh16(&frame, 4) * 100;
-			batgw_b_set_discharge_w(bg, uv);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_DISCHARGE_POWER], uv);
-			break;
-		case BYD_PID_CHARGE_TIMES:
-			uv = can_letoh16(&frame, 4);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_CHARGE_COUNT], uv);
-			break;
-		case BYD_PID_TOTAL_CHARGED_AH:
-			uv = can_letoh16(&frame, 4);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_CHARGED_AH], uv);
-			break;
-		case BYD_PID_TOTAL_DISCHARGED_AH:
-			uv = can_letoh16(&frame, 4);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_DISCHARGED_AH], uv);
-			break;
-		case BYD_PID_TOTAL_CHARGED_KWH:
-			uv = can_letoh16(&frame, 4);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_CHARGED_KWH], uv);
-			break;
-		case BYD_PID_TOTAL_DISCHARGED_KWH:
-			uv = can_letoh16(&frame, 4);
-			batgw_kv_update(bg, "battery",
-			    &sc->kvs[BYD_KV_PID_DISCHARGED_KWH], uv);
-			break;
-		}
+	case BYD_UDS_RX:
+		uds_can_input(sc->can_uds, frame);
 		break;
 	}
 }
@@ -43,16 +43,12 @@
 
 static int	 mg4_check(const struct batgw_config_battery *);
 static void	 mg4_config(struct batgw_config_battery *);
-static void	*mg4_attach(struct batgw *);
+static void	*mg4_attach(struct batgw *, struct batgw_b *);
 static void	 mg4_dispatch(struct batgw *, void *);
 static void	 mg4_teleperiod(struct batgw *, void *);
 
-const struct batgw_battery battery_mg4 = {
-	.b_check =			mg4_check,
-	.b_config =			mg4_config,
-	.b_attach =			mg4_attach,
-	.b_dispatch =			mg4_dispatch,
-	.b_teleperiod =			mg4_teleperiod,
+static const struct can_filter mg4_filters[] = {
+	CAN_FILTER_MASK(0x700, 0x700),	/* diagnostics */
 };
 
 /*
@@ -80,27 +76,77 @@ static const struct batgw_kv_tpl mg4_kvs_tpl[MG4_KV_COUNT] = {
 		{ NULL,			KV_T_POWER,	2 },
 };
 
+static const struct can_decode mg4_decode[] = {
+	{ 0x12c, CAN_D_ALIVE,		/* current */
+	    .cd_off = 2, .cd_bits = 16, .cd_add = -20000, .cd_div = 2,
+	    .cd_kv = MG4_KV_CURRENT,
+	    .cd_field = BATGW_B_F_CURRENT_DA, .cd_field_mul = -1 },
+	{ 0x12c, 0,			/* voltage */
+	    .cd_off = 4, .cd_bits = 16, .cd_mul = 5, .cd_div = 32,
+	    .cd_kv = MG4_KV_VOLTAGE,
+	    .cd_field = BATGW_B_F_VOLTAGE_DV },
+	{ 0x401, CAN_D_MUX,		/* soc */
+	    .cd_mux_off = 2, .cd_mux_mask = 0x01, .cd_mux = 0,
+	    .cd_off = 6, .cd_bits = 10,
+	    .cd_kv = MG4_KV_SOC,
+	    .cd_field = BATGW_B_F_SOC_CPCT, .cd_field_mul = 10 },
+};
+
+static struct can_decode_index mg4_decode_index;
+
+static const struct can_decoder mg4_decoder = {
+	.cdr_scope =			"battery",
+	.cdr_table =			mg4_decode,
+	.cdr_ntable =			nitems(mg4_decode),
+	.cdr_nkvs =			MG4_KV_COUNT,
+	.cdr_index =			&mg4_decode_index,
+};
+
+const struct batgw_battery battery_mg4 = {
+	.b_check =			mg4_check,
+	.b_config =			mg4_config,
+	.b_attach =			mg4_attach,
+	.b_dispatch =			mg4_dispatch,
+	.b_teleperiod =			mg4_teleperiod,
+
+	.b_decoder =			&mg4_decoder,
+	.b_filters =			mg4_filters,
+	.b_nfilters =			nitems(mg4_filters),
+};
+
 struct mg4_softc {
+	struct batgw		*bg;
+	struct batgw_b		*b;
+
 	int			 can;
 	struct event		*can_recv;
 
-	struct event		*can_keepalive;
-	struct event		*can_contactor;
-	unsigned int		 can_contactor_idx;
+	struct can_cyclic	*can_keepalive;
+	struct can_cyclic	*can_contactor;
 
 	struct event		*can_wdog;
+	struct batgw_task	*placeholders;
 
 	struct batgw_kv		 kvs[MG4_KV_COUNT];
 };
 
-static void	mg4_can_keepalive(int, short, void *);
-static void	mg4_can_contactor(int, short, void *);
+static size_t	mg4_can_contactor(struct canfd_frame *, size_t);
 static void	mg4_can_recv(int, short, void *);
+static void	mg4_can_input(struct batgw *, void *,
+		    const struct canfd_frame *);
 static void	mg4_can_wdog(int, short, void *);
+static void	mg4_placeholders(struct batgw *, void *);
 
 static const struct timeval mg4_wdog_tv = { 10, 0 };
 static const struct timeval mg4_keepalive_tv = { 0, 100000 };
 static const struct timeval mg4_contactor_tv = { 0,  10000 };
+static const struct timeval mg4_placeholders_tv = { 1, 0 };
+
+static const struct canfd_frame mg4_keepalive = {
+	.can_id = 0x4f3,
+	.len = 8,
+	.data = { 0xf3, 0x10, 0x48, 0x00, 0xff, 0xff, 0x00, 0x11 },
+};
 
 static int
 mg4_check(const struct batgw_config_battery *bconf)
@@ -147,10 +193,11 @@ mg4_config(struct batgw_config_battery *bconf)
 }
 
 static void *
-mg4_attach(struct batgw *bg)
+mg4_attach(struct batgw *bg, struct batgw_b *b)
 {
-	const struct batgw_config_battery *bconf = batgw_b_config(bg);
 	struct mg4_softc *sc;
+	struct canfd_frame frames[CAN_CYCLIC_MAX];
+	size_t nframes;
 	int fd;
 	unsigned int i;
 
@@ -158,32 +205,39 @@ mg4_attach(struct batgw *bg)
 	if (sc == NULL)
 		err(1, "%s alloc", __func__);
 
-	fd = can_open("mg4", bconf->ifname);
+	sc->bg = bg;
+	sc->b = b;
+
+	fd = batgw_b_can_open(b, "mg4");
 
 	sc->can = fd;
 
 	sc->can_recv = event_new(batgw_event_base(bg), fd, EV_READ|EV_PERSIST,
-	    mg4_can_recv, bg);
+	    mg4_can_recv, sc);
 	if (sc->can_recv == NULL)
 		errx(1, "new mg4 can recv event failed");
 
-	sc->can_keepalive = event_new(batgw_event_base(bg), 0, EV_PERSIST,
-	    mg4_can_keepalive, bg);
-	if (sc->can_keepalive == NULL)
-		errx(1, "new mg4 keepalive event failed");
+	sc->can_keepalive = batgw_b_can_cyclic(b,
+	    batgw_b_name(b, "mg4", "keepalive"), fd,
+	    &mg4_keepalive_tv, &mg4_keepalive, 1);
 
-	sc->can_contactor = event_new(batgw_event_base(bg), 0, EV_PERSIST,
-	    mg4_can_contactor, bg);
-	if (sc->can_contactor == NULL)
-		errx(1, "new mg4 contactor event failed");
+	nframes = mg4_can_contactor(frames, nitems(frames));
+	sc->can_contactor = batgw_b_can_cyclic(b,
+	    batgw_b_name(b, "mg4", "contactor"), fd,
+	    &mg4_contactor_tv, frames, nframes);
 
 	sc->can_wdog = evtimer_new(batgw_event_base(bg),
-	    mg4_can_wdog, bg);
+	    mg4_can_wdog, sc);
 	if (sc->can_wdog == NULL)
 		errx(1, "new mg4 can wdog event failed");
 
+	sc->placeholders = batgw_task_add(bg,
+	    batgw_b_name(b, "mg4", "placeholders"), &mg4_placeholders_tv,
+	    NULL, mg4_placeholders, sc);
+
 	for (i = 0; i < nitems(sc->kvs); i++)
 		batgw_kv_init_tpl(&sc->kvs[i], &mg4_kvs_tpl[i]);
+	batgw_kv_attach(bg, batgw_b_scope(b), sc->kvs, nitems(sc->kvs));
 
 	return (sc);
 }
@@ -191,32 +245,45 @@ mg4_attach(struct batgw *bg)
 static void
 mg4_dispatch(struct batgw *bg, void *arg)
 {
-	const struct batgw_config_battery *bconf = batgw_b_config(bg);
 	struct mg4_softc *sc = arg;
+	struct batgw_b *b = sc->b;
+	const struct batgw_config_battery *bconf = batgw_b_config(b);
+
+	batgw_b_set_rated_capacity_ah(b, bconf->rated_capacity_ah);
+	batgw_b_set_rated_voltage_dv(b, bconf->rated_voltage_dv);
+
+	batgw_b_set_min_voltage_dv(b, 2600 + 200);
+	batgw_b_set_max_voltage_dv(b, 3790 - 200);
 
-	batgw_b_set_rated_capacity_ah(bg, bconf->rated_capacity_ah);
-	batgw_b_set_rated_voltage_dv(bg, bconf->rated_voltage_dv);
+	mg4_placeholders(bg, sc);
 
-	batgw_b_set_min_voltage_dv(bg, 2600 + 200);
-	batgw_b_set_max_voltage_dv(bg, 3790 - 200);
+	event_add(sc->can_recv, NULL);
 
-	batgw_b_set_charge_w(bg, 5000);
-	batgw_b_set_discharge_w(bg, 5000);
+	can_cyclic_start(sc->can_keepalive);
+	can_cyclic_start(sc->can_contactor);
+	batgw_task_start(sc->placeholders);
+}
 
-	batgw_b_set_min_temp_dc(bg, 290);
-	batgw_b_set_max_temp_dc(bg, 310);
-	batgw_b_set_avg_temp_dc(bg, 300); /* 30.0 degC */
+/*
+ * nothing decodes these yet, so keep setting them or they go stale
+ * like any other field.
+ */
 
-	batgw_b_set_min_cell_voltage_mv(bg, 2999);
-	batgw_b_set_max_cell_voltage_mv(bg, 3001);
+static void
+mg4_placeholders(struct batgw *bg, void *arg)
+{
+	struct mg4_softc *sc = arg;
+	struct batgw_b *b = sc->b;
 
-	event_add(sc->can_recv, NULL);
+	batgw_b_set_charge_w(b, 5000);
+	batgw_b_set_discharge_w(b, 5000);
 
-	evtimer_add(sc->can_keepalive, &mg4_keepalive_tv);
-	evtimer_add(sc->can_contactor, &mg4_contactor_tv);
+	batgw_b_set_min_temp_dc(b, 290);
+	batgw_b_set_max_temp_dc(b, 310);
+	batgw_b_set_avg_temp_dc(b, 300); /* 30.0 degC */
 
-	mg4_can_keepalive(0, 0, bg);
-	mg4_can_contactor(0, 0, bg);
+	batgw_b_set_min_cell_voltage_mv(b, 2999);
+	batgw_b_set_max_cell_voltage_mv(b, 3001);
 }
 
 static void
@@ -231,28 +298,10 @@ mg4_teleperiod(struct batgw *bg, void *arg)
 		if (kv->kv_v == INT_MIN)
 			continue;
 
-		batgw_kv_publish(bg, "battery", kv);
+		batgw_kv_publish(bg, batgw_b_scope(sc->b), kv);
 	}
 }
 
-static void
-mg4_can_keepalive(int nil, short events, void *arg)
-{
-	struct batgw *bg = arg;
-	struct mg4_softc *sc = batgw_b_softc(bg);
-	static const struct can_frame frame = {
-		.can_id = 0x4f3,
-		.len = 8,
-		.data = { 0xf3, 0x10, 0x48, 0x00, 0xff, 0xff, 0x00, 0x11 },
-	};
-	ssize_t rv;
-
-	rv = send(EVENT_FD(sc->can_recv), &frame, sizeof(frame), 0);
-	if (rv == -1)
-		lwarn("mg4 keepalive");
-}
-
-
 static const uint64_t contactor_seq[] = {
 	0x8100457D7FFEFFFE,
 	0xDC01457D7FFEFFFE,
@@ -270,114 +319,68 @@ static const uint64_t contactor_seq[] = {
 	0x0F0E457D7FFFFFFE,
 };
 
-static void
-mg4_can_contactor(int nil, short events, void *arg)
+static size_t
+mg4_can_contactor(struct canfd_frame *frames, size_t nframes)
 {
-	struct batgw *bg = arg;
-	struct mg4_softc *sc = batgw_b_softc(bg);
-	struct can_frame frame = {
+	static const struct canfd_frame frame = {
 		.can_id = 0x047,
 		.len = 8,
 	};
-	unsigned int idx;
-	ssize_t rv;
-
-	idx = sc->can_contactor_idx;
-	can_htobe64(&frame, contactor_seq[idx]);
-	if (++idx >= nitems(contactor_seq))
-		idx = 0;
-	sc->can_contactor_idx = idx;
-
-	rv = send(EVENT_FD(sc->can_recv), &frame, sizeof(frame), 0);
-	if (rv == -1)
-		lwarn("mg4 contactor");
+	size_t i;
+
+	if (nframes > nitems(contactor_seq))
+		nframes = nitems(contactor_seq);
+
+	for (i = 0; i < nframes; i++) {
+		struct canfd_frame *f = &frames[i];
+
+		*f = frame;
+		can_htobe64(f, contactor_seq[i]);
+	}
+
+	return (nframes);
 }
 
 static void
 mg4_can_wdog(int nil, short events, void *arg)
 {
-	struct batgw *bg = arg;
-	batgw_b_set_stopped(bg);
+	struct mg4_softc *sc = arg;
+
+	batgw_b_set_stopped(sc->b);
 }
 
 static void
 mg4_can_recv(int fd, short events, void *arg)
 {
-	struct batgw *bg = arg;
-	struct mg4_softc *sc = batgw_b_softc(bg);
-	struct can_frame frame;
-	ssize_t rv;
-	size_t i;
-	unsigned int uv;
-	int sv;
-	unsigned int k;
-
-	rv = recv(fd, &frame, sizeof(frame), 0);
-	if (rv == -1) {
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-			break;
-		default:
-			lwarn("mg4 can recv");
-			break;
-		}
-		return;
-	}
+	struct mg4_softc *sc = arg;
 
-	if (frame.len != 8) {
+	can_recv(sc->bg, fd, "mg4", mg4_can_input, sc);
+}
+
+static void
+mg4_can_input(struct batgw *bg, void *arg, const struct canfd_frame *frame)
+{
+	struct mg4_softc *sc = arg;
+	unsigned int flags;
+
+	if (frame->len != 8) {
 		/* this is unexpected */
 		return;
 	}
 
-	if (frame.can_id == 0x12c) {
-		batgw_b_set_running(bg);
+	flags = can_decode(bg, sc->b, &mg4_decoder, sc->kvs, frame);
+	if (ISSET(flags, CAN_D_ALIVE)) {
+		batgw_b_set_running(sc->b);
 		evtimer_add(sc->can_wdog, &mg4_wdog_tv);
 	}
 
-	if ((frame.can_id & 0xf00) == 0x700 || batgw_verbose(bg) > 1) {
-		printf("rx 0x%03x [%u]", frame.can_id, frame.len);
-		for (i = 0; i < frame.len; i++) {
-			printf(" %02x", frame.data[i]);
-		}
-		printf("\n");
-	}
-
-	switch (frame.can_id) {
+	switch (frame->can_id) {
 	case 0x12c:
-		/* current */
-		sv = can_betoh16(&frame, 2);
-		sv -= 20000;
-		sv /= 2;
-
-		batgw_b_set_current_da(bg, 0 - sv);
-		batgw_kv_update(bg, "battery",
-                    &sc->kvs[MG4_KV_CURRENT], sv);
-
-		/* voltage */
-		uv = can_betoh16(&frame, 4);
-		uv *= 5;
-		uv >>= 5;
-
-		batgw_b_set_voltage_dv(bg, uv);
-		batgw_kv_update(bg, "battery",
-                    &sc->kvs[MG4_KV_VOLTAGE], uv);
-
 		/* power */
-		batgw_kv_update(bg, "battery",
-                    &sc->kvs[MG4_KV_POWER], uv * sv);
-	
-		break;
-
-	case 0x401:
-		if (frame.data[2] & 0x1)
-			break;
-
-		uv = can_betoh16(&frame, 6) & 0x3ff;
-
-		batgw_b_set_soc_c_pct(bg, uv * 10);
-		batgw_kv_update(bg, "battery",
-                    &sc->kvs[MG4_KV_SOC], uv);
+		batgw_kv_update(bg, batgw_b_scope(sc->b),
+		    &sc->kvs[MG4_KV_POWER],
+		    batgw_kv_get(&sc->kvs[MG4_KV_VOLTAGE]) *
+		    batgw_kv_get(&sc->kvs[MG4_KV_CURRENT]));
 		break;
 	}
 }
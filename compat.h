@@ -24,6 +24,10 @@
 #define nitems(_a) (sizeof((_a)) / sizeof((_a)[0]))
 #endif
 
+#ifndef howmany
+#define howmany(_x, _y) (((_x) + ((_y) - 1)) / (_y))
+#endif
+
 #define SET(_v, _m) ((_v) |= (_m))
 #define CLR(_v, _m) ((_v) &= ~(_m))
 #define ISSET(_v, _m) ((_v) & (_m))
@@ -60,16 +60,9 @@ static int	 byd_can_i_check(const struct batgw_config_inverter *);
 static void	 byd_can_i_config(struct batgw_config_inverter *);
 static void	*byd_can_i_attach(struct batgw *);
 static void	 byd_can_i_dispatch(struct batgw *, void *);
+static void	 byd_can_i_limits(struct batgw *, void *);
 static void	 byd_can_i_teleperiod(struct batgw *, void *);
 
-const struct batgw_inverter inverter_byd_can = {
-	.i_check =			byd_can_i_check,
-	.i_config =			byd_can_i_config,
-	.i_attach =			byd_can_i_attach,
-	.i_dispatch =			byd_can_i_dispatch,
-	.i_teleperiod =			byd_can_i_teleperiod,
-};
-
 /*
  * byd inverter driver
  */
@@ -103,6 +96,43 @@ static const struct batgw_kv_tpl byd_can_kvs_tpl[BYD_CAN_KV_COUNT] = {
 		{ "max-charge",		KV_T_CURRENT,   1 },
 };
 
+static const struct can_decode byd_can_i_decode[] = {
+	{ 0x019, CAN_D_ALIVE },
+	{ 0x091, 0,
+	    .cd_off = 0, .cd_bits = 16,
+	    .cd_kv = BYD_CAN_KV_RECV_VOLTAGE },
+	{ 0x091, CAN_D_SIGNED,
+	    .cd_off = 2, .cd_bits = 16,
+	    .cd_kv = BYD_CAN_KV_RECV_CURRENT },
+	{ 0x091, 0,			/* XXX signed? */
+	    .cd_off = 4, .cd_bits = 16,
+	    .cd_kv = BYD_CAN_KV_TEMP },
+	{ 0x0d1, CAN_D_ALIVE },
+	{ 0x111, CAN_D_ALIVE },
+	{ 0x151, CAN_D_ALIVE },
+};
+
+static struct can_decode_index byd_can_i_decode_index;
+
+static const struct can_decoder byd_can_i_decoder = {
+	.cdr_scope =			"inverter",
+	.cdr_table =			byd_can_i_decode,
+	.cdr_ntable =			nitems(byd_can_i_decode),
+	.cdr_nkvs =			BYD_CAN_KV_COUNT,
+	.cdr_index =			&byd_can_i_decode_index,
+};
+
+const struct batgw_inverter inverter_byd_can = {
+	.i_check =			byd_can_i_check,
+	.i_config =			byd_can_i_config,
+	.i_attach =			byd_can_i_attach,
+	.i_dispatch =			byd_can_i_dispatch,
+	.i_teleperiod =			byd_can_i_teleperiod,
+	.i_limits =			byd_can_i_limits,
+
+	.i_decoder =			&byd_can_i_decoder,
+};
+
 enum byd_can_ivals {
 	BYD_CAN_IVAL_2S,
 	BYD_CAN_IVAL_10S,
@@ -118,7 +148,8 @@ struct byd_can_i_softc {
 	struct event		*can_recv;
 	struct event		*can_wdog;
 
-	struct event		*can_ivals[BYD_CAN_IVAL_COUNT];
+	struct batgw_task	*can_ivals[BYD_CAN_IVAL_COUNT];
+	struct batgw_hist	*can_hello;
 
 	time_t			 inverter_time;
 	struct batgw_kv		 kvs[BYD_CAN_KV_COUNT];
@@ -126,22 +157,35 @@ struct byd_can_i_softc {
 
 static void	byd_can_i_poll(int, short, void *);
 static void	byd_can_i_recv(int, short, void *);
+static void	byd_can_i_input(struct batgw *, void *,
+		    const struct canfd_frame *);
 static void	byd_can_i_wdog(int, short, void *);
 
-static void	byd_can_i_2s(int, short, void *);
-static void	byd_can_i_10s(int, short, void *);
-static void	byd_can_i_60s(int, short, void *);
+static void	byd_can_i_2s(struct batgw *, void *);
+static void	byd_can_i_10s(struct batgw *, void *);
+static void	byd_can_i_60s(struct batgw *, void *);
+
+struct byd_can_ival {
+	const char		*name;
+	struct timeval		 period;
+	struct timeval		 phase;
+	void			(*fn)(struct batgw *, void *);
+};
 
-static const event_callback_fn byd_can_ivals[BYD_CAN_IVAL_COUNT] = {
-	[BYD_CAN_IVAL_2S] =	byd_can_i_2s,
-	[BYD_CAN_IVAL_10S] =	byd_can_i_10s,
-	[BYD_CAN_IVAL_60S] =	byd_can_i_60s,
+/* keep the streams from lining up on the same tick */
+static const struct byd_can_ival byd_can_ivals[BYD_CAN_IVAL_COUNT] = {
+	[BYD_CAN_IVAL_2S] =
+		{ "byd inverter 2s",	{ 2, 0 },	{ 0, 0 },
+		  byd_can_i_2s },
+	[BYD_CAN_IVAL_10S] =
+		{ "byd inverter 10s",	{ 10, 0 },	{ 0, 250000 },
+		  byd_can_i_10s },
+	[BYD_CAN_IVAL_60S] =
+		{ "byd inverter 60s",	{ 60, 0 },	{ 0, 500000 },
+		  byd_can_i_60s },
 };
 
 static const struct timeval byd_wdog_tv = { 60, 0 };
-static const struct timeval byd_2s = { 2, 000000 };
-static const struct timeval byd_10s = { 10, 000000 };
-static const struct timeval byd_60s = { 60, 000000 };
 
 static int
 byd_can_i_check(const struct batgw_config_inverter *iconf)
@@ -166,7 +210,6 @@ byd_can_i_config(struct batgw_config_inverter *iconf)
 static void *
 byd_can_i_attach(struct batgw *bg)
 {
-	const struct batgw_config_inverter *iconf = batgw_i_config(bg);
 	struct byd_can_i_softc *sc;
 	int fd;
 	size_t i;
@@ -175,7 +218,7 @@ byd_can_i_attach(struct batgw *bg)
 	if (sc == NULL)
 		err(1, "%s alloc", __func__);
 
-	fd = can_open("byd inverter", iconf->ifname);
+	fd = batgw_i_can_open(bg, "byd inverter");
 
 	sc->can = fd;
 
@@ -190,14 +233,16 @@ byd_can_i_attach(struct batgw *bg)
 		errx(1, "new byd can inverter wdog event failed");
 
 	for (i = 0; i < nitems(sc->can_ivals); i++) {
-		sc->can_ivals[i] = evtimer_new(batgw_event_base(bg),
-		    byd_can_ivals[i], bg);
-		if (sc->can_ivals[i] == NULL)
-			errx(1, "new byd can inverter ival %zu failed", i);
+		const struct byd_can_ival *ival = &byd_can_ivals[i];
+
+		sc->can_ivals[i] = batgw_task_add(bg, ival->name,
+		    &ival->period, &ival->phase, ival->fn, sc);
 	}
+	sc->can_hello = batgw_hist_add(bg, "inverter hello");
 
 	for (i = 0; i < nitems(sc->kvs); i++)
 		batgw_kv_init_tpl(&sc->kvs[i], &byd_can_kvs_tpl[i]);
+	batgw_kv_attach(bg, "inverter", sc->kvs, nitems(sc->kvs));
 
 	return (sc);
 }
@@ -238,27 +283,27 @@ byd_can_i_wdog(int nil, short events, void *arg)
 	batgw_i_set_contactor(bg, 0);
 
 	for (i = 0; i < nitems(sc->can_ivals); i++)
-		evtimer_del(sc->can_ivals[i]);
+		batgw_task_stop(sc->can_ivals[i]);
 }
 
 void
-byd_can_i_send_str(struct byd_can_i_softc *sc, uint16_t id,
-    const char *str, size_t len)
+byd_can_i_send_str(struct batgw *bg, struct byd_can_i_softc *sc,
+    uint16_t id, const char *str, size_t len)
 {
-	struct can_frame frame = { .can_id = id, .len = 8 };
+	struct canfd_frame frame = { .can_id = id, .len = 8 };
 	uint8_t i = 0;
 	ssize_t rv;
 
 	for (;;) {
 		size_t flen = len;
-		if (flen > (sizeof(frame.data) - 1))
-			flen = sizeof(frame.data) - 1;
+		if (flen > (CAN_MAX_DLEN - 1))
+			flen = CAN_MAX_DLEN - 1;
 
-		memset(frame.data, 0, sizeof(frame.data));
+		memset(frame.data, 0, CAN_MAX_DLEN);
 		frame.data[0] = i;
 		memcpy(frame.data + 1, str, flen);
 
-		rv = send(sc->can, &frame, sizeof(frame), 0);
+		rv = can_send(bg, sc->can, &frame);
 		if (rv == -1)
 			lwarnx("byd can inverter send 0x%03x %u", id, i);
 
@@ -274,7 +319,7 @@ byd_can_i_send_str(struct byd_can_i_softc *sc, uint16_t id,
 static void
 byd_can_i_hello(struct batgw *bg, struct byd_can_i_softc *sc)
 {
-	struct can_frame frame = { .len = 8 };
+	struct canfd_frame frame = { .len = 8 };
 	unsigned int wh;
 	ssize_t rv;
 	size_t i;
@@ -293,7 +338,7 @@ byd_can_i_hello(struct batgw *bg, struct byd_can_i_softc *sc)
 	frame.data[6] = 0x02;
 	frame.data[7] = 0x09;
 
-	rv = send(sc->can, &frame, sizeof(frame), 0);
+	rv = can_send(bg, sc->can, &frame);
 	if (rv == -1)
 		lwarnx("byd can inverter send 0x%03x", frame.can_id);
 
@@ -307,55 +352,46 @@ byd_can_i_hello(struct batgw *bg, struct byd_can_i_softc *sc)
 	frame.data[6] = 0x00;
 	frame.data[7] = 0x00;
 
-	rv = send(sc->can, &frame, sizeof(frame), 0);
+	rv = can_send(bg, sc->can, &frame);
 	if (rv == -1)
 		lwarnx("byd can inverter send 0x%03x", frame.can_id);
 
-	byd_can_i_send_str(sc, BYD_HVS_PID_VENDOR,
+	byd_can_i_send_str(bg, sc, BYD_HVS_PID_VENDOR,
 	    byd_hvs_vendor, sizeof(byd_hvs_vendor));
-	byd_can_i_send_str(sc, BYD_HVS_PID_PRODUCT,
+	byd_can_i_send_str(bg, sc, BYD_HVS_PID_PRODUCT,
 	    byd_hvs_product, sizeof(byd_hvs_product));
+	batgw_hist_rx(bg, sc->can_hello);
 
-	for (i = 0; i < nitems(sc->can_ivals); i++) {
-		event_callback_fn fn = event_get_callback(sc->can_ivals[i]);
-		fn(0, 0, bg);
-	}
+	for (i = 0; i < nitems(sc->can_ivals); i++)
+		batgw_task_start(sc->can_ivals[i]);
 }
 
 static void
 byd_can_i_recv(int fd, short events, void *arg)
 {
 	struct batgw *bg = arg;
-	struct byd_can_i_softc *sc = batgw_i_softc(bg);
-	struct can_frame frame;
-	ssize_t rv;
-	size_t i;
+
+	can_recv(bg, fd, "byd can inverter", byd_can_i_input,
+	    batgw_i_softc(bg));
+}
+
+static void
+byd_can_i_input(struct batgw *bg, void *arg, const struct canfd_frame *frame)
+{
+	struct byd_can_i_softc *sc = arg;
 	int v;
 	unsigned int bdv, idv;
-	int16_t ida;
 	unsigned int contactor = 0;
+	unsigned int flags;
 	char visdst[8 * 4 + 1];
 
-	rv = recv(fd, &frame, sizeof(frame), 0);
-	if (rv == -1) {
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-			break;
-		default:
-			lwarn("byd can inverter recv");
-			break;
-		}
-		return;
-	}
-
-	if (frame.len != 8) {
+	if (frame->len != 8) {
 		/* this is unexpected */
 		return;
 	}
 
 	if (!sc->running) {
-		if (frame.can_id != 0x151 && frame.data[0] != 0x01)
+		if (frame->can_id != 0x151 && frame->data[0] != 0x01)
 			return;
 		if (!batgw_b_get_running(bg))
 			return;
@@ -363,30 +399,18 @@ byd_can_i_recv(int fd, short events, void *arg)
 		sc->running = 1;
 	}
 
-	switch (frame.can_id) {
-	case 0x019:
-	case 0x0d1:
-	case 0x111:
-	case 0x151:
+	flags = can_decode(bg, NULL, &byd_can_i_decoder, sc->kvs, frame);
+	if (ISSET(flags, CAN_D_ALIVE)) {
 		batgw_i_set_running(bg);
 		evtimer_add(sc->can_wdog, &byd_wdog_tv);
-		break;
 	}
 
-	if (batgw_verbose(bg) > 1) {
-		printf("i 0x%03x [%u]", frame.can_id, frame.len);
-		for (i = 0; i < frame.len; i++) {
-			printf(" %02x", frame.data[i]);
-		}
-		printf("\n");
-	}
-
-	switch (frame.can_id) {
+	switch (frame->can_id) {
 	case 0x151:
-		switch (frame.data[0]) {
+		switch (frame->data[0]) {
 		case 0x00:
 			strvisx(visdst,
-			    frame.data + 1, sizeof(frame.data) - 1,
+			    frame->data + 1, CAN_MAX_DLEN - 1,
 			    VIS_NL | VIS_TAB);
 			linfo("inverter brand %s", visdst);
 			break;
@@ -397,18 +421,7 @@ byd_can_i_recv(int fd, short events, void *arg)
 		break;
 
 	case 0x091:
-		idv = can_betoh16(&frame, 0);
-		batgw_kv_update(bg, "inverter",
-		    &sc->kvs[BYD_CAN_KV_RECV_VOLTAGE], idv);
-
-		ida = can_betoh16(&frame, 2);
-		batgw_kv_update(bg, "inverter",
-		    &sc->kvs[BYD_CAN_KV_RECV_CURRENT], ida);
-
-		/* XXX signed? */
-		batgw_kv_update(bg, "inverter",
-		    &sc->kvs[BYD_CAN_KV_TEMP], can_betoh16(&frame, 4));
-
+		idv = can_betoh16(frame, 0);
 		if (batgw_i_get_voltage_dv(bg, &bdv) != 0) {
 			contactor =
 			    (bdv + BYD_HVS_VOLTAGE_OFFSET_DV) > idv &&
@@ -417,27 +430,36 @@ byd_can_i_recv(int fd, short events, void *arg)
 		batgw_i_set_contactor(bg, contactor);
 		break;
 	case 0x0d1:
-		//printf("i soc %u\n", can_betoh16(&frame, 0));
+		//printf("i soc %u\n", can_betoh16(frame, 0));
 		break;
 	case 0x111:
 		/* use gmtime to pull this apart event though it's not UTC */
-		sc->inverter_time = can_betoh32(&frame, 0);
+		sc->inverter_time = can_betoh32(frame, 0);
 		break;
 	}
 }
 
 static void
-byd_can_i_2s(int nil, short events, void *arg)
+byd_can_i_limits(struct batgw *bg, void *arg)
 {
-	struct batgw *bg = arg;
-	struct byd_can_i_softc *sc = batgw_i_softc(bg);
-	struct can_frame frame = { .can_id = 0x110, .len = 8 };
+	struct byd_can_i_softc *sc = arg;
+
+	/* the inverter hasn't said hello yet */
+	if (!sc->running)
+		return;
+
+	byd_can_i_2s(bg, sc);
+}
+
+static void
+byd_can_i_2s(struct batgw *bg, void *arg)
+{
+	struct byd_can_i_softc *sc = arg;
+	struct canfd_frame frame = { .can_id = 0x110, .len = 8 };
 	ssize_t rv;
 	unsigned int min_dv, max_dv, da;
 	unsigned int safety;
 
-	evtimer_add(sc->can_ivals[BYD_CAN_IVAL_2S], &byd_2s);
-
 	if (batgw_i_get_min_voltage_dv(bg, &min_dv) != 0 ||
 	    batgw_i_get_max_voltage_dv(bg, &max_dv) != 0)
 		return;
@@ -459,15 +481,15 @@ byd_can_i_2s(int nil, short events, void *arg)
 	    &sc->kvs[BYD_CAN_KV_CHARGE_CURRENT], da);
 	can_htobe16(&frame, 6, da);
 
-	rv = send(sc->can, &frame, sizeof(frame), 0);
+	rv = can_send(bg, sc->can, &frame);
 	if (rv == -1)
 		lwarn("byd can inverter send 0x%03x 2s", frame.can_id);
 }
 
 static void
-byd_can_send_150(const struct batgw *bg, struct byd_can_i_softc *sc)
+byd_can_send_150(struct batgw *bg, struct byd_can_i_softc *sc)
 {
-	struct can_frame frame = { .can_id = 0x150, .len = 8 };
+	struct canfd_frame frame = { .can_id = 0x150, .len = 8 };
 	unsigned int soc, ah;
 
 	if (batgw_i_get_soc_cpct(bg, &soc) != 0 ||
@@ -479,14 +501,14 @@ byd_can_send_150(const struct batgw *bg, struct byd_can_i_softc *sc)
 	can_htobe16(&frame, 4, (ah * soc) / 10000);
 	can_htobe16(&frame, 6, ah);
 
-	if (send(sc->can, &frame, sizeof(frame), 0) == -1)
+	if (can_send(bg, sc->can, &frame) == -1)
 		lwarn("byd can inverter send 0x%03x", frame.can_id);
 }
 
 static void
 byd_can_send_1d0(struct batgw *bg, struct byd_can_i_softc *sc)
 {
-	struct can_frame frame = {
+	struct canfd_frame frame = {
 		.can_id = 0x1d0,
 		.len = 8,
 		.data = { [6] = 0x03, [7] = 0x08 }
@@ -511,14 +533,14 @@ byd_can_send_1d0(struct batgw *bg, struct byd_can_i_softc *sc)
 	can_htobe16(&frame, 2, (int16_t)da);
 	can_htobe16(&frame, 4, temp);
 
-	if (send(sc->can, &frame, sizeof(frame), 0) == -1)
+	if (can_send(bg, sc->can, &frame) == -1)
 		lwarn("byd can inverter send 0x%03x", frame.can_id);
 }
 
 static void
-byd_can_send_210(const struct batgw *bg, struct byd_can_i_softc *sc)
+byd_can_send_210(struct batgw *bg, struct byd_can_i_softc *sc)
 {
-	struct can_frame frame = { .can_id = 0x210, .len = 8 };
+	struct canfd_frame frame = { .can_id = 0x210, .len = 8 };
 	unsigned int min_temp, max_temp;
 
 	if (batgw_i_get_min_temp_dc(bg, &min_temp) != 0 ||
@@ -528,40 +550,34 @@ byd_can_send_210(const struct batgw *bg, struct byd_can_i_softc *sc)
 	can_htobe16(&frame, 0, max_temp);
 	can_htobe16(&frame, 2, min_temp);
 
-	if (send(sc->can, &frame, sizeof(frame), 0) == -1)
+	if (can_send(bg, sc->can, &frame) == -1)
 		lwarn("byd can inverter send 0x%03x", frame.can_id);
 }
 
 static void
-byd_can_i_10s(int nil, short events, void *arg)
+byd_can_i_10s(struct batgw *bg, void *arg)
 {
-	struct batgw *bg = arg;
-	struct byd_can_i_softc *sc = batgw_i_softc(bg);
-	struct can_frame frame = { .len = 8 };
+	struct byd_can_i_softc *sc = arg;
+	struct canfd_frame frame = { .len = 8 };
 	ssize_t rv;
 
-	evtimer_add(sc->can_ivals[BYD_CAN_IVAL_10S], &byd_10s);
-
 	byd_can_send_150(bg, sc);
 	byd_can_send_1d0(bg, sc);
 	byd_can_send_210(bg, sc);
 }
 
 static void
-byd_can_i_60s(int nil, short events, void *arg)
+byd_can_i_60s(struct batgw *bg, void *arg)
 {
-	struct batgw *bg = arg;
-	struct byd_can_i_softc *sc = batgw_i_softc(bg);
-	struct can_frame frame = {
+	struct byd_can_i_softc *sc = arg;
+	struct canfd_frame frame = {
 		.can_id = 0x190,
 		.len = 8,
 		.data = { [2] = 0x03, }
 	};
 	ssize_t rv;
 
-	evtimer_add(sc->can_ivals[BYD_CAN_IVAL_60S], &byd_60s);
-
-	rv = send(sc->can, &frame, sizeof(frame), 0);
+	rv = can_send(bg, sc->can, &frame);
 	if (rv == -1)
 		lwarn("byd can inverter send 0x%03x 60s", frame.can_id);
 }
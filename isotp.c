@@ -0,0 +1,667 @@
+/* */
+
+/*
+ * Copyright (c) 2025 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ISO 15765-2 (ISO-TP) transport and a small UDS client on top of it.
+ *
+ * the transport carries one message at a time in each direction
+ * between a pair of can ids. it handles segmentation, reassembly,
+ * flow control and the N_Bs/N_Cr timeouts.
+ */
+
+#include "compat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <linux/can.h>
+
+#include "batgw_config.h"
+#include "batgw.h"
+#include "log.h"
+
+#define ISOTP_PCI_SF		0x0
+#define ISOTP_PCI_FF		0x1
+#define ISOTP_PCI_CF		0x2
+#define ISOTP_PCI_FC		0x3
+
+#define ISOTP_FC_CTS		0x0
+#define ISOTP_FC_WAIT		0x1
+#define ISOTP_FC_OVFLW		0x2
+
+#define ISOTP_SF_MAX		7
+#define ISOTP_FF_DATA		6
+#define ISOTP_CF_DATA		7
+
+enum isotp_state {
+	ISOTP_S_IDLE,
+	ISOTP_S_RX,		/* reassembling */
+	ISOTP_S_TX_WAIT,	/* waiting for flow control */
+	ISOTP_S_TX,		/* sending consecutive frames */
+};
+
+struct isotp {
+	struct batgw		*it_bg;
+	const char		*it_scope;
+	int			 it_fd;
+	canid_t			 it_txid;
+	canid_t			 it_rxid;
+	struct isotp_params	 it_params;
+
+	void			(*it_input)(struct batgw *, void *,
+				     const uint8_t *, size_t, int);
+	void			*it_arg;
+
+	struct batgw_hist	*it_fc_hist;	/* FF to our FC */
+
+	enum isotp_state	 it_rx_state;
+	struct event		*it_rx_tmo;
+	size_t			 it_rx_len;
+	size_t			 it_rx_off;
+	unsigned int		 it_rx_sn;
+	unsigned int		 it_rx_block;
+	uint8_t			 it_rx_buf[ISOTP_MAX];
+
+	enum isotp_state	 it_tx_state;
+	struct event		*it_tx_tmo;
+	struct event		*it_tx_gap;
+	size_t			 it_tx_len;
+	size_t			 it_tx_off;
+	unsigned int		 it_tx_sn;
+	unsigned int		 it_tx_bs;
+	unsigned int		 it_tx_block;
+	struct timeval		 it_tx_stmin;
+	uint8_t			 it_tx_buf[ISOTP_MAX];
+};
+
+static void	isotp_rx_tmo(int, short, void *);
+static void	isotp_tx_tmo(int, short, void *);
+static void	isotp_tx_gap(int, short, void *);
+static void	isotp_tx_cf(struct isotp *);
+
+static const struct isotp_params isotp_defaults = {
+	.ip_bs =		8,
+	.ip_stmin_us =		5000,
+	.ip_timeout =		{ 1, 0 },
+	.ip_pad =		0x00,
+};
+
+struct isotp *
+isotp_create(struct batgw *bg, const char *scope, int fd,
+    canid_t txid, canid_t rxid, const struct isotp_params *params,
+    void (*input)(struct batgw *, void *, const uint8_t *, size_t, int),
+    void *arg)
+{
+	struct isotp *it;
+	char *name;
+
+	it = calloc(1, sizeof(*it));
+	if (it == NULL)
+		err(1, "%s isotp alloc", scope);
+
+	it->it_bg = bg;
+	it->it_scope = scope;
+	it->it_fd = fd;
+	it->it_txid = txid;
+	it->it_rxid = rxid;
+	it->it_params = (params != NULL) ? *params : isotp_defaults;
+	it->it_input = input;
+	it->it_arg = arg;
+
+	it->it_rx_tmo = evtimer_new(batgw_event_base(bg), isotp_rx_tmo, it);
+	it->it_tx_tmo = evtimer_new(batgw_event_base(bg), isotp_tx_tmo, it);
+	it->it_tx_gap = evtimer_new(batgw_event_base(bg), isotp_tx_gap, it);
+	if (it->it_rx_tmo == NULL || it->it_tx_tmo == NULL ||
+	    it->it_tx_gap == NULL)
+		errx(1, "%s isotp events", scope);
+
+	if (asprintf(&name, "%s flow control", scope) == -1)
+		errx(1, "%s isotp hist name", scope);
+	it->it_fc_hist = batgw_hist_add(bg, name);
+
+	return (it);
+}
+
+static uint8_t
+isotp_stmin_enc(unsigned int usec)
+{
+	if (usec == 0)
+		return (0x00);
+	if (usec < 1000)
+		return (0xf0 + howmany(usec, 100));
+	if (usec > 127000)
+		return (0x7f);
+
+	return (howmany(usec, 1000));
+}
+
+static void
+isotp_stmin_dec(uint8_t stmin, struct timeval *tv)
+{
+	tv->tv_sec = 0;
+
+	if (stmin <= 0x7f)
+		tv->tv_usec = stmin * 1000;
+	else if (stmin >= 0xf1 && stmin <= 0xf9)
+		tv->tv_usec = (stmin - 0xf0) * 100;
+	else {
+		/* reserved values mean the longest gap */
+		tv->tv_usec = 127000;
+	}
+}
+
+static int
+isotp_send(struct isotp *it, struct canfd_frame *frame, size_t len)
+{
+	/* pad the frame out, some ecus insist on 8 bytes */
+	memset(frame->data + len, it->it_params.ip_pad,
+	    CAN_MAX_DLEN - len);
+	frame->can_id = it->it_txid;
+	frame->len = CAN_MAX_DLEN;
+
+	if (can_send(it->it_bg, it->it_fd, frame) == -1) {
+		lwarn("%s isotp send", it->it_scope);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+isotp_fc(struct isotp *it, unsigned int fs)
+{
+	struct canfd_frame frame;
+
+	frame.data[0] = (ISOTP_PCI_FC << 4) | fs;
+	frame.data[1] = it->it_params.ip_bs;
+	frame.data[2] = isotp_stmin_enc(it->it_params.ip_stmin_us);
+
+	isotp_send(it, &frame, 3);
+}
+
+static void
+isotp_rx_abort(struct isotp *it, int error)
+{
+	it->it_rx_state = ISOTP_S_IDLE;
+	evtimer_del(it->it_rx_tmo);
+
+	it->it_input(it->it_bg, it->it_arg, NULL, 0, error);
+}
+
+static void
+isotp_tx_abort(struct isotp *it, int error)
+{
+	it->it_tx_state = ISOTP_S_IDLE;
+	evtimer_del(it->it_tx_tmo);
+	evtimer_del(it->it_tx_gap);
+
+	it->it_input(it->it_bg, it->it_arg, NULL, 0, error);
+}
+
+static void
+isotp_rx_tmo(int nil, short events, void *arg)
+{
+	struct isotp *it = arg;
+
+	lwarnx("%s isotp receive timeout", it->it_scope);
+	isotp_rx_abort(it, ETIMEDOUT);
+}
+
+static void
+isotp_tx_tmo(int nil, short events, void *arg)
+{
+	struct isotp *it = arg;
+
+	lwarnx("%s isotp flow control timeout", it->it_scope);
+	isotp_tx_abort(it, ETIMEDOUT);
+}
+
+static void
+isotp_tx_gap(int nil, short events, void *arg)
+{
+	struct isotp *it = arg;
+
+	isotp_tx_cf(it);
+}
+
+int
+isotp_write(struct isotp *it, const void *buf, size_t len)
+{
+	struct canfd_frame frame;
+
+	if (it->it_tx_state != ISOTP_S_IDLE) {
+		errno = EBUSY;
+		return (-1);
+	}
+	if (len == 0 || len > sizeof(it->it_tx_buf)) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	if (len <= ISOTP_SF_MAX) {
+		frame.data[0] = (ISOTP_PCI_SF << 4) | len;
+		memcpy(frame.data + 1, buf, len);
+		return (isotp_send(it, &frame, 1 + len));
+	}
+
+	memcpy(it->it_tx_buf, buf, len);
+	it->it_tx_len = len;
+
+	frame.data[0] = (ISOTP_PCI_FF << 4) | (len >> 8);
+	frame.data[1] = len;
+	memcpy(frame.data + 2, it->it_tx_buf, ISOTP_FF_DATA);
+	if (isotp_send(it, &frame, CAN_MAX_DLEN) == -1)
+		return (-1);
+
+	it->it_tx_off = ISOTP_FF_DATA;
+	it->it_tx_sn = 1;
+	it->it_tx_state = ISOTP_S_TX_WAIT;
+	evtimer_add(it->it_tx_tmo, &it->it_params.ip_timeout);
+
+	return (0);
+}
+
+static void
+isotp_tx_cf(struct isotp *it)
+{
+	struct canfd_frame frame;
+	size_t len;
+
+	for (;;) {
+		len = it->it_tx_len - it->it_tx_off;
+		if (len > ISOTP_CF_DATA)
+			len = ISOTP_CF_DATA;
+
+		frame.data[0] = (ISOTP_PCI_CF << 4) | it->it_tx_sn;
+		memcpy(frame.data + 1, it->it_tx_buf + it->it_tx_off, len);
+		if (isotp_send(it, &frame, 1 + len) == -1) {
+			isotp_tx_abort(it, EIO);
+			return;
+		}
+
+		it->it_tx_off += len;
+		it->it_tx_sn = (it->it_tx_sn + 1) & 0xf;
+
+		if (it->it_tx_off >= it->it_tx_len) {
+			it->it_tx_state = ISOTP_S_IDLE;
+			return;
+		}
+
+		if (it->it_tx_bs != 0 && ++it->it_tx_block >= it->it_tx_bs) {
+			it->it_tx_state = ISOTP_S_TX_WAIT;
+			evtimer_add(it->it_tx_tmo, &it->it_params.ip_timeout);
+			return;
+		}
+
+		if (timerisset(&it->it_tx_stmin)) {
+			evtimer_add(it->it_tx_gap, &it->it_tx_stmin);
+			return;
+		}
+	}
+}
+
+static void
+isotp_input_fc(struct isotp *it, const struct canfd_frame *frame)
+{
+	if (it->it_tx_state != ISOTP_S_TX_WAIT)
+		return;
+
+	switch (frame->data[0] & 0xf) {
+	case ISOTP_FC_CTS:
+		evtimer_del(it->it_tx_tmo);
+		it->it_tx_bs = frame->data[1];
+		it->it_tx_block = 0;
+		isotp_stmin_dec(frame->data[2], &it->it_tx_stmin);
+		it->it_tx_state = ISOTP_S_TX;
+		isotp_tx_cf(it);
+		break;
+	case ISOTP_FC_WAIT:
+		evtimer_add(it->it_tx_tmo, &it->it_params.ip_timeout);
+		break;
+	case ISOTP_FC_OVFLW:
+		lwarnx("%s isotp peer overflow", it->it_scope);
+		isotp_tx_abort(it, EMSGSIZE);
+		break;
+	default:
+		isotp_tx_abort(it, EPROTO);
+		break;
+	}
+}
+
+static void
+isotp_input_ff(struct isotp *it, const struct canfd_frame *frame)
+{
+	size_t len;
+
+	len = ((frame->data[0] & 0xf) << 8) | frame->data[1];
+	if (len <= ISOTP_SF_MAX) {
+		/* this is unexpected */
+		return;
+	}
+	if (len > sizeof(it->it_rx_buf)) {
+		isotp_fc(it, ISOTP_FC_OVFLW);
+		return;
+	}
+
+	/* a new first frame replaces whatever was in progress */
+	memcpy(it->it_rx_buf, frame->data + 2, ISOTP_FF_DATA);
+	it->it_rx_len = len;
+	it->it_rx_off = ISOTP_FF_DATA;
+	it->it_rx_sn = 1;
+	it->it_rx_block = 0;
+	it->it_rx_state = ISOTP_S_RX;
+
+	isotp_fc(it, ISOTP_FC_CTS);
+	batgw_hist_rx(it->it_bg, it->it_fc_hist);
+	evtimer_add(it->it_rx_tmo, &it->it_params.ip_timeout);
+}
+
+static void
+isotp_input_cf(struct isotp *it, const struct canfd_frame *frame)
+{
+	size_t len;
+
+	if (it->it_rx_state != ISOTP_S_RX)
+		return;
+
+	if ((frame->data[0] & 0xf) != it->it_rx_sn) {
+		lwarnx("%s isotp sequence %u, expected %u", it->it_scope,
+		    frame->data[0] & 0xf, it->it_rx_sn);
+		isotp_rx_abort(it, EPROTO);
+		return;
+	}
+
+	len = it->it_rx_len - it->it_rx_off;
+	if (len > ISOTP_CF_DATA)
+		len = ISOTP_CF_DATA;
+	memcpy(it->it_rx_buf + it->it_rx_off, frame->data + 1, len);
+	it->it_rx_off += len;
+	it->it_rx_sn = (it->it_rx_sn + 1) & 0xf;
+
+	if (it->it_rx_off >= it->it_rx_len) {
+		it->it_rx_state = ISOTP_S_IDLE;
+		evtimer_del(it->it_rx_tmo);
+		it->it_input(it->it_bg, it->it_arg,
+		    it->it_rx_buf, it->it_rx_len, 0);
+		return;
+	}
+
+	if (it->it_params.ip_bs != 0 &&
+	    ++it->it_rx_block >= it->it_params.ip_bs) {
+		it->it_rx_block = 0;
+		isotp_fc(it, ISOTP_FC_CTS);
+	}
+
+	evtimer_add(it->it_rx_tmo, &it->it_params.ip_timeout);
+}
+
+int
+isotp_input(struct isotp *it, const struct canfd_frame *frame)
+{
+	size_t len;
+
+	if (frame->can_id != it->it_rxid)
+		return (0);
+	if (frame->len < 1)
+		return (1);
+
+	switch (frame->data[0] >> 4) {
+	case ISOTP_PCI_SF:
+		len = frame->data[0] & 0xf;
+		if (len == 0 || len >= frame->len) {
+			/* this is unexpected */
+			break;
+		}
+		if (it->it_rx_state == ISOTP_S_RX) {
+			it->it_rx_state = ISOTP_S_IDLE;
+			evtimer_del(it->it_rx_tmo);
+		}
+		it->it_input(it->it_bg, it->it_arg, frame->data + 1, len, 0);
+		break;
+	case ISOTP_PCI_FF:
+		if (frame->len == CAN_MAX_DLEN)
+			isotp_input_ff(it, frame);
+		break;
+	case ISOTP_PCI_CF:
+		isotp_input_cf(it, frame);
+		break;
+	case ISOTP_PCI_FC:
+		if (frame->len >= 3)
+			isotp_input_fc(it, frame);
+		break;
+	}
+
+	return (1);
+}
+
+/*
+ * UDS ReadDataByIdentifier. several dids can go in one request if the
+ * ecu allows it. if it rejects a multi did request or answers it
+ * short, drop back to one did per request and let the caller try again.
+ */
+
+#define UDS_SID_RDBI		0x22
+#define UDS_SID_NEGATIVE	0x7f
+#define UDS_POSITIVE		0x40
+
+#define UDS_NRC_LENGTH		0x13	/* incorrectMessageLength */
+#define UDS_NRC_TOO_LONG	0x14	/* responseTooLong */
+#define UDS_NRC_RANGE		0x31	/* requestOutOfRange */
+#define UDS_NRC_PENDING		0x78	/* responsePending */
+
+struct uds {
+	struct batgw		*u_bg;
+	const char		*u_scope;
+	struct isotp		*u_tp;
+	struct event		*u_tmo;
+
+	unsigned int		 u_maxdids;
+	struct uds_did		 u_dids[UDS_MAX_DIDS];
+	size_t			 u_ndids;	/* outstanding */
+
+	void			(*u_did)(struct batgw *, void *, uint16_t,
+				     const uint8_t *, size_t);
+	void			(*u_done)(struct batgw *, void *, int);
+	void			*u_arg;
+};
+
+static const struct timeval uds_p2 = { 1, 0 };
+static const struct timeval uds_p2_ext = { 5, 0 };
+
+static void
+uds_done(struct uds *u, int error)
+{
+	u->u_ndids = 0;
+	evtimer_del(u->u_tmo);
+
+	u->u_done(u->u_bg, u->u_arg, error);
+}
+
+static void
+uds_tmo(int nil, short events, void *arg)
+{
+	struct uds *u = arg;
+
+	uds_done(u, ETIMEDOUT);
+}
+
+static void
+uds_single(struct uds *u, const char *why)
+{
+	if (u->u_ndids > 1 && u->u_maxdids > 1) {
+		linfo("%s: multiple dids %s, asking for one at a time",
+		    u->u_scope, why);
+		u->u_maxdids = 1;
+	}
+}
+
+static void
+uds_nrc(struct uds *u, const uint8_t *buf, size_t len)
+{
+	char why[32];
+
+	if (len < 3 || buf[1] != UDS_SID_RDBI)
+		return;
+
+	switch (buf[2]) {
+	case UDS_NRC_PENDING:
+		evtimer_add(u->u_tmo, &uds_p2_ext);
+		return;
+	case UDS_NRC_LENGTH:
+	case UDS_NRC_TOO_LONG:
+	case UDS_NRC_RANGE:
+		snprintf(why, sizeof(why), "refused (nrc 0x%02x)", buf[2]);
+		uds_single(u, why);
+		break;
+	}
+
+	uds_done(u, EIO);
+}
+
+static void
+uds_input(struct batgw *bg, void *arg, const uint8_t *buf, size_t len,
+    int error)
+{
+	struct uds *u = arg;
+	const struct uds_did *d;
+	size_t i, off = 1;
+
+	if (u->u_ndids == 0) {
+		/* nothing asked for this */
+		return;
+	}
+	if (error != 0) {
+		uds_done(u, error);
+		return;
+	}
+
+	if (len < 1)
+		return;
+	if (buf[0] == UDS_SID_NEGATIVE) {
+		uds_nrc(u, buf, len);
+		return;
+	}
+	if (buf[0] != (UDS_SID_RDBI | UDS_POSITIVE))
+		return;
+
+	for (i = 0; i < u->u_ndids; i++) {
+		d = &u->u_dids[i];
+
+		if (len - off < 2 + d->len ||
+		    ((buf[off] << 8) | buf[off + 1]) != d->did) {
+			/* some ecus only answer the first did, or garble it */
+			uds_single(u, "answered short");
+			uds_done(u, EPROTO);
+			return;
+		}
+
+		u->u_did(bg, u->u_arg, d->did, buf + off + 2, d->len);
+		off += 2 + d->len;
+	}
+
+	uds_done(u, 0);
+}
+
+struct uds *
+uds_create(struct batgw *bg, const char *scope, int fd,
+    canid_t txid, canid_t rxid, const struct isotp_params *params,
+    unsigned int maxdids,
+    void (*did)(struct batgw *, void *, uint16_t, const uint8_t *, size_t),
+    void (*done)(struct batgw *, void *, int), void *arg)
+{
+	struct uds *u;
+
+	u = calloc(1, sizeof(*u));
+	if (u == NULL)
+		err(1, "%s uds alloc", scope);
+
+	if (maxdids < 1)
+		maxdids = 1;
+	if (maxdids > UDS_MAX_DIDS)
+		maxdids = UDS_MAX_DIDS;
+
+	u->u_bg = bg;
+	u->u_scope = scope;
+	u->u_maxdids = maxdids;
+	u->u_did = did;
+	u->u_done = done;
+	u->u_arg = arg;
+
+	u->u_tmo = evtimer_new(batgw_event_base(bg), uds_tmo, u);
+	if (u->u_tmo == NULL)
+		errx(1, "%s uds timeout event", scope);
+
+	u->u_tp = isotp_create(bg, scope, fd, txid, rxid, params,
+	    uds_input, u);
+
+	return (u);
+}
+
+unsigned int
+uds_maxdids(const struct uds *u)
+{
+	return (u->u_maxdids);
+}
+
+int
+uds_busy(const struct uds *u)
+{
+	return (u->u_ndids > 0);
+}
+
+size_t
+uds_read(struct uds *u, const struct uds_did *dids, size_t ndids)
+{
+	uint8_t req[1 + (UDS_MAX_DIDS * 2)];
+	size_t i, len = 0;
+
+	if (u->u_ndids > 0)
+		return (0);
+
+	if (ndids > u->u_maxdids)
+		ndids = u->u_maxdids;
+
+	req[len++] = UDS_SID_RDBI;
+	for (i = 0; i < ndids; i++) {
+		u->u_dids[i] = dids[i];
+		req[len++] = dids[i].did >> 8;
+		req[len++] = dids[i].did;
+	}
+
+	if (isotp_write(u->u_tp, req, len) == -1) {
+		lwarn("%s uds read", u->u_scope);
+		return (0);
+	}
+
+	u->u_ndids = ndids;
+	evtimer_add(u->u_tmo, &uds_p2);
+
+	return (ndids);
+}
+
+int
+uds_can_input(struct uds *u, const struct canfd_frame *frame)
+{
+	return (isotp_input(u->u_tp, frame));
+}
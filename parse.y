@@ -82,6 +82,8 @@ char            *symget(const char *);
 
 static int			 errors;
 static struct batgw_config	*conf;
+static struct batgw_config_battery
+				*battery;
 
 static const char *check_mqtt_topic(const char *);
 
@@ -97,17 +99,22 @@ typedef struct {
 %}
 
 %token	MQTT HOST PORT USERNAME PASSWORD CLIENT ID TOPIC TELEPERIOD RECONNECT
-%token	KEEP ALIVE OFF
+%token	KEEP ALIVE OFF TELEMETRY JSON KV BINARY
+%token	DEADBAND PUBLISH INTERVAL WATERMARK LOW HIGH
 %token	INET INET6 IPV4 IPV6
-%token	BATTERY CHARGE DISCHARGE LIMIT MAX
+%token	BATTERY CHARGE DISCHARGE LIMIT MAX AGE
 %token	INVERTER
-%token	PROTOCOL INTERFACE
+%token	REALTIME PRIORITY CPU THREAD ROLLUP
+%token	QOS QUEUE RATE
+%token	HTTP LISTEN ON
+%token	CONNECT TIMEOUT
+%token	PROTOCOL INTERFACE BCM FD BRS
 %token	INCLUDE
 %token	ERROR
 %token	<v.string>		STRING
 %token	<v.number>		NUMBER
-%type	<v.number>		limit_max
-%type	<v.i>			af mqtt_keepalive
+%type	<v.number>		limit_max rt_cpu queue_rate canfd
+%type	<v.i>			af mqtt_keepalive mqtt_telemetry
 %type	<v.string>		string
 
 %%
@@ -119,6 +126,8 @@ grammar		: /* empty */
 		| grammar mqtt '\n'
 		| grammar battery '\n'
 		| grammar inverter '\n'
+		| grammar http '\n'
+		| grammar realtime '\n'
 		| grammar error '\n'		{ file->errors++; }
 		;
 
@@ -188,6 +197,8 @@ mqtt		: MQTT {
 			conf->mqtt->af = AF_UNSPEC;
 			conf->mqtt->keepalive =
 			    BATGW_MQTT_KEEPALIVE_UNSET;
+			conf->mqtt->publish_min = BATGW_MQTT_PUBLISH_UNSET;
+			conf->mqtt->qos = BATGW_MQTT_QOS_UNSET;
 		} '{' optnl mqttopts_l '}' {
 			if (conf->mqtt->host == NULL) {
 				yyerror("mqtt host not specified");
@@ -309,6 +320,191 @@ mqttopts	: HOST STRING {
 
 			conf->mqtt->reconnect_tmo = $2;
 		}
+		| CONNECT TIMEOUT NUMBER {
+			if (conf->mqtt->connect_tmo != 0) {
+				yyerror("mqtt connect timeout "
+				    "is already configured");
+				YYERROR;
+			}
+			if ($3 < 1) {
+				yyerror("mqtt connect timeout is too short");
+				YYERROR;
+			}
+			if ($3 > 300) {
+				yyerror("mqtt connect timeout is too long");
+				YYERROR;
+			}
+
+			conf->mqtt->connect_tmo = $3;
+		}
+		| TELEMETRY mqtt_telemetry {
+			if (conf->mqtt->telemetry !=
+			    BATGW_MQTT_TELEMETRY_UNSET) {
+				yyerror("mqtt telemetry "
+				    "is already configured");
+				YYERROR;
+			}
+
+			conf->mqtt->telemetry = $2;
+		}
+		| PUBLISH INTERVAL NUMBER limit_max {
+			if (conf->mqtt->publish_min !=
+			    BATGW_MQTT_PUBLISH_UNSET) {
+				yyerror("mqtt publish interval "
+				    "is already configured");
+				YYERROR;
+			}
+			if ($3 < 0) {
+				yyerror("mqtt publish interval is too short");
+				YYERROR;
+			}
+			if ($3 > BATGW_MQTT_PUBLISH_MAX ||
+			    $4 > BATGW_MQTT_PUBLISH_MAX) {
+				yyerror("mqtt publish interval is too long");
+				YYERROR;
+			}
+			if ($4 != 0 && $4 < $3) {
+				yyerror("mqtt publish interval max "
+				    "is less than the min");
+				YYERROR;
+			}
+
+			conf->mqtt->publish_min = $3;
+			conf->mqtt->publish_max = $4;
+		}
+		| WATERMARK LOW NUMBER HIGH NUMBER {
+			if (conf->mqtt->wm_high != 0) {
+				yyerror("mqtt watermark "
+				    "is already configured");
+				YYERROR;
+			}
+			if ($3 < 0 || $5 <= $3) {
+				yyerror("mqtt watermark low must be "
+				    "less than high");
+				YYERROR;
+			}
+			if ($5 > BATGW_MQTT_OBUF_SIZE) {
+				yyerror("mqtt watermark high is too high");
+				YYERROR;
+			}
+
+			conf->mqtt->wm_low = $3;
+			conf->mqtt->wm_high = $5;
+		}
+		| THREAD {
+			if (conf->mqtt->thread) {
+				yyerror("mqtt thread is already configured");
+				YYERROR;
+			}
+
+			conf->mqtt->thread = 1;
+		}
+		| ROLLUP {
+			if (conf->mqtt->rollup) {
+				yyerror("mqtt rollup is already configured");
+				YYERROR;
+			}
+
+			conf->mqtt->rollup = 1;
+		}
+		| QOS NUMBER {
+			if (conf->mqtt->qos != BATGW_MQTT_QOS_UNSET) {
+				yyerror("mqtt qos is already configured");
+				YYERROR;
+			}
+			if ($2 != 0 && $2 != 1) {
+				yyerror("mqtt qos must be 0 or 1");
+				YYERROR;
+			}
+
+			conf->mqtt->qos = $2;
+		}
+		| QUEUE NUMBER queue_rate {
+			if (conf->mqtt->queue != 0) {
+				yyerror("mqtt queue is already configured");
+				YYERROR;
+			}
+			if ($2 < 1 || $2 > BATGW_MQTT_QUEUE_MAX) {
+				yyerror("mqtt queue is out of range");
+				YYERROR;
+			}
+
+			conf->mqtt->queue = $2;
+			conf->mqtt->queue_rate = $3;
+		}
+		| DEADBAND STRING NUMBER {
+			struct batgw_config_deadband *db;
+			unsigned int i;
+
+			for (i = 0; i < conf->mqtt->ndeadbands; i++) {
+				db = &conf->mqtt->deadbands[i];
+				if (strcmp(db->name, $2) == 0) {
+					yyerror("mqtt deadband %s "
+					    "is already configured", $2);
+					free($2);
+					YYERROR;
+				}
+			}
+			if (conf->mqtt->ndeadbands >= BATGW_MQTT_DEADBANDS) {
+				yyerror("too many mqtt deadbands");
+				free($2);
+				YYERROR;
+			}
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("mqtt deadband %s is out of range", $2);
+				free($2);
+				YYERROR;
+			}
+
+			db = &conf->mqtt->deadbands[conf->mqtt->ndeadbands++];
+			db->name = $2;
+			db->milli = $3;
+		}
+		;
+
+realtime	: REALTIME PRIORITY NUMBER rt_cpu {
+			if (conf->rt_priority != 0) {
+				yyerror("realtime is already configured");
+				YYERROR;
+			}
+			if ($3 < BATGW_RT_PRIORITY_MIN ||
+			    $3 > BATGW_RT_PRIORITY_MAX) {
+				yyerror("realtime priority is out of range");
+				YYERROR;
+			}
+
+			conf->rt_priority = $3;
+			conf->rt_cpu = $4;
+		}
+		;
+
+queue_rate	: /* empty */			{ $$ = BATGW_MQTT_QUEUE_RATE; }
+		| RATE NUMBER {
+			if ($2 < 1 || $2 > BATGW_MQTT_QUEUE_RATE_MAX) {
+				yyerror("mqtt queue rate is out of range");
+				YYERROR;
+			}
+
+			$$ = $2;
+		}
+		;
+
+rt_cpu		: /* empty */			{ $$ = -1; }
+		| CPU NUMBER {
+			if ($2 < 0 || $2 > BATGW_RT_CPU_MAX) {
+				yyerror("realtime cpu is out of range");
+				YYERROR;
+			}
+
+			$$ = $2;
+		}
+		;
+
+mqtt_telemetry	: KV				{ $$ = BATGW_MQTT_TELEMETRY_KV; }
+		| JSON				{ $$ = BATGW_MQTT_TELEMETRY_JSON; }
+		| BINARY			{
+			$$ = BATGW_MQTT_TELEMETRY_BINARY;
+		}
 		;
 
 af		: IPV4				{ $$ = PF_INET; }
@@ -333,15 +529,29 @@ mqtt_keepalive	: OFF				{ $$ = 0; }
 		;
 
 battery		: BATTERY {
-			if (conf->battery.protocol != NULL) {
-				yyerror("battery is already configured");
+			if (conf->nbatteries >= BATGW_BATTERIES) {
+				yyerror("too many batteries");
 				YYERROR;
 			}
+			battery = &conf->batteries[conf->nbatteries++];
 		} '{' optnl batteryopts_l '}' {
-			if (conf->battery.protocol == NULL) {
+			unsigned int i;
+
+			if (battery->protocol == NULL) {
 				yyerror("battery protocol is not configured");
 				YYERROR;
 			}
+			for (i = 0; battery->ifname != NULL &&
+			    &conf->batteries[i] != battery; i++) {
+				if (conf->batteries[i].ifname != NULL &&
+				    strcmp(conf->batteries[i].ifname,
+				    battery->ifname) == 0) {
+					yyerror("battery interface %s "
+					    "is already in use",
+					    battery->ifname);
+					YYERROR;
+				}
+			}
 		}
 		;
 
@@ -350,27 +560,78 @@ batteryopts_l	: batteryopts_l batteryopts optnl
 		;
 
 batteryopts	: PROTOCOL STRING {
-			if (conf->battery.protocol != NULL) {
+			if (battery->protocol != NULL) {
 				yyerror("battery protocol "
 				    "is already configured");
 				free($2);
 				YYERROR;
 			}
-			conf->battery.protocol = $2;
+			battery->protocol = $2;
 		}
 		| INTERFACE STRING {
-			if (conf->battery.ifname != NULL) {
+			if (battery->ifname != NULL) {
 				yyerror("battery interface "
 				    "is already configured");
 				free($2);
 				YYERROR;
 			}
-			conf->battery.ifname = $2;
+			battery->ifname = $2;
+		}
+		| BCM {
+			battery->bcm = 1;
+		}
+		| canfd {
+			if (battery->canfd != 0) {
+				yyerror("battery fd is already configured");
+				YYERROR;
+			}
+			battery->canfd = $1;
+		}
+		| AGE LIMIT NUMBER {
+			if (battery->max_age_ms != 0) {
+				yyerror("battery age limit "
+				    "is already configured");
+				YYERROR;
+			}
+			if ($3 < 1 || $3 > INT_MAX) {
+				yyerror("battery age limit is out of range");
+				YYERROR;
+			}
+			battery->max_age_ms = $3;
+		}
+		| AGE LIMIT STRING NUMBER {
+			struct batgw_config_max_age *ma;
+			unsigned int i;
+
+			for (i = 0; i < battery->nmax_ages; i++) {
+				ma = &battery->max_ages[i];
+				if (strcmp(ma->name, $3) == 0) {
+					yyerror("battery age limit %s "
+					    "is already configured", $3);
+					free($3);
+					YYERROR;
+				}
+			}
+			if (battery->nmax_ages >= BATGW_BATTERY_MAX_AGES) {
+				yyerror("too many battery age limits");
+				free($3);
+				YYERROR;
+			}
+			if ($4 < 1 || $4 > INT_MAX) {
+				yyerror("battery age limit %s "
+				    "is out of range", $3);
+				free($3);
+				YYERROR;
+			}
+
+			ma = &battery->max_ages[battery->nmax_ages++];
+			ma->name = $3;
+			ma->ms = $4;
 		}
 		| CHARGE LIMIT NUMBER limit_max {
 			static const char *cfg = "battery charge limit";
 			unsigned int w, maxw;
-			if (conf->battery.max_charge_w != 0) {
+			if (battery->max_charge_w != 0) {
 				yyerror("%s is already configured", cfg);
 				YYERROR;
 			}
@@ -402,13 +663,13 @@ batteryopts	: PROTOCOL STRING {
 				YYERROR;
 			}
 
-			conf->battery.max_charge_w = maxw;
-			conf->battery.charge_w = w;
+			battery->max_charge_w = maxw;
+			battery->charge_w = w;
 		}
 		| DISCHARGE LIMIT NUMBER limit_max {
 			static const char *cfg = "battery discharge limit";
 			unsigned int w, maxw;
-			if (conf->battery.max_discharge_w != 0) {
+			if (battery->max_discharge_w != 0) {
 				yyerror("%s is already configured", cfg);
 				YYERROR;
 			}
@@ -440,8 +701,8 @@ batteryopts	: PROTOCOL STRING {
 				YYERROR;
 			}
 
-			conf->battery.max_discharge_w = maxw;
-			conf->battery.discharge_w = w;
+			battery->max_discharge_w = maxw;
+			battery->discharge_w = w;
 		}
 		;
 
@@ -457,6 +718,50 @@ limit_max	: /* nop */ {
 		}
 		;
 
+http		: HTTP {
+			if (conf->http != NULL) {
+				yyerror("http is already configured");
+				YYERROR;
+			}
+
+			conf->http = calloc(1, sizeof(*conf->http));
+			if (conf->http == NULL)
+				err(1, "http configuration");
+		} '{' optnl httpopts_l '}' {
+			if (conf->http->listen == NULL) {
+				yyerror("http listen address not specified");
+				YYERROR;
+			}
+			if (conf->http->port == 0)
+				conf->http->port = BATGW_HTTP_PORT;
+		}
+		;
+
+httpopts_l	: httpopts_l httpopts optnl
+		| httpopts optnl
+		;
+
+httpopts	: LISTEN ON STRING {
+			if (conf->http->listen != NULL) {
+				yyerror("http listen is already configured");
+				free($3);
+				YYERROR;
+			}
+			conf->http->listen = $3;
+		}
+		| PORT NUMBER {
+			if (conf->http->port != 0) {
+				yyerror("http port is already configured");
+				YYERROR;
+			}
+			if ($2 < 1 || $2 > 65535) {
+				yyerror("http port is out of range");
+				YYERROR;
+			}
+			conf->http->port = $2;
+		}
+		;
+
 inverter	: INVERTER {
 			if (conf->inverter.protocol != NULL) {
 				yyerror("inverter is already configured");
@@ -492,7 +797,19 @@ inverteropts	: PROTOCOL STRING {
 			}
 			conf->inverter.ifname = $2;
 		}
+		| canfd {
+			if (conf->inverter.canfd != 0) {
+				yyerror("inverter fd is already configured");
+				YYERROR;
+			}
+			conf->inverter.canfd = $1;
+		}
 		;
+
+canfd		: FD				{ $$ = BATGW_CAN_FD; }
+		| FD BRS {
+			$$ = BATGW_CAN_FD | BATGW_CAN_FD_BRS;
+		}
 		;
 
 %%
@@ -527,32 +844,59 @@ lookup(char *s)
 {
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
+		{"age",			AGE},
 		{"alive",		ALIVE},
 		{"battery",		BATTERY},
+		{"bcm",			BCM},
+		{"binary",		BINARY},
+		{"brs",			BRS},
 		{"charge",		CHARGE},
 		{"client",		CLIENT},
+		{"connect",		CONNECT},
+		{"cpu",			CPU},
+		{"deadband",		DEADBAND},
 		{"discharge",		DISCHARGE},
+		{"fd",			FD},
+		{"high",		HIGH},
 		{"host",		HOST},
+		{"http",		HTTP},
 		{"id",			ID},
 		{"iface",		INTERFACE},
 		{"inet",		INET},
 		{"inet6",		INET6},
 		{"interface",		INTERFACE},
+		{"interval",		INTERVAL},
 		{"inverter",		INVERTER},
 		{"ipv4",		IPV4},
 		{"ipv6",		IPV6},
+		{"json",		JSON},
 		{"keep",		KEEP},
+		{"kv",			KV},
 		{"limit",		LIMIT},
+		{"listen",		LISTEN},
+		{"low",			LOW},
 		{"max",			MAX},
 		{"mqtt",		MQTT},
 		{"off",			OFF},
+		{"on",			ON},
 		{"password",		PASSWORD},
 		{"port",		PORT},
+		{"priority",		PRIORITY},
 		{"protocol",		PROTOCOL},
+		{"publish",		PUBLISH},
+		{"qos",			QOS},
+		{"queue",		QUEUE},
+		{"rate",		RATE},
+		{"realtime",		REALTIME},
 		{"reconnect",		RECONNECT},
+		{"rollup",		ROLLUP},
+		{"telemetry",		TELEMETRY},
 		{"teleperiod",		TELEPERIOD},
+		{"thread",		THREAD},
+		{"timeout",		TIMEOUT},
 		{"topic",		TOPIC},
 		{"username",		USERNAME},
+		{"watermark",		WATERMARK},
 	};
 	const struct keywords	*p;
 
@@ -878,10 +1222,11 @@ parse_config(const char *filename)
 	conf = calloc(1, sizeof(struct batgw_config));
 	if (conf == NULL)
 		return (NULL);
+	conf->rt_cpu = -1;
 
 	yyparse();
 
-	if (conf->battery.protocol == NULL)
+	if (conf->nbatteries == 0)
 		yyerror("battery has not been configured");
 	if (conf->inverter.protocol == NULL)
 		yyerror("inverter has not been configured");
@@ -978,20 +1323,29 @@ symset(const char *nam, const char *val, int persist)
 	return (0);
 }
 
+void
+clear_config_mqtt(struct batgw_config_mqtt *mqtt)
+{
+	if (mqtt == NULL)
+		return;
+
+	free(mqtt->host);
+	free(mqtt->port);
+	free(mqtt->user);
+	free(mqtt->pass);
+	free(mqtt->topic);
+	free(mqtt->clientid);
+	free(mqtt);
+}
+
 void
 clear_config(struct batgw_config *c)
 {
-	struct batgw_config_mqtt *mqtt;
-
-	mqtt = c->mqtt;
-	if (mqtt != NULL) {
-		free(mqtt->host);
-		free(mqtt->port);
-		free(mqtt->user);
-		free(mqtt->pass);
-		free(mqtt->topic);
-		free(mqtt->clientid);
-		free(mqtt);
+	clear_config_mqtt(c->mqtt);
+
+	if (c->http != NULL) {
+		free(c->http->listen);
+		free(c->http);
 	}
 
 	free(c);